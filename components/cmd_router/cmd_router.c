@@ -6,6 +6,7 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include "esp_log.h"
@@ -21,12 +22,9 @@
 #include "sdkconfig.h"
 #include "nvs.h"
 #include "esp_wifi.h"
+#include "esp_mac.h"
 
 #include "lwip/ip4_addr.h"
-#if !IP_NAPT
-#error "IP_NAPT must be defined"
-#endif
-#include "lwip/lwip_napt.h"
 
 #include "router_globals.h"
 #include "cmd_router.h"
@@ -44,6 +42,22 @@ static void register_set_ap(void);
 static void register_set_ap_ip(void);
 static void register_show(void);
 static void register_portmap(void);
+static void register_set_nat_size(void);
+static void register_nat_stats(void);
+static void register_nat_timeouts(void);
+static void register_nat_limits(void);
+static void register_conntrack(void);
+static void register_set_mss_clamp(void);
+static void register_nat_cone(void);
+static void register_set_dmz(void);
+static void register_set_icmp_rate(void);
+static void register_set_ipv6(void);
+static void register_mcast_reflect(void);
+static void register_set_upnp(void);
+static void register_shape(void);
+static void register_qos(void);
+static void register_ipfix(void);
+static void register_fw(void);
 
 void preprocess_string(char* str)
 {
@@ -148,6 +162,22 @@ void register_router(void)
     register_set_ap();
     register_set_ap_ip();
     register_portmap();
+    register_set_nat_size();
+    register_nat_stats();
+    register_nat_timeouts();
+    register_nat_limits();
+    register_conntrack();
+    register_set_mss_clamp();
+    register_nat_cone();
+    register_set_dmz();
+    register_set_icmp_rate();
+    register_set_ipv6();
+    register_mcast_reflect();
+    register_set_upnp();
+    register_shape();
+    register_qos();
+    register_ipfix();
+    register_fw();
     register_show();
 }
 
@@ -373,6 +403,8 @@ static void register_set_mac(void)
 static struct {
     struct arg_str *ssid;
     struct arg_str *password;
+    struct arg_str *isolate;
+    struct arg_str *except;
     struct arg_end *end;
 } set_ap_args;
 
@@ -395,6 +427,33 @@ int set_ap(int argc, char **argv)
         printf("AP will be open (no passwd needed).\n");
     }
 
+    /* Client isolation applies right away, unlike the rest */
+    if (set_ap_args.isolate->count > 0 || set_ap_args.except->count > 0) {
+        isolate_config_t iso;
+        isolate_get_config(&iso, NULL);
+        if (set_ap_args.isolate->count > 0) {
+            if (strcmp(set_ap_args.isolate->sval[0], "on") == 0) {
+                iso.on = true;
+            } else if (strcmp(set_ap_args.isolate->sval[0], "off") == 0) {
+                iso.on = false;
+            } else {
+                printf("Isolation must be 'on' or 'off'\n");
+                return 1;
+            }
+        }
+        if (set_ap_args.except->count > 0) {
+            preprocess_string((char*)set_ap_args.except->sval[0]);
+            if (!isolate_parse_macs(set_ap_args.except->sval[0], &iso)) {
+                printf("Exceptions must be up to %d MACs, separated by commas\n", ISOLATE_EXEMPT_MAX);
+                return ESP_ERR_INVALID_ARG;
+            }
+        }
+        err = set_isolate(&iso);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+
     err = nvs_open(PARAM_NAMESPACE, NVS_READWRITE, &nvs);
     if (err != ESP_OK) {
         return err;
@@ -418,11 +477,13 @@ static void register_set_ap(void)
 {
     set_ap_args.ssid = arg_str1(NULL, NULL, "<ssid>", "SSID of AP");
     set_ap_args.password = arg_str1(NULL, NULL, "<passwd>", "Password of AP");
-    set_ap_args.end = arg_end(2);
+    set_ap_args.isolate = arg_str0(NULL, "isolate", "<on|off>", "keep the AP clients from reaching each other, applied right away");
+    set_ap_args.except = arg_str0(NULL, "except", "<mac,...>", "clients that all others may reach in isolation mode");
+    set_ap_args.end = arg_end(4);
 
     const esp_console_cmd_t cmd = {
         .command = "set_ap",
-        .help = "Set SSID and password of the SoftAP",
+        .help = "Set SSID and password of the SoftAP and whether its clients are isolated",
         .hint = NULL,
         .func = &set_ap,
         .argtable = &set_ap_args
@@ -483,12 +544,38 @@ static void register_set_ap_ip(void)
 static struct {
     struct arg_str *add_del;
     struct arg_str *TCP_UDP;
-    struct arg_int *ext_port;
+    struct arg_str *ext_port;
     struct arg_str *int_ip;
-    struct arg_int *int_port;
+    struct arg_str *int_port;
+    struct arg_lit *hairpin;
     struct arg_end *end;
 } portmap_args;
 
+/* Parses "<port>" or "<first>-<last>" */
+static bool parse_port_range(const char *str, uint16_t *first, uint16_t *last)
+{
+    char *end;
+    long a = strtol(str, &end, 10);
+    long b = a;
+
+    if (end == str || a < 1 || a > 65535) {
+        return false;
+    }
+    if (*end == '-') {
+        const char *s = end + 1;
+        b = strtol(s, &end, 10);
+        if (end == s) {
+            return false;
+        }
+    }
+    if (*end != '\0' || b < a || b > 65535) {
+        return false;
+    }
+    *first = a;
+    *last = b;
+    return true;
+}
+
 /* 'portmap' command */
 int portmap(int argc, char **argv)
 {
@@ -518,29 +605,59 @@ int portmap(int argc, char **argv)
         return 1;
     }
 
-    uint16_t ext_port = portmap_args.ext_port->ival[0];
-    uint32_t int_ip = esp_ip4addr_aton((char *)portmap_args.int_ip->sval[0]);
-    uint16_t int_port = portmap_args.int_port->ival[0];
+    uint16_t ext_port, ext_last;
+    if (!parse_port_range(portmap_args.ext_port->sval[0], &ext_port, &ext_last)) {
+        printf("Invalid external port or range\n");
+        return 1;
+    }
 
-    //printf("portmap %d %d %x %d %x %d\n", add, tcp_udp, my_ip, ext_port, int_ip, int_port);
+    if (!add) {
+        /* A rule is deleted by its first external port */
+        if (ext_last != ext_port) {
+            printf("Give only the first external port of the portmapping\n");
+            return 1;
+        }
+        esp_err_t err = del_portmap(tcp_udp, ext_port);
+        if (err == ESP_ERR_NOT_FOUND) {
+            printf("No portmapping starts at %s port %d\n", portmap_args.TCP_UDP->sval[0], ext_port);
+        }
+        return err;
+    }
 
-    if (add) {
-        add_portmap(tcp_udp, ext_port, int_ip, int_port);
-    } else {
-        del_portmap(tcp_udp, ext_port);
+    if (portmap_args.int_ip->count == 0 || portmap_args.int_port->count == 0) {
+        printf("Internal IP and port are required\n");
+        return 1;
     }
 
-    return ESP_OK;
+    uint32_t int_ip = esp_ip4addr_aton((char *)portmap_args.int_ip->sval[0]);
+    uint16_t int_port, int_last;
+    if (!parse_port_range(portmap_args.int_port->sval[0], &int_port, &int_last)) {
+        printf("Invalid internal port or range\n");
+        return 1;
+    }
+    /* A single internal port is the start of an equally long range */
+    if (int_last != int_port && int_last - int_port != ext_last - ext_port) {
+        printf("Internal and external range must have the same length\n");
+        return 1;
+    }
+
+    uint8_t flags = portmap_args.hairpin->count > 0 ? PORTMAP_HAIRPIN : 0;
+    esp_err_t err = add_portmap_range(tcp_udp, ext_port, ext_last, int_ip, int_port, flags);
+    if (err == ESP_ERR_INVALID_STATE) {
+        printf("Overlaps an existing portmapping\n");
+    }
+    return err;
 }
 
 static void register_portmap(void)
 {
     portmap_args.add_del = arg_str1(NULL, NULL, "[add|del]", "add or delete portmapping");
     portmap_args.TCP_UDP = arg_str1(NULL, NULL, "[TCP|UDP]", "TCP or UDP port");
-    portmap_args.ext_port = arg_int1(NULL, NULL, "<ext_portno>", "external port number");
-    portmap_args.int_ip = arg_str1(NULL, NULL, "<int_ip>", "internal IP");
-    portmap_args.int_port = arg_int1(NULL, NULL, "<int_portno>", "internal port number");
-    portmap_args.end = arg_end(5);
+    portmap_args.ext_port = arg_str1(NULL, NULL, "<ext_port[-last]>", "external port number or range");
+    portmap_args.int_ip = arg_str0(NULL, NULL, "<int_ip>", "internal IP (add only)");
+    portmap_args.int_port = arg_str0(NULL, NULL, "<int_port[-last]>", "internal port number or range (add only)");
+    portmap_args.hairpin = arg_lit0(NULL, "hairpin", "AP clients reach it by the uplink address too (add only)");
+    portmap_args.end = arg_end(6);
 
     const esp_console_cmd_t cmd = {
         .command = "portmap",
@@ -552,37 +669,1271 @@ static void register_portmap(void)
     ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
 }
 
-/* 'show' command */
-static int show(int argc, char **argv)
+/** Arguments used by 'set_nat_size' function */
+static struct {
+    struct arg_int *napt_max;
+    struct arg_int *portmap_max;
+    struct arg_end *end;
+} set_nat_size_args;
+
+/* 'set_nat_size' command */
+int set_nat_size(int argc, char **argv)
 {
-    char* ssid = NULL;
-    char* ent_username = NULL;
-    char* ent_identity = NULL;
-    char* passwd = NULL;
-    char* static_ip = NULL;
-    char* subnet_mask = NULL;
-    char* gateway_addr = NULL;
-    char* ap_ssid = NULL;
-    char* ap_passwd = NULL;
+    esp_err_t err;
+    nvs_handle_t nvs;
 
-    get_config_param_str("ssid", &ssid);
-    get_config_param_str("ent_username", &ent_username);
-    get_config_param_str("ent_identity", &ent_identity);
-    get_config_param_str("passwd", &passwd);
-    get_config_param_str("static_ip", &static_ip);
-    get_config_param_str("subnet_mask", &subnet_mask);
-    get_config_param_str("gateway_addr", &gateway_addr);
-    get_config_param_str("ap_ssid", &ap_ssid);
-    get_config_param_str("ap_passwd", &ap_passwd);
+    int nerrors = arg_parse(argc, argv, (void **) &set_nat_size_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, set_nat_size_args.end, argv[0]);
+        return 1;
+    }
 
-    printf("STA SSID: %s Password: %s Enterprise: %s %s\n",
-        ssid != NULL ? ssid : "<undef>",
-        passwd != NULL ? passwd : "<undef>",
-        ((ent_username != NULL) && (strlen(ent_username) > 0)) ? ent_username : "<not active>",
-        ((ent_username != NULL) && (strlen(ent_username) > 0) && (ent_identity != NULL) && (strlen(ent_identity) > 0)) ? ent_identity : ""
-    );
-    printf("AP SSID: %s Password: %s\n", ap_ssid != NULL ? ap_ssid : "<undef>",
-        ap_passwd != NULL ? ap_passwd : "<undef>");
+    int napt_max = set_nat_size_args.napt_max->ival[0];
+    if (napt_max < 16 || napt_max > 65534) {
+        printf("NAPT entries must be 16..65534\n");
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (set_nat_size_args.portmap_max->count > 0 &&
+        (set_nat_size_args.portmap_max->ival[0] < 1 || set_nat_size_args.portmap_max->ival[0] > 65535)) {
+        printf("Portmap rules must be 1..65535\n");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    err = nvs_open(PARAM_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    err = nvs_set_i32(nvs, "napt_max", napt_max);
+    if (err == ESP_OK && set_nat_size_args.portmap_max->count > 0) {
+        err = nvs_set_i32(nvs, "portmap_max", set_nat_size_args.portmap_max->ival[0]);
+    }
+    if (err == ESP_OK) {
+        err = nvs_commit(nvs);
+        if (err == ESP_OK) {
+            ESP_LOGI(TAG, "NAT table sizes stored, applied after restart.");
+        }
+    }
+    nvs_close(nvs);
+    return err;
+}
+
+static void register_set_nat_size(void)
+{
+    set_nat_size_args.napt_max = arg_int1(NULL, NULL, "<napt_entries>", "NAPT table entries (default 512)");
+    set_nat_size_args.portmap_max = arg_int0(NULL, NULL, "<portmap_rules>", "max portmap rules (default 128)");
+    set_nat_size_args.end = arg_end(2);
+
+    const esp_console_cmd_t cmd = {
+        .command = "set_nat_size",
+        .help = "Set the size of the NAPT and portmap tables, the NAPT table is limited by the free heap",
+        .hint = NULL,
+        .func = &set_nat_size,
+        .argtable = &set_nat_size_args
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+/** Arguments used by 'nat_stats' function */
+static struct {
+    struct arg_lit *reset;
+    struct arg_end *end;
+} nat_stats_args;
+
+/* 'nat_stats' command */
+static int nat_stats(int argc, char **argv)
+{
+    napt_stats_t stats;
+    router_stats_t hook_stats;
+    rxbuf_stats_t rx;
+
+    int nerrors = arg_parse(argc, argv, (void **) &nat_stats_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, nat_stats_args.end, argv[0]);
+        return 1;
+    }
+    if (nat_stats_args.reset->count > 0) {
+        router_hooks_reset_time();
+        printf("Hook timing cleared\n");
+        return 0;
+    }
+
+    napt_get_stats(&stats);
+    router_hooks_get_stats(&hook_stats);
+    rxbuf_get_stats(&rx);
+    printf("NAPT entries: %lu of %lu (TCP %lu, UDP %lu, ICMP %lu)\n",
+        (unsigned long)stats.entries, (unsigned long)stats.capacity,
+        (unsigned long)stats.tcp, (unsigned long)stats.udp, (unsigned long)stats.icmp);
+    printf("High-water mark: %lu\n", (unsigned long)stats.high_water);
+    printf("Allocation failures: %lu  Evictions: %lu  Expired: %lu  Over client limits: %lu\n",
+        (unsigned long)stats.alloc_failures, (unsigned long)stats.evictions, (unsigned long)stats.expired,
+        (unsigned long)stats.limited);
+    printf("Flow cache hits: %lu  misses: %lu\n", (unsigned long)hook_stats.flow_hits, (unsigned long)hook_stats.flow_misses);
+    printf("MSS clamped SYNs: %lu\n", (unsigned long)hook_stats.mss_clamped);
+    printf("ICMP rate limited: %lu\n", (unsigned long)hook_stats.icmp_limited);
+    printf("Hook time: %lu packets, avg %lu ns, max %lu us\n", (unsigned long)hook_stats.timed,
+        (unsigned long)hook_stats.time_avg_ns, (unsigned long)hook_stats.time_max_us);
+    printf("  <1us %lu  <2us %lu  <4us %lu  <8us %lu  <16us %lu  <32us %lu  <64us %lu  more %lu\n",
+        (unsigned long)hook_stats.time_hist[0], (unsigned long)hook_stats.time_hist[1],
+        (unsigned long)hook_stats.time_hist[2], (unsigned long)hook_stats.time_hist[3],
+        (unsigned long)hook_stats.time_hist[4], (unsigned long)hook_stats.time_hist[5],
+        (unsigned long)hook_stats.time_hist[6], (unsigned long)hook_stats.time_hist[7]);
+    printf("Driver RX buffers held: %lu (peak %lu)  Frames in place: %lu  copied: %lu  no memory: %lu\n",
+        (unsigned long)rx.held, (unsigned long)rx.peak, (unsigned long)rx.in_place, (unsigned long)rx.copied,
+        (unsigned long)rx.no_mem);
+    uint32_t reflected, dropped;
+    mcast_reflect_get_stats(&reflected, &dropped);
+    printf("mDNS/SSDP reflected: %lu  dropped: %lu\n", (unsigned long)reflected, (unsigned long)dropped);
+    return 0;
+}
+
+static void register_nat_stats(void)
+{
+    nat_stats_args.reset = arg_lit0(NULL, "reset", "clear the hook timing, before a measurement");
+    nat_stats_args.end = arg_end(1);
+
+    const esp_console_cmd_t cmd = {
+        .command = "nat_stats",
+        .help = "Show the occupancy of the NAPT table and the forwarding counters",
+        .hint = NULL,
+        .func = &nat_stats,
+        .argtable = &nat_stats_args
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+/** Arguments used by 'nat_timeouts' function */
+static struct {
+    struct arg_int *tcp;
+    struct arg_int *tcp_closing;
+    struct arg_int *udp;
+    struct arg_int *udp_stream;
+    struct arg_int *icmp;
+    struct arg_end *end;
+} nat_timeouts_args;
+
+/* 'nat_timeouts' command */
+static int nat_timeouts(int argc, char **argv)
+{
+    napt_timeouts_t t;
+
+    int nerrors = arg_parse(argc, argv, (void **) &nat_timeouts_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, nat_timeouts_args.end, argv[0]);
+        return 1;
+    }
+
+    napt_get_timeouts(&t);
+    if (nat_timeouts_args.tcp->count > 0 || nat_timeouts_args.tcp_closing->count > 0 ||
+        nat_timeouts_args.udp->count > 0 || nat_timeouts_args.udp_stream->count > 0 ||
+        nat_timeouts_args.icmp->count > 0) {
+        if (nat_timeouts_args.tcp->count > 0) t.tcp = nat_timeouts_args.tcp->ival[0];
+        if (nat_timeouts_args.tcp_closing->count > 0) t.tcp_closing = nat_timeouts_args.tcp_closing->ival[0];
+        if (nat_timeouts_args.udp->count > 0) t.udp = nat_timeouts_args.udp->ival[0];
+        if (nat_timeouts_args.udp_stream->count > 0) t.udp_stream = nat_timeouts_args.udp_stream->ival[0];
+        if (nat_timeouts_args.icmp->count > 0) t.icmp = nat_timeouts_args.icmp->ival[0];
+
+        esp_err_t err = set_nat_timeouts(&t);
+        if (err == ESP_ERR_INVALID_ARG) {
+            printf("Timeouts must be 1..604800 s\n");
+        }
+        if (err != ESP_OK) {
+            return err;
+        }
+        ESP_LOGI(TAG, "NAT timeouts stored.");
+    }
+
+    printf("NAT timeouts: TCP %lus, TCP closing %lus, UDP %lus, UDP stream %lus, ICMP %lus\n",
+        (unsigned long)t.tcp, (unsigned long)t.tcp_closing, (unsigned long)t.udp,
+        (unsigned long)t.udp_stream, (unsigned long)t.icmp);
+    return 0;
+}
+
+static void register_nat_timeouts(void)
+{
+    nat_timeouts_args.tcp = arg_int0(NULL, "tcp", "<s>", "established TCP");
+    nat_timeouts_args.tcp_closing = arg_int0(NULL, "tcp_closing", "<s>", "TCP before the handshake and after FIN/RST");
+    nat_timeouts_args.udp = arg_int0(NULL, "udp", "<s>", "UDP");
+    nat_timeouts_args.udp_stream = arg_int0(NULL, "udp_stream", "<s>", "UDP with traffic in both directions");
+    nat_timeouts_args.icmp = arg_int0(NULL, "icmp", "<s>", "ICMP echo");
+    nat_timeouts_args.end = arg_end(5);
+
+    const esp_console_cmd_t cmd = {
+        .command = "nat_timeouts",
+        .help = "Show or set the idle timeouts of NAPT entries, applied right away",
+        .hint = NULL,
+        .func = &nat_timeouts,
+        .argtable = &nat_timeouts_args
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+/** Arguments used by 'nat_limits' function */
+static struct {
+    struct arg_int *rate;
+    struct arg_int *flows;
+    struct arg_end *end;
+} nat_limits_args;
+
+/* 'nat_limits' command */
+static int nat_limits(int argc, char **argv)
+{
+    napt_limits_t l;
+    napt_stats_t stats;
+
+    int nerrors = arg_parse(argc, argv, (void **) &nat_limits_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, nat_limits_args.end, argv[0]);
+        return 1;
+    }
+
+    napt_get_limits(&l);
+    if (nat_limits_args.rate->count > 0 || nat_limits_args.flows->count > 0) {
+        if (nat_limits_args.rate->count > 0) l.rate = nat_limits_args.rate->ival[0];
+        if (nat_limits_args.flows->count > 0) l.flows = nat_limits_args.flows->ival[0];
+
+        esp_err_t err = set_nat_limits(&l);
+        if (err == ESP_ERR_INVALID_ARG) {
+            printf("Rate must be 0..10000 per second, flows 0 up to the NAPT table size\n");
+        }
+        if (err != ESP_OK) {
+            return err;
+        }
+        ESP_LOGI(TAG, "NAT client limits stored.");
+    }
+
+    napt_get_stats(&stats);
+    printf("Per-client limits: new connections %lu/s, open connections %lu (0 = no limit)\n",
+        (unsigned long)l.rate, (unsigned long)l.flows);
+    printf("Connections refused: %lu\n", (unsigned long)stats.limited);
+    return 0;
+}
+
+static void register_nat_limits(void)
+{
+    nat_limits_args.rate = arg_int0(NULL, "rate", "<n>", "new connections a client may open per second");
+    nat_limits_args.flows = arg_int0(NULL, "flows", "<n>", "connections a client may have open");
+    nat_limits_args.end = arg_end(2);
+
+    const esp_console_cmd_t cmd = {
+        .command = "nat_limits",
+        .help = "Show or set the per-client limits on NAPT connections, 0 for none, applied right away",
+        .hint = NULL,
+        .func = &nat_limits,
+        .argtable = &nat_limits_args
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+/** Arguments used by 'conntrack' function */
+static struct {
+    struct arg_str *client_ip;
+    struct arg_end *end;
+} conntrack_args;
+
+static const char *proto_str(uint8_t proto)
+{
+    switch (proto) {
+    case PROTO_TCP:
+        return "TCP";
+    case PROTO_UDP:
+        return "UDP";
+    default:
+        return "ICMP";
+    }
+}
+
+/* 'conntrack' command */
+static int conntrack(int argc, char **argv)
+{
+    napt_conn_t conns[8];
+    uint32_t filter_ip = 0, pos = 0, total = 0;
+    ip4_addr_t addr;
+    int n;
+
+    int nerrors = arg_parse(argc, argv, (void **) &conntrack_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, conntrack_args.end, argv[0]);
+        return 1;
+    }
+    if (conntrack_args.client_ip->count > 0) {
+        filter_ip = esp_ip4addr_aton(conntrack_args.client_ip->sval[0]);
+        if (filter_ip == 0) {
+            printf("Invalid client IP\n");
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
+
+    while ((n = napt_walk(&pos, filter_ip, conns, sizeof(conns) / sizeof(conns[0]))) > 0) {
+        for (int i = 0; i < n; i++) {
+            napt_conn_t *c = &conns[i];
+            printf("%-4s %-6s ", proto_str(c->proto), napt_state_str(c->proto, c->state));
+            addr.addr = c->src;
+            printf(IPSTR":%d -> ", IP2STR(&addr), c->sport);
+            if (c->dest == 0) {
+                /* Full cone, open to any remote host */
+                printf("*:* ");
+            } else {
+                addr.addr = c->dest;
+                printf(IPSTR":%d ", IP2STR(&addr), c->dport);
+            }
+            addr.addr = my_ip;
+            printf("via "IPSTR":%d age %lus out %lu in %lu bytes\n", IP2STR(&addr), c->mport,
+                (unsigned long)c->age, (unsigned long)c->bytes_out, (unsigned long)c->bytes_in);
+        }
+        total += n;
+    }
+    printf("%lu entries\n", (unsigned long)total);
+    return 0;
+}
+
+static void register_conntrack(void)
+{
+    conntrack_args.client_ip = arg_str0(NULL, NULL, "<client_ip>", "only entries of this AP client");
+    conntrack_args.end = arg_end(1);
+
+    const esp_console_cmd_t cmd = {
+        .command = "conntrack",
+        .help = "List the NAPT table entries",
+        .hint = NULL,
+        .func = &conntrack,
+        .argtable = &conntrack_args
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+/** Arguments used by 'set_mss_clamp' function */
+static struct {
+    struct arg_str *mss;
+    struct arg_end *end;
+} set_mss_clamp_args;
+
+/* 'set_mss_clamp' command */
+static int set_mss_clamp_cmd(int argc, char **argv)
+{
+    esp_err_t err;
+    nvs_handle_t nvs;
+    int mss;
+
+    int nerrors = arg_parse(argc, argv, (void **) &set_mss_clamp_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, set_mss_clamp_args.end, argv[0]);
+        return 1;
+    }
+
+    const char *val = set_mss_clamp_args.mss->sval[0];
+    if (strcmp(val, "off") == 0) {
+        mss = 0;
+    } else if (strcmp(val, "auto") == 0) {
+        mss = MSS_CLAMP_AUTO;
+    } else {
+        mss = atoi(val);
+        if (mss < 536 || mss > 1460) {
+            printf("MSS must be off, auto or 536..1460\n");
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
+    set_mss_clamp(mss);
+
+    err = nvs_open(PARAM_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = nvs_set_i32(nvs, "mss_clamp", mss);
+    if (err == ESP_OK) {
+        err = nvs_commit(nvs);
+        if (err == ESP_OK) {
+            ESP_LOGI(TAG, "MSS clamping %s stored.", val);
+        }
+    }
+    nvs_close(nvs);
+    return err;
+}
+
+static void register_set_mss_clamp(void)
+{
+    set_mss_clamp_args.mss = arg_str1(NULL, NULL, "<off|auto|mss>", "off, auto (from the uplink MTU) or max MSS");
+    set_mss_clamp_args.end = arg_end(1);
+
+    const esp_console_cmd_t cmd = {
+        .command = "set_mss_clamp",
+        .help = "Set the TCP MSS clamping of forwarded SYNs, applied right away",
+        .hint = NULL,
+        .func = &set_mss_clamp_cmd,
+        .argtable = &set_mss_clamp_args
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+/** Arguments used by 'nat_cone' function */
+static struct {
+    struct arg_str *add_del;
+    struct arg_str *client_ip;
+    struct arg_end *end;
+} nat_cone_args;
+
+/* 'nat_cone' command */
+static int nat_cone(int argc, char **argv)
+{
+    uint32_t ips[NAPT_CONE_MAX];
+    ip4_addr_t addr;
+
+    int nerrors = arg_parse(argc, argv, (void **) &nat_cone_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, nat_cone_args.end, argv[0]);
+        return 1;
+    }
+
+    if (nat_cone_args.add_del->count == 0) {
+        int n = napt_get_cone(ips);
+        for (int i = 0; i < n; i++) {
+            addr.addr = ips[i];
+            printf(IPSTR"\n", IP2STR(&addr));
+        }
+        printf("%d of %d clients with full cone UDP\n", n, NAPT_CONE_MAX);
+        return 0;
+    }
+
+    bool add;
+    if (strcmp(nat_cone_args.add_del->sval[0], "add") == 0) {
+        add = true;
+    } else if (strcmp(nat_cone_args.add_del->sval[0], "del") == 0) {
+        add = false;
+    } else {
+        printf("Must be 'add' or 'del'\n");
+        return 1;
+    }
+    if (nat_cone_args.client_ip->count == 0 ||
+        (addr.addr = esp_ip4addr_aton(nat_cone_args.client_ip->sval[0])) == 0) {
+        printf("Invalid client IP\n");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    esp_err_t err = set_nat_cone(addr.addr, add);
+    if (err == ESP_ERR_NO_MEM) {
+        printf("At most %d clients\n", NAPT_CONE_MAX);
+    } else if (err == ESP_OK) {
+        ESP_LOGI(TAG, "Full cone UDP for "IPSTR" %s.", IP2STR(&addr), add ? "enabled" : "disabled");
+    }
+    return err;
+}
+
+static void register_nat_cone(void)
+{
+    nat_cone_args.add_del = arg_str0(NULL, NULL, "[add|del]", "add or delete a client, lists them if omitted");
+    nat_cone_args.client_ip = arg_str0(NULL, NULL, "<client_ip>", "IP of the client in the AP network");
+    nat_cone_args.end = arg_end(2);
+
+    const esp_console_cmd_t cmd = {
+        .command = "nat_cone",
+        .help = "Map the UDP of a client endpoint independent (full cone), for hole punching",
+        .hint = NULL,
+        .func = &nat_cone,
+        .argtable = &nat_cone_args
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+/** Arguments used by 'set_dmz' function */
+static struct {
+    struct arg_str *host;
+    struct arg_end *end;
+} set_dmz_args;
+
+/* 'set_dmz' command */
+static int set_dmz(int argc, char **argv)
+{
+    uint32_t host = 0;
+
+    int nerrors = arg_parse(argc, argv, (void **) &set_dmz_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, set_dmz_args.end, argv[0]);
+        return 1;
+    }
+    if (strcmp(set_dmz_args.host->sval[0], "off") != 0) {
+        host = esp_ip4addr_aton(set_dmz_args.host->sval[0]);
+        if (host == 0) {
+            printf("Invalid IP\n");
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
+
+    esp_err_t err = set_dmz_host(host);
+    if (err == ESP_OK) {
+        ESP_LOGI(TAG, "DMZ host stored.");
+    }
+    return err;
+}
+
+static void register_set_dmz(void)
+{
+    set_dmz_args.host = arg_str1(NULL, NULL, "<ip|off>", "internal IP that gets all unmatched inbound TCP/UDP, or off");
+    set_dmz_args.end = arg_end(1);
+
+    const esp_console_cmd_t cmd = {
+        .command = "set_dmz",
+        .help = "Set the DMZ host, applied right away. Portmaps take priority",
+        .hint = NULL,
+        .func = &set_dmz,
+        .argtable = &set_dmz_args
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+/** Arguments used by 'set_icmp_rate' function */
+static struct {
+    struct arg_int *rate;
+    struct arg_end *end;
+} set_icmp_rate_args;
+
+/* 'set_icmp_rate' command */
+static int set_icmp_rate_cmd(int argc, char **argv)
+{
+    esp_err_t err;
+    nvs_handle_t nvs;
+
+    int nerrors = arg_parse(argc, argv, (void **) &set_icmp_rate_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, set_icmp_rate_args.end, argv[0]);
+        return 1;
+    }
+
+    int rate = set_icmp_rate_args.rate->ival[0];
+    if (rate < 0 || rate > 1000) {
+        printf("Rate must be 0..1000\n");
+        return ESP_ERR_INVALID_ARG;
+    }
+    set_icmp_rate(rate);
+
+    err = nvs_open(PARAM_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = nvs_set_i32(nvs, "icmp_rate", rate);
+    if (err == ESP_OK) {
+        err = nvs_commit(nvs);
+        if (err == ESP_OK) {
+            ESP_LOGI(TAG, "ICMP rate %d/s stored.", rate);
+        }
+    }
+    nvs_close(nvs);
+    return err;
+}
+
+static void register_set_icmp_rate(void)
+{
+    set_icmp_rate_args.rate = arg_int1(NULL, NULL, "<per_s>", "pings and closed UDP ports answered per second, 0 for no limit (default 20)");
+    set_icmp_rate_args.end = arg_end(1);
+
+    const esp_console_cmd_t cmd = {
+        .command = "set_icmp_rate",
+        .help = "Limit the ICMP the router sends in answer to the uplink, applied right away",
+        .hint = NULL,
+        .func = &set_icmp_rate_cmd,
+        .argtable = &set_icmp_rate_args
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+/** Arguments used by 'set_ipv6' function */
+static struct {
+    struct arg_str *mode;
+    struct arg_end *end;
+} set_ipv6_args;
+
+/* 'set_ipv6' command */
+static int set_ipv6(int argc, char **argv)
+{
+    esp_err_t err;
+    nvs_handle_t nvs;
+    int relay;
+
+    int nerrors = arg_parse(argc, argv, (void **) &set_ipv6_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, set_ipv6_args.end, argv[0]);
+        return 1;
+    }
+    if (strcmp(set_ipv6_args.mode->sval[0], "relay") == 0) {
+        relay = 1;
+    } else if (strcmp(set_ipv6_args.mode->sval[0], "off") == 0) {
+        relay = 0;
+    } else {
+        printf("Must be 'off' or 'relay'\n");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    err = nvs_open(PARAM_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = nvs_set_i32(nvs, "ipv6_relay", relay);
+    if (err == ESP_OK) {
+        err = nvs_commit(nvs);
+        if (err == ESP_OK) {
+            ESP_LOGI(TAG, "IPv6 %s stored.", set_ipv6_args.mode->sval[0]);
+        }
+    }
+    nvs_close(nvs);
+    return err;
+}
+
+static void register_set_ipv6(void)
+{
+    set_ipv6_args.mode = arg_str1(NULL, NULL, "<off|relay>", "relay the uplink's /64 prefix to the AP clients, or off (default)");
+    set_ipv6_args.end = arg_end(1);
+
+    const esp_console_cmd_t cmd = {
+        .command = "set_ipv6",
+        .help = "Set IPv6 for the AP clients, applied after restart",
+        .hint = NULL,
+        .func = &set_ipv6,
+        .argtable = &set_ipv6_args
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+/** Arguments used by 'mcast_reflect' function */
+static struct {
+    struct arg_str *add_del;
+    struct arg_str *service;
+    struct arg_end *end;
+} mcast_reflect_args;
+
+/* 'mcast_reflect' command */
+static int mcast_reflect(int argc, char **argv)
+{
+    char names[MCAST_ALLOW_MAX][MCAST_NAME_LEN];
+
+    int nerrors = arg_parse(argc, argv, (void **) &mcast_reflect_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, mcast_reflect_args.end, argv[0]);
+        return 1;
+    }
+
+    if (mcast_reflect_args.add_del->count == 0) {
+        int n = mcast_get_reflect(names);
+        for (int i = 0; i < n; i++) {
+            printf("%s\n", names[i]);
+        }
+        printf("%d of %d services reflected\n", n, MCAST_ALLOW_MAX);
+        return 0;
+    }
+
+    bool add;
+    if (strcmp(mcast_reflect_args.add_del->sval[0], "add") == 0) {
+        add = true;
+    } else if (strcmp(mcast_reflect_args.add_del->sval[0], "del") == 0) {
+        add = false;
+    } else {
+        printf("Must be 'add' or 'del'\n");
+        return 1;
+    }
+    if (mcast_reflect_args.service->count == 0) {
+        printf("Service missing\n");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    const char *service = mcast_reflect_args.service->sval[0];
+    esp_err_t err = set_mcast_reflect(service, add);
+    if (err == ESP_ERR_NO_MEM) {
+        printf("At most %d services\n", MCAST_ALLOW_MAX);
+    } else if (err == ESP_ERR_INVALID_SIZE) {
+        printf("Service name too long\n");
+    } else if (err == ESP_OK) {
+        ESP_LOGI(TAG, "Reflection of %s %s.", service, add ? "enabled" : "disabled");
+    }
+    return err;
+}
+
+static void register_mcast_reflect(void)
+{
+    mcast_reflect_args.add_del = arg_str0(NULL, NULL, "[add|del]", "add or delete a service, lists them if omitted");
+    mcast_reflect_args.service = arg_str0(NULL, NULL, "<service>", "mDNS service (_http._tcp) or SSDP search target (urn:...)");
+    mcast_reflect_args.end = arg_end(2);
+
+    const esp_console_cmd_t cmd = {
+        .command = "mcast_reflect",
+        .help = "Reflect mDNS/SSDP discovery of a service on the uplink to the AP clients",
+        .hint = NULL,
+        .func = &mcast_reflect,
+        .argtable = &mcast_reflect_args
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+/** Arguments used by 'set_upnp' function */
+static struct {
+    struct arg_str *mode;
+    struct arg_end *end;
+} set_upnp_args;
+
+/* 'set_upnp' command */
+static int set_upnp(int argc, char **argv)
+{
+    esp_err_t err;
+    nvs_handle_t nvs;
+    bool enable;
+
+    int nerrors = arg_parse(argc, argv, (void **) &set_upnp_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, set_upnp_args.end, argv[0]);
+        return 1;
+    }
+    if (strcmp(set_upnp_args.mode->sval[0], "on") == 0) {
+        enable = true;
+    } else if (strcmp(set_upnp_args.mode->sval[0], "off") == 0) {
+        enable = false;
+    } else {
+        printf("Must be 'on' or 'off'\n");
+        return ESP_ERR_INVALID_ARG;
+    }
+    set_igd(enable);
+
+    err = nvs_open(PARAM_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = nvs_set_i32(nvs, "upnp", enable);
+    if (err == ESP_OK) {
+        err = nvs_commit(nvs);
+        if (err == ESP_OK) {
+            ESP_LOGI(TAG, "UPnP/NAT-PMP %s stored.", set_upnp_args.mode->sval[0]);
+        }
+    }
+    nvs_close(nvs);
+    return err;
+}
+
+static void register_set_upnp(void)
+{
+    set_upnp_args.mode = arg_str1(NULL, NULL, "<on|off>", "let the AP clients open ports by UPnP-IGD and NAT-PMP/PCP, off by default");
+    set_upnp_args.end = arg_end(1);
+
+    const esp_console_cmd_t cmd = {
+        .command = "set_upnp",
+        .help = "Enable or disable port mapping by the AP clients, applied right away",
+        .hint = NULL,
+        .func = &set_upnp,
+        .argtable = &set_upnp_args
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+/** Arguments used by 'shape' function */
+static struct {
+    struct arg_str *add_del;
+    struct arg_str *client;
+    struct arg_int *up;
+    struct arg_int *down;
+    struct arg_end *end;
+} shape_args;
+
+/* 'shape' command */
+static int shape(int argc, char **argv)
+{
+    shape_rule_t rules[SHAPE_MAX];
+    uint8_t mac[6] = {0};
+    ip4_addr_t addr = {0};
+    bool by_mac;
+
+    int nerrors = arg_parse(argc, argv, (void **) &shape_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, shape_args.end, argv[0]);
+        return 1;
+    }
+
+    if (shape_args.add_del->count == 0) {
+        int n = shape_get_rules(rules);
+        for (int i = 0; i < n; i++) {
+            addr.addr = rules[i].ip;
+            if (rules[i].mac[0] | rules[i].mac[1] | rules[i].mac[2] | rules[i].mac[3] | rules[i].mac[4] | rules[i].mac[5]) {
+                printf(MACSTR" ", MAC2STR(rules[i].mac));
+            }
+            printf(IPSTR" up %lu kbit/s (%lu dropped) down %lu kbit/s (%lu dropped)\n", IP2STR(&addr),
+                   (unsigned long)rules[i].up, (unsigned long)rules[i].dropped_up,
+                   (unsigned long)rules[i].down, (unsigned long)rules[i].dropped_down);
+        }
+        printf("%d of %d clients with rate limits\n", n, SHAPE_MAX);
+        return 0;
+    }
+
+    bool add;
+    if (strcmp(shape_args.add_del->sval[0], "add") == 0) {
+        add = true;
+    } else if (strcmp(shape_args.add_del->sval[0], "del") == 0) {
+        add = false;
+    } else {
+        printf("Must be 'add' or 'del'\n");
+        return 1;
+    }
+    if (shape_args.client->count == 0 ||
+        !shape_parse_client(shape_args.client->sval[0], mac, &addr.addr, &by_mac)) {
+        printf("Invalid client, must be a MAC or an IP\n");
+        return ESP_ERR_INVALID_ARG;
+    }
+    uint32_t up = 0, down = 0;
+    if (add) {
+        if (shape_args.up->count == 0 || shape_args.down->count == 0 ||
+            shape_args.up->ival[0] < 0 || shape_args.down->ival[0] < 0 ||
+            (shape_args.up->ival[0] == 0 && shape_args.down->ival[0] == 0)) {
+            printf("Need an upload and a download limit, one of them above 0\n");
+            return ESP_ERR_INVALID_ARG;
+        }
+        up = shape_args.up->ival[0];
+        down = shape_args.down->ival[0];
+    }
+
+    esp_err_t err = set_shape(by_mac ? mac : NULL, addr.addr, up, down);
+    if (err == ESP_ERR_NO_MEM) {
+        printf("At most %d clients\n", SHAPE_MAX);
+    } else if (err == ESP_ERR_NOT_FOUND) {
+        printf("No limits for %s\n", shape_args.client->sval[0]);
+    } else if (err == ESP_OK) {
+        ESP_LOGI(TAG, "Rate limits for %s %s.", shape_args.client->sval[0], add ? "set" : "removed");
+    }
+    return err;
+}
+
+static void register_shape(void)
+{
+    shape_args.add_del = arg_str0(NULL, NULL, "[add|del]", "add or delete a client, lists them if omitted");
+    shape_args.client = arg_str0(NULL, NULL, "<client>", "MAC (by its DHCP lease) or IP of the client in the AP network");
+    shape_args.up = arg_int0(NULL, NULL, "<up_kbit>", "upload limit in kbit/s, 0 for none");
+    shape_args.down = arg_int0(NULL, NULL, "<down_kbit>", "download limit in kbit/s, 0 for none");
+    shape_args.end = arg_end(4);
+
+    const esp_console_cmd_t cmd = {
+        .command = "shape",
+        .help = "Limit the upload and download rate of an AP client, packets over the limit are dropped",
+        .hint = NULL,
+        .func = &shape,
+        .argtable = &shape_args
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+/** Arguments used by 'qos' function */
+static struct {
+    struct arg_str *add_del;
+    struct arg_str *cls;
+    struct arg_str *ip;
+    struct arg_str *proto;
+    struct arg_str *port;
+    struct arg_end *end;
+} qos_args;
+
+static void print_qos(void)
+{
+    qos_rule_t rules[QOS_RULE_MAX];
+    qos_class_stats_t stats[2][QOS_CLASSES];
+    ip4_addr_t addr;
+
+    int n = qos_get_rules(rules);
+    for (int i = 0; i < n; i++) {
+        qos_rule_t *r = &rules[i];
+        printf("%d: %s", i + 1, qos_class_str(r->cls));
+        if (r->ip != 0) {
+            addr.addr = r->ip;
+            printf(" client "IPSTR, IP2STR(&addr));
+        }
+        if (r->proto != 0) {
+            printf(" %s", r->proto == PROTO_TCP ? "TCP" : "UDP");
+        }
+        if (r->port != 0) {
+            printf(r->port_last != r->port ? " port %d-%d" : " port %d", r->port, r->port_last);
+        }
+        printf("%s\n", r->ip == 0 && r->proto == 0 && r->port == 0 ? " any" : "");
+    }
+    printf("%d of %d QoS rules\n", n, QOS_RULE_MAX);
+
+    qos_get_stats(stats);
+    for (int cls = QOS_CLASSES - 1; cls >= 0; cls--) {
+        qos_class_stats_t *up = &stats[0][cls], *ap = &stats[1][cls];
+        printf("%s marked %lu, uplink queued %lu (now %lu, max %lu, dropped %lu), AP queued %lu (now %lu, max %lu, dropped %lu)\n",
+               qos_class_str(cls), (unsigned long)up->marked,
+               (unsigned long)up->queued, (unsigned long)up->depth, (unsigned long)up->high_water, (unsigned long)up->dropped,
+               (unsigned long)ap->queued, (unsigned long)ap->depth, (unsigned long)ap->high_water, (unsigned long)ap->dropped);
+    }
+}
+
+/* 'qos' command */
+static int qos(int argc, char **argv)
+{
+    int nerrors = arg_parse(argc, argv, (void **) &qos_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, qos_args.end, argv[0]);
+        return 1;
+    }
+
+    if (qos_args.add_del->count == 0) {
+        print_qos();
+        return 0;
+    }
+    if (qos_args.cls->count == 0) {
+        printf("Class or rule number required\n");
+        return 1;
+    }
+    if (strcmp(qos_args.add_del->sval[0], "del") == 0) {
+        esp_err_t err = del_qos_rule(atoi(qos_args.cls->sval[0]) - 1);
+        if (err == ESP_ERR_NOT_FOUND) {
+            printf("No rule %s\n", qos_args.cls->sval[0]);
+        }
+        return err;
+    } else if (strcmp(qos_args.add_del->sval[0], "add") != 0) {
+        printf("Must be 'add' or 'del'\n");
+        return 1;
+    }
+
+    qos_rule_t rule = {0};
+    int cls = qos_parse_class(qos_args.cls->sval[0]);
+    if (cls < 0) {
+        printf("Class must be 'vo', 'vi', 'be' or 'bk'\n");
+        return 1;
+    }
+    rule.cls = cls;
+    if (qos_args.ip->count > 0 && (rule.ip = esp_ip4addr_aton(qos_args.ip->sval[0])) == 0) {
+        printf("Invalid client IP\n");
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (qos_args.proto->count > 0) {
+        if (strcmp(qos_args.proto->sval[0], "TCP") == 0) {
+            rule.proto = PROTO_TCP;
+        } else if (strcmp(qos_args.proto->sval[0], "UDP") == 0) {
+            rule.proto = PROTO_UDP;
+        } else {
+            printf("Must be 'TCP' or 'UDP'\n");
+            return 1;
+        }
+    }
+    if (qos_args.port->count > 0 && !parse_port_range(qos_args.port->sval[0], &rule.port, &rule.port_last)) {
+        printf("Invalid port or range\n");
+        return 1;
+    }
+
+    esp_err_t err = add_qos_rule(&rule);
+    if (err == ESP_ERR_NO_MEM) {
+        printf("At most %d rules\n", QOS_RULE_MAX);
+    }
+    return err;
+}
+
+static void register_qos(void)
+{
+    qos_args.add_del = arg_str0(NULL, NULL, "[add|del]", "add or delete a rule, lists rules and queues if omitted");
+    qos_args.cls = arg_str0(NULL, NULL, "<vo|vi|be|bk|rule>", "class to add, number of the rule to delete");
+    qos_args.ip = arg_str0(NULL, "ip", "<client_ip>", "only this AP client");
+    qos_args.proto = arg_str0(NULL, "proto", "<TCP|UDP>", "only this protocol");
+    qos_args.port = arg_str0(NULL, "port", "<port[-last]>", "only flows with this client or remote port");
+    qos_args.end = arg_end(5);
+
+    const esp_console_cmd_t cmd = {
+        .command = "qos",
+        .help = "Put forwarded traffic into a WMM class (voice, video, best effort, background), applied right away",
+        .hint = NULL,
+        .func = &qos,
+        .argtable = &qos_args
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+/** Arguments used by 'ipfix' function */
+static struct {
+    struct arg_str *collector;
+    struct arg_int *active;
+    struct arg_end *end;
+} ipfix_args;
+
+/* 'ipfix' command */
+static int ipfix(int argc, char **argv)
+{
+    ipfix_config_t cfg;
+    ipfix_stats_t stats;
+    ip4_addr_t addr;
+
+    int nerrors = arg_parse(argc, argv, (void **) &ipfix_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, ipfix_args.end, argv[0]);
+        return 1;
+    }
+
+    ipfix_get_config(&cfg, &stats);
+    if (ipfix_args.collector->count == 0) {
+        if (cfg.collector == 0) {
+            printf("IPFIX export is off\n");
+        } else {
+            addr.addr = cfg.collector;
+            printf("Exporting to "IPSTR":%u, active timeout %us\n", IP2STR(&addr), cfg.port, cfg.active_timeout);
+        }
+        printf("%lu records in %lu packets, %lu dropped\n", (unsigned long)stats.records,
+               (unsigned long)stats.packets, (unsigned long)stats.dropped);
+        return 0;
+    }
+
+    if (strcmp(ipfix_args.collector->sval[0], "off") == 0) {
+        memset(&cfg, 0, sizeof(cfg));
+    } else {
+        char buf[24];
+        strlcpy(buf, ipfix_args.collector->sval[0], sizeof(buf));
+        char *port = strchr(buf, ':');
+        cfg.port = IPFIX_PORT;
+        if (port != NULL) {
+            *port++ = '\0';
+            int p = atoi(port);
+            if (p <= 0 || p > 65535) {
+                printf("Invalid port\n");
+                return ESP_ERR_INVALID_ARG;
+            }
+            cfg.port = p;
+        }
+        if ((cfg.collector = esp_ip4addr_aton(buf)) == 0) {
+            printf("Invalid collector IP\n");
+            return ESP_ERR_INVALID_ARG;
+        }
+        cfg.active_timeout = IPFIX_ACTIVE_TIMEOUT;
+        if (ipfix_args.active->count > 0) {
+            if (ipfix_args.active->ival[0] < 0 || ipfix_args.active->ival[0] > 65535) {
+                printf("Invalid active timeout\n");
+                return ESP_ERR_INVALID_ARG;
+            }
+            cfg.active_timeout = ipfix_args.active->ival[0];
+        }
+    }
+
+    esp_err_t err = set_ipfix(&cfg);
+    if (err == ESP_OK) {
+        ESP_LOGI(TAG, "IPFIX export %s.", cfg.collector != 0 ? "set" : "turned off");
+    }
+    return err;
+}
+
+static void register_ipfix(void)
+{
+    ipfix_args.collector = arg_str0(NULL, NULL, "<collector_ip[:port]|off>", "collector to send to (port 4739 by default) or off, shows the exporter if omitted");
+    ipfix_args.active = arg_int0(NULL, "active", "<s>", "report flows still in use every <s> seconds (default 60), 0 only when they end");
+    ipfix_args.end = arg_end(2);
+
+    const esp_console_cmd_t cmd = {
+        .command = "ipfix",
+        .help = "Export the NAT flows to an IPFIX collector over UDP, applied right away",
+        .hint = NULL,
+        .func = &ipfix,
+        .argtable = &ipfix_args
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+/** Arguments used by 'fw' function */
+static struct {
+    struct arg_str *add_del;
+    struct arg_str *action;
+    struct arg_str *dir;
+    struct arg_str *client;
+    struct arg_str *remote;
+    struct arg_str *proto;
+    struct arg_str *port;
+    struct arg_int *pos;
+    struct arg_end *end;
+} fw_args;
+
+static void print_fw(void)
+{
+    /* Too large for the console's stack */
+    static fw_rule_t rules[FW_MAX];
+    ip4_addr_t addr;
+
+    int n = fw_get_rules(rules);
+    for (int i = 0; i < n; i++) {
+        fw_rule_t *r = &rules[i];
+        printf("%d: %s %s", i + 1, r->allow ? "allow" : "deny", r->dir == FW_IN ? "in" : "out");
+        if (r->mac[0] | r->mac[1] | r->mac[2] | r->mac[3] | r->mac[4] | r->mac[5]) {
+            printf(" client "MACSTR, MAC2STR(r->mac));
+            if (r->ip == 0) {
+                printf(" (no lease)");
+            }
+        } else if (r->ip != 0) {
+            addr.addr = r->ip;
+            printf(" client "IPSTR, IP2STR(&addr));
+        }
+        if (r->remote_len != 0) {
+            addr.addr = r->remote;
+            printf(" remote "IPSTR"/%d", IP2STR(&addr), r->remote_len);
+        }
+        if (r->proto != 0) {
+            printf(" %s", proto_str(r->proto));
+        }
+        if (r->port != 0) {
+            printf(r->port_last != r->port ? " port %d-%d" : " port %d", r->port, r->port_last);
+        }
+        printf(", %lu hits\n", (unsigned long)r->hits);
+    }
+    printf("%d of %d filter rules, other connections are allowed\n", n, FW_MAX);
+}
+
+/* 'fw' command */
+static int fw(int argc, char **argv)
+{
+    int nerrors = arg_parse(argc, argv, (void **) &fw_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, fw_args.end, argv[0]);
+        return 1;
+    }
+
+    if (fw_args.add_del->count == 0) {
+        print_fw();
+        return 0;
+    }
+    if (fw_args.action->count == 0) {
+        printf("Action or rule number required\n");
+        return 1;
+    }
+    if (strcmp(fw_args.add_del->sval[0], "del") == 0) {
+        esp_err_t err = del_fw_rule(atoi(fw_args.action->sval[0]) - 1);
+        if (err == ESP_ERR_NOT_FOUND) {
+            printf("No rule %s\n", fw_args.action->sval[0]);
+        }
+        return err;
+    } else if (strcmp(fw_args.add_del->sval[0], "add") != 0) {
+        printf("Must be 'add' or 'del'\n");
+        return 1;
+    }
+
+    fw_rule_t rule = {0};
+    if (strcmp(fw_args.action->sval[0], "allow") == 0) {
+        rule.allow = 1;
+    } else if (strcmp(fw_args.action->sval[0], "deny") != 0) {
+        printf("Action must be 'allow' or 'deny'\n");
+        return 1;
+    }
+    if (fw_args.dir->count == 0 || strcmp(fw_args.dir->sval[0], "out") == 0) {
+        rule.dir = FW_OUT;
+    } else if (strcmp(fw_args.dir->sval[0], "in") == 0) {
+        rule.dir = FW_IN;
+    } else {
+        printf("Direction must be 'in' or 'out'\n");
+        return 1;
+    }
+    if (fw_args.client->count > 0) {
+        bool by_mac;
+        if (!shape_parse_client(fw_args.client->sval[0], rule.mac, &rule.ip, &by_mac)) {
+            printf("Invalid client, must be a MAC or an IP\n");
+            return ESP_ERR_INVALID_ARG;
+        }
+        if (by_mac) {
+            rule.ip = 0;
+        }
+    }
+    if (fw_args.remote->count > 0) {
+        char buf[20];
+        int len = 32;
+        strlcpy(buf, fw_args.remote->sval[0], sizeof(buf));
+        char *slash = strchr(buf, '/');
+        if (slash != NULL) {
+            *slash++ = '\0';
+            len = atoi(slash);
+        }
+        uint32_t remote = esp_ip4addr_aton(buf);
+        if (len < 0 || len > 32 || remote == IPADDR_NONE || (remote == 0 && len != 0)) {
+            printf("Invalid remote network\n");
+            return ESP_ERR_INVALID_ARG;
+        }
+        rule.remote_len = len;
+        rule.remote = len == 0 ? 0 : remote & lwip_htonl(0xffffffffUL << (32 - len));
+    }
+    if (fw_args.proto->count > 0) {
+        if (strcmp(fw_args.proto->sval[0], "TCP") == 0) {
+            rule.proto = PROTO_TCP;
+        } else if (strcmp(fw_args.proto->sval[0], "UDP") == 0) {
+            rule.proto = PROTO_UDP;
+        } else if (strcmp(fw_args.proto->sval[0], "ICMP") == 0) {
+            rule.proto = PROTO_ICMP;
+        } else {
+            printf("Must be 'TCP', 'UDP' or 'ICMP'\n");
+            return 1;
+        }
+    }
+    if (fw_args.port->count > 0) {
+        if (!parse_port_range(fw_args.port->sval[0], &rule.port, &rule.port_last)) {
+            printf("Invalid port or range\n");
+            return 1;
+        }
+        if (rule.proto == PROTO_ICMP) {
+            printf("ICMP has no ports\n");
+            return 1;
+        }
+    }
+
+    esp_err_t err = add_fw_rule(&rule, fw_args.pos->count > 0 ? fw_args.pos->ival[0] - 1 : -1);
+    if (err == ESP_ERR_INVALID_SIZE) {
+        printf("At most %d rules\n", FW_MAX);
+    } else if (err == ESP_ERR_NO_MEM) {
+        printf("Out of memory for the filter tables\n");
+    }
+    return err;
+}
+
+static void register_fw(void)
+{
+    fw_args.add_del = arg_str0(NULL, NULL, "[add|del]", "add or delete a rule, lists rules and their hits if omitted");
+    fw_args.action = arg_str0(NULL, NULL, "<allow|deny|rule>", "action to add, number of the rule to delete");
+    fw_args.dir = arg_str0(NULL, NULL, "[in|out]", "out (default) for connections of AP clients, in for those to forwarded ports and the DMZ host");
+    fw_args.client = arg_str0(NULL, "client", "<mac|ip>", "only this AP client (the internal host for in), a MAC by its DHCP lease");
+    fw_args.remote = arg_str0(NULL, "remote", "<ip[/len]>", "only this remote host or network");
+    fw_args.proto = arg_str0(NULL, "proto", "<TCP|UDP|ICMP>", "only this protocol");
+    fw_args.port = arg_str0(NULL, "port", "<port[-last]>", "only this remote port (out) or port on the uplink (in)");
+    fw_args.pos = arg_int0(NULL, "pos", "<n>", "insert as rule <n>, appended if omitted");
+    fw_args.end = arg_end(8);
+
+    const esp_console_cmd_t cmd = {
+        .command = "fw",
+        .help = "Allow or deny new connections through the NAT, the first matching rule decides, applied right away",
+        .hint = NULL,
+        .func = &fw,
+        .argtable = &fw_args
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+/* 'show' command */
+static int show(int argc, char **argv)
+{
+    char* ssid = NULL;
+    char* ent_username = NULL;
+    char* ent_identity = NULL;
+    char* passwd = NULL;
+    char* static_ip = NULL;
+    char* subnet_mask = NULL;
+    char* gateway_addr = NULL;
+    char* ap_ssid = NULL;
+    char* ap_passwd = NULL;
+
+    get_config_param_str("ssid", &ssid);
+    get_config_param_str("ent_username", &ent_username);
+    get_config_param_str("ent_identity", &ent_identity);
+    get_config_param_str("passwd", &passwd);
+    get_config_param_str("static_ip", &static_ip);
+    get_config_param_str("subnet_mask", &subnet_mask);
+    get_config_param_str("gateway_addr", &gateway_addr);
+    get_config_param_str("ap_ssid", &ap_ssid);
+    get_config_param_str("ap_passwd", &ap_passwd);
+
+    printf("STA SSID: %s Password: %s Enterprise: %s %s\n",
+        ssid != NULL ? ssid : "<undef>",
+        passwd != NULL ? passwd : "<undef>",
+        ((ent_username != NULL) && (strlen(ent_username) > 0)) ? ent_username : "<not active>",
+        ((ent_username != NULL) && (strlen(ent_username) > 0) && (ent_identity != NULL) && (strlen(ent_identity) > 0)) ? ent_identity : ""
+    );
+    printf("AP SSID: %s Password: %s\n", ap_ssid != NULL ? ap_ssid : "<undef>",
+        ap_passwd != NULL ? ap_passwd : "<undef>");
+    isolate_config_t iso;
+    isolate_stats_t iso_stats;
+    isolate_get_config(&iso, &iso_stats);
+    if (iso.on) {
+        char macs[ISOLATE_EXEMPT_MAX * 18];
+        isolate_format_macs(&iso, macs, sizeof(macs));
+        printf("AP client isolation on%s%s, dropped %lu packets and %lu ARP between clients\n",
+               iso.count > 0 ? " except " : "", macs,
+               (unsigned long)iso_stats.dropped, (unsigned long)iso_stats.arp_dropped);
+    }
     ip4_addr_t addr;
     addr.addr = my_ap_ip;
     printf("AP IP address: " IPSTR "\n", IP2STR(&addr));
@@ -603,8 +1954,11 @@ static int show(int argc, char **argv)
         printf ("IP: " IPSTR "\n", IP2STR(&addr));
     }
     printf("%d Stations connected\n", connect_count);
+    print_clients();
 
+    printf("UPnP/NAT-PMP %s\n", get_igd() ? "on" : "off");
     print_portmap_tab();
+    print_ip6_relay();
 
     return 0;
 }
@@ -14,6 +14,11 @@ extern "C" {
 
 #define PROTO_TCP 6
 #define PROTO_UDP 17
+#define PROTO_ICMP 1
+
+/* Table sizes used when none are stored with set_nat_size */
+#define DEFAULT_NAPT_MAX 512
+#define DEFAULT_PORTMAP_MAX 128
 
 extern char* ssid;
 extern char* ent_username;
@@ -40,9 +45,325 @@ esp_err_t get_config_param_blob(char* name, uint8_t** blob, size_t blob_len);
 esp_err_t get_config_param_int(char* name, int* param);
 esp_err_t get_config_param_str(char* name, char** param);
 
+esp_err_t get_portmap_tab();
+esp_err_t apply_portmap_tab();
+esp_err_t delete_portmap_tab();
+esp_err_t reconcile_portmap_tab(uint32_t old_ip);
 void print_portmap_tab();
 esp_err_t add_portmap(uint8_t proto, uint16_t mport, uint32_t daddr, uint16_t dport);
+/* Flags of a portmap rule */
+#define PORTMAP_HAIRPIN 0x01    /* AP clients reach it by the uplink address too */
+#define PORTMAP_LEASE   0x02    /* created by an AP client, RAM only, see igd.c */
+
+esp_err_t add_portmap_range(uint8_t proto, uint16_t mport, uint16_t mport_last, uint32_t daddr, uint16_t dport, uint8_t flags);
 esp_err_t del_portmap(uint8_t proto, uint16_t mport);
+void set_portmap_max(uint16_t max);
+esp_err_t set_dmz_host(uint32_t ip);
+uint32_t get_dmz_host(void);
+
+/* Leases live until their lifetime (s) runs out and are never stored */
+#define PORTMAP_LEASE_MAX 32
+
+/* One portmap rule, as listed by portmap_walk() */
+typedef struct {
+    uint8_t proto;
+    uint8_t flags;
+    uint16_t mport;
+    uint16_t mport_last;
+    uint16_t dport;
+    uint32_t daddr;
+    uint32_t lease;             /* seconds left, 0 if stored */
+} portmap_rule_t;
+
+esp_err_t add_portmap_lease(uint8_t proto, uint16_t mport, uint32_t daddr, uint16_t dport, uint32_t lifetime);
+uint16_t portmap_lease_port(uint8_t proto, uint16_t port);
+void del_portmap_leases(uint8_t proto, uint32_t daddr);
+void expire_portmap_leases(void);
+bool portmap_walk(uint32_t *pos, portmap_rule_t *rule);
+
+/* NAPT table occupancy, see napt.c */
+typedef struct {
+    uint32_t capacity;
+    uint32_t entries;
+    uint32_t high_water;
+    uint32_t tcp;
+    uint32_t udp;
+    uint32_t icmp;
+    uint32_t alloc_failures;    /* new mappings refused, no free port */
+    uint32_t evictions;         /* mappings dropped to make room */
+    uint32_t expired;
+    uint32_t limited;           /* new mappings refused by the per-client limits */
+} napt_stats_t;
+
+/* NAPT idle timeouts in seconds */
+typedef struct {
+    uint32_t tcp;
+    uint32_t tcp_closing;
+    uint32_t udp;
+    uint32_t udp_stream;        /* UDP with traffic in both directions */
+    uint32_t icmp;
+} napt_timeouts_t;
+
+/* Per-client limits on new NAPT mappings, 0 for none */
+typedef struct {
+    uint32_t rate;              /* new connections per second, also the burst */
+    uint32_t flows;             /* mappings at a time */
+} napt_limits_t;
+
+/* One NAPT mapping, as listed by napt_walk() */
+typedef struct {
+    uint8_t proto;
+    uint8_t state;              /* see napt_state_str() */
+    uint16_t sport;             /* AP client, host byte order */
+    uint32_t src;
+    uint32_t dest;              /* remote side */
+    uint16_t dport;
+    uint16_t mport;             /* port on my_ip */
+    uint32_t age;               /* seconds since the last packet */
+    uint32_t bytes_out;
+    uint32_t bytes_in;
+} napt_conn_t;
+
+esp_err_t napt_init(uint32_t max_entries);
+void napt_get_stats(napt_stats_t *stats);
+void napt_get_timeouts(napt_timeouts_t *t);
+esp_err_t get_nat_timeouts(void);
+esp_err_t set_nat_timeouts(const napt_timeouts_t *t);
+void napt_get_limits(napt_limits_t *l);
+esp_err_t get_nat_limits(void);
+esp_err_t set_nat_limits(const napt_limits_t *l);
+/* Clients whose UDP is mapped endpoint independent (full cone) */
+#define NAPT_CONE_MAX 8
+
+esp_err_t get_nat_cone(void);
+esp_err_t set_nat_cone(uint32_t ip, bool enable);
+int napt_get_cone(uint32_t *ips);
+int napt_walk(uint32_t *pos, uint32_t filter_ip, napt_conn_t *conns, int max);
+const char *napt_state_str(uint8_t proto, uint8_t state);
+
+/* Forwarding path lookups, tcpip thread only */
+bool portmap_match_ext(uint8_t proto, uint16_t port, uint32_t *daddr, uint16_t *dport);
+bool portmap_match_int(uint8_t proto, uint32_t saddr, uint16_t sport, uint16_t *mport);
+bool portmap_match_hairpin(uint8_t proto, uint16_t port, uint32_t *daddr, uint16_t *dport);
+
+/* Counters of the packet hooks, see router_hooks.c. The time a packet
+ * of the AP or STA interface spends in the hook is counted in buckets of
+ * < 1, 2, 4 ... 64 us and more. */
+#define ROUTER_TIME_BUCKETS 8
+
+typedef struct {
+    uint32_t flow_hits;         /* packets translated from the flow cache */
+    uint32_t flow_misses;       /* packets that needed the full lookups */
+    uint32_t mss_clamped;       /* SYNs with their MSS lowered */
+    uint32_t icmp_limited;      /* packets not answered by the ICMP rate limit */
+    uint32_t timed;             /* packets timed in the hook */
+    uint32_t time_avg_ns;
+    uint32_t time_max_us;
+    uint32_t time_hist[ROUTER_TIME_BUCKETS];
+} router_stats_t;
+
+/* Forwarding from the Wi-Fi driver's RX buffers, see rxbuf.c */
+typedef struct {
+    uint32_t held;              /* driver buffers lwIP holds now */
+    uint32_t peak;
+    uint32_t in_place;          /* frames passed on in the driver's buffer */
+    uint32_t copied;            /* frames copied, buffers short or not sent in place */
+    uint32_t no_mem;            /* no heap for a copy, passed on in place */
+} rxbuf_stats_t;
+
+void rxbuf_get_stats(rxbuf_stats_t *stats);
+
+#define MSS_CLAMP_AUTO -1
+#define ICMP_RATE_DEFAULT 20
+
+void router_hooks_init(void);
+void router_hooks_get_stats(router_stats_t *stats);
+void router_hooks_reset_time(void);
+void set_mss_clamp(int mss);
+int get_mss_clamp(void);
+void set_icmp_rate(int rate);
+int get_icmp_rate(void);
+
+/* IPv6 prefix relay to the AP clients, see ip6_relay.c */
+void ip6_relay_init(void);
+void set_ip6_relay(bool enable);
+bool get_ip6_relay(void);
+void print_ip6_relay(void);
+
+/* mDNS/SSDP services reflected from the uplink to the AP clients, see
+ * mcast_reflect.c */
+#define MCAST_ALLOW_MAX 8
+#define MCAST_NAME_LEN 64
+
+esp_err_t get_mcast_reflect(void);
+esp_err_t set_mcast_reflect(const char *service, bool enable);
+int mcast_get_reflect(char names[][MCAST_NAME_LEN]);
+void mcast_reflect_get_stats(uint32_t *reflected, uint32_t *dropped);
+
+/* UPnP-IGD and NAT-PMP/PCP server for the AP clients, see igd.c */
+void igd_init(void);
+void set_igd(bool enable);
+bool get_igd(void);
+
+/* Per-client upload/download limits in kbit/s, see shape.c */
+#define SHAPE_MAX 8
+
+typedef struct {
+    uint8_t mac[6];             /* all 0 for a client set by IP */
+    uint32_t ip;                /* 0 while a MAC has no DHCP lease */
+    uint32_t up;                /* 0 for no limit */
+    uint32_t down;
+    uint32_t dropped_up;
+    uint32_t dropped_down;
+} shape_rule_t;
+
+esp_err_t get_shape(void);
+esp_err_t set_shape(const uint8_t *mac, uint32_t ip, uint32_t up, uint32_t down);
+int shape_get_rules(shape_rule_t *rules);
+void shape_client_ip(const uint8_t *mac, uint32_t ip);
+bool shape_parse_client(const char *s, uint8_t *mac, uint32_t *ip, bool *mac_set);
+
+/* Traffic of the AP clients through the uplink, see acct.c */
+#define ACCT_MAX 16
+
+typedef struct {
+    uint32_t ip;
+    uint8_t mac[6];             /* all 0 if not in the ARP table */
+    uint32_t idle;              /* seconds since the last packet */
+    uint64_t bytes_up;
+    uint64_t bytes_down;
+    uint32_t rate_up;           /* bytes in the last second */
+    uint32_t rate_down;
+    uint32_t packets_up;
+    uint32_t packets_down;
+    uint32_t flows;             /* open NAPT mappings */
+} acct_client_t;
+
+int acct_get_clients(acct_client_t *clients);
+void print_clients(void);
+
+/* Packet filter for new connections through the NAT, see fw.c */
+#define FW_MAX 32
+#define FW_OUT 0                /* opened by an AP client */
+#define FW_IN 1                 /* from the uplink to a forwarded port or the DMZ host */
+
+/* 0 in ip, remote_len, proto or port matches any */
+typedef struct {
+    uint8_t mac[6];             /* all 0 for a client set by IP */
+    uint32_t ip;                /* AP client, 0 while a MAC has no DHCP lease */
+    uint32_t remote;            /* remote network */
+    uint8_t remote_len;         /* its prefix length */
+    uint8_t proto;
+    uint8_t dir;
+    uint8_t allow;
+    uint16_t port;              /* remote port (FW_OUT), port on the uplink (FW_IN) */
+    uint16_t port_last;
+    uint32_t hits;              /* connections it decided on */
+} fw_rule_t;
+
+esp_err_t get_fw(void);
+esp_err_t add_fw_rule(const fw_rule_t *rule, int index);
+esp_err_t del_fw_rule(int index);
+int fw_get_rules(fw_rule_t *rules);
+void fw_client_ip(const uint8_t *mac, uint32_t ip);
+
+/* AP client isolation, see isolate.c */
+#define ISOLATE_EXEMPT_MAX 8
+
+typedef struct {
+    bool on;
+    uint8_t count;
+    uint8_t mac[ISOLATE_EXEMPT_MAX][6];     /* clients all others may reach */
+} isolate_config_t;
+
+typedef struct {
+    uint32_t dropped;           /* IPv4 packets between clients */
+    uint32_t arp_dropped;       /* ARP between clients */
+} isolate_stats_t;
+
+esp_err_t get_isolate(void);
+esp_err_t set_isolate(const isolate_config_t *cfg);
+void isolate_get_config(isolate_config_t *cfg, isolate_stats_t *stats);
+void isolate_client_ip(const uint8_t *mac, uint32_t ip);
+bool isolate_parse_macs(const char *s, isolate_config_t *cfg);
+void isolate_format_macs(const isolate_config_t *cfg, char *buf, size_t len);
+
+/* IPFIX export of the NAPT flows, see ipfix.c */
+#define IPFIX_PORT 4739
+#define IPFIX_ACTIVE_TIMEOUT 60
+
+typedef struct {
+    uint32_t collector;         /* 0 for off */
+    uint16_t port;
+    uint16_t active_timeout;    /* s, 0 to report flows only when they end */
+} ipfix_config_t;
+
+typedef struct {
+    uint32_t records;           /* sent to the collector */
+    uint32_t packets;
+    uint32_t dropped;           /* ring full or not sent */
+} ipfix_stats_t;
+
+esp_err_t get_ipfix(void);
+esp_err_t set_ipfix(const ipfix_config_t *cfg);
+void ipfix_get_config(ipfix_config_t *cfg, ipfix_stats_t *stats);
+
+/* Packet capture for /api/pcap, see pcap.c */
+#define PCAP_IF_STA 0x01
+#define PCAP_IF_AP 0x02
+#define PCAP_PROTO_ARP 0x100
+#define PCAP_SNAPLEN_MAX 1536
+#define PCAP_RECORD_MAX (16 + PCAP_SNAPLEN_MAX)
+
+/* 0 in host, proto or port matches any */
+typedef struct {
+    uint8_t ifs;                /* PCAP_IF_* */
+    uint16_t proto;             /* IP protocol or PCAP_PROTO_ARP */
+    uint32_t host;              /* either address of IPv4 or ARP */
+    uint16_t port;              /* either TCP/UDP port */
+    uint16_t snaplen;           /* 0 for PCAP_SNAPLEN_MAX */
+    uint32_t skip_host;         /* TCP connection left out, the reader's */
+    uint16_t skip_port;
+} pcap_filter_t;
+
+esp_err_t pcap_start(const pcap_filter_t *filter);
+size_t pcap_read(uint8_t *buf, size_t size, uint32_t timeout_ms);
+void pcap_stop(uint32_t *captured, uint32_t *dropped);
+
+/* WMM access categories of forwarded traffic, see qos.c */
+#define QOS_BK 0
+#define QOS_BE 1
+#define QOS_VI 2
+#define QOS_VO 3
+#define QOS_CLASSES 4
+#define QOS_NONE 0xff
+#define QOS_RULE_MAX 16
+
+/* 0 in ip, proto or port matches any */
+typedef struct {
+    uint32_t ip;                /* AP client */
+    uint16_t port;              /* either port of the client's flow */
+    uint16_t port_last;
+    uint8_t proto;
+    uint8_t cls;
+} qos_rule_t;
+
+typedef struct {
+    uint32_t marked;            /* packets a rule put into the class */
+    uint32_t queued;            /* frames that had to wait for the driver */
+    uint32_t depth;             /* frames waiting now */
+    uint32_t high_water;
+    uint32_t dropped;           /* queue full or refused by the driver */
+} qos_class_stats_t;
+
+esp_err_t get_qos(void);
+esp_err_t add_qos_rule(const qos_rule_t *rule);
+esp_err_t del_qos_rule(int index);
+int qos_get_rules(qos_rule_t *rules);
+/* [0] uplink, [1] AP; marked counts both directions */
+void qos_get_stats(qos_class_stats_t stats[2][QOS_CLASSES]);
+const char *qos_class_str(uint8_t cls);
+int qos_parse_class(const char *s);
 
 #ifdef __cplusplus
 }
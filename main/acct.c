@@ -0,0 +1,211 @@
+/* Per-client traffic accounting of the esp32_nat_router
+
+   Counts the bytes and packets each AP client sends to and receives from
+   the uplink, and the NAPT mappings it has open. The packet hook
+   (router_hooks.c) calls acct_count() for what it forwards after the
+   rate limits, napt.c calls acct_flow() when a mapping is created or
+   freed. All of it happens in the tcpip thread, the only writer, so the
+   counters need no lock. Readers copy them with tcpip_api_call().
+
+   Up to ACCT_MAX clients of the AP network are kept, found by the last
+   byte of their address like the rate limits (shape.c). A new client
+   takes the place of the one idle the longest. The MAC of a client is
+   looked up in the ARP table of the AP. A timer turns the byte counters
+   into the rate of the last second.
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "esp_netif.h"
+#include "esp_netif_net_stack.h"
+
+#include "lwip/opt.h"
+#include "lwip/def.h"
+#include "lwip/sys.h"
+#include "lwip/timeouts.h"
+#include "lwip/netif.h"
+#include "lwip/etharp.h"
+#include "lwip/ip4_addr.h"
+#include "lwip/priv/tcpip_priv.h"
+
+#include "router_globals.h"
+#include "nat.h"
+
+extern esp_netif_t* wifiAP;
+
+#define ACCT_TMR_INTERVAL 1000
+
+struct acct_entry {
+    u32_t ip;           /* 0 for a free entry */
+    u8_t mac[6];
+    bool have_mac;
+    u32_t last;         /* sys_now() of the last packet */
+    u64_t bytes[2];     /* SHAPE_UP, SHAPE_DOWN */
+    u64_t bytes_prev[2];
+    u32_t rate[2];      /* bytes in the last second */
+    u32_t packets[2];
+    u32_t flows;
+};
+
+static struct acct_entry acct_tab[ACCT_MAX];
+static u8_t acct_idx[256];      /* last address byte -> acct_tab index + 1 */
+static bool acct_tmr_on;
+
+static void acct_tmr(void *arg)
+{
+    for (int i = 0; i < ACCT_MAX; i++) {
+        struct acct_entry *e = &acct_tab[i];
+        for (int dir = 0; dir < 2; dir++) {
+            e->rate[dir] = e->bytes[dir] - e->bytes_prev[dir];
+            e->bytes_prev[dir] = e->bytes[dir];
+        }
+    }
+    sys_timeout(ACCT_TMR_INTERVAL, acct_tmr, NULL);
+}
+
+static void acct_find_mac(struct acct_entry *e)
+{
+    struct eth_addr *eth;
+    const ip4_addr_t *ip;
+    ip4_addr_t addr = { .addr = e->ip };
+
+    if (etharp_find_addr(esp_netif_get_netif_impl(wifiAP), &addr, &eth, &ip) >= 0) {
+        memcpy(e->mac, eth->addr, 6);
+        e->have_mac = true;
+    }
+}
+
+/* Entry of client, a new one if it has none and is in the AP network */
+static ROUTER_HOT struct acct_entry *acct_entry(u32_t client)
+{
+    u8_t i = acct_idx[((const u8_t *)&client)[3]];
+    if (i != 0 && acct_tab[i - 1].ip == client) {
+        return &acct_tab[i - 1];
+    }
+    if (my_ap_ip == 0 || (client ^ my_ap_ip) & PP_HTONL(0xffffff00UL) || client == my_ap_ip) {
+        return NULL;
+    }
+
+    struct acct_entry *e = &acct_tab[0];
+    u32_t now = sys_now();
+    for (int j = 0; j < ACCT_MAX; j++) {
+        if (acct_tab[j].ip == 0) {
+            e = &acct_tab[j];
+            break;
+        }
+        if (now - acct_tab[j].last > now - e->last) {
+            e = &acct_tab[j];
+        }
+    }
+    if (e->ip != 0) {
+        acct_idx[((const u8_t *)&e->ip)[3]] = 0;
+    }
+    memset(e, 0, sizeof(*e));
+    e->ip = client;
+    e->last = now;
+    acct_idx[((const u8_t *)&client)[3]] = e - acct_tab + 1;
+    acct_find_mac(e);
+    if (!acct_tmr_on) {
+        acct_tmr_on = true;
+        sys_timeout(ACCT_TMR_INTERVAL, acct_tmr, NULL);
+    }
+    return e;
+}
+
+ROUTER_HOT void acct_count(u32_t client, u16_t len, int dir)
+{
+    struct acct_entry *e = acct_entry(client);
+    if (e == NULL) {
+        return;
+    }
+    e->bytes[dir] += len;
+    e->packets[dir]++;
+    e->last = sys_now();
+}
+
+void acct_flow(u32_t client, bool open)
+{
+    struct acct_entry *e = acct_entry(client);
+    if (e == NULL) {
+        return;
+    }
+    if (open) {
+        e->flows++;
+    } else if (e->flows > 0) {
+        /* The entry may be newer than the mapping */
+        e->flows--;
+    }
+}
+
+struct acct_call {
+    struct tcpip_api_call_data call;
+    acct_client_t *clients;
+    int count;
+};
+
+static err_t acct_read(struct tcpip_api_call_data *call)
+{
+    struct acct_call *msg = (struct acct_call *)call;
+    u32_t now = sys_now();
+
+    msg->count = 0;
+    for (int i = 0; i < ACCT_MAX; i++) {
+        struct acct_entry *e = &acct_tab[i];
+        if (e->ip == 0) {
+            continue;
+        }
+        if (!e->have_mac) {
+            acct_find_mac(e);
+        }
+        acct_client_t *c = &msg->clients[msg->count++];
+        c->ip = e->ip;
+        memcpy(c->mac, e->mac, 6);
+        c->idle = (now - e->last) / 1000;
+        c->bytes_up = e->bytes[SHAPE_UP];
+        c->bytes_down = e->bytes[SHAPE_DOWN];
+        c->rate_up = e->rate[SHAPE_UP];
+        c->rate_down = e->rate[SHAPE_DOWN];
+        c->packets_up = e->packets[SHAPE_UP];
+        c->packets_down = e->packets[SHAPE_DOWN];
+        c->flows = e->flows;
+    }
+    return ERR_OK;
+}
+
+/* Copies the counters of up to ACCT_MAX clients, busiest first */
+int acct_get_clients(acct_client_t *clients)
+{
+    struct acct_call msg = { .clients = clients };
+
+    tcpip_api_call(acct_read, &msg.call);
+    for (int i = 1; i < msg.count; i++) {
+        acct_client_t c = clients[i];
+        int j = i;
+        for (; j > 0 && clients[j - 1].bytes_up + clients[j - 1].bytes_down < c.bytes_up + c.bytes_down; j--) {
+            clients[j] = clients[j - 1];
+        }
+        clients[j] = c;
+    }
+    return msg.count;
+}
+
+void print_clients(void)
+{
+    acct_client_t clients[ACCT_MAX];
+    ip4_addr_t addr;
+
+    int n = acct_get_clients(clients);
+    for (int i = 0; i < n; i++) {
+        acct_client_t *c = &clients[i];
+        addr.addr = c->ip;
+        printf("  "IPSTR" %02x:%02x:%02x:%02x:%02x:%02x up %llu bytes %lu pkts %lu kbit/s, down %llu bytes %lu pkts %lu kbit/s, %lu flows, idle %lus\n",
+               IP2STR(&addr), c->mac[0], c->mac[1], c->mac[2], c->mac[3], c->mac[4], c->mac[5],
+               (unsigned long long)c->bytes_up, (unsigned long)c->packets_up, (unsigned long)(c->rate_up * 8 / 1000),
+               (unsigned long long)c->bytes_down, (unsigned long)c->packets_down, (unsigned long)(c->rate_down * 8 / 1000),
+               (unsigned long)c->flows, (unsigned long)c->idle);
+    }
+}
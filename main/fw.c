@@ -0,0 +1,481 @@
+/* Packet filter of the esp32_nat_router
+
+   Up to FW_MAX rules allow or deny new connections through the NAT, the
+   first rule that matches decides, without one the connection is let
+   through. A rule matches on
+   - the direction: FW_OUT for connections an AP client opens, FW_IN for
+     connections from the uplink to a forwarded port or the DMZ host,
+   - the AP client (for FW_IN the internal host), by IP or by MAC,
+   - the remote network (for FW_IN the source), as address/prefix,
+   - the protocol, TCP, UDP or ICMP,
+   - a port range, the remote port for FW_OUT, the port on my_ip for
+     FW_IN.
+
+   It is stateful: napt.c asks fw_check() when it creates a mapping, the
+   packets that follow belong to the mapping and are not looked at again.
+   Forwarded ports have no mapping, router_hooks.c checks them for every
+   packet the flow cache does not know. So does napt.c for full cone
+   mappings, which are for any remote host: FW_OUT for what the client
+   sends, FW_IN for what comes back, with the mapped port. When the rules
+   change, the flow cache is flushed and napt_fw_recheck() ends the
+   mappings they no longer allow.
+
+   The rules are compiled into lookup tables, so a check costs the same
+   however many rules there are: a bit mask of the rules that can match
+   for each direction, protocol and client (by the last address byte, the
+   AP network is a /24), one for each interval between the rules' port
+   boundaries, found by binary search, and a binary trie of the remote
+   networks that gathers the masks of the prefixes along the address. The
+   lowest bit left after ANDing them is the first matching rule.
+
+   MACs are resolved to the DHCP lease like in shape.c. The tables belong
+   to the tcpip thread, a new set is compiled by the task that changes the
+   rules and installed with tcpip_api_call(), fw_lock serializes changes.
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "esp_log.h"
+#include "esp_netif.h"
+#include "esp_mac.h"
+#include "nvs.h"
+
+#include "lwip/opt.h"
+#include "lwip/def.h"
+#include "lwip/ip4_addr.h"
+#include "lwip/prot/ip.h"
+#include "lwip/priv/tcpip_priv.h"
+
+#include "router_globals.h"
+#include "nat.h"
+
+static const char *TAG = "fw";
+
+extern esp_netif_t* wifiAP;
+
+#define FW_NVS_KEY          "fw"
+#define FW_PORT_RANGES      (2 * FW_MAX + 1)
+
+/* Stored per rule, ip is 0 for a client set by MAC */
+struct fw_nvs_rec {
+    u8_t mac[6];
+    u32_t ip;
+    u32_t remote;
+    u8_t remote_len;
+    u8_t proto;
+    u8_t dir;
+    u8_t allow;
+    u16_t port;
+    u16_t port_last;
+} __attribute__((packed));
+
+struct fw_node {
+    u16_t child[2];     /* 0 for none, the root is no child */
+    u32_t rules;        /* rules whose remote network ends here */
+};
+
+/* Bit i of each mask stands for rule i */
+struct fw_tab {
+    u32_t allow;
+    u32_t dir[2];
+    u32_t proto[3];             /* TCP, UDP, ICMP */
+    u32_t any_client;           /* for addresses outside the AP network */
+    u32_t client[256];          /* by last address byte */
+    u32_t port_count;
+    u16_t port_start[FW_PORT_RANGES];
+    u32_t port_rules[FW_PORT_RANGES];
+    struct fw_node node[];      /* node[0] is the root */
+};
+
+static struct fw_tab *fw_tab;
+static fw_rule_t fw_rules[FW_MAX];
+static u32_t fw_count;
+static u32_t fw_hits[FW_MAX];
+static pthread_mutex_t fw_lock = PTHREAD_MUTEX_INITIALIZER;
+
+bool fw_check(int dir, u8_t proto, u32_t client, u32_t remote, u16_t port, bool count)
+{
+    const struct fw_tab *t = fw_tab;
+
+    if (t == NULL) {
+        return true;
+    }
+    u32_t m = t->dir[dir];
+    m &= t->proto[proto == IP_PROTO_TCP ? 0 : proto == IP_PROTO_UDP ? 1 : 2];
+    if (my_ap_ip != 0 && ((client ^ my_ap_ip) & PP_HTONL(0xffffff00UL)) == 0) {
+        m &= t->client[((const u8_t *)&client)[3]];
+    } else {
+        m &= t->any_client;
+    }
+    if (m == 0) {
+        return true;
+    }
+
+    /* Last port range starting at or below port, the first starts at 0 */
+    u32_t lo = 0, hi = t->port_count;
+    while (hi - lo > 1) {
+        u32_t mid = (lo + hi) / 2;
+        if (t->port_start[mid] <= port) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    m &= t->port_rules[lo];
+
+    u32_t r = t->node[0].rules;
+    u32_t addr = lwip_ntohl(remote);
+    u16_t n = 0;
+    for (int bit = 31; bit >= 0 && (m & ~r) != 0; bit--) {
+        n = t->node[n].child[(addr >> bit) & 1];
+        if (n == 0) {
+            break;
+        }
+        r |= t->node[n].rules;
+    }
+    m &= r;
+    if (m == 0) {
+        return true;
+    }
+
+    int i = __builtin_ctz(m);
+    if (count) {
+        fw_hits[i]++;
+    }
+    return (t->allow >> i) & 1;
+}
+
+static bool fw_by_mac(const fw_rule_t *r)
+{
+    static const u8_t none[6];
+    return memcmp(r->mac, none, 6) != 0;
+}
+
+static struct fw_tab *fw_compile(const fw_rule_t *rules, u32_t count)
+{
+    u32_t nodes = 1;
+    for (u32_t i = 0; i < count; i++) {
+        nodes += rules[i].remote_len;
+    }
+    struct fw_tab *t = calloc(1, sizeof(struct fw_tab) + nodes * sizeof(struct fw_node));
+    if (t == NULL) {
+        return NULL;
+    }
+
+    u32_t used = 1;
+    u32_t starts[FW_PORT_RANGES];
+    u32_t nstarts = 0;
+    starts[nstarts++] = 0;
+    for (u32_t i = 0; i < count; i++) {
+        const fw_rule_t *r = &rules[i];
+        u32_t bit = 1u << i;
+
+        if (r->allow) {
+            t->allow |= bit;
+        }
+        t->dir[r->dir] |= bit;
+        if (r->proto == 0 || r->proto == IP_PROTO_TCP) {
+            t->proto[0] |= bit;
+        }
+        if (r->proto == 0 || r->proto == IP_PROTO_UDP) {
+            t->proto[1] |= bit;
+        }
+        /* ICMP has no ports */
+        if ((r->proto == 0 || r->proto == IP_PROTO_ICMP) && r->port == 0) {
+            t->proto[2] |= bit;
+        }
+
+        if (r->ip != 0) {
+            t->client[((const u8_t *)&r->ip)[3]] |= bit;
+        } else if (!fw_by_mac(r)) {
+            t->any_client |= bit;
+        }
+
+        if (r->port != 0) {
+            starts[nstarts++] = r->port;
+            if (r->port_last < 0xffff) {
+                starts[nstarts++] = r->port_last + 1;
+            }
+        }
+
+        u16_t n = 0;
+        u32_t addr = lwip_ntohl(r->remote);
+        for (u32_t b = 0; b < r->remote_len; b++) {
+            u32_t side = (addr >> (31 - b)) & 1;
+            if (t->node[n].child[side] == 0) {
+                t->node[n].child[side] = used++;
+            }
+            n = t->node[n].child[side];
+        }
+        t->node[n].rules |= bit;
+    }
+    for (u32_t i = 0; i < 256; i++) {
+        t->client[i] |= t->any_client;
+    }
+
+    /* Sorted, without duplicates */
+    for (u32_t i = 1; i < nstarts; i++) {
+        u32_t s = starts[i], j = i;
+        for (; j > 0 && starts[j - 1] > s; j--) {
+            starts[j] = starts[j - 1];
+        }
+        starts[j] = s;
+    }
+    for (u32_t i = 0; i < nstarts; i++) {
+        if (t->port_count > 0 && t->port_start[t->port_count - 1] == starts[i]) {
+            continue;
+        }
+        u32_t s = starts[i], m = 0;
+        for (u32_t j = 0; j < count; j++) {
+            if (rules[j].port == 0 || (rules[j].port <= s && s <= rules[j].port_last)) {
+                m |= 1u << j;
+            }
+        }
+        t->port_start[t->port_count] = s;
+        t->port_rules[t->port_count++] = m;
+    }
+    return t;
+}
+
+struct fw_call {
+    struct tcpip_api_call_data call;
+    fw_rule_t rules[FW_MAX];
+    u32_t count;
+    struct fw_tab *tab;
+};
+
+/* Under fw_lock, too large for the stacks of the console and the event
+ * loop */
+static struct fw_call fw_msg;
+static struct fw_nvs_rec fw_recs[FW_MAX];
+
+/* Swaps in the compiled tables, msg->tab returns the old ones */
+static err_t fw_install(struct tcpip_api_call_data *call)
+{
+    struct fw_call *msg = (struct fw_call *)call;
+    struct fw_tab *old = fw_tab;
+
+    fw_tab = msg->count > 0 ? msg->tab : NULL;
+    msg->tab = old;
+    memcpy(fw_rules, msg->rules, msg->count * sizeof(fw_rule_t));
+    fw_count = msg->count;
+    for (u32_t i = 0; i < fw_count; i++) {
+        fw_hits[i] = fw_rules[i].hits;
+    }
+    flow_cache_flush();
+    napt_fw_recheck();
+    return ERR_OK;
+}
+
+static err_t fw_read(struct tcpip_api_call_data *call)
+{
+    struct fw_call *msg = (struct fw_call *)call;
+
+    memcpy(msg->rules, fw_rules, fw_count * sizeof(fw_rule_t));
+    for (u32_t i = 0; i < fw_count; i++) {
+        msg->rules[i].hits = fw_hits[i];
+    }
+    msg->count = fw_count;
+    return ERR_OK;
+}
+
+static void fw_load(struct fw_call *msg)
+{
+    memset(msg->rules, 0, sizeof(msg->rules));
+    tcpip_api_call(fw_read, &msg->call);
+}
+
+/* Copies the rules with their hit counters, rules has FW_MAX entries */
+int fw_get_rules(fw_rule_t *rules)
+{
+    pthread_mutex_lock(&fw_lock);
+    fw_load(&fw_msg);
+    int count = fw_msg.count;
+    memcpy(rules, fw_msg.rules, count * sizeof(fw_rule_t));
+    pthread_mutex_unlock(&fw_lock);
+    return count;
+}
+
+/* Fills in the DHCP lease of the clients set by MAC */
+static void fw_resolve(fw_rule_t *rules, u32_t count)
+{
+    for (u32_t i = 0; i < count; i++) {
+        if (fw_by_mac(&rules[i])) {
+            esp_netif_pair_mac_ip_t pair;
+            memcpy(pair.mac, rules[i].mac, 6);
+            pair.ip.addr = 0;
+            if (esp_netif_dhcps_get_clients_by_mac(wifiAP, 1, &pair) == ESP_OK && pair.ip.addr != 0) {
+                rules[i].ip = pair.ip.addr;
+            }
+        }
+    }
+}
+
+static esp_err_t fw_apply(struct fw_call *msg)
+{
+    struct fw_tab *tab = fw_compile(msg->rules, msg->count);
+    if (tab == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    msg->tab = tab;
+    tcpip_api_call(fw_install, &msg->call);
+    free(msg->tab);
+    if (msg->count == 0) {
+        free(tab);
+    }
+    return ESP_OK;
+}
+
+static esp_err_t fw_store(const fw_rule_t *rules, u32_t count)
+{
+    esp_err_t err;
+    nvs_handle_t nvs;
+    struct fw_nvs_rec *recs = fw_recs;
+
+    for (u32_t i = 0; i < count; i++) {
+        const fw_rule_t *r = &rules[i];
+        memcpy(recs[i].mac, r->mac, 6);
+        recs[i].ip = fw_by_mac(r) ? 0 : r->ip;
+        recs[i].remote = r->remote;
+        recs[i].remote_len = r->remote_len;
+        recs[i].proto = r->proto;
+        recs[i].dir = r->dir;
+        recs[i].allow = r->allow;
+        recs[i].port = r->port;
+        recs[i].port_last = r->port_last;
+    }
+
+    err = nvs_open(PARAM_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (count > 0) {
+        err = nvs_set_blob(nvs, FW_NVS_KEY, recs, count * sizeof(struct fw_nvs_rec));
+    } else {
+        err = nvs_erase_key(nvs, FW_NVS_KEY);
+        if (err == ESP_ERR_NVS_NOT_FOUND) {
+            err = ESP_OK;
+        }
+    }
+    if (err == ESP_OK) {
+        err = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+    return err;
+}
+
+/* Loads the rules stored by add_fw_rule(), after napt_init() */
+esp_err_t get_fw(void)
+{
+    esp_err_t err;
+    nvs_handle_t nvs;
+    struct fw_nvs_rec *recs = fw_recs;
+    struct fw_call *msg = &fw_msg;
+    size_t len = sizeof(fw_recs);
+
+    err = nvs_open(PARAM_NAMESPACE, NVS_READONLY, &nvs);
+    if (err != ESP_OK) {
+        return err;
+    }
+    pthread_mutex_lock(&fw_lock);
+    err = nvs_get_blob(nvs, FW_NVS_KEY, recs, &len);
+    nvs_close(nvs);
+    if (err != ESP_OK) {
+        pthread_mutex_unlock(&fw_lock);
+        return err;
+    }
+    msg->count = len / sizeof(struct fw_nvs_rec);
+    memset(msg->rules, 0, sizeof(msg->rules));
+    for (u32_t i = 0; i < msg->count; i++) {
+        fw_rule_t *r = &msg->rules[i];
+        memcpy(r->mac, recs[i].mac, 6);
+        r->ip = recs[i].ip;
+        r->remote = recs[i].remote;
+        r->remote_len = recs[i].remote_len;
+        r->proto = recs[i].proto;
+        r->dir = recs[i].dir;
+        r->allow = recs[i].allow;
+        r->port = recs[i].port;
+        r->port_last = recs[i].port_last;
+    }
+    fw_resolve(msg->rules, msg->count);
+    err = fw_apply(msg);
+    ESP_LOGI(TAG, "%u filter rules", (unsigned)msg->count);
+    pthread_mutex_unlock(&fw_lock);
+    return err;
+}
+
+/* Inserts rule before rule index, at the end if index is -1.
+ * ESP_ERR_INVALID_SIZE if there are FW_MAX rules already. */
+esp_err_t add_fw_rule(const fw_rule_t *rule, int index)
+{
+    struct fw_call *msg = &fw_msg;
+    esp_err_t err;
+
+    pthread_mutex_lock(&fw_lock);
+    fw_load(msg);
+    if (msg->count == FW_MAX) {
+        pthread_mutex_unlock(&fw_lock);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (index < 0 || (u32_t)index > msg->count) {
+        index = msg->count;
+    }
+    memmove(&msg->rules[index + 1], &msg->rules[index], (msg->count - index) * sizeof(fw_rule_t));
+    msg->rules[index] = *rule;
+    msg->rules[index].hits = 0;
+    msg->count++;
+    fw_resolve(msg->rules, msg->count);
+    err = fw_apply(msg);
+    if (err == ESP_OK) {
+        err = fw_store(msg->rules, msg->count);
+    }
+    pthread_mutex_unlock(&fw_lock);
+    return err;
+}
+
+esp_err_t del_fw_rule(int index)
+{
+    struct fw_call *msg = &fw_msg;
+    esp_err_t err;
+
+    pthread_mutex_lock(&fw_lock);
+    fw_load(msg);
+    if (index < 0 || (u32_t)index >= msg->count) {
+        pthread_mutex_unlock(&fw_lock);
+        return ESP_ERR_NOT_FOUND;
+    }
+    memmove(&msg->rules[index], &msg->rules[index + 1], (msg->count - index - 1) * sizeof(fw_rule_t));
+    msg->count--;
+    err = fw_apply(msg);
+    if (err == ESP_OK) {
+        err = fw_store(msg->rules, msg->count);
+    }
+    pthread_mutex_unlock(&fw_lock);
+    return err;
+}
+
+/* A client got a DHCP lease, from the event loop */
+void fw_client_ip(const uint8_t *mac, uint32_t ip)
+{
+    struct fw_call *msg = &fw_msg;
+    bool changed = false;
+
+    pthread_mutex_lock(&fw_lock);
+    fw_load(msg);
+    for (u32_t i = 0; i < msg->count; i++) {
+        if (memcmp(msg->rules[i].mac, mac, 6) == 0 && msg->rules[i].ip != ip) {
+            msg->rules[i].ip = ip;
+            changed = true;
+        }
+    }
+    if (changed && fw_apply(msg) != ESP_OK) {
+        ESP_LOGW(TAG, "No memory for the filter rules of " MACSTR, MAC2STR(mac));
+    }
+    pthread_mutex_unlock(&fw_lock);
+}
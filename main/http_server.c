@@ -8,6 +8,7 @@
 */
 
 #include <esp_wifi.h>
+#include <esp_mac.h>
 #include <esp_event.h>
 #include <esp_log.h>
 #include <esp_system.h>
@@ -19,12 +20,18 @@
 //#include "protocol_examples_common.h"
 
 #include <esp_http_server.h>
+#include "lwip/sockets.h"
+#include <pthread.h>
 
 #include "pages.h"
 #include "router_globals.h"
 
 static const char *TAG = "HTTPServer";
 
+extern esp_netif_t* wifiAP;
+
+void igd_register_uri_handlers(httpd_handle_t server);
+
 esp_timer_handle_t restart_timer;
 
 static void restart_timer_callback(void* arg)
@@ -79,11 +86,18 @@ static esp_err_t index_get_handler(httpd_req_t *req)
                 if (httpd_query_key_value(buf, "ap_password", param2, sizeof(param2)) == ESP_OK) {
                     ESP_LOGI(TAG, "Found URL query parameter => ap_password=%s", param2);
                     preprocess_string(param2);
-                    int argc = 3;
-                    char* argv[3];
+                    /* The checkbox is only sent when checked */
+                    char except[ISOLATE_EXEMPT_MAX * 32];
+                    strcpy(except, "--except=");
+                    httpd_query_key_value(buf, "ap_isolate_except", except + 9, sizeof(except) - 9);
+                    int argc = 5;
+                    char* argv[5];
                     argv[0] = "set_ap";
                     argv[1] = param1;
                     argv[2] = param2;
+                    argv[3] = httpd_query_key_value(buf, "ap_isolate", param3, sizeof(param3)) == ESP_OK ?
+                              "--isolate=on" : "--isolate=off";
+                    argv[4] = except;
                     set_ap(argc, argv);
                     esp_timer_start_once(restart_timer, 500000);
                 }
@@ -144,6 +158,19 @@ static esp_err_t index_get_handler(httpd_req_t *req)
                     }
                 }
             }
+            if (httpd_query_key_value(buf, "shape_client", param1, sizeof(param1)) == ESP_OK &&
+                httpd_query_key_value(buf, "shape_up", param2, sizeof(param2)) == ESP_OK &&
+                httpd_query_key_value(buf, "shape_down", param3, sizeof(param3)) == ESP_OK) {
+                ESP_LOGI(TAG, "Found URL query parameter => shape_client=%s", param1);
+                preprocess_string(param1);
+                uint8_t mac[6];
+                uint32_t ip = 0;
+                bool by_mac;
+                if (shape_parse_client(param1, mac, &ip, &by_mac)) {
+                    /* No restart, the limits apply right away */
+                    set_shape(by_mac ? mac : NULL, ip, strtoul(param2, NULL, 10), strtoul(param3, NULL, 10));
+                }
+            }
         }
         free(buf);
     }
@@ -162,6 +189,342 @@ static httpd_uri_t indexp = {
     .handler   = index_get_handler,
 };
 
+/* NAPT table occupancy as JSON */
+static esp_err_t nat_stats_get_handler(httpd_req_t *req)
+{
+    napt_stats_t stats;
+    router_stats_t hook_stats;
+    rxbuf_stats_t rx;
+    uint32_t reflected, dropped;
+    char buf[1024];
+
+    napt_get_stats(&stats);
+    router_hooks_get_stats(&hook_stats);
+    rxbuf_get_stats(&rx);
+    mcast_reflect_get_stats(&reflected, &dropped);
+    snprintf(buf, sizeof(buf),
+        "{\"capacity\":%lu,\"entries\":%lu,\"high_water\":%lu,\"tcp\":%lu,\"udp\":%lu,\"icmp\":%lu,"
+        "\"alloc_failures\":%lu,\"evictions\":%lu,\"expired\":%lu,\"limited\":%lu,\"flow_hits\":%lu,\"flow_misses\":%lu,"
+        "\"mss_clamped\":%lu,\"icmp_limited\":%lu,\"mcast_reflected\":%lu,\"mcast_dropped\":%lu,"
+        "\"rx_held\":%lu,\"rx_peak\":%lu,\"rx_in_place\":%lu,\"rx_copied\":%lu,\"rx_no_mem\":%lu,"
+        "\"hook_timed\":%lu,\"hook_avg_ns\":%lu,\"hook_max_us\":%lu,\"hook_hist_us\":[%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu]}",
+        (unsigned long)stats.capacity, (unsigned long)stats.entries, (unsigned long)stats.high_water,
+        (unsigned long)stats.tcp, (unsigned long)stats.udp, (unsigned long)stats.icmp,
+        (unsigned long)stats.alloc_failures, (unsigned long)stats.evictions, (unsigned long)stats.expired,
+        (unsigned long)stats.limited, (unsigned long)hook_stats.flow_hits, (unsigned long)hook_stats.flow_misses,
+        (unsigned long)hook_stats.mss_clamped, (unsigned long)hook_stats.icmp_limited,
+        (unsigned long)reflected, (unsigned long)dropped,
+        (unsigned long)rx.held, (unsigned long)rx.peak, (unsigned long)rx.in_place, (unsigned long)rx.copied,
+        (unsigned long)rx.no_mem,
+        (unsigned long)hook_stats.timed, (unsigned long)hook_stats.time_avg_ns, (unsigned long)hook_stats.time_max_us,
+        (unsigned long)hook_stats.time_hist[0], (unsigned long)hook_stats.time_hist[1],
+        (unsigned long)hook_stats.time_hist[2], (unsigned long)hook_stats.time_hist[3],
+        (unsigned long)hook_stats.time_hist[4], (unsigned long)hook_stats.time_hist[5],
+        (unsigned long)hook_stats.time_hist[6], (unsigned long)hook_stats.time_hist[7]);
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_send(req, buf, strlen(buf));
+    return ESP_OK;
+}
+
+static httpd_uri_t nat_statsp = {
+    .uri       = "/api/nat_stats",
+    .method    = HTTP_GET,
+    .handler   = nat_stats_get_handler,
+};
+
+/* NAPT table entries as a JSON array, streamed in chunks.
+ * /api/conntrack?ip=<client> lists the entries of one client only. */
+static esp_err_t conntrack_get_handler(httpd_req_t *req)
+{
+    napt_conn_t conns[8];
+    uint32_t filter_ip = 0, pos = 0;
+    char query[64], param[32], buf[224];
+    bool first = true;
+    int n;
+
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+        httpd_query_key_value(query, "ip", param, sizeof(param)) == ESP_OK) {
+        filter_ip = esp_ip4addr_aton(param);
+        if (filter_ip == 0) {
+            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid ip");
+            return ESP_FAIL;
+        }
+    }
+
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_sendstr_chunk(req, "[");
+    while ((n = napt_walk(&pos, filter_ip, conns, sizeof(conns) / sizeof(conns[0]))) > 0) {
+        for (int i = 0; i < n; i++) {
+            napt_conn_t *c = &conns[i];
+            esp_ip4_addr_t src = { .addr = c->src }, dest = { .addr = c->dest };
+            snprintf(buf, sizeof(buf),
+                "%s{\"proto\":%d,\"state\":\"%s\",\"src\":\"" IPSTR "\",\"sport\":%d,"
+                "\"dest\":\"" IPSTR "\",\"dport\":%d,\"mport\":%d,\"age\":%lu,\"bytes_out\":%lu,\"bytes_in\":%lu}",
+                first ? "" : ",", c->proto, napt_state_str(c->proto, c->state),
+                IP2STR(&src), c->sport, IP2STR(&dest), c->dport, c->mport,
+                (unsigned long)c->age, (unsigned long)c->bytes_out, (unsigned long)c->bytes_in);
+            first = false;
+            if (httpd_resp_sendstr_chunk(req, buf) != ESP_OK) {
+                /* Client went away, end the response */
+                httpd_resp_sendstr_chunk(req, NULL);
+                return ESP_FAIL;
+            }
+        }
+    }
+    httpd_resp_sendstr_chunk(req, "]");
+    httpd_resp_sendstr_chunk(req, NULL);
+    return ESP_OK;
+}
+
+static httpd_uri_t conntrackp = {
+    .uri       = "/api/conntrack",
+    .method    = HTTP_GET,
+    .handler   = conntrack_get_handler,
+};
+
+/* Traffic per AP client as a JSON array, busiest first, see acct.c */
+static esp_err_t clients_get_handler(httpd_req_t *req)
+{
+    acct_client_t clients[ACCT_MAX];
+    char buf[288];
+    int n = acct_get_clients(clients);
+
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_sendstr_chunk(req, "[");
+    for (int i = 0; i < n; i++) {
+        acct_client_t *c = &clients[i];
+        esp_ip4_addr_t ip = { .addr = c->ip };
+        snprintf(buf, sizeof(buf),
+            "%s{\"ip\":\"" IPSTR "\",\"mac\":\"" MACSTR "\",\"idle\":%lu,\"bytes_up\":%llu,\"bytes_down\":%llu,"
+            "\"rate_up\":%lu,\"rate_down\":%lu,\"packets_up\":%lu,\"packets_down\":%lu,\"flows\":%lu}",
+            i == 0 ? "" : ",", IP2STR(&ip), MAC2STR(c->mac), (unsigned long)c->idle,
+            (unsigned long long)c->bytes_up, (unsigned long long)c->bytes_down,
+            (unsigned long)c->rate_up, (unsigned long)c->rate_down,
+            (unsigned long)c->packets_up, (unsigned long)c->packets_down, (unsigned long)c->flows);
+        httpd_resp_sendstr_chunk(req, buf);
+    }
+    httpd_resp_sendstr_chunk(req, "]");
+    httpd_resp_sendstr_chunk(req, NULL);
+    return ESP_OK;
+}
+
+static httpd_uri_t clientsp = {
+    .uri       = "/api/clients",
+    .method    = HTTP_GET,
+    .handler   = clients_get_handler,
+};
+
+/* Rate limited clients as a JSON array, see shape.c */
+static esp_err_t shape_get_handler(httpd_req_t *req)
+{
+    shape_rule_t rules[SHAPE_MAX];
+    char buf[192];
+    int n = shape_get_rules(rules);
+
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_sendstr_chunk(req, "[");
+    for (int i = 0; i < n; i++) {
+        shape_rule_t *r = &rules[i];
+        esp_ip4_addr_t ip = { .addr = r->ip };
+        snprintf(buf, sizeof(buf),
+            "%s{\"mac\":\"" MACSTR "\",\"ip\":\"" IPSTR "\",\"up\":%lu,\"down\":%lu,"
+            "\"dropped_up\":%lu,\"dropped_down\":%lu}",
+            i == 0 ? "" : ",", MAC2STR(r->mac), IP2STR(&ip), (unsigned long)r->up, (unsigned long)r->down,
+            (unsigned long)r->dropped_up, (unsigned long)r->dropped_down);
+        httpd_resp_sendstr_chunk(req, buf);
+    }
+    httpd_resp_sendstr_chunk(req, "]");
+    httpd_resp_sendstr_chunk(req, NULL);
+    return ESP_OK;
+}
+
+static httpd_uri_t shapep = {
+    .uri       = "/api/shape",
+    .method    = HTTP_GET,
+    .handler   = shape_get_handler,
+};
+
+#define PCAP_THREAD_STACK 4096
+
+/* A capture streamed by its own thread, on the copy of the request the
+ * web server hands over */
+struct pcap_stream {
+    httpd_req_t *req;
+    int64_t end;                /* esp_timer time, 0 for none */
+    uint8_t buf[PCAP_RECORD_MAX];
+};
+
+/* Fills in the address and port of the client of req, to keep its
+ * connection out of the capture, and returns the address, 0 unless IPv4.
+ * The server takes IPv4 clients on an IPv6 socket. */
+static uint32_t pcap_peer(httpd_req_t *req, pcap_filter_t *f)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+
+    if (getpeername(httpd_req_to_sockfd(req), (struct sockaddr *)&addr, &len) != 0) {
+        return 0;
+    }
+    if (addr.ss_family == AF_INET) {
+        struct sockaddr_in *in = (struct sockaddr_in *)&addr;
+        f->skip_host = in->sin_addr.s_addr;
+        f->skip_port = ntohs(in->sin_port);
+    } else if (addr.ss_family == AF_INET6) {
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&addr;
+        if (in6->sin6_addr.un.u32_addr[0] != 0 || in6->sin6_addr.un.u32_addr[1] != 0 ||
+            in6->sin6_addr.un.u32_addr[2] != PP_HTONL(0xffff)) {
+            return 0;
+        }
+        memcpy(&f->skip_host, &in6->sin6_addr.s6_addr[12], 4);
+        f->skip_port = ntohs(in6->sin6_port);
+    }
+    return f->skip_host;
+}
+
+/* Only AP clients may capture, the web server is reachable from the
+ * uplink as well */
+static bool pcap_client_ok(uint32_t addr)
+{
+    esp_netif_ip_info_t ip_info;
+    uint32_t mask = PP_HTONL(0xffffff00UL);
+
+    if (esp_netif_get_ip_info(wifiAP, &ip_info) == ESP_OK && ip_info.netmask.addr != 0) {
+        mask = ip_info.netmask.addr;
+    }
+    return addr != 0 && addr != my_ap_ip && ((addr ^ my_ap_ip) & mask) == 0;
+}
+
+static void *pcap_thread(void *arg)
+{
+    struct pcap_stream *s = arg;
+    httpd_req_t *req = s->req;
+    uint32_t captured = 0, dropped = 0;
+
+    httpd_resp_set_type(req, "application/vnd.tcpdump.pcap");
+    httpd_resp_set_hdr(req, "Content-Disposition", "attachment; filename=\"nozzlenat.pcap\"");
+    int fd = httpd_req_to_sockfd(req);
+    for (;;) {
+        size_t n = pcap_read(s->buf, PCAP_RECORD_MAX, 500);
+        if (n > 0 && httpd_resp_send_chunk(req, (const char *)s->buf, n) != ESP_OK) {
+            break;
+        }
+        if (s->end != 0 && esp_timer_get_time() >= s->end) {
+            httpd_resp_send_chunk(req, NULL, 0);
+            break;
+        }
+        /* Without traffic only this notices that the client went away */
+        char c;
+        if (recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 0) {
+            break;
+        }
+    }
+    pcap_stop(&captured, &dropped);
+    httpd_req_async_handler_complete(req);
+    free(s);
+    return NULL;
+}
+
+/* Packet capture as a pcap stream, until the client closes the connection
+ * or the time given by seconds is up. Query: if=ap|sta (both by default),
+ * host=<ip>, proto=tcp|udp|icmp|arp|<number>, port=<n>, snap=<bytes>.
+ * Only for AP clients. The stream runs in a thread of its own, the web
+ * server goes on with other requests meanwhile. */
+static esp_err_t pcap_get_handler(httpd_req_t *req)
+{
+    pcap_filter_t f = { .ifs = PCAP_IF_STA | PCAP_IF_AP };
+    char query[128], param[32];
+    uint32_t seconds = 0, captured, dropped;
+    pthread_t t;
+    pthread_attr_t attr;
+
+    if (!pcap_client_ok(pcap_peer(req, &f))) {
+        httpd_resp_send_err(req, HTTPD_403_FORBIDDEN, "Only AP clients may capture");
+        return ESP_FAIL;
+    }
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+        if (httpd_query_key_value(query, "if", param, sizeof(param)) == ESP_OK) {
+            if (strcmp(param, "ap") == 0) {
+                f.ifs = PCAP_IF_AP;
+            } else if (strcmp(param, "sta") == 0) {
+                f.ifs = PCAP_IF_STA;
+            } else {
+                httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "if must be ap or sta");
+                return ESP_FAIL;
+            }
+        }
+        if (httpd_query_key_value(query, "host", param, sizeof(param)) == ESP_OK &&
+            (f.host = esp_ip4addr_aton(param)) == 0) {
+            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid host");
+            return ESP_FAIL;
+        }
+        if (httpd_query_key_value(query, "proto", param, sizeof(param)) == ESP_OK) {
+            if (strcmp(param, "tcp") == 0) {
+                f.proto = PROTO_TCP;
+            } else if (strcmp(param, "udp") == 0) {
+                f.proto = PROTO_UDP;
+            } else if (strcmp(param, "icmp") == 0) {
+                f.proto = PROTO_ICMP;
+            } else if (strcmp(param, "arp") == 0) {
+                f.proto = PCAP_PROTO_ARP;
+            } else {
+                int proto = atoi(param);
+                if (proto <= 0 || proto > 255) {
+                    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid proto");
+                    return ESP_FAIL;
+                }
+                f.proto = proto;
+            }
+        }
+        if (httpd_query_key_value(query, "port", param, sizeof(param)) == ESP_OK) {
+            int port = atoi(param);
+            if (port <= 0 || port > 65535) {
+                httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid port");
+                return ESP_FAIL;
+            }
+            f.port = port;
+        }
+        if (httpd_query_key_value(query, "snap", param, sizeof(param)) == ESP_OK) {
+            f.snaplen = MIN(MAX(atoi(param), 64), PCAP_SNAPLEN_MAX);
+        }
+        if (httpd_query_key_value(query, "seconds", param, sizeof(param)) == ESP_OK) {
+            seconds = atoi(param);
+        }
+    }
+
+    struct pcap_stream *s = malloc(sizeof(*s));
+    if (s == NULL || pcap_start(&f) != ESP_OK) {
+        free(s);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Cannot start the capture");
+        return ESP_FAIL;
+    }
+    s->end = seconds != 0 ? esp_timer_get_time() + (int64_t)seconds * 1000000 : 0;
+    if (httpd_req_async_handler_begin(req, &s->req) != ESP_OK) {
+        pcap_stop(&captured, &dropped);
+        free(s);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Cannot start the capture");
+        return ESP_FAIL;
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, PCAP_THREAD_STACK);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int err = pthread_create(&t, &attr, pcap_thread, s);
+    pthread_attr_destroy(&attr);
+    if (err != 0) {
+        pcap_stop(&captured, &dropped);
+        httpd_resp_send_err(s->req, HTTPD_500_INTERNAL_SERVER_ERROR, "Cannot start the capture");
+        httpd_req_async_handler_complete(s->req);
+        free(s);
+    }
+    return ESP_OK;
+}
+
+static httpd_uri_t pcapp = {
+    .uri       = "/api/pcap",
+    .method    = HTTP_GET,
+    .handler   = pcap_get_handler,
+};
+
 esp_err_t http_404_error_handler(httpd_req_t *req, httpd_err_code_t err)
 {
     httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "Page not found");
@@ -205,6 +568,8 @@ httpd_handle_t start_webserver(void)
 {
     httpd_handle_t server = NULL;
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+    config.uri_match_fn = httpd_uri_match_wildcard;
+    config.max_uri_handlers = 12;
 
     const char* config_page_template = CONFIG_PAGE;
 
@@ -214,6 +579,10 @@ httpd_handle_t start_webserver(void)
     char* safe_passwd = html_escape(passwd);
     char* safe_ent_username = html_escape(ent_username);
     char* safe_ent_identity = html_escape(ent_identity);
+    isolate_config_t iso;
+    char iso_macs[ISOLATE_EXEMPT_MAX * 18];
+    isolate_get_config(&iso, NULL);
+    isolate_format_macs(&iso, iso_macs, sizeof(iso_macs));
 
     int page_len =
         strlen(config_page_template) +
@@ -223,12 +592,13 @@ httpd_handle_t start_webserver(void)
         strlen(safe_passwd) +
         strlen(safe_ent_username) +
         strlen(safe_ent_identity) +
+        strlen(iso_macs) +
         256;
     char* config_page = malloc(sizeof(char) * page_len);
 
     snprintf(
         config_page, page_len, config_page_template,
-        safe_ap_ssid, safe_ap_passwd,
+        safe_ap_ssid, safe_ap_passwd, iso.on ? "checked" : "", iso_macs,
         safe_ssid, safe_passwd, safe_ent_username, safe_ent_identity,
             static_ip, subnet_mask, gateway_addr);
     indexp.user_ctx = config_page;
@@ -248,6 +618,12 @@ httpd_handle_t start_webserver(void)
         // Set URI handlers
         ESP_LOGI(TAG, "Registering URI handlers");
         httpd_register_uri_handler(server, &indexp);
+        httpd_register_uri_handler(server, &nat_statsp);
+        httpd_register_uri_handler(server, &conntrackp);
+        httpd_register_uri_handler(server, &shapep);
+        httpd_register_uri_handler(server, &clientsp);
+        httpd_register_uri_handler(server, &pcapp);
+        igd_register_uri_handlers(server);
         return server;
     }
 
@@ -0,0 +1,1026 @@
+/* UPnP-IGD and NAT-PMP/PCP server of the esp32_nat_router
+
+   Lets the AP clients open their own port mappings on my_ip, with "set_upnp
+   on". Three protocols are served, all on the AP side only:
+
+   - NAT-PMP (RFC 6886) and PCP (RFC 6887, MAP and ANNOUNCE opcodes) on UDP
+     port 5351 of my_ap_ip, told apart by their version byte,
+   - UPnP IGD v1: M-SEARCHes on the AP are answered with the location of
+     the device description, which the web server hands out together with
+     the SOAP control endpoint of WANIPConnection (/igd/...). Without the
+     web server (lock set) there is no UPnP.
+
+   Mappings are leases in the portmap table (add_portmap_lease()), kept in
+   RAM only. A client can only map ports to itself, only to external ports
+   below the NAPT range and at most PORTMAP_LEASE_MAX leases exist at a
+   time. NAT-PMP/PCP lifetimes are capped at 2 hours, UPnP ones at a week
+   (a UPnP lease of 0, "forever", gets a week as well, as in IGD v2).
+
+   The UDP side runs in a thread of its own, which also expires the leases.
+   The portmap table must not be changed from the tcpip thread (it publishes
+   through tcpip_api_call()), so the raw API is not an option here.
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_netif.h"
+#include "esp_http_server.h"
+
+#include "lwip/def.h"
+#include "lwip/ip4_addr.h"
+#include "lwip/sockets.h"
+
+#include "router_globals.h"
+
+static const char *TAG = "igd";
+
+extern esp_netif_t* wifiAP;
+
+#define IGD_PMP_PORT            5351
+#define IGD_SSDP_PORT           1900
+#define IGD_PMP_LIFETIME_MAX    7200            /* s */
+#define IGD_UPNP_LIFETIME_MAX   (7*24*3600)     /* s */
+#define IGD_NOTIFY_INTERVAL     900             /* s, half the max-age */
+#define IGD_PCP_MAX_LEN         1100
+#define IGD_SOAP_MAX_LEN        2048
+#define IGD_THREAD_STACK        4096
+
+/* NAT-PMP opcodes and result codes */
+#define PMP_OP_ADDRESS          0
+#define PMP_OP_MAP_UDP          1
+#define PMP_OP_MAP_TCP          2
+#define PMP_OP_REPLY            0x80
+#define PMP_NETWORK_FAILURE     3
+#define PMP_NO_RESOURCES        4
+#define PMP_UNSUPP_OPCODE       5
+
+/* PCP, RFC 6887 */
+#define PCP_VERSION             2
+#define PCP_HLEN                24
+#define PCP_MAP_LEN             36
+#define PCP_OP_ANNOUNCE         0
+#define PCP_OP_MAP              1
+#define PCP_SUCCESS             0
+#define PCP_UNSUPP_VERSION      1
+#define PCP_MALFORMED_REQUEST   3
+#define PCP_UNSUPP_OPCODE       4
+#define PCP_UNSUPP_OPTION       5
+#define PCP_MALFORMED_OPTION    6
+#define PCP_NETWORK_FAILURE     7
+#define PCP_NO_RESOURCES        8
+#define PCP_UNSUPP_PROTOCOL     9
+#define PCP_ADDRESS_MISMATCH    12
+#define PCP_ERROR_LIFETIME      30              /* s, for errors that may go away */
+#define PCP_LONG_ERROR_LIFETIME 1800
+
+#define IGD_DEVICE  "urn:schemas-upnp-org:device:InternetGatewayDevice:1"
+#define IGD_WANDEV  "urn:schemas-upnp-org:device:WANDevice:1"
+#define IGD_WANCDEV "urn:schemas-upnp-org:device:WANConnectionDevice:1"
+#define IGD_WANIPC  "urn:schemas-upnp-org:service:WANIPConnection:1"
+#define IGD_WANCIC  "urn:schemas-upnp-org:service:WANCommonInterfaceConfig:1"
+
+static bool igd_enabled;
+static bool igd_http_ready;
+static u32_t igd_start;             /* s, NAT-PMP/PCP epoch */
+static u32_t igd_netmask;
+static char igd_uuid[40];           /* of the root device, the others differ in the last digit */
+static int igd_pmp_sock = -1;
+static int igd_ssdp_sock = -1;
+
+static u8_t igd_pmp_buf[IGD_PCP_MAX_LEN];
+static char igd_ssdp_buf[1024];
+static char igd_soap_buf[IGD_SOAP_MAX_LEN + 1];
+static char igd_resp_buf[2048];
+
+static inline u32_t igd_now(void)
+{
+    return (u32_t)(esp_timer_get_time() / 1000000);
+}
+
+/* Only AP clients may map ports, the web server and 5351 are reachable
+ * from the uplink as well */
+static bool igd_client_ok(u32_t addr)
+{
+    return igd_enabled && addr != my_ap_ip && (addr & igd_netmask) == (my_ap_ip & igd_netmask);
+}
+
+static void put16(u8_t *p, u16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static void put32(u8_t *p, u32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static u16_t get16(const u8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static u32_t get32(const u8_t *p)
+{
+    return ((u32_t)p[0] << 24) | ((u32_t)p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/* External port of the lease client holds for iport, 0 if none */
+static u16_t igd_find_lease(u8_t proto, u32_t client, u16_t iport)
+{
+    portmap_rule_t rule;
+    u32_t pos = 0;
+
+    while (portmap_walk(&pos, &rule)) {
+        if ((rule.flags & PORTMAP_LEASE) && rule.proto == proto && rule.daddr == client && rule.dport == iport) {
+            return rule.mport;
+        }
+    }
+    return 0;
+}
+
+/* Maps iport of client for lifetime s, keeping the external port of an
+ * existing lease and trying the suggested one otherwise. Returns the
+ * external port, 0 if there is none left. */
+static u16_t igd_map(u8_t proto, u32_t client, u16_t iport, u16_t suggested, u32_t lifetime)
+{
+    u16_t mport = igd_find_lease(proto, client, iport);
+
+    for (int tries = 0; tries < 4; tries++) {
+        if (mport == 0) {
+            mport = portmap_lease_port(proto, suggested != 0 ? suggested : iport);
+            if (mport == 0) {
+                return 0;
+            }
+        }
+        esp_err_t err = add_portmap_lease(proto, mport, client, iport, lifetime);
+        if (err == ESP_OK) {
+            return mport;
+        }
+        if (err != ESP_ERR_INVALID_STATE) {
+            return 0;
+        }
+        /* Taken in between, by another client or the console */
+        suggested = mport + 1;
+        mport = 0;
+    }
+    return 0;
+}
+
+/* Ends the lease of iport, or all leases of client for proto if iport is 0 */
+static void igd_unmap(u8_t proto, u32_t client, u16_t iport)
+{
+    if (iport == 0) {
+        del_portmap_leases(proto, client);
+        return;
+    }
+    u16_t mport = igd_find_lease(proto, client, iport);
+    if (mport != 0) {
+        del_portmap(proto, mport);
+    }
+}
+
+static int pmp_request(const u8_t *req, int len, u32_t client, u8_t *resp)
+{
+    u8_t op = req[1];
+
+    if (len < 2 || (op & PMP_OP_REPLY)) {
+        return 0;
+    }
+    resp[0] = 0;
+    resp[1] = op | PMP_OP_REPLY;
+    put16(resp + 2, 0);
+    put32(resp + 4, igd_now() - igd_start);
+
+    if (op == PMP_OP_ADDRESS) {
+        if (!ap_connect || my_ip == 0) {
+            put16(resp + 2, PMP_NETWORK_FAILURE);
+        }
+        memcpy(resp + 8, &my_ip, 4);
+        return 12;
+    }
+    if ((op != PMP_OP_MAP_UDP && op != PMP_OP_MAP_TCP) || len < 12) {
+        put16(resp + 2, PMP_UNSUPP_OPCODE);
+        return 8;
+    }
+
+    u8_t proto = op == PMP_OP_MAP_UDP ? PROTO_UDP : PROTO_TCP;
+    u16_t iport = get16(req + 4);
+    u16_t mport = get16(req + 6);
+    u32_t lifetime = get32(req + 8);
+
+    memcpy(resp + 8, req + 4, 2);
+    if (lifetime == 0) {
+        igd_unmap(proto, client, iport);
+        put16(resp + 10, 0);
+        put32(resp + 12, 0);
+        return 16;
+    }
+    if (iport == 0) {
+        put16(resp + 2, PMP_UNSUPP_OPCODE);
+        return 8;
+    }
+    lifetime = LWIP_MIN(lifetime, IGD_PMP_LIFETIME_MAX);
+    if (!ap_connect || my_ip == 0) {
+        put16(resp + 2, PMP_NETWORK_FAILURE);
+        mport = 0;
+    } else if ((mport = igd_map(proto, client, iport, mport, lifetime)) == 0) {
+        put16(resp + 2, PMP_NO_RESOURCES);
+    }
+    put16(resp + 10, mport);
+    put32(resp + 12, mport != 0 ? lifetime : 0);
+    return 16;
+}
+
+/* Fills in the PCP response header, the opcode data follows */
+static void pcp_header(u8_t *resp, u8_t op, u8_t result, u32_t lifetime)
+{
+    memset(resp, 0, PCP_HLEN);
+    resp[0] = PCP_VERSION;
+    resp[1] = op | PMP_OP_REPLY;
+    resp[3] = result;
+    if (result != PCP_SUCCESS) {
+        lifetime = result == PCP_NO_RESOURCES || result == PCP_NETWORK_FAILURE ?
+            PCP_ERROR_LIFETIME : PCP_LONG_ERROR_LIFETIME;
+    }
+    put32(resp + 4, lifetime);
+    put32(resp + 8, igd_now() - igd_start);
+}
+
+static bool pcp_v4mapped(const u8_t *a, u32_t addr)
+{
+    static const u8_t prefix[12] = { 0,0,0,0, 0,0,0,0, 0,0,0xff,0xff };
+    return memcmp(a, prefix, 12) == 0 && memcmp(a + 12, &addr, 4) == 0;
+}
+
+static int pcp_request(const u8_t *req, int len, u32_t client, u8_t *resp)
+{
+    u8_t op = req[1] & ~PMP_OP_REPLY;
+    int rlen = PCP_HLEN;
+
+    if (req[1] & PMP_OP_REPLY) {
+        return 0;
+    }
+    if (req[0] != PCP_VERSION) {
+        pcp_header(resp, op, PCP_UNSUPP_VERSION, 0);
+        return PCP_HLEN;
+    }
+    if (len < PCP_HLEN || len % 4 != 0) {
+        pcp_header(resp, op, PCP_MALFORMED_REQUEST, 0);
+        return PCP_HLEN;
+    }
+    if (!pcp_v4mapped(req + 8, client)) {
+        pcp_header(resp, op, PCP_ADDRESS_MISMATCH, 0);
+        return PCP_HLEN;
+    }
+    if (op == PCP_OP_ANNOUNCE) {
+        pcp_header(resp, op, PCP_SUCCESS, 0);
+        return PCP_HLEN;
+    }
+    if (op != PCP_OP_MAP) {
+        pcp_header(resp, op, PCP_UNSUPP_OPCODE, 0);
+        return PCP_HLEN;
+    }
+    if (len < PCP_HLEN + PCP_MAP_LEN) {
+        pcp_header(resp, op, PCP_MALFORMED_REQUEST, 0);
+        return PCP_HLEN;
+    }
+
+    /* The MAP data is sent back with the assigned port and address */
+    const u8_t *map = req + PCP_HLEN;
+    u8_t *rmap = resp + PCP_HLEN;
+    memcpy(rmap, map, PCP_MAP_LEN);
+    rlen += PCP_MAP_LEN;
+
+    /* No option is supported, the mandatory ones (code < 128) are refused */
+    u8_t result = PCP_SUCCESS;
+    for (int off = PCP_HLEN + PCP_MAP_LEN; off < len && result == PCP_SUCCESS; ) {
+        u16_t olen = off + 4 <= len ? get16(req + off + 2) : 0xffff;
+        if (off + 4 + olen > len) {
+            result = PCP_MALFORMED_OPTION;
+        } else if (req[off] < 128) {
+            result = PCP_UNSUPP_OPTION;
+        }
+        off += 4 + ((olen + 3) & ~3);
+    }
+
+    u8_t proto = map[12];
+    u16_t iport = get16(map + 16);
+    u16_t mport = get16(map + 18);
+    u32_t lifetime = get32(req + 4);
+
+    if (result == PCP_SUCCESS && proto != PROTO_TCP && proto != PROTO_UDP) {
+        result = PCP_UNSUPP_PROTOCOL;
+    } else if (result == PCP_SUCCESS && iport == 0 && lifetime != 0) {
+        result = PCP_MALFORMED_REQUEST;
+    }
+    if (result == PCP_SUCCESS && lifetime == 0) {
+        igd_unmap(proto, client, iport);
+    } else if (result == PCP_SUCCESS) {
+        lifetime = LWIP_MIN(lifetime, IGD_PMP_LIFETIME_MAX);
+        if (!ap_connect || my_ip == 0) {
+            result = PCP_NETWORK_FAILURE;
+        } else if ((mport = igd_map(proto, client, iport, mport, lifetime)) == 0) {
+            result = PCP_NO_RESOURCES;
+        }
+    }
+    pcp_header(resp, op, result, lifetime);
+    if (result == PCP_SUCCESS && lifetime != 0) {
+        put16(rmap + 18, mport);
+        memset(rmap + 20, 0, 10);
+        rmap[30] = rmap[31] = 0xff;
+        memcpy(rmap + 32, &my_ip, 4);
+    }
+    return rlen;
+}
+
+static void igd_pmp_recv(void)
+{
+    static u8_t resp[PCP_HLEN + PCP_MAP_LEN];
+    struct sockaddr_in from;
+    socklen_t fromlen = sizeof(from);
+
+    int len = recvfrom(igd_pmp_sock, igd_pmp_buf, sizeof(igd_pmp_buf), 0, (struct sockaddr *)&from, &fromlen);
+    if (len < 2 || !igd_client_ok(from.sin_addr.s_addr)) {
+        return;
+    }
+
+    int rlen = igd_pmp_buf[0] == 0 ?
+        pmp_request(igd_pmp_buf, len, from.sin_addr.s_addr, resp) :
+        pcp_request(igd_pmp_buf, len, from.sin_addr.s_addr, resp);
+    if (rlen > 0) {
+        sendto(igd_pmp_sock, resp, rlen, 0, (struct sockaddr *)&from, fromlen);
+    }
+}
+
+/* Value of a header field of the SSDP message in igd_ssdp_buf, NULL if it
+ * is missing */
+static const char *igd_ssdp_header(const char *field, int *vlen)
+{
+    size_t fl = strlen(field);
+    const char *line = strchr(igd_ssdp_buf, '\n');
+
+    while (line != NULL) {
+        line++;
+        if (strncasecmp(line, field, fl) == 0 && line[fl] == ':') {
+            const char *v = line + fl + 1;
+            while (*v == ' ' || *v == '\t') {
+                v++;
+            }
+            int n = strcspn(v, "\r\n");
+            while (n > 0 && (v[n - 1] == ' ' || v[n - 1] == '\t')) {
+                n--;
+            }
+            *vlen = n;
+            return v;
+        }
+        line = strchr(line, '\n');
+    }
+    return NULL;
+}
+
+/* Search and notification targets, with the suffix of their device's UUID */
+static const struct {
+    const char *target;
+    char dev;
+} igd_targets[] = {
+    { "upnp:rootdevice", '0' },
+    { IGD_DEVICE, '0' },
+    { IGD_WANDEV, '1' },
+    { IGD_WANCIC, '1' },
+    { IGD_WANCDEV, '2' },
+    { IGD_WANIPC, '2' },
+};
+
+static int igd_ssdp_msg(char *buf, size_t size, bool notify, const char *target, char dev)
+{
+    ip4_addr_t ap;
+    ap.addr = my_ap_ip;
+
+    return snprintf(buf, size,
+        "%s\r\n"
+        "CACHE-CONTROL: max-age=%d\r\n"
+        "%s"
+        "LOCATION: http://" IPSTR "/igd/desc.xml\r\n"
+        "SERVER: ESP-IDF UPnP/1.0 esp32_nat_router/1.0\r\n"
+        "%s: %s\r\n"
+        "USN: uuid:%.35s%c%s%s\r\n"
+        "\r\n",
+        notify ? "NOTIFY * HTTP/1.1\r\nHOST: 239.255.255.250:1900\r\nNTS: ssdp:alive" : "HTTP/1.1 200 OK",
+        2 * IGD_NOTIFY_INTERVAL,
+        notify ? "" : "EXT:\r\n",
+        IP2STR(&ap),
+        notify ? "NT" : "ST", target,
+        igd_uuid, dev, strncmp(target, "uuid:", 5) == 0 ? "" : "::",
+        strncmp(target, "uuid:", 5) == 0 ? "" : target);
+}
+
+static void igd_ssdp_reply(const struct sockaddr_in *to, const char *target, char dev)
+{
+    char buf[384];
+    int len = igd_ssdp_msg(buf, sizeof(buf), false, target, dev);
+    sendto(igd_ssdp_sock, buf, len, 0, (const struct sockaddr *)to, sizeof(*to));
+}
+
+static void igd_ssdp_recv(void)
+{
+    struct sockaddr_in from;
+    socklen_t fromlen = sizeof(from);
+    char uuid[48];
+
+    int len = recvfrom(igd_ssdp_sock, igd_ssdp_buf, sizeof(igd_ssdp_buf) - 1, 0, (struct sockaddr *)&from, &fromlen);
+    if (len <= 0 || !igd_http_ready || !igd_client_ok(from.sin_addr.s_addr)) {
+        return;
+    }
+    igd_ssdp_buf[len] = '\0';
+    if (strncmp(igd_ssdp_buf, "M-SEARCH ", 9) != 0) {
+        return;
+    }
+
+    int vlen;
+    const char *st = igd_ssdp_header("ST", &vlen);
+    if (st == NULL) {
+        return;
+    }
+    bool all = vlen == 8 && strncasecmp(st, "ssdp:all", 8) == 0;
+    for (int i = 0; i < sizeof(igd_targets) / sizeof(igd_targets[0]); i++) {
+        if (all || ((int)strlen(igd_targets[i].target) == vlen && strncmp(st, igd_targets[i].target, vlen) == 0)) {
+            igd_ssdp_reply(&from, igd_targets[i].target, igd_targets[i].dev);
+        }
+    }
+    for (char dev = '0'; dev <= '2'; dev++) {
+        snprintf(uuid, sizeof(uuid), "uuid:%.35s%c", igd_uuid, dev);
+        if (all || ((int)strlen(uuid) == vlen && strncasecmp(st, uuid, vlen) == 0)) {
+            igd_ssdp_reply(&from, uuid, dev);
+        }
+    }
+}
+
+static void igd_ssdp_notify(void)
+{
+    struct sockaddr_in to = {
+        .sin_family = AF_INET,
+        .sin_port = htons(IGD_SSDP_PORT),
+        .sin_addr.s_addr = inet_addr("239.255.255.250"),
+    };
+    char buf[384];
+
+    for (int i = 0; i < sizeof(igd_targets) / sizeof(igd_targets[0]); i++) {
+        int len = igd_ssdp_msg(buf, sizeof(buf), true, igd_targets[i].target, igd_targets[i].dev);
+        sendto(igd_ssdp_sock, buf, len, 0, (struct sockaddr *)&to, sizeof(to));
+    }
+}
+
+static int igd_udp_socket(u32_t addr, u16_t port)
+{
+    struct sockaddr_in sa = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = addr,
+    };
+    int one = 1;
+
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock < 0) {
+        return -1;
+    }
+    /* mcast_reflect.c has 1900 bound as well */
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(sock, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static void *igd_thread(void *p)
+{
+    u32_t last_expire = igd_now(), next_notify = 0;
+
+    igd_pmp_sock = igd_udp_socket(my_ap_ip, IGD_PMP_PORT);
+    igd_ssdp_sock = igd_udp_socket(INADDR_ANY, IGD_SSDP_PORT);
+    if (igd_pmp_sock < 0 || igd_ssdp_sock < 0) {
+        ESP_LOGE(TAG, "Cannot open the NAT-PMP/SSDP sockets");
+    }
+    if (igd_ssdp_sock >= 0) {
+        struct ip_mreq mreq = {
+            .imr_multiaddr.s_addr = inet_addr("239.255.255.250"),
+            .imr_interface.s_addr = my_ap_ip,
+        };
+        struct in_addr ifaddr = { .s_addr = my_ap_ip };
+        setsockopt(igd_ssdp_sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq));
+        setsockopt(igd_ssdp_sock, IPPROTO_IP, IP_MULTICAST_IF, &ifaddr, sizeof(ifaddr));
+    }
+
+    while (true) {
+        fd_set fds;
+        struct timeval tv = { .tv_sec = 1 };
+        int maxfd = -1;
+
+        FD_ZERO(&fds);
+        if (igd_pmp_sock >= 0) {
+            FD_SET(igd_pmp_sock, &fds);
+            maxfd = igd_pmp_sock;
+        }
+        if (igd_ssdp_sock >= 0) {
+            FD_SET(igd_ssdp_sock, &fds);
+            maxfd = LWIP_MAX(maxfd, igd_ssdp_sock);
+        }
+        if (select(maxfd + 1, &fds, NULL, NULL, &tv) > 0) {
+            if (igd_pmp_sock >= 0 && FD_ISSET(igd_pmp_sock, &fds)) {
+                igd_pmp_recv();
+            }
+            if (igd_ssdp_sock >= 0 && FD_ISSET(igd_ssdp_sock, &fds)) {
+                igd_ssdp_recv();
+            }
+        }
+
+        u32_t now = igd_now();
+        if (now != last_expire) {
+            last_expire = now;
+            expire_portmap_leases();
+        }
+        if (igd_enabled && igd_http_ready && igd_ssdp_sock >= 0 && (s32_t)(now - next_notify) >= 0) {
+            igd_ssdp_notify();
+            next_notify = now + IGD_NOTIFY_INTERVAL;
+        }
+    }
+    return NULL;
+}
+
+void igd_init(void)
+{
+    esp_netif_ip_info_t ip_info;
+    uint8_t mac[6];
+    pthread_t t;
+    pthread_attr_t attr;
+
+    igd_start = igd_now();
+    igd_netmask = PP_HTONL(0xffffff00UL);
+    if (esp_netif_get_ip_info(wifiAP, &ip_info) == ESP_OK && ip_info.netmask.addr != 0) {
+        igd_netmask = ip_info.netmask.addr;
+    }
+    esp_netif_get_mac(wifiAP, mac);
+    /* The last digit, left out here, is the device: 0 root, 1 WAN, 2 WAN connection */
+    snprintf(igd_uuid, sizeof(igd_uuid), "6e6174e5-3200-4947-8000-%02x%02x%02x%02x%02x%x",
+        mac[0], mac[1], mac[2], mac[3], mac[4], mac[5] >> 4);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, IGD_THREAD_STACK);
+    if (pthread_create(&t, &attr, igd_thread, NULL) != 0) {
+        ESP_LOGE(TAG, "Cannot start the IGD thread");
+    }
+    pthread_attr_destroy(&attr);
+}
+
+void set_igd(bool enable)
+{
+    igd_enabled = enable;
+    if (!enable) {
+        del_portmap_leases(0, 0);
+    }
+}
+
+bool get_igd(void)
+{
+    return igd_enabled;
+}
+
+/* ----- UPnP description and control, served by http_server.c ----- */
+
+#define IGD_SERVICE(type, id, scpd) \
+    "<service><serviceType>" type "</serviceType><serviceId>urn:upnp-org:serviceId:" id "</serviceId>" \
+    "<SCPDURL>/igd/" scpd "</SCPDURL><controlURL>/igd/ctl</controlURL><eventSubURL>/igd/evt</eventSubURL></service>"
+
+#define IGD_DEV_INFO(type, name, dev) \
+    "<deviceType>" type "</deviceType><friendlyName>" name "</friendlyName>" \
+    "<manufacturer>esp32_nat_router</manufacturer><modelName>ESP32 NAT Router</modelName>" \
+    "<UDN>uuid:%.35s" dev "</UDN>"
+
+static const char igd_desc[] =
+    "<?xml version=\"1.0\"?>"
+    "<root xmlns=\"urn:schemas-upnp-org:device-1-0\"><specVersion><major>1</major><minor>0</minor></specVersion>"
+    "<device>" IGD_DEV_INFO(IGD_DEVICE, "ESP32 NAT Router", "0")
+    "<deviceList><device>" IGD_DEV_INFO(IGD_WANDEV, "WANDevice", "1")
+    "<serviceList>" IGD_SERVICE(IGD_WANCIC, "WANCommonIFC1", "wancic.xml") "</serviceList>"
+    "<deviceList><device>" IGD_DEV_INFO(IGD_WANCDEV, "WANConnectionDevice", "2")
+    "<serviceList>" IGD_SERVICE(IGD_WANIPC, "WANIPConn1", "wanipc.xml") "</serviceList>"
+    "</device></deviceList></device></deviceList>"
+    "<presentationURL>http://" IPSTR "/</presentationURL></device></root>";
+
+#define SCPD_ARG(name, dir, var) \
+    "<argument><name>" name "</name><direction>" dir "</direction><relatedStateVariable>" var "</relatedStateVariable></argument>"
+#define SCPD_ACTION(name, args) "<action><name>" name "</name><argumentList>" args "</argumentList></action>"
+#define SCPD_VAR(name, type) "<stateVariable sendEvents=\"no\"><name>" name "</name><dataType>" type "</dataType></stateVariable>"
+#define SCPD_HEAD "<?xml version=\"1.0\"?><scpd xmlns=\"urn:schemas-upnp-org:service-1-0\"><specVersion><major>1</major><minor>0</minor></specVersion>"
+
+/* The arguments of a port mapping entry, shared by the mapping actions */
+#define SCPD_ENTRY_ARGS(dir) \
+    SCPD_ARG("NewInternalPort", dir, "InternalPort") \
+    SCPD_ARG("NewInternalClient", dir, "InternalClient") \
+    SCPD_ARG("NewEnabled", dir, "PortMappingEnabled") \
+    SCPD_ARG("NewPortMappingDescription", dir, "PortMappingDescription") \
+    SCPD_ARG("NewLeaseDuration", dir, "PortMappingLeaseDuration")
+#define SCPD_KEY_ARGS(dir) \
+    SCPD_ARG("NewRemoteHost", dir, "RemoteHost") \
+    SCPD_ARG("NewExternalPort", dir, "ExternalPort") \
+    SCPD_ARG("NewProtocol", dir, "PortMappingProtocol")
+
+static const char igd_wanipc_scpd[] = SCPD_HEAD
+    "<actionList>"
+    SCPD_ACTION("GetConnectionTypeInfo",
+        SCPD_ARG("NewConnectionType", "out", "ConnectionType")
+        SCPD_ARG("NewPossibleConnectionTypes", "out", "PossibleConnectionTypes"))
+    SCPD_ACTION("GetStatusInfo",
+        SCPD_ARG("NewConnectionStatus", "out", "ConnectionStatus")
+        SCPD_ARG("NewLastConnectionError", "out", "LastConnectionError")
+        SCPD_ARG("NewUptime", "out", "Uptime"))
+    SCPD_ACTION("GetNATRSIPStatus",
+        SCPD_ARG("NewRSIPAvailable", "out", "RSIPAvailable")
+        SCPD_ARG("NewNATEnabled", "out", "NATEnabled"))
+    SCPD_ACTION("GetExternalIPAddress",
+        SCPD_ARG("NewExternalIPAddress", "out", "ExternalIPAddress"))
+    SCPD_ACTION("GetGenericPortMappingEntry",
+        SCPD_ARG("NewPortMappingIndex", "in", "PortMappingNumberOfEntries")
+        SCPD_KEY_ARGS("out") SCPD_ENTRY_ARGS("out"))
+    SCPD_ACTION("GetSpecificPortMappingEntry", SCPD_KEY_ARGS("in") SCPD_ENTRY_ARGS("out"))
+    SCPD_ACTION("AddPortMapping", SCPD_KEY_ARGS("in") SCPD_ENTRY_ARGS("in"))
+    SCPD_ACTION("DeletePortMapping", SCPD_KEY_ARGS("in"))
+    "</actionList><serviceStateTable>"
+    SCPD_VAR("ConnectionType", "string")
+    SCPD_VAR("PossibleConnectionTypes", "string")
+    SCPD_VAR("ConnectionStatus", "string")
+    SCPD_VAR("Uptime", "ui4")
+    SCPD_VAR("LastConnectionError", "string")
+    SCPD_VAR("RSIPAvailable", "boolean")
+    SCPD_VAR("NATEnabled", "boolean")
+    SCPD_VAR("ExternalIPAddress", "string")
+    SCPD_VAR("PortMappingNumberOfEntries", "ui2")
+    SCPD_VAR("PortMappingEnabled", "boolean")
+    SCPD_VAR("PortMappingLeaseDuration", "ui4")
+    SCPD_VAR("RemoteHost", "string")
+    SCPD_VAR("ExternalPort", "ui2")
+    SCPD_VAR("InternalPort", "ui2")
+    SCPD_VAR("PortMappingProtocol", "string")
+    SCPD_VAR("InternalClient", "string")
+    SCPD_VAR("PortMappingDescription", "string")
+    "</serviceStateTable></scpd>";
+
+static const char igd_wancic_scpd[] = SCPD_HEAD
+    "<actionList>"
+    SCPD_ACTION("GetCommonLinkProperties",
+        SCPD_ARG("NewWANAccessType", "out", "WANAccessType")
+        SCPD_ARG("NewLayer1UpstreamMaxBitRate", "out", "Layer1UpstreamMaxBitRate")
+        SCPD_ARG("NewLayer1DownstreamMaxBitRate", "out", "Layer1DownstreamMaxBitRate")
+        SCPD_ARG("NewPhysicalLinkStatus", "out", "PhysicalLinkStatus"))
+    "</actionList><serviceStateTable>"
+    SCPD_VAR("WANAccessType", "string")
+    SCPD_VAR("Layer1UpstreamMaxBitRate", "ui4")
+    SCPD_VAR("Layer1DownstreamMaxBitRate", "ui4")
+    SCPD_VAR("PhysicalLinkStatus", "string")
+    "</serviceStateTable></scpd>";
+
+/* IPv4 address of the peer of req, 0 if it has none */
+static u32_t igd_peer(httpd_req_t *req)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+
+    if (getpeername(httpd_req_to_sockfd(req), (struct sockaddr *)&addr, &len) < 0) {
+        return 0;
+    }
+    if (addr.ss_family == AF_INET) {
+        return ((struct sockaddr_in *)&addr)->sin_addr.s_addr;
+    }
+#if LWIP_IPV6
+    if (addr.ss_family == AF_INET6) {
+        struct sockaddr_in6 *a6 = (struct sockaddr_in6 *)&addr;
+        if (a6->sin6_addr.un.u32_addr[0] == 0 && a6->sin6_addr.un.u32_addr[1] == 0 &&
+            a6->sin6_addr.un.u32_addr[2] == PP_HTONL(0xffff)) {
+            return a6->sin6_addr.un.u32_addr[3];
+        }
+    }
+#endif
+    return 0;
+}
+
+static esp_err_t igd_desc_get_handler(httpd_req_t *req)
+{
+    if (!igd_client_ok(igd_peer(req))) {
+        httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "Page not found");
+        return ESP_FAIL;
+    }
+
+    httpd_resp_set_type(req, "text/xml; charset=\"utf-8\"");
+    if (strcmp(req->uri, "/igd/desc.xml") == 0) {
+        ip4_addr_t ap;
+        ap.addr = my_ap_ip;
+        snprintf(igd_resp_buf, sizeof(igd_resp_buf), igd_desc, igd_uuid, igd_uuid, igd_uuid, IP2STR(&ap));
+        return httpd_resp_sendstr(req, igd_resp_buf);
+    }
+    if (strcmp(req->uri, "/igd/wanipc.xml") == 0) {
+        return httpd_resp_send(req, igd_wanipc_scpd, sizeof(igd_wanipc_scpd) - 1);
+    }
+    if (strcmp(req->uri, "/igd/wancic.xml") == 0) {
+        return httpd_resp_send(req, igd_wancic_scpd, sizeof(igd_wancic_scpd) - 1);
+    }
+    httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "Page not found");
+    return ESP_FAIL;
+}
+
+/* Text of the argument element name in the SOAP body, "" if it is empty.
+ * Returns false if the argument is missing or does not fit. */
+static bool soap_arg(const char *name, char *val, size_t size)
+{
+    size_t n = strlen(name);
+
+    for (const char *p = strchr(igd_soap_buf, '<'); p != NULL; p = strchr(p + 1, '<')) {
+        const char *q = p + 1 + n;
+        if (strncmp(p + 1, name, n) != 0 || (*q != '>' && *q != ' ' && *q != '/')) {
+            continue;
+        }
+        q = strchr(q, '>');
+        if (q == NULL) {
+            return false;
+        }
+        if (q[-1] == '/') {
+            val[0] = '\0';
+            return true;
+        }
+        q++;
+        while (*q == ' ' || *q == '\t' || *q == '\r' || *q == '\n') {
+            q++;
+        }
+        const char *end = strchr(q, '<');
+        if (end == NULL) {
+            return false;
+        }
+        while (end > q && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r' || end[-1] == '\n')) {
+            end--;
+        }
+        if (end - q >= size) {
+            return false;
+        }
+        memcpy(val, q, end - q);
+        val[end - q] = '\0';
+        return true;
+    }
+    return false;
+}
+
+static bool soap_arg_uint(const char *name, u32_t max, u32_t *val)
+{
+    char buf[12], *end;
+
+    if (!soap_arg(name, buf, sizeof(buf)) || buf[0] == '\0') {
+        return false;
+    }
+    unsigned long v = strtoul(buf, &end, 10);
+    if (*end != '\0' || v > max) {
+        return false;
+    }
+    *val = v;
+    return true;
+}
+
+static bool soap_arg_proto(u8_t *proto)
+{
+    char buf[8];
+
+    if (!soap_arg("NewProtocol", buf, sizeof(buf))) {
+        return false;
+    }
+    if (strcasecmp(buf, "TCP") == 0) {
+        *proto = PROTO_TCP;
+    } else if (strcasecmp(buf, "UDP") == 0) {
+        *proto = PROTO_UDP;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static esp_err_t soap_send(httpd_req_t *req, const char *service, const char *action, const char *args)
+{
+    snprintf(igd_resp_buf, sizeof(igd_resp_buf),
+        "<?xml version=\"1.0\"?>\r\n"
+        "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
+        "<s:Body><u:%sResponse xmlns:u=\"%s\">%s</u:%sResponse></s:Body></s:Envelope>\r\n",
+        action, service, args, action);
+    httpd_resp_set_type(req, "text/xml; charset=\"utf-8\"");
+    return httpd_resp_sendstr(req, igd_resp_buf);
+}
+
+static esp_err_t soap_error(httpd_req_t *req, int code, const char *desc)
+{
+    snprintf(igd_resp_buf, sizeof(igd_resp_buf),
+        "<?xml version=\"1.0\"?>\r\n"
+        "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
+        "<s:Body><s:Fault><faultcode>s:Client</faultcode><faultstring>UPnPError</faultstring>"
+        "<detail><UPnPError xmlns=\"urn:schemas-upnp-org:control-1-0\"><errorCode>%d</errorCode>"
+        "<errorDescription>%s</errorDescription></UPnPError></detail></s:Fault></s:Body></s:Envelope>\r\n",
+        code, desc);
+    httpd_resp_set_status(req, "500 Internal Server Error");
+    httpd_resp_set_type(req, "text/xml; charset=\"utf-8\"");
+    return httpd_resp_sendstr(req, igd_resp_buf);
+}
+
+/* The out arguments of a port mapping entry */
+static void soap_entry(char *buf, size_t size, bool key, const portmap_rule_t *rule)
+{
+    ip4_addr_t addr;
+    addr.addr = rule->daddr;
+    int n = 0;
+
+    if (key) {
+        n = snprintf(buf, size, "<NewRemoteHost></NewRemoteHost><NewExternalPort>%d</NewExternalPort>"
+            "<NewProtocol>%s</NewProtocol>", rule->mport, rule->proto == PROTO_TCP ? "TCP" : "UDP");
+    }
+    snprintf(buf + n, size - n, "<NewInternalPort>%d</NewInternalPort><NewInternalClient>" IPSTR "</NewInternalClient>"
+        "<NewEnabled>1</NewEnabled><NewPortMappingDescription>%s</NewPortMappingDescription>"
+        "<NewLeaseDuration>%lu</NewLeaseDuration>",
+        rule->dport, IP2STR(&addr), (rule->flags & PORTMAP_LEASE) ? "lease" : "portmap", (unsigned long)rule->lease);
+}
+
+/* The rule starting at mport, false if there is none */
+static bool igd_find_rule(u8_t proto, u16_t mport, portmap_rule_t *rule)
+{
+    u32_t pos = 0;
+
+    while (portmap_walk(&pos, rule)) {
+        if (rule->proto == proto && rule->mport == mport) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static esp_err_t igd_add_mapping(httpd_req_t *req, const char *service, u32_t client)
+{
+    char host[40], ip[16];
+    u32_t mport, dport, lease, enabled = 1;
+    u8_t proto;
+
+    if (!soap_arg("NewRemoteHost", host, sizeof(host)) || !soap_arg_uint("NewExternalPort", 0xffff, &mport) ||
+        !soap_arg_proto(&proto) || !soap_arg_uint("NewInternalPort", 0xffff, &dport) || dport == 0 ||
+        !soap_arg("NewInternalClient", ip, sizeof(ip)) || !soap_arg_uint("NewLeaseDuration", UINT32_MAX, &lease)) {
+        return soap_error(req, 402, "Invalid Args");
+    }
+    soap_arg_uint("NewEnabled", 1, &enabled);
+    if (host[0] != '\0' && strcmp(host, "*") != 0) {
+        return soap_error(req, 726, "RemoteHostOnlySupportsWildcard");
+    }
+    if (mport == 0) {
+        return soap_error(req, 716, "WildCardNotPermittedInExtPort");
+    }
+    if (esp_ip4addr_aton(ip) != client) {
+        return soap_error(req, 606, "Action not authorized");
+    }
+
+    if (!enabled) {
+        portmap_rule_t rule;
+        if (igd_find_rule(proto, mport, &rule) && (rule.flags & PORTMAP_LEASE) && rule.daddr == client) {
+            del_portmap(proto, mport);
+        }
+        return soap_send(req, service, "AddPortMapping", "");
+    }
+    if (lease == 0 || lease > IGD_UPNP_LIFETIME_MAX) {
+        lease = IGD_UPNP_LIFETIME_MAX;
+    }
+    esp_err_t err = add_portmap_lease(proto, mport, client, dport, lease);
+    if (err == ESP_ERR_NO_MEM) {
+        return soap_error(req, 728, "NoPortMapsAvailable");
+    }
+    if (err != ESP_OK) {
+        return soap_error(req, 718, "ConflictInMappingEntry");
+    }
+    return soap_send(req, service, "AddPortMapping", "");
+}
+
+static esp_err_t igd_ctl_post_handler(httpd_req_t *req)
+{
+    char action[160], args[480];
+    portmap_rule_t rule;
+    u32_t client = igd_peer(req);
+    int len = 0;
+
+    if (!igd_client_ok(client)) {
+        httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "Page not found");
+        return ESP_FAIL;
+    }
+    if (req->content_len > IGD_SOAP_MAX_LEN) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Request too long");
+        return ESP_FAIL;
+    }
+    while (len < req->content_len) {
+        int n = httpd_req_recv(req, igd_soap_buf + len, req->content_len - len);
+        if (n <= 0) {
+            if (n == HTTPD_SOCK_ERR_TIMEOUT) {
+                continue;
+            }
+            return ESP_FAIL;
+        }
+        len += n;
+    }
+    igd_soap_buf[len] = '\0';
+
+    /* SOAPACTION: "urn:schemas-upnp-org:service:WANIPConnection:1#AddPortMapping" */
+    if (httpd_req_get_hdr_value_str(req, "SOAPAction", action, sizeof(action)) != ESP_OK) {
+        return soap_error(req, 401, "Invalid Action");
+    }
+    char *service = action[0] == '"' ? action + 1 : action;
+    char *name = strchr(service, '#');
+    if (name == NULL) {
+        return soap_error(req, 401, "Invalid Action");
+    }
+    *name++ = '\0';
+    name[strcspn(name, "\"")] = '\0';
+    bool wanipc = strcmp(service, IGD_WANIPC) == 0;
+
+    ip4_addr_t ext;
+    ext.addr = my_ip;
+    if (strcmp(service, IGD_WANCIC) == 0 && strcmp(name, "GetCommonLinkProperties") == 0) {
+        snprintf(args, sizeof(args), "<NewWANAccessType>Ethernet</NewWANAccessType>"
+            "<NewLayer1UpstreamMaxBitRate>0</NewLayer1UpstreamMaxBitRate>"
+            "<NewLayer1DownstreamMaxBitRate>0</NewLayer1DownstreamMaxBitRate>"
+            "<NewPhysicalLinkStatus>%s</NewPhysicalLinkStatus>", ap_connect ? "Up" : "Down");
+    } else if (wanipc && strcmp(name, "GetConnectionTypeInfo") == 0) {
+        snprintf(args, sizeof(args), "<NewConnectionType>IP_Routed</NewConnectionType>"
+            "<NewPossibleConnectionTypes>IP_Routed</NewPossibleConnectionTypes>");
+    } else if (wanipc && strcmp(name, "GetStatusInfo") == 0) {
+        snprintf(args, sizeof(args), "<NewConnectionStatus>%s</NewConnectionStatus>"
+            "<NewLastConnectionError>ERROR_NONE</NewLastConnectionError><NewUptime>%lu</NewUptime>",
+            ap_connect ? "Connected" : "Disconnected", (unsigned long)(igd_now() - igd_start));
+    } else if (wanipc && strcmp(name, "GetNATRSIPStatus") == 0) {
+        snprintf(args, sizeof(args), "<NewRSIPAvailable>0</NewRSIPAvailable><NewNATEnabled>1</NewNATEnabled>");
+    } else if (wanipc && strcmp(name, "GetExternalIPAddress") == 0) {
+        snprintf(args, sizeof(args), "<NewExternalIPAddress>" IPSTR "</NewExternalIPAddress>", IP2STR(&ext));
+    } else if (wanipc && strcmp(name, "AddPortMapping") == 0) {
+        return igd_add_mapping(req, service, client);
+    } else if (wanipc && (strcmp(name, "DeletePortMapping") == 0 || strcmp(name, "GetSpecificPortMappingEntry") == 0)) {
+        u32_t mport;
+        u8_t proto;
+        if (!soap_arg_uint("NewExternalPort", 0xffff, &mport) || !soap_arg_proto(&proto)) {
+            return soap_error(req, 402, "Invalid Args");
+        }
+        if (!igd_find_rule(proto, mport, &rule)) {
+            return soap_error(req, 714, "NoSuchEntryInArray");
+        }
+        if (name[0] == 'G') {
+            soap_entry(args, sizeof(args), false, &rule);
+        } else if (!(rule.flags & PORTMAP_LEASE) || rule.daddr != client) {
+            return soap_error(req, 606, "Action not authorized");
+        } else {
+            del_portmap(proto, mport);
+            args[0] = '\0';
+        }
+    } else if (wanipc && strcmp(name, "GetGenericPortMappingEntry") == 0) {
+        u32_t index, pos = 0;
+        if (!soap_arg_uint("NewPortMappingIndex", 0xffff, &index)) {
+            return soap_error(req, 402, "Invalid Args");
+        }
+        bool found;
+        while ((found = portmap_walk(&pos, &rule)) && index > 0) {
+            index--;
+        }
+        if (!found) {
+            return soap_error(req, 713, "SpecifiedArrayIndexInvalid");
+        }
+        soap_entry(args, sizeof(args), true, &rule);
+    } else {
+        return soap_error(req, 401, "Invalid Action");
+    }
+    return soap_send(req, service, name, args);
+}
+
+static httpd_uri_t igd_descp = {
+    .uri       = "/igd/*",
+    .method    = HTTP_GET,
+    .handler   = igd_desc_get_handler,
+};
+
+static httpd_uri_t igd_ctlp = {
+    .uri       = "/igd/ctl",
+    .method    = HTTP_POST,
+    .handler   = igd_ctl_post_handler,
+};
+
+/* Needs the server started with httpd_uri_match_wildcard */
+void igd_register_uri_handlers(httpd_handle_t server)
+{
+    httpd_register_uri_handler(server, &igd_descp);
+    httpd_register_uri_handler(server, &igd_ctlp);
+    igd_http_ready = true;
+}
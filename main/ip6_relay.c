@@ -0,0 +1,633 @@
+/* IPv6 relay of the esp32_nat_router
+
+   With "ipv6_relay" set (set_ipv6 relay), the AP clients get addresses
+   from the /64 prefix the uplink assigned to the STA interface by SLAAC.
+   The router announces it on the AP side in its own router advertisements,
+   as autonomous but not on-link, so the clients send all their traffic to
+   the router. That traffic is forwarded between the two interfaces as it
+   is: IPv6 is not translated and never touches the NAPT table.
+
+   Towards the uplink the router answers neighbor solicitations for the
+   addresses of its clients with its own MAC (ND proxy, RFC 4389), so the
+   upstream router hands their packets to it. The client addresses are
+   learned from the packets the clients send and from their duplicate
+   address detection, their MAC addresses from the packets and from their
+   neighbor solicitations and advertisements. A packet for a client whose MAC is not
+   known yet is dropped and the client is asked for it instead. A packet
+   too big for the way out is answered with a Packet Too Big, rate limited
+   with lwIP's ICMP answers (set_icmp_rate).
+
+   lwIP does not forward IPv6 itself (LWIP_IPV6_FORWARD stays off), it
+   could not, as the prefix is on-link on the STA side. Everything is done
+   in router_ip6_input_hook() in the tcpip thread.
+
+   With AP client isolation on (isolate.c), packets from one client to
+   another and the neighbor solicitations between them are dropped, unless
+   either client is an exception. The clients are told apart by the MACs
+   learned here.
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_netif.h"
+#include "esp_netif_net_stack.h"
+
+#include "lwip/opt.h"
+#include "lwip/def.h"
+#include "lwip/pbuf.h"
+#include "lwip/sys.h"
+#include "lwip/netif.h"
+#include "lwip/ip6.h"
+#include "lwip/ip6_addr.h"
+#include "lwip/inet_chksum.h"
+#include "lwip/timeouts.h"
+#include "lwip/tcpip.h"
+#include "lwip/priv/tcpip_priv.h"
+#include "lwip/prot/ip6.h"
+#include "lwip/prot/icmp6.h"
+#include "lwip/prot/nd6.h"
+#include "netif/ethernet.h"
+
+#include "router_globals.h"
+#include "router_hooks.h"
+#include "nat.h"
+
+static const char *TAG = "ip6_relay";
+
+extern esp_netif_t* wifiAP;
+extern esp_netif_t* wifiSTA;
+
+#define IP6_RELAY_TMR_INTERVAL  10000   /* ms, prefix check and expiry */
+#define IP6_RELAY_RA_INTERVAL   60000   /* ms between unsolicited RAs */
+#define IP6_RELAY_NEIGHBORS     16
+#define IP6_RELAY_NEIGHBOR_AGE  600000  /* ms a silent client is kept */
+#define IP6_RELAY_SOLICIT_GAP   1000    /* ms between solicitations for a client */
+#define IP6_RELAY_ROUTER_LIFE   1800    /* s, lifetimes advertised in the RA */
+#define IP6_RELAY_VALID_LIFE    600
+#define IP6_RELAY_PREF_LIFE     300
+#define IP6_RELAY_ND_HOPLIM     255
+#define IP6_RELAY_MIN_MTU       1280    /* an ICMPv6 error fits it */
+
+/* A client on the AP side, addresses in network byte order */
+struct ip6_neighbor {
+    u32_t addr[4];
+    struct eth_addr mac;
+    u8_t used;
+    u8_t has_mac;
+    u32_t last;                 /* sys_now() of the last packet */
+    u32_t solicited;            /* sys_now() of the last NS for it */
+};
+
+static bool ip6_relay_on;
+static struct netif *ap_netif;
+static struct netif *sta_netif;
+
+static bool have_prefix;
+static u32_t prefix[2];
+static u32_t ra_last;
+static struct ip6_neighbor neighbors[IP6_RELAY_NEIGHBORS];
+
+static bool ip6_in_prefix(const u32_t *addr)
+{
+    return have_prefix && addr[0] == prefix[0] && addr[1] == prefix[1];
+}
+
+static bool ip6_is_local(const u32_t *addr)
+{
+    for (int i = 0; i < LWIP_IPV6_NUM_ADDRESSES; i++) {
+        if ((ip6_addr_isvalid(netif_ip6_addr_state(sta_netif, i)) &&
+             memcmp(netif_ip6_addr(sta_netif, i)->addr, addr, 16) == 0) ||
+            (ip6_addr_isvalid(netif_ip6_addr_state(ap_netif, i)) &&
+             memcmp(netif_ip6_addr(ap_netif, i)->addr, addr, 16) == 0)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* The first global address of netif */
+static const ip6_addr_t *ip6_global(struct netif *netif)
+{
+    for (int i = 0; i < LWIP_IPV6_NUM_ADDRESSES; i++) {
+        const ip6_addr_t *a = netif_ip6_addr(netif, i);
+        if (ip6_addr_isvalid(netif_ip6_addr_state(netif, i)) &&
+            !ip6_addr_islinklocal(a) && !ip6_addr_ismulticast(a)) {
+            return a;
+        }
+    }
+    return NULL;
+}
+
+static const ip6_addr_t *ip6_linklocal(struct netif *netif)
+{
+    /* esp_netif_create_ip6_linklocal() puts it into slot 0 */
+    if (!ip6_addr_isvalid(netif_ip6_addr_state(netif, 0))) {
+        return NULL;
+    }
+    return netif_ip6_addr(netif, 0);
+}
+
+static void ip6_addr_from_words(ip6_addr_t *a, const u32_t *addr)
+{
+    ip6_addr_set_zero(a);
+    memcpy(a->addr, addr, 16);
+}
+
+static struct ip6_neighbor *ip6_neighbor_find(const u32_t *addr)
+{
+    for (int i = 0; i < IP6_RELAY_NEIGHBORS; i++) {
+        if (neighbors[i].used && memcmp(neighbors[i].addr, addr, 16) == 0) {
+            return &neighbors[i];
+        }
+    }
+    return NULL;
+}
+
+static struct ip6_neighbor *ip6_neighbor_learn(const u32_t *addr, const u8_t *mac)
+{
+    struct ip6_neighbor *n = ip6_neighbor_find(addr);
+    u32_t now = sys_now();
+
+    if (n == NULL) {
+        /* A free slot, else the one silent for the longest time */
+        n = &neighbors[0];
+        for (int i = 0; i < IP6_RELAY_NEIGHBORS && n->used; i++) {
+            if (!neighbors[i].used || now - neighbors[i].last > now - n->last) {
+                n = &neighbors[i];
+            }
+        }
+        memset(n, 0, sizeof(*n));
+        memcpy(n->addr, addr, 16);
+        n->used = 1;
+        n->solicited = now - IP6_RELAY_SOLICIT_GAP;
+    }
+    if (mac != NULL) {
+        memcpy(n->mac.addr, mac, ETH_HWADDR_LEN);
+        n->has_mac = 1;
+    }
+    n->last = now;
+    return n;
+}
+
+/* The source MAC of a packet from the AP. ethernet_input() took the
+ * Ethernet header off, it is still in front of the IPv6 header. */
+static const u8_t *ip6_eth_src(const struct pbuf *p)
+{
+    return (const u8_t *)p->payload - SIZEOF_ETH_HDR + ETH_HWADDR_LEN;
+}
+
+/* Finds the link layer address option of the given type in the options of
+ * an ND message */
+static const u8_t *ip6_nd_lladdr(const u8_t *opt, int len, u8_t type)
+{
+    while (len >= 8) {
+        int olen = opt[1] * 8;
+        if (olen == 0 || olen > len) {
+            return NULL;
+        }
+        if (opt[0] == type && olen == sizeof(struct lladdr_option)) {
+            return opt + 2;
+        }
+        opt += olen;
+        len -= olen;
+    }
+    return NULL;
+}
+
+static void ip6_nd_send(struct pbuf *p, struct netif *netif, const ip6_addr_t *src, ip6_addr_t *dest)
+{
+    struct icmp6_hdr *icmp6hdr = (struct icmp6_hdr *)p->payload;
+
+    ip6_addr_assign_zone(dest, IP6_UNKNOWN, netif);
+    icmp6hdr->chksum = 0;
+    icmp6hdr->chksum = ip6_chksum_pseudo(p, IP6_NEXTH_ICMP6, p->tot_len, src, dest);
+    ip6_output_if(p, src, dest, IP6_RELAY_ND_HOPLIM, 0, IP6_NEXTH_ICMP6, netif);
+    pbuf_free(p);
+}
+
+/* Router advertisement of the prefix to the AP clients, a lifetime of 0
+ * withdraws it */
+static void ip6_relay_send_ra(const u32_t *pfx, bool valid)
+{
+    const ip6_addr_t *src = ip6_linklocal(ap_netif);
+    if (src == NULL) {
+        return;
+    }
+    u16_t len = sizeof(struct ra_header) + sizeof(struct lladdr_option) +
+                sizeof(struct mtu_option) + sizeof(struct prefix_option);
+    struct pbuf *p = pbuf_alloc(PBUF_IP, len, PBUF_RAM);
+    if (p == NULL) {
+        return;
+    }
+    memset(p->payload, 0, len);
+
+    struct ra_header *ra = (struct ra_header *)p->payload;
+    ra->type = ICMP6_TYPE_RA;
+    ra->router_lifetime = lwip_htons(valid ? IP6_RELAY_ROUTER_LIFE : 0);
+
+    struct lladdr_option *lla = (struct lladdr_option *)(ra + 1);
+    lla->type = ND6_OPTION_TYPE_SOURCE_LLADDR;
+    lla->length = 1;
+    memcpy(lla->addr, ap_netif->hwaddr, ETH_HWADDR_LEN);
+
+    struct mtu_option *mtu = (struct mtu_option *)(lla + 1);
+    mtu->type = ND6_OPTION_TYPE_MTU;
+    mtu->length = 1;
+    mtu->mtu = lwip_htonl(LWIP_MIN(netif_mtu6(sta_netif), netif_mtu6(ap_netif)));
+
+    struct prefix_option *pi = (struct prefix_option *)(mtu + 1);
+    pi->type = ND6_OPTION_TYPE_PREFIX_INFO;
+    pi->length = 4;
+    pi->prefix_length = 64;
+    /* Autonomous only: not on-link, everything goes through the router */
+    pi->flags = ND6_PREFIX_FLAG_AUTONOMOUS;
+    pi->valid_lifetime = lwip_htonl(valid ? IP6_RELAY_VALID_LIFE : 0);
+    pi->preferred_lifetime = lwip_htonl(valid ? IP6_RELAY_PREF_LIFE : 0);
+    memcpy(&pi->prefix, pfx, 8);
+
+    ip6_addr_t dest;
+    ip6_addr_set_allnodes_linklocal(&dest);
+    ip6_nd_send(p, ap_netif, src, &dest);
+    ra_last = sys_now();
+}
+
+/* Asks an AP client for its MAC */
+static void ip6_relay_solicit(struct ip6_neighbor *n)
+{
+    const ip6_addr_t *src = ip6_linklocal(ap_netif);
+    u32_t now = sys_now();
+
+    if (src == NULL || now - n->solicited < IP6_RELAY_SOLICIT_GAP) {
+        return;
+    }
+    n->solicited = now;
+
+    u16_t len = sizeof(struct ns_header) + sizeof(struct lladdr_option);
+    struct pbuf *p = pbuf_alloc(PBUF_IP, len, PBUF_RAM);
+    if (p == NULL) {
+        return;
+    }
+    memset(p->payload, 0, len);
+
+    struct ns_header *ns = (struct ns_header *)p->payload;
+    ns->type = ICMP6_TYPE_NS;
+    memcpy(&ns->target_address, n->addr, 16);
+
+    struct lladdr_option *lla = (struct lladdr_option *)(ns + 1);
+    lla->type = ND6_OPTION_TYPE_SOURCE_LLADDR;
+    lla->length = 1;
+    memcpy(lla->addr, ap_netif->hwaddr, ETH_HWADDR_LEN);
+
+    /* Solicited-node multicast address of the client */
+    ip6_addr_t dest;
+    IP6_ADDR(&dest, PP_HTONL(0xff020000UL), 0, PP_HTONL(0x00000001UL),
+             PP_HTONL(0xff000000UL) | (n->addr[3] & PP_HTONL(0x00ffffffUL)));
+    ip6_nd_send(p, ap_netif, src, &dest);
+}
+
+/* Proxy neighbor advertisement for an AP client on the uplink. Not an
+ * override, the client's own address would win over it */
+static void ip6_relay_advertise(const u32_t *target, const u32_t *to)
+{
+    const ip6_addr_t *src = ip6_linklocal(sta_netif);
+    if (src == NULL) {
+        return;
+    }
+    u16_t len = sizeof(struct na_header) + sizeof(struct lladdr_option);
+    struct pbuf *p = pbuf_alloc(PBUF_IP, len, PBUF_RAM);
+    if (p == NULL) {
+        return;
+    }
+    memset(p->payload, 0, len);
+
+    struct na_header *na = (struct na_header *)p->payload;
+    na->type = ICMP6_TYPE_NA;
+    memcpy(&na->target_address, target, 16);
+
+    struct lladdr_option *lla = (struct lladdr_option *)(na + 1);
+    lla->type = ND6_OPTION_TYPE_TARGET_LLADDR;
+    lla->length = 1;
+    memcpy(lla->addr, sta_netif->hwaddr, ETH_HWADDR_LEN);
+
+    ip6_addr_t dest;
+    if (to[0] == 0 && to[1] == 0 && to[2] == 0 && to[3] == 0) {
+        /* Answer to duplicate address detection goes to all nodes */
+        ip6_addr_set_allnodes_linklocal(&dest);
+    } else {
+        na->flags = ND6_FLAG_SOLICITED;
+        ip6_addr_from_words(&dest, to);
+    }
+    ip6_nd_send(p, sta_netif, src, &dest);
+}
+
+/* Sends a packet the way the relay forwards it: out of the uplink to its
+ * router, or to the MAC of the AP client n, which is asked for it while
+ * unknown */
+static void ip6_relay_output(struct pbuf *p, struct netif *outp, struct ip6_neighbor *n, const u32_t *dest)
+{
+    if (outp == sta_netif) {
+        ip6_addr_t nexthop;
+        ip6_addr_from_words(&nexthop, dest);
+        sta_netif->output_ip6(sta_netif, p, &nexthop);
+    } else if (n->has_mac) {
+        ethernet_output(ap_netif, p, (const struct eth_addr *)ap_netif->hwaddr, &n->mac, ETHTYPE_IPV6);
+    } else {
+        ip6_relay_solicit(n);
+    }
+}
+
+/* Packet Too Big to the sender of a packet that does not fit mtu, quoting
+ * as much of it as the minimum MTU leaves room for. From the uplink's
+ * address, and back the way the packet came: lwIP would route it by the
+ * prefix to the uplink, and has no route to the clients. */
+static void ip6_relay_too_big(struct pbuf *p, u16_t len, struct netif *inp, struct ip6_neighbor *from, u16_t mtu)
+{
+    const ip6_addr_t *src = ip6_global(sta_netif);
+    u32_t dest[4];
+
+    if (src == NULL || !icmp_rate_ok()) {
+        return;
+    }
+    memcpy(dest, &((const struct ip6_hdr *)p->payload)->src, 16);
+    u16_t qlen = LWIP_MIN(len, IP6_RELAY_MIN_MTU - IP6_HLEN - sizeof(struct icmp6_hdr));
+    struct pbuf *q = pbuf_alloc(PBUF_IP, sizeof(struct icmp6_hdr) + qlen, PBUF_RAM);
+    if (q == NULL) {
+        return;
+    }
+    struct icmp6_hdr *icmp6hdr = (struct icmp6_hdr *)q->payload;
+    icmp6hdr->type = ICMP6_TYPE_PTB;
+    icmp6hdr->code = 0;
+    icmp6hdr->data = lwip_htonl(mtu);
+    pbuf_copy_partial(p, icmp6hdr + 1, qlen, 0);
+
+    ip6_addr_t d;
+    ip6_addr_from_words(&d, dest);
+    icmp6hdr->chksum = 0;
+    icmp6hdr->chksum = ip6_chksum_pseudo(q, IP6_NEXTH_ICMP6, q->tot_len, src, &d);
+
+    if (pbuf_add_header(q, IP6_HLEN) == 0) {
+        struct ip6_hdr *ip6hdr = (struct ip6_hdr *)q->payload;
+        IP6H_VTCFL_SET(ip6hdr, 6, 0, 0);
+        IP6H_PLEN_SET(ip6hdr, sizeof(struct icmp6_hdr) + qlen);
+        IP6H_NEXTH_SET(ip6hdr, IP6_NEXTH_ICMP6);
+        IP6H_HOPLIM_SET(ip6hdr, LWIP_ICMP6_HL);
+        memcpy(&ip6hdr->src, src->addr, 16);
+        memcpy(&ip6hdr->dest, dest, 16);
+        ip6_relay_output(q, inp, from, dest);
+    }
+    pbuf_free(q);
+}
+
+static void ip6_relay_update_prefix(void)
+{
+    const ip6_addr_t *a = ip6_global(sta_netif);
+    u32_t p[2] = { 0, 0 };
+    bool found = a != NULL;
+
+    if (found) {
+        p[0] = a->addr[0];
+        p[1] = a->addr[1];
+    }
+    if (found == have_prefix && (!found || (p[0] == prefix[0] && p[1] == prefix[1]))) {
+        return;
+    }
+
+    if (have_prefix) {
+        ip6_relay_send_ra(prefix, false);
+    }
+    memset(neighbors, 0, sizeof(neighbors));
+    have_prefix = found;
+    prefix[0] = p[0];
+    prefix[1] = p[1];
+    if (found) {
+        ESP_LOGI(TAG, "Relaying prefix %lx:%lx:%lx:%lx::/64 to the AP",
+                 (unsigned long)(lwip_ntohl(p[0]) >> 16), (unsigned long)(lwip_ntohl(p[0]) & 0xffff),
+                 (unsigned long)(lwip_ntohl(p[1]) >> 16), (unsigned long)(lwip_ntohl(p[1]) & 0xffff));
+        ip6_relay_send_ra(prefix, true);
+    } else {
+        ESP_LOGI(TAG, "No IPv6 prefix on the uplink");
+    }
+}
+
+static void ip6_relay_tmr(void *arg)
+{
+    u32_t now = sys_now();
+
+    ip6_relay_update_prefix();
+    if (have_prefix && now - ra_last >= IP6_RELAY_RA_INTERVAL) {
+        ip6_relay_send_ra(prefix, true);
+    }
+    for (int i = 0; i < IP6_RELAY_NEIGHBORS; i++) {
+        if (neighbors[i].used && now - neighbors[i].last > IP6_RELAY_NEIGHBOR_AGE) {
+            neighbors[i].used = 0;
+        }
+    }
+    sys_timeout(IP6_RELAY_TMR_INTERVAL, ip6_relay_tmr, NULL);
+}
+
+/* Neighbor discovery seen on either side. Returns 1 if the message was
+ * consumed */
+static int ip6_relay_nd(struct pbuf *p, struct netif *inp, const u32_t *src)
+{
+    const struct ip6_hdr *ip6hdr = (const struct ip6_hdr *)p->payload;
+    const u8_t *icmp6 = (const u8_t *)p->payload + IP6_HLEN;
+    int len = p->len - IP6_HLEN;
+    u32_t target[4];
+    const u8_t *mac;
+
+    /* ND never crosses a router */
+    if (IP6H_HOPLIM(ip6hdr) != IP6_RELAY_ND_HOPLIM) {
+        return 0;
+    }
+
+    switch (icmp6[0]) {
+    case ICMP6_TYPE_RS:
+        if (inp != ap_netif) {
+            return 0;
+        }
+        ip6_relay_send_ra(prefix, true);
+        pbuf_free(p);
+        return 1;
+
+    case ICMP6_TYPE_NS:
+        if (len < (int)sizeof(struct ns_header)) {
+            return 0;
+        }
+        memcpy(target, icmp6 + offsetof(struct ns_header, target_address), 16);
+        if (inp == ap_netif) {
+            mac = ip6_nd_lladdr(icmp6 + sizeof(struct ns_header), len - sizeof(struct ns_header),
+                                ND6_OPTION_TYPE_SOURCE_LLADDR);
+            if (ip6_in_prefix(src)) {
+                struct ip6_neighbor *from = ip6_neighbor_learn(src, mac != NULL ? mac : ip6_eth_src(p));
+                struct ip6_neighbor *to = ip6_neighbor_find(target);
+                if (to != NULL && to != from && isolate_drop_mac(from->mac.addr, to->has_mac ? to->mac.addr : NULL)) {
+                    pbuf_free(p);
+                    return 1;
+                }
+            } else if (src[0] == 0 && src[1] == 0 && src[2] == 0 && src[3] == 0 &&
+                       ip6_in_prefix(target) && !ip6_is_local(target)) {
+                /* Duplicate address detection of a new client address */
+                ip6_neighbor_learn(target, NULL);
+            }
+            return 0;
+        }
+        /* Uplink: answered for the clients, lwIP answers for the router */
+        if (ip6_neighbor_find(target) == NULL || ip6_is_local(target)) {
+            return 0;
+        }
+        ip6_relay_advertise(target, src);
+        pbuf_free(p);
+        return 1;
+
+    case ICMP6_TYPE_NA:
+        if (inp != ap_netif || len < (int)sizeof(struct na_header)) {
+            return 0;
+        }
+        memcpy(target, icmp6 + offsetof(struct na_header, target_address), 16);
+        mac = ip6_nd_lladdr(icmp6 + sizeof(struct na_header), len - sizeof(struct na_header),
+                            ND6_OPTION_TYPE_TARGET_LLADDR);
+        if (mac != NULL && ip6_in_prefix(target) && !ip6_is_local(target)) {
+            ip6_neighbor_learn(target, mac);
+        }
+        return 0;
+
+    default:
+        return 0;
+    }
+}
+
+int router_ip6_input_hook(struct pbuf *p, struct netif *inp)
+{
+    u32_t src[4], dest[4];
+
+    if (!ip6_relay_on || !have_prefix || (inp != ap_netif && inp != sta_netif)) {
+        return 0;
+    }
+    /* The hook runs before lwIP checked the header */
+    if (p->len < IP6_HLEN) {
+        return 0;
+    }
+    struct ip6_hdr *ip6hdr = (struct ip6_hdr *)p->payload;
+    u32_t len = IP6_HLEN + IP6H_PLEN(ip6hdr);
+    if (IP6H_V(ip6hdr) != 6 || len > p->tot_len) {
+        return 0;
+    }
+    memcpy(src, &ip6hdr->src, 16);
+    memcpy(dest, &ip6hdr->dest, 16);
+
+    if (IP6H_NEXTH(ip6hdr) == IP6_NEXTH_ICMP6 && p->len >= IP6_HLEN + 4) {
+        u8_t type = ((const u8_t *)p->payload)[IP6_HLEN];
+        if (type >= ICMP6_TYPE_RS && type <= ICMP6_TYPE_NA) {
+            return ip6_relay_nd(p, inp, src);
+        }
+    }
+
+    /* Multicast stays on its link, link-local addresses are not routed */
+    u8_t scope = ((const u8_t *)dest)[0];
+    if (scope == 0xff || (scope == 0xfe && (((const u8_t *)dest)[1] & 0xc0) == 0x80) ||
+        ip6_is_local(dest)) {
+        return 0;
+    }
+
+    struct netif *outp;
+    struct ip6_neighbor *n = NULL, *from = NULL;
+    if (inp == ap_netif) {
+        if (!ip6_in_prefix(src)) {
+            return 0;
+        }
+        from = ip6_neighbor_learn(src, ip6_eth_src(p));
+        n = ip6_neighbor_find(dest);
+        outp = n != NULL ? ap_netif : sta_netif;
+        /* A client whose MAC is not known yet is asked for it below,
+         * nothing reaches it before */
+        if (n != NULL && n != from && n->has_mac && isolate_drop_mac(from->mac.addr, n->mac.addr)) {
+            pbuf_free(p);
+            return 1;
+        }
+    } else {
+        if (!ip6_in_prefix(dest)) {
+            return 0;
+        }
+        /* Only the clients get proxied, anything else in the prefix is
+         * not behind the router */
+        n = ip6_neighbor_find(dest);
+        if (n == NULL) {
+            return 0;
+        }
+        outp = ap_netif;
+    }
+
+    /* Consumed from here on */
+    if (IP6H_HOPLIM(ip6hdr) <= 1) {
+        pbuf_free(p);
+        return 1;
+    }
+    if (len > netif_mtu6(outp)) {
+        ip6_relay_too_big(p, len, inp, from, netif_mtu6(outp));
+        pbuf_free(p);
+        return 1;
+    }
+    if (len < p->tot_len) {
+        pbuf_realloc(p, len);
+    }
+    IP6H_HOPLIM_SET(ip6hdr, IP6H_HOPLIM(ip6hdr) - 1);
+
+    ip6_relay_output(p, outp, n, dest);
+    pbuf_free(p);
+    return 1;
+}
+
+static err_t ip6_relay_install(struct tcpip_api_call_data *call)
+{
+    sys_timeout(IP6_RELAY_TMR_INTERVAL, ip6_relay_tmr, NULL);
+    return ERR_OK;
+}
+
+void set_ip6_relay(bool enable)
+{
+    ip6_relay_on = enable;
+}
+
+bool get_ip6_relay(void)
+{
+    return ip6_relay_on;
+}
+
+void ip6_relay_init(void)
+{
+    struct tcpip_api_call_data call;
+
+    ap_netif = esp_netif_get_netif_impl(wifiAP);
+    sta_netif = esp_netif_get_netif_impl(wifiSTA);
+    if (!ip6_relay_on) {
+        return;
+    }
+    tcpip_api_call(ip6_relay_install, &call);
+    ESP_LOGI(TAG, "IPv6 relay to the AP enabled");
+}
+
+void print_ip6_relay(void)
+{
+    int clients = 0;
+
+    if (!ip6_relay_on) {
+        return;
+    }
+    if (!have_prefix) {
+        printf("IPv6 relay: no prefix on the uplink\n");
+        return;
+    }
+    for (int i = 0; i < IP6_RELAY_NEIGHBORS; i++) {
+        clients += neighbors[i].used;
+    }
+    printf("IPv6 relay: %lx:%lx:%lx:%lx::/64, %d clients\n",
+           (unsigned long)(lwip_ntohl(prefix[0]) >> 16), (unsigned long)(lwip_ntohl(prefix[0]) & 0xffff),
+           (unsigned long)(lwip_ntohl(prefix[1]) >> 16), (unsigned long)(lwip_ntohl(prefix[1]) & 0xffff),
+           clients);
+}
@@ -0,0 +1,321 @@
+/* IPFIX export of the NAPT flows of the esp32_nat_router
+
+   When a collector is set, napt.c hands over one record per mapping when
+   it is freed (idle timeout, end of the TCP connection, evicted) and, for
+   long lived mappings, every active timeout while it is in use. Records
+   go into a ring of IPFIX_RING entries allocated when the exporter is
+   turned on, so the forwarding path only copies a few fields and never
+   allocates. A full ring drops the record.
+
+   Once a second the ring is sent to the collector as IPFIX (RFC 7011)
+   over UDP, as many records per packet as fit into the uplink MTU. The
+   template goes along with the first packet and then every
+   IPFIX_TEMPLATE_INTERVAL, as RFC 7011 asks for over UDP. A record has
+   the client and remote address and port, the protocol, the address and
+   port it was translated to, the bytes each way (initiator/responder
+   octets), start and end time and why it ended. Times are absolute, taken
+   from the system clock, which starts at 1970 unless something sets it.
+
+   Everything runs in the tcpip thread, the settings are installed with
+   tcpip_api_call().
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "esp_log.h"
+#include "nvs.h"
+
+#include "lwip/opt.h"
+#include "lwip/def.h"
+#include "lwip/pbuf.h"
+#include "lwip/sys.h"
+#include "lwip/udp.h"
+#include "lwip/timeouts.h"
+#include "lwip/priv/tcpip_priv.h"
+
+#include "router_globals.h"
+#include "nat.h"
+
+static const char *TAG = "ipfix";
+
+#define IPFIX_NVS_KEY           "ipfix"
+#define IPFIX_RING              128
+#define IPFIX_TMR_INTERVAL      1000
+#define IPFIX_TEMPLATE_INTERVAL (60 * 1000)
+#define IPFIX_PAYLOAD           (1500 - 20 - 8)
+
+#define IPFIX_VERSION           10
+#define IPFIX_TEMPLATE_SET      2
+#define IPFIX_TEMPLATE_ID       256
+
+#define IPFIX_HDR_LEN           16
+#define IPFIX_SET_HDR_LEN       4
+
+/* Information elements of a record, with their length */
+static const u16_t ipfix_fields[][2] = {
+    { 8, 4 },       /* sourceIPv4Address, the client */
+    { 12, 4 },      /* destinationIPv4Address */
+    { 7, 2 },       /* sourceTransportPort, echo id for ICMP */
+    { 11, 2 },      /* destinationTransportPort */
+    { 4, 1 },       /* protocolIdentifier */
+    { 225, 4 },     /* postNATSourceIPv4Address */
+    { 227, 2 },     /* postNAPTSourceTransportPort */
+    { 231, 4 },     /* initiatorOctets, reduced size */
+    { 232, 4 },     /* responderOctets, reduced size */
+    { 152, 8 },     /* flowStartMilliseconds */
+    { 153, 8 },     /* flowEndMilliseconds */
+    { 136, 1 },     /* flowEndReason */
+};
+
+#define IPFIX_FIELDS            (sizeof(ipfix_fields) / sizeof(ipfix_fields[0]))
+#define IPFIX_RECORD_LEN        44
+#define IPFIX_TEMPLATE_LEN      (IPFIX_SET_HDR_LEN + 4 + IPFIX_FIELDS * 4)
+#define IPFIX_MAX_RECORDS       ((IPFIX_PAYLOAD - IPFIX_HDR_LEN - IPFIX_TEMPLATE_LEN - IPFIX_SET_HDR_LEN) / IPFIX_RECORD_LEN)
+
+static ipfix_config_t ipfix_cfg;
+static ipfix_stats_t ipfix_stats;
+static struct udp_pcb *ipfix_pcb;
+static struct ipfix_flow *ipfix_ring;
+static u32_t ipfix_head;
+static u32_t ipfix_count;
+static u32_t ipfix_seq;
+static u32_t ipfix_template_sent;
+static bool ipfix_template_due;
+
+u32_t ipfix_active_ms;
+
+void ipfix_flow(const struct ipfix_flow *f)
+{
+    if (ipfix_ring == NULL) {
+        return;
+    }
+    if (ipfix_count == IPFIX_RING) {
+        ipfix_stats.dropped++;
+        return;
+    }
+    ipfix_ring[(ipfix_head + ipfix_count) % IPFIX_RING] = *f;
+    ipfix_count++;
+}
+
+static u8_t *ipfix_put16(u8_t *b, u16_t v)
+{
+    b[0] = v >> 8;
+    b[1] = v;
+    return b + 2;
+}
+
+static u8_t *ipfix_put32(u8_t *b, u32_t v)
+{
+    b = ipfix_put16(b, v >> 16);
+    return ipfix_put16(b, v);
+}
+
+static u8_t *ipfix_put64(u8_t *b, u64_t v)
+{
+    b = ipfix_put32(b, v >> 32);
+    return ipfix_put32(b, v);
+}
+
+/* Addresses are kept in network byte order */
+static u8_t *ipfix_put_addr(u8_t *b, u32_t addr)
+{
+    memcpy(b, &addr, 4);
+    return b + 4;
+}
+
+static u8_t *ipfix_put_record(u8_t *b, const struct ipfix_flow *f, u64_t wall_ms, u32_t now)
+{
+    b = ipfix_put_addr(b, f->src);
+    b = ipfix_put_addr(b, f->dest);
+    b = ipfix_put16(b, f->sport);
+    b = ipfix_put16(b, f->dport);
+    *b++ = f->proto;
+    b = ipfix_put_addr(b, f->xaddr);
+    b = ipfix_put16(b, f->xport);
+    b = ipfix_put32(b, f->bytes_out);
+    b = ipfix_put32(b, f->bytes_in);
+    b = ipfix_put64(b, wall_ms - (now - f->start));
+    b = ipfix_put64(b, wall_ms - (now - f->end));
+    *b++ = f->reason;
+    return b;
+}
+
+/* Sends up to IPFIX_MAX_RECORDS records of the ring in one packet */
+static bool ipfix_send(void)
+{
+    struct timeval tv;
+    u32_t now = sys_now();
+    u32_t n = LWIP_MIN(ipfix_count, IPFIX_MAX_RECORDS);
+    bool template = ipfix_template_due || now - ipfix_template_sent >= IPFIX_TEMPLATE_INTERVAL;
+    u16_t len = IPFIX_HDR_LEN + (template ? IPFIX_TEMPLATE_LEN : 0) + IPFIX_SET_HDR_LEN + n * IPFIX_RECORD_LEN;
+
+    struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, len, PBUF_RAM);
+    if (p == NULL) {
+        return false;
+    }
+    gettimeofday(&tv, NULL);
+    u64_t wall_ms = (u64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+
+    u8_t *b = (u8_t *)p->payload;
+    b = ipfix_put16(b, IPFIX_VERSION);
+    b = ipfix_put16(b, len);
+    b = ipfix_put32(b, tv.tv_sec);
+    b = ipfix_put32(b, ipfix_seq);
+    b = ipfix_put32(b, 0);                  /* observation domain */
+    if (template) {
+        b = ipfix_put16(b, IPFIX_TEMPLATE_SET);
+        b = ipfix_put16(b, IPFIX_TEMPLATE_LEN);
+        b = ipfix_put16(b, IPFIX_TEMPLATE_ID);
+        b = ipfix_put16(b, IPFIX_FIELDS);
+        for (u32_t i = 0; i < IPFIX_FIELDS; i++) {
+            b = ipfix_put16(b, ipfix_fields[i][0]);
+            b = ipfix_put16(b, ipfix_fields[i][1]);
+        }
+    }
+    b = ipfix_put16(b, IPFIX_TEMPLATE_ID);
+    b = ipfix_put16(b, IPFIX_SET_HDR_LEN + n * IPFIX_RECORD_LEN);
+    for (u32_t i = 0; i < n; i++) {
+        b = ipfix_put_record(b, &ipfix_ring[ipfix_head], wall_ms, now);
+        ipfix_head = (ipfix_head + 1) % IPFIX_RING;
+    }
+    ipfix_count -= n;
+
+    ip_addr_t dst = IPADDR4_INIT(ipfix_cfg.collector);
+    if (udp_sendto(ipfix_pcb, p, &dst, ipfix_cfg.port) == ERR_OK) {
+        ipfix_seq += n;
+        ipfix_stats.records += n;
+        ipfix_stats.packets++;
+        if (template) {
+            ipfix_template_sent = now;
+            ipfix_template_due = false;
+        }
+    } else {
+        ipfix_stats.dropped += n;
+    }
+    pbuf_free(p);
+    return true;
+}
+
+static void ipfix_tmr(void *arg)
+{
+    /* Without an uplink address the records wait, until the ring is full */
+    while (ipfix_count > 0 && my_ip != 0 && ipfix_send()) {
+    }
+    sys_timeout(IPFIX_TMR_INTERVAL, ipfix_tmr, NULL);
+}
+
+struct ipfix_call {
+    struct tcpip_api_call_data call;
+    ipfix_config_t cfg;
+    ipfix_stats_t stats;
+};
+
+static err_t ipfix_install(struct tcpip_api_call_data *call)
+{
+    struct ipfix_call *msg = (struct ipfix_call *)call;
+
+    if (msg->cfg.collector != 0 && ipfix_ring == NULL) {
+        ipfix_ring = malloc(IPFIX_RING * sizeof(struct ipfix_flow));
+        ipfix_pcb = udp_new();
+        if (ipfix_ring == NULL || ipfix_pcb == NULL) {
+            free(ipfix_ring);
+            ipfix_ring = NULL;
+            if (ipfix_pcb != NULL) {
+                udp_remove(ipfix_pcb);
+                ipfix_pcb = NULL;
+            }
+            return ERR_MEM;
+        }
+        ipfix_head = 0;
+        ipfix_count = 0;
+        sys_timeout(IPFIX_TMR_INTERVAL, ipfix_tmr, NULL);
+    } else if (msg->cfg.collector == 0 && ipfix_ring != NULL) {
+        sys_untimeout(ipfix_tmr, NULL);
+        udp_remove(ipfix_pcb);
+        ipfix_pcb = NULL;
+        free(ipfix_ring);
+        ipfix_ring = NULL;
+    }
+    ipfix_cfg = msg->cfg;
+    ipfix_active_ms = ipfix_ring != NULL ? ipfix_cfg.active_timeout * 1000 : 0;
+    /* A new collector needs the template right away */
+    ipfix_template_due = true;
+    return ERR_OK;
+}
+
+static err_t ipfix_read(struct tcpip_api_call_data *call)
+{
+    struct ipfix_call *msg = (struct ipfix_call *)call;
+
+    msg->cfg = ipfix_cfg;
+    msg->stats = ipfix_stats;
+    return ERR_OK;
+}
+
+void ipfix_get_config(ipfix_config_t *cfg, ipfix_stats_t *stats)
+{
+    struct ipfix_call msg;
+
+    tcpip_api_call(ipfix_read, &msg.call);
+    *cfg = msg.cfg;
+    *stats = msg.stats;
+}
+
+/* Loads the settings stored by set_ipfix(), after napt_init() */
+esp_err_t get_ipfix(void)
+{
+    esp_err_t err;
+    nvs_handle_t nvs;
+    struct ipfix_call msg;
+    size_t len = sizeof(msg.cfg);
+
+    err = nvs_open(PARAM_NAMESPACE, NVS_READONLY, &nvs);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = nvs_get_blob(nvs, IPFIX_NVS_KEY, &msg.cfg, &len);
+    nvs_close(nvs);
+    if (err != ESP_OK || len != sizeof(msg.cfg) || msg.cfg.collector == 0) {
+        return err;
+    }
+    if (tcpip_api_call(ipfix_install, &msg.call) != ERR_OK) {
+        return ESP_ERR_NO_MEM;
+    }
+    ESP_LOGI(TAG, "Exporting flows to " IPSTR ":%u", IP2STR((ip4_addr_t *)&msg.cfg.collector), msg.cfg.port);
+    return ESP_OK;
+}
+
+/* Sets the collector, 0 turns the exporter off */
+esp_err_t set_ipfix(const ipfix_config_t *cfg)
+{
+    esp_err_t err;
+    nvs_handle_t nvs;
+    struct ipfix_call msg = { .cfg = *cfg };
+
+    if (tcpip_api_call(ipfix_install, &msg.call) != ERR_OK) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    err = nvs_open(PARAM_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (cfg->collector != 0) {
+        err = nvs_set_blob(nvs, IPFIX_NVS_KEY, cfg, sizeof(*cfg));
+    } else {
+        err = nvs_erase_key(nvs, IPFIX_NVS_KEY);
+        if (err == ESP_ERR_NVS_NOT_FOUND) {
+            err = ESP_OK;
+        }
+    }
+    if (err == ESP_OK) {
+        err = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+    return err;
+}
@@ -0,0 +1,315 @@
+/* AP client isolation of the esp32_nat_router
+
+   With isolation on, the AP clients reach the router and the uplink but
+   not each other: router_hooks.c drops the IPv4 packets lwIP would
+   forward from one client to another (isolate_drop()), and the ARP
+   requests and replies between clients are dropped before lwIP sees them,
+   by a wrapper in front of the AP interface's input (isolate_attach()).
+   The IPv6 relay (ip6_relay.c) asks isolate_drop_mac() before it forwards
+   a packet from one client to another, and drops the neighbor
+   solicitations of a client for another the same way.
+   Clients on the exception list, set by MAC (a camera, a printer), can be
+   reached by all others and reach them.
+
+   The exceptions are resolved to the DHCP leases like the rate limits
+   (shape.c), when the list is set and whenever such a client gets a new
+   lease, and kept as a bit mask by the last address byte, the AP network
+   is a /24. The mask belongs to the tcpip thread and is installed with
+   tcpip_api_call(), iso_lock serializes changes. The ARP wrapper runs in
+   the Wi-Fi driver's task and only reads it, a change may take effect a
+   frame late there.
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "esp_log.h"
+#include "esp_netif.h"
+#include "nvs.h"
+
+#include "lwip/opt.h"
+#include "lwip/def.h"
+#include "lwip/pbuf.h"
+#include "lwip/netif.h"
+#include "lwip/prot/ethernet.h"
+#include "lwip/priv/tcpip_priv.h"
+
+#include "router_globals.h"
+#include "nat.h"
+
+static const char *TAG = "isolate";
+
+extern esp_netif_t* wifiAP;
+
+#define ISOLATE_NVS_KEY     "ap_isolate"
+
+/* Stored setting */
+struct isolate_nvs_rec {
+    u8_t on;
+    u8_t count;
+    u8_t mac[ISOLATE_EXEMPT_MAX][6];
+} __attribute__((packed));
+
+/* Owned by the tcpip thread */
+static bool iso_on;
+static u32_t iso_exempt[256 / 32];      /* by last address byte */
+static isolate_config_t iso_cfg;
+static u32_t iso_ip[ISOLATE_EXEMPT_MAX];
+static isolate_stats_t iso_stats;
+
+static netif_input_fn iso_input;
+static pthread_mutex_t iso_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Both are AP clients, other than the router, and neither is an exception */
+static ROUTER_HOT bool isolate_between(u32_t src, u32_t dest)
+{
+    const u32_t mask = PP_HTONL(0xffffff00UL);
+
+    if (!iso_on || my_ap_ip == 0 || ((src ^ my_ap_ip) & mask) != 0 || ((dest ^ my_ap_ip) & mask) != 0 ||
+        src == my_ap_ip || dest == my_ap_ip) {
+        return false;
+    }
+    u8_t s = ((const u8_t *)&src)[3], d = ((const u8_t *)&dest)[3];
+    if (s == d || d == 0 || d == 255) {
+        return false;
+    }
+    return !(iso_exempt[s / 32] & (1u << (s % 32))) && !(iso_exempt[d / 32] & (1u << (d % 32)));
+}
+
+/* For a packet from an AP client that lwIP would forward to dest, true
+ * (and counted) if isolation drops it */
+ROUTER_HOT bool isolate_drop(u32_t src, u32_t dest)
+{
+    if (!isolate_between(src, dest)) {
+        return false;
+    }
+    iso_stats.dropped++;
+    return true;
+}
+
+static ROUTER_HOT bool isolate_exempt_mac(const u8_t *mac)
+{
+    for (int i = 0; mac != NULL && i < iso_cfg.count; i++) {
+        if (memcmp(iso_cfg.mac[i], mac, 6) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* For IPv6 between two AP clients, true (and counted) if isolation drops
+ * it. A client whose MAC is not known is no exception. */
+ROUTER_HOT bool isolate_drop_mac(const u8_t *src_mac, const u8_t *dest_mac)
+{
+    if (!iso_on || isolate_exempt_mac(src_mac) || isolate_exempt_mac(dest_mac)) {
+        return false;
+    }
+    iso_stats.dropped++;
+    return true;
+}
+
+/* Runs in the Wi-Fi driver's task */
+static ROUTER_HOT err_t isolate_input_arp(struct pbuf *p, struct netif *netif)
+{
+    if (iso_on && p->len >= SIZEOF_ETH_HDR + 28) {
+        const u8_t *b = (const u8_t *)p->payload;
+        u32_t spa, tpa;
+
+        if (((b[12] << 8) | b[13]) == ETHTYPE_ARP) {
+            memcpy(&spa, b + SIZEOF_ETH_HDR + 14, 4);
+            memcpy(&tpa, b + SIZEOF_ETH_HDR + 24, 4);
+            if (isolate_between(spa, tpa)) {
+                iso_stats.arp_dropped++;
+                pbuf_free(p);
+                return ERR_OK;
+            }
+        }
+    }
+    return iso_input(p, netif);
+}
+
+/* Filters the ARP the AP interface receives, after pcap_attach() */
+void isolate_attach(struct netif *netif)
+{
+    iso_input = netif->input;
+    netif->input = isolate_input_arp;
+}
+
+struct isolate_call {
+    struct tcpip_api_call_data call;
+    isolate_config_t cfg;
+    u32_t ip[ISOLATE_EXEMPT_MAX];
+    isolate_stats_t stats;
+};
+
+static err_t isolate_install(struct tcpip_api_call_data *call)
+{
+    struct isolate_call *msg = (struct isolate_call *)call;
+
+    iso_cfg = msg->cfg;
+    memcpy(iso_ip, msg->ip, sizeof(iso_ip));
+    memset(iso_exempt, 0, sizeof(iso_exempt));
+    for (int i = 0; i < iso_cfg.count; i++) {
+        if (iso_ip[i] != 0) {
+            u8_t b = ((const u8_t *)&iso_ip[i])[3];
+            iso_exempt[b / 32] |= 1u << (b % 32);
+        }
+    }
+    iso_on = iso_cfg.on;
+    return ERR_OK;
+}
+
+static err_t isolate_read(struct tcpip_api_call_data *call)
+{
+    struct isolate_call *msg = (struct isolate_call *)call;
+
+    msg->cfg = iso_cfg;
+    memcpy(msg->ip, iso_ip, sizeof(iso_ip));
+    msg->stats = iso_stats;
+    return ERR_OK;
+}
+
+/* Looks up the DHCP leases of the exceptions */
+static void isolate_resolve(struct isolate_call *msg)
+{
+    for (int i = 0; i < msg->cfg.count; i++) {
+        esp_netif_pair_mac_ip_t pair;
+        memcpy(pair.mac, msg->cfg.mac[i], 6);
+        pair.ip.addr = 0;
+        if (esp_netif_dhcps_get_clients_by_mac(wifiAP, 1, &pair) == ESP_OK && pair.ip.addr != 0) {
+            msg->ip[i] = pair.ip.addr;
+        }
+    }
+}
+
+void isolate_get_config(isolate_config_t *cfg, isolate_stats_t *stats)
+{
+    struct isolate_call msg;
+
+    tcpip_api_call(isolate_read, &msg.call);
+    *cfg = msg.cfg;
+    if (stats != NULL) {
+        *stats = msg.stats;
+    }
+}
+
+static esp_err_t isolate_apply(const isolate_config_t *cfg)
+{
+    struct isolate_call msg = { .cfg = *cfg };
+
+    if (msg.cfg.count > ISOLATE_EXEMPT_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    isolate_resolve(&msg);
+    tcpip_api_call(isolate_install, &msg.call);
+    return ESP_OK;
+}
+
+/* Loads the setting stored by set_isolate(), after the DHCP server started */
+esp_err_t get_isolate(void)
+{
+    esp_err_t err;
+    nvs_handle_t nvs;
+    struct isolate_nvs_rec rec;
+    size_t len = sizeof(rec);
+
+    err = nvs_open(PARAM_NAMESPACE, NVS_READONLY, &nvs);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = nvs_get_blob(nvs, ISOLATE_NVS_KEY, &rec, &len);
+    nvs_close(nvs);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (len != sizeof(rec) || rec.count > ISOLATE_EXEMPT_MAX) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    isolate_config_t cfg = { .on = rec.on, .count = rec.count };
+    memcpy(cfg.mac, rec.mac, sizeof(cfg.mac));
+    ESP_LOGI(TAG, "AP client isolation %s, %u exceptions", cfg.on ? "on" : "off", cfg.count);
+    return isolate_apply(&cfg);
+}
+
+/* Applies the setting right away and stores it */
+esp_err_t set_isolate(const isolate_config_t *cfg)
+{
+    esp_err_t err;
+    nvs_handle_t nvs;
+    struct isolate_nvs_rec rec = { .on = cfg->on, .count = cfg->count };
+
+    pthread_mutex_lock(&iso_lock);
+    err = isolate_apply(cfg);
+    pthread_mutex_unlock(&iso_lock);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    memcpy(rec.mac, cfg->mac, sizeof(rec.mac));
+    err = nvs_open(PARAM_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = nvs_set_blob(nvs, ISOLATE_NVS_KEY, &rec, sizeof(rec));
+    if (err == ESP_OK) {
+        err = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+    return err;
+}
+
+/* A client got a DHCP lease, from the event loop */
+void isolate_client_ip(const uint8_t *mac, uint32_t ip)
+{
+    struct isolate_call msg;
+
+    pthread_mutex_lock(&iso_lock);
+    tcpip_api_call(isolate_read, &msg.call);
+    for (int i = 0; i < msg.cfg.count; i++) {
+        if (memcmp(msg.cfg.mac[i], mac, 6) == 0 && msg.ip[i] != ip) {
+            msg.ip[i] = ip;
+            tcpip_api_call(isolate_install, &msg.call);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&iso_lock);
+}
+
+/* Parses a comma separated list of MACs into cfg's exceptions, an empty
+ * string clears them */
+bool isolate_parse_macs(const char *s, isolate_config_t *cfg)
+{
+    isolate_config_t c = *cfg;
+    char buf[ISOLATE_EXEMPT_MAX * 20];
+
+    if (strlcpy(buf, s, sizeof(buf)) >= sizeof(buf)) {
+        return false;
+    }
+    c.count = 0;
+    for (char *save, *tok = strtok_r(buf, ", ", &save); tok != NULL; tok = strtok_r(NULL, ", ", &save)) {
+        uint32_t ip;
+        bool by_mac;
+        if (c.count == ISOLATE_EXEMPT_MAX || !shape_parse_client(tok, c.mac[c.count], &ip, &by_mac) || !by_mac) {
+            return false;
+        }
+        c.count++;
+    }
+    *cfg = c;
+    return true;
+}
+
+/* The exceptions as a comma separated list */
+void isolate_format_macs(const isolate_config_t *cfg, char *buf, size_t len)
+{
+    size_t n = 0;
+
+    buf[0] = '\0';
+    for (int i = 0; i < cfg->count && n < len; i++) {
+        n += snprintf(buf + n, len - n, "%s" MACSTR, i > 0 ? "," : "", MAC2STR(cfg->mac[i]));
+    }
+}
@@ -0,0 +1,617 @@
+/* mDNS and SSDP reflector of the esp32_nat_router
+
+   Lets the AP clients discover services of the uplink network. Only the
+   services on the allowlist (mcast_reflect add ...) are reflected, and
+   only in the direction that makes sense for clients behind NAT:
+
+   - mDNS queries of the AP clients about an allowed service are repeated
+     on the uplink from my_ip, with the unicast-response bit cleared so the
+     answers come back by multicast. Answers and announcements from the
+     uplink are repeated on the AP if they are about a service an AP client
+     asked for within the last minute,
+   - SSDP M-SEARCHes for an allowed search target are repeated on the uplink
+     from a port of their own, the unicast answers to it are passed on to
+     the client that searched. NOTIFYs from the uplink are repeated on the
+     AP under the same condition as mDNS answers.
+
+   Services of the AP clients are never announced on the uplink, their
+   addresses are not reachable from there. The same packet is reflected
+   only once per second, and each direction is limited to MCAST_RATE
+   packets per second.
+
+   The router only joins the multicast groups while the allowlist is not
+   empty. All reflector state is owned by the tcpip thread.
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_netif.h"
+#include "esp_netif_net_stack.h"
+#include "nvs.h"
+
+#include "lwip/opt.h"
+#include "lwip/def.h"
+#include "lwip/pbuf.h"
+#include "lwip/sys.h"
+#include "lwip/netif.h"
+#include "lwip/ip.h"
+#include "lwip/udp.h"
+#include "lwip/igmp.h"
+#include "lwip/tcpip.h"
+#include "lwip/priv/tcpip_priv.h"
+
+#include "router_globals.h"
+
+static const char *TAG = "mcast_reflect";
+
+extern esp_netif_t* wifiAP;
+extern esp_netif_t* wifiSTA;
+
+#define MCAST_MDNS_PORT         5353
+#define MCAST_SSDP_PORT         1900
+#define MCAST_SEARCH_PORT       65280   /* first M-SEARCH port, above the NAPT ports */
+#define MCAST_SEARCHES          4
+#define MCAST_ASK_WINDOW        60000   /* ms answers are reflected after a query */
+#define MCAST_DEDUP_WINDOW      1000    /* ms */
+#define MCAST_DEDUP_SLOTS       16
+#define MCAST_RATE              10      /* packets per second and direction */
+#define MCAST_BUF_LEN           1472
+#define MCAST_NVS_KEY           "mcast_allow"
+
+#define MDNS_HLEN               12
+#define MDNS_FLAG_QR            0x80    /* in the first flags byte */
+#define MDNS_CLASS_QU           0x80    /* in the first class byte of a question */
+
+enum {
+    MCAST_UP,                   /* AP to uplink */
+    MCAST_DOWN                  /* uplink to AP */
+};
+
+/* An M-SEARCH of an AP client, the unicast answers to the port of pcb are
+ * passed on to client:port until 'until' */
+struct ssdp_search {
+    struct udp_pcb *pcb;
+    u32_t client;
+    u16_t port;
+    u32_t until;
+};
+
+static const ip_addr_t mdns_group = IPADDR4_INIT_BYTES(224, 0, 0, 251);
+static const ip_addr_t ssdp_group = IPADDR4_INIT_BYTES(239, 255, 255, 250);
+
+static struct netif *ap_netif;
+static struct netif *sta_netif;
+static struct udp_pcb *mdns_pcb;
+static struct udp_pcb *ssdp_pcb;
+static struct ssdp_search ssdp_searches[MCAST_SEARCHES];
+
+static char mcast_allow[MCAST_ALLOW_MAX][MCAST_NAME_LEN];
+static u32_t mcast_allow_count;
+static u32_t mcast_asked[MCAST_ALLOW_MAX];  /* sys_now() of the last query, 0 if none */
+
+static struct {
+    u32_t hash;
+    u32_t time;
+} mcast_dedup[MCAST_DEDUP_SLOTS];
+static u32_t mcast_dedup_next;
+static u32_t mcast_tokens[2], mcast_last[2];
+static u32_t mcast_reflected, mcast_dropped;
+
+/* Payload of the packet being reflected, NUL terminated for SSDP */
+static u8_t mcast_buf[MCAST_BUF_LEN + 1];
+
+static bool mcast_rate_ok(int dir)
+{
+    u32_t now = sys_now();
+    u32_t elapsed = LWIP_MIN(now - mcast_last[dir], 1000);
+    mcast_last[dir] = now;
+    mcast_tokens[dir] = LWIP_MIN(mcast_tokens[dir] + elapsed * MCAST_RATE, MCAST_RATE * 1000);
+    if (mcast_tokens[dir] < 1000) {
+        mcast_dropped++;
+        return false;
+    }
+    mcast_tokens[dir] -= 1000;
+    return true;
+}
+
+/* Drops what was reflected the same way within the last second. seed
+ * tells apart packets that only look the same */
+static bool mcast_admit(int dir, u16_t len, u32_t seed)
+{
+    u32_t hash = 2166136261u ^ seed ^ dir;
+    u32_t now = sys_now();
+
+    for (u16_t i = 0; i < len; i++) {
+        hash = (hash ^ mcast_buf[i]) * 16777619u;
+    }
+    for (int i = 0; i < MCAST_DEDUP_SLOTS; i++) {
+        if (mcast_dedup[i].hash == hash && now - mcast_dedup[i].time < MCAST_DEDUP_WINDOW) {
+            mcast_dropped++;
+            return false;
+        }
+    }
+    if (!mcast_rate_ok(dir)) {
+        return false;
+    }
+    mcast_dedup[mcast_dedup_next].hash = hash;
+    mcast_dedup[mcast_dedup_next].time = now;
+    mcast_dedup_next = (mcast_dedup_next + 1) % MCAST_DEDUP_SLOTS;
+    return true;
+}
+
+static void mcast_send(struct udp_pcb *pcb, struct netif *outp, const ip_addr_t *dst, u16_t port, u16_t len)
+{
+    struct pbuf *q = pbuf_alloc(PBUF_TRANSPORT, len, PBUF_RAM);
+    if (q == NULL) {
+        mcast_dropped++;
+        return;
+    }
+    memcpy(q->payload, mcast_buf, len);
+    if (udp_sendto_if_src(pcb, q, dst, port, outp, netif_ip_addr4(outp)) == ERR_OK) {
+        mcast_reflected++;
+    }
+    pbuf_free(q);
+}
+
+static bool mcast_recent(int i)
+{
+    return mcast_asked[i] != 0 && sys_now() - mcast_asked[i] < MCAST_ASK_WINDOW;
+}
+
+/* Reads the DNS name at off, lowercase and dot separated. Returns the
+ * offset behind it, -1 if it is malformed */
+static int mdns_name(u16_t len, int off, char *name, size_t size)
+{
+    int end = -1, jumps = 0;
+    size_t n = 0;
+
+    name[0] = '\0';
+    while (off < len) {
+        u8_t l = mcast_buf[off];
+        if (l == 0) {
+            return end < 0 ? off + 1 : end;
+        }
+        if ((l & 0xc0) == 0xc0) {
+            if (off + 1 >= len || ++jumps > 16) {
+                return -1;
+            }
+            if (end < 0) {
+                end = off + 2;
+            }
+            off = ((l & 0x3f) << 8) | mcast_buf[off + 1];
+            continue;
+        }
+        if ((l & 0xc0) != 0 || off + 1 + l > len) {
+            return -1;
+        }
+        /* Overlong names are walked but match nothing */
+        if (n + l + 1 < size) {
+            if (n > 0) {
+                name[n++] = '.';
+            }
+            for (int i = 0; i < l; i++) {
+                name[n++] = tolower(mcast_buf[off + 1 + i]);
+            }
+            name[n] = '\0';
+        } else {
+            size = 0;
+            name[0] = '\0';
+        }
+        off += 1 + l;
+    }
+    return -1;
+}
+
+/* Allowlist entry the name belongs to, -1 if none. SSDP entries have a
+ * colon, mDNS entries none */
+static int mdns_match(const char *name)
+{
+    size_t nl = strlen(name);
+
+    for (u32_t i = 0; i < mcast_allow_count; i++) {
+        const char *e = mcast_allow[i];
+        size_t el = strlen(e);
+        if (strchr(e, ':') == NULL && nl >= el && strcmp(name + nl - el, e) == 0 &&
+            (nl == el || name[nl - el - 1] == '.')) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void mdns_reflect(struct netif *inp, u16_t sport, u16_t len)
+{
+    char name[256];
+    bool want = false;
+
+    if (len < MDNS_HLEN) {
+        return;
+    }
+    bool response = (mcast_buf[2] & MDNS_FLAG_QR) != 0;
+    int qd = (mcast_buf[4] << 8) | mcast_buf[5];
+    int rr = ((mcast_buf[6] << 8) | mcast_buf[7]) + ((mcast_buf[8] << 8) | mcast_buf[9]) +
+             ((mcast_buf[10] << 8) | mcast_buf[11]);
+    int off = MDNS_HLEN;
+
+    if (inp == ap_netif) {
+        /* Queries of full responders only, others want unicast answers
+         * from the port they asked from */
+        if (response || sport != MCAST_MDNS_PORT || my_ip == 0) {
+            return;
+        }
+        for (int q = 0; q < qd; q++) {
+            off = mdns_name(len, off, name, sizeof(name));
+            if (off < 0 || off + 4 > len) {
+                return;
+            }
+            int i = mdns_match(name);
+            if (i >= 0) {
+                mcast_asked[i] = sys_now();
+                want = true;
+            }
+            mcast_buf[off + 2] &= ~MDNS_CLASS_QU;
+            off += 4;
+        }
+        if (want && mcast_admit(MCAST_UP, len, 0)) {
+            mcast_send(mdns_pcb, sta_netif, &mdns_group, MCAST_MDNS_PORT, len);
+        }
+        return;
+    }
+
+    if (!response) {
+        return;
+    }
+    for (int q = 0; q < qd; q++) {
+        off = mdns_name(len, off, name, sizeof(name));
+        if (off < 0 || off + 4 > len) {
+            return;
+        }
+        off += 4;
+    }
+    for (int r = 0; r < rr && !want; r++) {
+        off = mdns_name(len, off, name, sizeof(name));
+        if (off < 0 || off + 10 > len) {
+            return;
+        }
+        int i = mdns_match(name);
+        want = i >= 0 && mcast_recent(i);
+        off += 10 + ((mcast_buf[off + 8] << 8) | mcast_buf[off + 9]);
+    }
+    if (want && mcast_admit(MCAST_DOWN, len, 0)) {
+        mcast_send(mdns_pcb, ap_netif, &mdns_group, MCAST_MDNS_PORT, len);
+    }
+}
+
+/* Value of a header field of an SSDP message, NULL if it is missing */
+static const char *ssdp_header(const char *field, int *vlen)
+{
+    size_t fl = strlen(field);
+    const char *line = strchr((const char *)mcast_buf, '\n');
+
+    while (line != NULL) {
+        line++;
+        if (strncasecmp(line, field, fl) == 0 && line[fl] == ':') {
+            const char *v = line + fl + 1;
+            while (*v == ' ' || *v == '\t') {
+                v++;
+            }
+            int n = strcspn(v, "\r\n");
+            while (n > 0 && (v[n - 1] == ' ' || v[n - 1] == '\t')) {
+                n--;
+            }
+            *vlen = n;
+            return v;
+        }
+        line = strchr(line, '\n');
+    }
+    return NULL;
+}
+
+/* Allowlist entry a search or notification target belongs to, -1 if none */
+static int ssdp_match(const char *field)
+{
+    int vlen;
+    const char *v = ssdp_header(field, &vlen);
+
+    if (v == NULL) {
+        return -1;
+    }
+    for (u32_t i = 0; i < mcast_allow_count; i++) {
+        const char *e = mcast_allow[i];
+        size_t el = strlen(e);
+        if (strchr(e, ':') != NULL && el <= (size_t)vlen && strncasecmp(v, e, el) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void ssdp_reflect(struct netif *inp, u32_t src, u16_t sport, u16_t len)
+{
+    u32_t now = sys_now();
+
+    if (inp == ap_netif) {
+        if (strncmp((const char *)mcast_buf, "M-SEARCH ", 9) != 0 || my_ip == 0) {
+            return;
+        }
+        int i = ssdp_match("ST");
+        if (i < 0) {
+            return;
+        }
+        mcast_asked[i] = now;
+        if (!mcast_admit(MCAST_UP, len, src ^ sport)) {
+            return;
+        }
+
+        /* The client's earlier search, else the one that ended first */
+        struct ssdp_search *s = &ssdp_searches[0];
+        for (int n = 0; n < MCAST_SEARCHES; n++) {
+            struct ssdp_search *t = &ssdp_searches[n];
+            if (t->client == src && t->port == sport) {
+                s = t;
+                break;
+            }
+            if ((s32_t)(t->until - s->until) < 0) {
+                s = t;
+            }
+        }
+        int vlen, mx = 3;
+        const char *v = ssdp_header("MX", &vlen);
+        if (v != NULL) {
+            mx = LWIP_MAX(1, LWIP_MIN(atoi(v), 5));
+        }
+        s->client = src;
+        s->port = sport;
+        s->until = now + (mx + 1) * 1000;
+
+        mcast_send(s->pcb, sta_netif, &ssdp_group, MCAST_SSDP_PORT, len);
+        return;
+    }
+
+    if (strncmp((const char *)mcast_buf, "NOTIFY ", 7) != 0) {
+        return;
+    }
+    int i = ssdp_match("NT");
+    if (i >= 0 && mcast_recent(i) && mcast_admit(MCAST_DOWN, len, 0)) {
+        mcast_send(ssdp_pcb, ap_netif, &ssdp_group, MCAST_SSDP_PORT, len);
+    }
+}
+
+static void mcast_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *addr, u16_t port)
+{
+    struct netif *inp = ip_current_input_netif();
+    u16_t len = p->tot_len;
+
+    /* Multicast only, and nothing the router sent itself */
+    if (!IP_IS_V4(addr) || !ip4_addr_ismulticast(ip4_current_dest_addr()) ||
+        ip4_addr_get_u32(ip_2_ip4(addr)) == my_ip || ip4_addr_get_u32(ip_2_ip4(addr)) == my_ap_ip ||
+        (inp != ap_netif && inp != sta_netif) || len > MCAST_BUF_LEN) {
+        pbuf_free(p);
+        return;
+    }
+    pbuf_copy_partial(p, mcast_buf, len, 0);
+    mcast_buf[len] = '\0';
+    pbuf_free(p);
+
+    if (pcb == mdns_pcb) {
+        mdns_reflect(inp, port, len);
+    } else {
+        ssdp_reflect(inp, ip4_addr_get_u32(ip_2_ip4(addr)), port, len);
+    }
+}
+
+/* Unicast answers to a reflected M-SEARCH */
+static void ssdp_search_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *addr, u16_t port)
+{
+    struct ssdp_search *s = (struct ssdp_search *)arg;
+
+    if (ip_current_input_netif() == sta_netif && (s32_t)(sys_now() - s->until) < 0 && mcast_rate_ok(MCAST_DOWN)) {
+        ip_addr_t client;
+        ip_addr_set_ip4_u32(&client, s->client);
+        if (udp_sendto_if_src(pcb, p, &client, s->port, ap_netif, netif_ip_addr4(ap_netif)) == ERR_OK) {
+            mcast_reflected++;
+        }
+    }
+    pbuf_free(p);
+}
+
+static void mcast_join(bool join)
+{
+    const ip4_addr_t *groups[] = { ip_2_ip4(&mdns_group), ip_2_ip4(&ssdp_group) };
+
+    for (int i = 0; i < 2; i++) {
+        if (join) {
+            igmp_joingroup_netif(ap_netif, groups[i]);
+            igmp_joingroup_netif(sta_netif, groups[i]);
+        } else {
+            igmp_leavegroup_netif(ap_netif, groups[i]);
+            igmp_leavegroup_netif(sta_netif, groups[i]);
+        }
+    }
+}
+
+static struct udp_pcb *mcast_pcb(u16_t port, udp_recv_fn recv, void *arg)
+{
+    struct udp_pcb *pcb = udp_new();
+    if (pcb == NULL) {
+        return NULL;
+    }
+    ip_set_option(pcb, SOF_REUSEADDR);
+    if (udp_bind(pcb, IP_ADDR_ANY, port) != ERR_OK) {
+        udp_remove(pcb);
+        return NULL;
+    }
+    udp_recv(pcb, recv, arg);
+    return pcb;
+}
+
+static void mcast_stop(void)
+{
+    if (mdns_pcb != NULL) {
+        mcast_join(false);
+        udp_remove(mdns_pcb);
+        mdns_pcb = NULL;
+    }
+    if (ssdp_pcb != NULL) {
+        udp_remove(ssdp_pcb);
+        ssdp_pcb = NULL;
+    }
+    for (int i = 0; i < MCAST_SEARCHES; i++) {
+        if (ssdp_searches[i].pcb != NULL) {
+            udp_remove(ssdp_searches[i].pcb);
+        }
+    }
+    memset(ssdp_searches, 0, sizeof(ssdp_searches));
+}
+
+static void mcast_start(void)
+{
+    mdns_pcb = mcast_pcb(MCAST_MDNS_PORT, mcast_recv, NULL);
+    ssdp_pcb = mcast_pcb(MCAST_SSDP_PORT, mcast_recv, NULL);
+    bool ok = mdns_pcb != NULL && ssdp_pcb != NULL;
+    for (int i = 0; i < MCAST_SEARCHES && ok; i++) {
+        ssdp_searches[i].pcb = mcast_pcb(MCAST_SEARCH_PORT + i, ssdp_search_recv, &ssdp_searches[i]);
+        ok = ssdp_searches[i].pcb != NULL;
+    }
+    if (!ok) {
+        ESP_LOGE(TAG, "Cannot open the mDNS/SSDP ports");
+        mcast_stop();
+        return;
+    }
+#if LWIP_MULTICAST_TX_OPTIONS
+    /* RFC 6762 */
+    udp_set_multicast_ttl(mdns_pcb, 255);
+#endif
+    mcast_join(true);
+}
+
+struct mcast_allow_call {
+    struct tcpip_api_call_data call;
+    char names[MCAST_ALLOW_MAX][MCAST_NAME_LEN];
+    u32_t count;
+};
+
+static err_t mcast_allow_install(struct tcpip_api_call_data *call)
+{
+    struct mcast_allow_call *msg = (struct mcast_allow_call *)call;
+
+    ap_netif = esp_netif_get_netif_impl(wifiAP);
+    sta_netif = esp_netif_get_netif_impl(wifiSTA);
+    memcpy(mcast_allow, msg->names, sizeof(mcast_allow));
+    mcast_allow_count = msg->count;
+    memset(mcast_asked, 0, sizeof(mcast_asked));
+    if (mcast_allow_count > 0 && mdns_pcb == NULL) {
+        mcast_start();
+    } else if (mcast_allow_count == 0) {
+        mcast_stop();
+    }
+    return ERR_OK;
+}
+
+int mcast_get_reflect(char names[][MCAST_NAME_LEN])
+{
+    memcpy(names, mcast_allow, mcast_allow_count * MCAST_NAME_LEN);
+    return mcast_allow_count;
+}
+
+void mcast_reflect_get_stats(uint32_t *reflected, uint32_t *dropped)
+{
+    *reflected = mcast_reflected;
+    *dropped = mcast_dropped;
+}
+
+/* Loads the services stored by set_mcast_reflect() and starts the
+ * reflector if there are any */
+esp_err_t get_mcast_reflect(void)
+{
+    esp_err_t err;
+    nvs_handle_t nvs;
+    struct mcast_allow_call msg = { .count = 0 };
+    size_t len = sizeof(msg.names);
+
+    err = nvs_open(PARAM_NAMESPACE, NVS_READONLY, &nvs);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = nvs_get_blob(nvs, MCAST_NVS_KEY, msg.names, &len);
+    nvs_close(nvs);
+    if (err != ESP_OK) {
+        return err;
+    }
+    msg.count = len / MCAST_NAME_LEN;
+    tcpip_api_call(mcast_allow_install, &msg.call);
+    return ESP_OK;
+}
+
+/* Services are mDNS names (_http._tcp, ".local" is implied) or SSDP search
+ * targets (urn:schemas-upnp-org:device:MediaServer:1), which have a colon
+ * and also match longer targets they are the start of */
+esp_err_t set_mcast_reflect(const char *service, bool enable)
+{
+    esp_err_t err;
+    nvs_handle_t nvs;
+    struct mcast_allow_call msg;
+    char name[MCAST_NAME_LEN];
+
+    size_t n = strlen(service);
+    while (n > 0 && service[n - 1] == '.') {
+        n--;
+    }
+    if (n == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    bool ssdp = memchr(service, ':', n) != NULL;
+    bool local = n >= 6 && strncasecmp(service + n - 6, ".local", 6) == 0;
+    if (n + (ssdp || local ? 0 : 6) >= MCAST_NAME_LEN) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    for (size_t i = 0; i < n; i++) {
+        name[i] = ssdp ? service[i] : tolower((unsigned char)service[i]);
+    }
+    strcpy(name + n, ssdp || local ? "" : ".local");
+
+    memset(msg.names, 0, sizeof(msg.names));
+    msg.count = mcast_get_reflect(msg.names);
+    u32_t i;
+    for (i = 0; i < msg.count && strcmp(msg.names[i], name) != 0; i++) {
+    }
+    if (enable) {
+        if (i < msg.count) {
+            return ESP_OK;
+        }
+        if (msg.count == MCAST_ALLOW_MAX) {
+            return ESP_ERR_NO_MEM;
+        }
+        strcpy(msg.names[msg.count++], name);
+    } else {
+        if (i == msg.count) {
+            return ESP_ERR_NOT_FOUND;
+        }
+        msg.count--;
+        memmove(msg.names[i], msg.names[msg.count], MCAST_NAME_LEN);
+        memset(msg.names[msg.count], 0, MCAST_NAME_LEN);
+    }
+    tcpip_api_call(mcast_allow_install, &msg.call);
+
+    err = nvs_open(PARAM_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (msg.count > 0) {
+        err = nvs_set_blob(nvs, MCAST_NVS_KEY, msg.names, msg.count * MCAST_NAME_LEN);
+    } else {
+        err = nvs_erase_key(nvs, MCAST_NVS_KEY);
+    }
+    if (err == ESP_OK) {
+        err = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+    return err;
+}
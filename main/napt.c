@@ -0,0 +1,1253 @@
+/* NAPT of the esp32_nat_router
+
+   Translates the AP clients onto the uplink address (my_ip). It replaces
+   lwIP's NAPT, whose table size is fixed at compile time and whose state
+   cannot be looked at. The table here is allocated once at boot, sized
+   from NVS ("napt_max", see set_nat_size) and bounded by the free heap.
+
+   Every mapping is reachable through two hash tables, one keyed by the
+   inside 5-tuple for packets leaving through the uplink and one keyed by
+   (proto, port on my_ip) for the replies. Mappings are kept on an LRU
+   list, so a full table makes room by evicting the least recently used
+   one, and the expiry timer only looks at the idle end of the list.
+
+   TCP mappings are only created by a SYN, UDP mappings by any packet and
+   ICMP mappings by echo requests, using the echo id as port. Replies are
+   only accepted from the remote address and port the mapping was created
+   for. UDP of the clients set with nat_cone is mapped endpoint
+   independent (full cone) instead: one mapping per client socket, with
+   the client's port kept if it is free, for all remote hosts, and open
+   to replies from any of them. Ports the router's own sockets use are
+   never handed out. With a DMZ host set, an unsolicited SYN or UDP
+   packet to my_ip that no rule takes creates a mapping to that host, on
+   the same port. ICMP errors about a mapped packet are translated in
+   both directions, the header they quote included. Each mapping counts
+   the bytes in both directions, napt_walk() lists them for the conntrack
+   command and /api/conntrack. With an IPFIX collector set, a mapping is
+   reported when it is freed and every active timeout while it is in use
+   (see ipfix.c). New mappings have to pass the packet filter (fw.c).
+
+   So that one client cannot fill the table, each client may open at most
+   lim_rate new mappings per second (a token bucket with a second's worth
+   of burst) and hold at most lim_flows at a time, see set_nat_limits().
+   A SYN over the limit is answered with a RST, other packets that would
+   open a mapping are dropped. Clients are found by the last byte of their
+   address, the AP network is a /24. Mappings of the DMZ host count
+   towards its flows but are not refused, they are opened from outside.
+
+   All table state is owned by the tcpip thread.
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+#include "nvs.h"
+
+#include "lwip/opt.h"
+#include "lwip/def.h"
+#include "lwip/sys.h"
+#include "lwip/timeouts.h"
+#include "lwip/prot/tcp.h"
+#include "lwip/prot/udp.h"
+#include "lwip/prot/icmp.h"
+#include "lwip/priv/tcp_priv.h"
+#include "lwip/priv/tcpip_priv.h"
+
+#include "router_globals.h"
+#include "nat.h"
+
+static const char *TAG = "napt";
+
+#define NAPT_NO_IDX         NAPT_NO_FLOW
+#define NAPT_MIN_ENTRIES    16
+#define NAPT_MAX_ENTRIES    (NAPT_NO_IDX - 1)
+#define NAPT_TMR_INTERVAL   2000
+
+/* Default idle timeouts in s, changed with nat_timeouts. TCP, TCP closing
+ * (also a SYN not answered yet), UDP and ICMP are lwIP's defaults. A UDP
+ * mapping counts as a stream once the client sent again after a reply,
+ * so DNS lookups and other one-shot exchanges still go after 2 s. */
+#define NAPT_TIMEOUT_TCP            (30*60)
+#define NAPT_TIMEOUT_TCP_CLOSING    20
+#define NAPT_TIMEOUT_UDP            2
+#define NAPT_TIMEOUT_UDP_STREAM     60
+#define NAPT_TIMEOUT_ICMP           2
+#define NAPT_TIMEOUT_MAX            (7*24*60*60)
+
+/* TCP state of a mapping */
+#define NAPT_TCP_ESTAB      0x01    /* SYN-ACK seen */
+#define NAPT_TCP_FIN_OUT    0x02
+#define NAPT_TCP_FIN_IN     0x04
+#define NAPT_TCP_RST        0x08
+
+/* UDP state of a mapping */
+#define NAPT_UDP_REPLY      0x01    /* the remote side answered */
+#define NAPT_UDP_STREAM     0x02    /* and the client sent again after that */
+#define NAPT_UDP_CONE       0x04    /* endpoint independent, dest and dport are 0 */
+
+/* Both protocols */
+#define NAPT_INBOUND        0x80    /* created for the DMZ host */
+
+/* Client ports below this are not kept by full cone mappings */
+#define NAPT_CONE_PORT_MIN  1024
+
+#define NAPT_CONE_NVS_KEY   "nat_cone"
+
+#define NAPT_LIMIT_RATE_MAX     10000
+#define NAPT_LIMIT_LOG_INTERVAL 10000   /* ms between warnings */
+
+struct napt_entry {
+  u32_t src;        /* AP client */
+  u32_t dest;       /* remote host */
+  u16_t sport;      /* client port or echo id, host byte order */
+  u16_t dport;      /* remote port, 0 for ICMP */
+  u16_t mport;      /* port or echo id on my_ip */
+  u8_t proto;       /* 0 for a free entry */
+  u8_t state;
+  u32_t last;       /* sys_now() of the last packet */
+  u32_t bytes_out;  /* IP bytes from the client */
+  u32_t bytes_in;
+  u32_t start;      /* sys_now() of the first packet or the last IPFIX record */
+  u32_t exp_out;    /* bytes already in IPFIX records */
+  u32_t exp_in;
+  u16_t out_next;   /* hash chains, NAPT_NO_IDX terminated */
+  u16_t in_next;
+  u16_t lru_prev;   /* most recently used first */
+  u16_t lru_next;
+};
+
+static struct napt_entry *napt_tab;
+static u16_t *napt_out_hash;
+static u16_t *napt_in_hash;
+static u32_t napt_hash_shift;   /* 32 - log2(buckets) */
+static u16_t napt_free_list;    /* chained through out_next */
+static u16_t napt_lru_head = NAPT_NO_IDX;
+static u16_t napt_lru_tail = NAPT_NO_IDX;
+static u16_t napt_next_port = NAPT_PORT_MIN;
+
+static napt_stats_t napt_stats;
+
+/* Clients with full cone UDP, see set_nat_cone() */
+static u32_t napt_cone_ips[NAPT_CONE_MAX];
+static u32_t napt_cone_count;
+
+/* Per-client limits, 0 for none, read by the tcpip thread */
+static u32_t napt_lim_rate;
+static u32_t napt_lim_flows;
+
+/* By the last address byte of the client. Tokens are counted in 1/1000. */
+struct napt_client_bucket {
+    u32_t tokens;
+    u32_t last;
+};
+static u16_t napt_client_flows[256];
+static struct napt_client_bucket napt_client_rate[256];
+static u32_t napt_limit_logged;
+static u32_t napt_limit_quiet;  /* refusals since the last warning */
+
+/* In ms, read by the tcpip thread */
+static u32_t napt_to_tcp = NAPT_TIMEOUT_TCP * 1000;
+static u32_t napt_to_tcp_closing = NAPT_TIMEOUT_TCP_CLOSING * 1000;
+static u32_t napt_to_udp = NAPT_TIMEOUT_UDP * 1000;
+static u32_t napt_to_udp_stream = NAPT_TIMEOUT_UDP_STREAM * 1000;
+static u32_t napt_to_icmp = NAPT_TIMEOUT_ICMP * 1000;
+static u32_t napt_to_min = NAPT_TIMEOUT_UDP * 1000;
+
+static inline ROUTER_HOT u32_t napt_hash_out(u8_t proto, u32_t src, u16_t sport, u32_t dest, u16_t dport)
+{
+    u32_t h = src ^ (dest * 2654435761u) ^ (((u32_t)sport << 16) | dport) ^ proto;
+    h ^= h >> 16;
+    return (h * 2654435761u) >> napt_hash_shift;
+}
+
+static inline ROUTER_HOT u32_t napt_hash_in(u8_t proto, u16_t mport)
+{
+    return ((((u32_t)proto << 16) | mport) * 2654435761u) >> napt_hash_shift;
+}
+
+static ROUTER_HOT struct napt_entry *napt_find_out(u8_t proto, u32_t src, u16_t sport, u32_t dest, u16_t dport)
+{
+    u16_t i = napt_out_hash[napt_hash_out(proto, src, sport, dest, dport)];
+
+    while (i != NAPT_NO_IDX) {
+        struct napt_entry *e = &napt_tab[i];
+        if (e->src == src && e->sport == sport && e->dest == dest && e->dport == dport && e->proto == proto) {
+            return e;
+        }
+        i = e->out_next;
+    }
+    return NULL;
+}
+
+static ROUTER_HOT struct napt_entry *napt_find_in(u8_t proto, u16_t mport)
+{
+    u16_t i = napt_in_hash[napt_hash_in(proto, mport)];
+
+    while (i != NAPT_NO_IDX) {
+        struct napt_entry *e = &napt_tab[i];
+        if (e->mport == mport && e->proto == proto) {
+            return e;
+        }
+        i = e->in_next;
+    }
+    return NULL;
+}
+
+static ROUTER_HOT void napt_lru_unlink(struct napt_entry *e)
+{
+    if (e->lru_prev != NAPT_NO_IDX) {
+        napt_tab[e->lru_prev].lru_next = e->lru_next;
+    } else {
+        napt_lru_head = e->lru_next;
+    }
+    if (e->lru_next != NAPT_NO_IDX) {
+        napt_tab[e->lru_next].lru_prev = e->lru_prev;
+    } else {
+        napt_lru_tail = e->lru_prev;
+    }
+}
+
+static ROUTER_HOT void napt_lru_push(struct napt_entry *e)
+{
+    u16_t idx = e - napt_tab;
+
+    e->lru_prev = NAPT_NO_IDX;
+    e->lru_next = napt_lru_head;
+    if (napt_lru_head != NAPT_NO_IDX) {
+        napt_tab[napt_lru_head].lru_prev = idx;
+    } else {
+        napt_lru_tail = idx;
+    }
+    napt_lru_head = idx;
+}
+
+/* Hands what mapping e carried since its last record to the IPFIX
+ * exporter, see ipfix.c */
+static void napt_export(struct napt_entry *e, u8_t reason)
+{
+    struct ipfix_flow f = {
+        .src = e->src,
+        .dest = e->dest,
+        .xaddr = my_ip,
+        .sport = e->sport,
+        .dport = e->dport,
+        .xport = e->mport,
+        .proto = e->proto,
+        .reason = reason,
+        .bytes_out = e->bytes_out - e->exp_out,
+        .bytes_in = e->bytes_in - e->exp_in,
+        .start = e->start,
+        .end = e->last,
+    };
+
+    if (f.bytes_out != 0 || f.bytes_in != 0) {
+        ipfix_flow(&f);
+    }
+    e->start = e->last;
+    e->exp_out = e->bytes_out;
+    e->exp_in = e->bytes_in;
+}
+
+static ROUTER_HOT void napt_touch(struct napt_entry *e, const struct ip_hdr *iphdr, bool out)
+{
+    if (out) {
+        e->bytes_out += lwip_ntohs(IPH_LEN(iphdr));
+    } else {
+        e->bytes_in += lwip_ntohs(IPH_LEN(iphdr));
+    }
+    e->last = sys_now();
+    if (ipfix_active_ms != 0 && e->last - e->start >= ipfix_active_ms) {
+        napt_export(e, IPFIX_END_ACTIVE);
+    }
+    if (napt_lru_head != e - napt_tab) {
+        napt_lru_unlink(e);
+        napt_lru_push(e);
+    }
+}
+
+static u32_t *napt_proto_count(u8_t proto)
+{
+    switch (proto) {
+    case IP_PROTO_TCP:
+        return &napt_stats.tcp;
+    case IP_PROTO_UDP:
+        return &napt_stats.udp;
+    default:
+        return &napt_stats.icmp;
+    }
+}
+
+static void napt_free(struct napt_entry *e, u8_t reason)
+{
+    u16_t idx = e - napt_tab;
+    u16_t *pp;
+
+    pp = &napt_out_hash[napt_hash_out(e->proto, e->src, e->sport, e->dest, e->dport)];
+    while (*pp != idx) {
+        pp = &napt_tab[*pp].out_next;
+    }
+    *pp = e->out_next;
+
+    pp = &napt_in_hash[napt_hash_in(e->proto, e->mport)];
+    while (*pp != idx) {
+        pp = &napt_tab[*pp].in_next;
+    }
+    *pp = e->in_next;
+
+    napt_lru_unlink(e);
+    (*napt_proto_count(e->proto))--;
+    napt_stats.entries--;
+    napt_client_flows[((const u8_t *)&e->src)[3]]--;
+    acct_flow(e->src, false);
+    napt_export(e, reason);
+
+    e->proto = 0;
+    e->out_next = napt_free_list;
+    napt_free_list = idx;
+}
+
+static bool napt_is_cone(u32_t src)
+{
+    for (u32_t i = 0; i < napt_cone_count; i++) {
+        if (napt_cone_ips[i] == src) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Whether mapping e is for addr:port, a full cone one is for any remote */
+static inline ROUTER_HOT bool napt_remote_ok(const struct napt_entry *e, u32_t addr, u16_t port)
+{
+    if (e->proto == IP_PROTO_UDP && (e->state & NAPT_UDP_CONE)) {
+        return true;
+    }
+    return e->dest == addr && e->dport == port;
+}
+
+/* Whether a packet from addr:port may use mapping e to reach the client.
+ * A full cone mapping takes any remote host the inbound rules allow, as
+ * if it connected to a forwarded port. */
+static inline ROUTER_HOT bool napt_inbound_ok(const struct napt_entry *e, u32_t addr, u16_t port, bool count)
+{
+    if (e->proto == IP_PROTO_UDP && (e->state & NAPT_UDP_CONE)) {
+        return fw_check(FW_IN, e->proto, e->src, addr, e->mport, count);
+    }
+    return e->dest == addr && e->dport == port;
+}
+
+static bool napt_port_in_use(u8_t proto, u16_t port)
+{
+    u32_t daddr;
+    u16_t dport;
+
+    if (napt_find_in(proto, port) != NULL) {
+        return true;
+    }
+    /* A client's own port (nat_cone) may be one the router listens on */
+    return proto != IP_PROTO_ICMP &&
+           (portmap_match_ext(proto, port, &daddr, &dport) || local_port_in_use(proto, port));
+}
+
+/* Hands out port if it is not 0 and free, otherwise the next free one */
+static u16_t napt_alloc_port(u8_t proto, u16_t port)
+{
+    if (port != 0 && !napt_port_in_use(proto, port)) {
+        return port;
+    }
+    for (u32_t n = 0; n <= NAPT_PORT_MAX - NAPT_PORT_MIN; n++) {
+        u16_t port = napt_next_port;
+        napt_next_port = port == NAPT_PORT_MAX ? NAPT_PORT_MIN : port + 1;
+        if (!napt_port_in_use(proto, port)) {
+            return port;
+        }
+    }
+    return 0;
+}
+
+static struct napt_entry *napt_new(u8_t proto, u32_t src, u16_t sport, u32_t dest, u16_t dport, u16_t port)
+{
+    struct napt_entry *e;
+    u32_t h;
+
+    if (napt_free_list == NAPT_NO_IDX) {
+        /* Full, make room by dropping the least recently used mapping */
+        napt_free(&napt_tab[napt_lru_tail], IPFIX_END_RESOURCES);
+        napt_stats.evictions++;
+    }
+    u16_t mport = napt_alloc_port(proto, port);
+    if (mport == 0) {
+        napt_stats.alloc_failures++;
+        return NULL;
+    }
+
+    u16_t idx = napt_free_list;
+    e = &napt_tab[idx];
+    napt_free_list = e->out_next;
+
+    e->src = src;
+    e->dest = dest;
+    e->sport = sport;
+    e->dport = dport;
+    e->mport = mport;
+    e->proto = proto;
+    e->state = 0;
+    e->last = sys_now();
+    e->bytes_out = 0;
+    e->bytes_in = 0;
+    e->start = e->last;
+    e->exp_out = 0;
+    e->exp_in = 0;
+
+    h = napt_hash_out(proto, src, sport, dest, dport);
+    e->out_next = napt_out_hash[h];
+    napt_out_hash[h] = idx;
+    h = napt_hash_in(proto, mport);
+    e->in_next = napt_in_hash[h];
+    napt_in_hash[h] = idx;
+    napt_lru_push(e);
+
+    (*napt_proto_count(proto))++;
+    if (++napt_stats.entries > napt_stats.high_water) {
+        napt_stats.high_water = napt_stats.entries;
+    }
+    napt_client_flows[((const u8_t *)&src)[3]]++;
+    acct_flow(src, true);
+    return e;
+}
+
+/* Whether client src may open another mapping now, a refusal is counted
+ * and logged, at most every NAPT_LIMIT_LOG_INTERVAL */
+static bool napt_client_ok(u32_t src)
+{
+    u8_t i = ((const u8_t *)&src)[3];
+    u32_t rate = napt_lim_rate;
+    u32_t now = sys_now();
+    const char *limit;
+
+    if (napt_lim_flows != 0 && napt_client_flows[i] >= napt_lim_flows) {
+        limit = "concurrent connection";
+    } else if (rate != 0) {
+        struct napt_client_bucket *b = &napt_client_rate[i];
+        u32_t elapsed = LWIP_MIN(now - b->last, 1000);
+        b->last = now;
+        b->tokens = LWIP_MIN(b->tokens + elapsed * rate, rate * 1000);
+        if (b->tokens >= 1000) {
+            b->tokens -= 1000;
+            return true;
+        }
+        limit = "new connection";
+    } else {
+        return true;
+    }
+
+    napt_stats.limited++;
+    napt_limit_quiet++;
+    if (napt_limit_logged == 0 || now - napt_limit_logged >= NAPT_LIMIT_LOG_INTERVAL) {
+        ip4_addr_t addr = { .addr = src };
+        ESP_LOGW(TAG, IPSTR " is over the %s limit, %lu connections refused", IP2STR(&addr), limit,
+                 (unsigned long)napt_limit_quiet);
+        napt_limit_logged = now != 0 ? now : 1;
+        napt_limit_quiet = 0;
+    }
+    return false;
+}
+
+/* Refuses a SYN of an AP client with a RST from the remote host */
+static void napt_tcp_refuse(const struct ip_hdr *iphdr, const struct tcp_hdr *tcphdr)
+{
+    ip_addr_t local = IPADDR4_INIT(iphdr->dest.addr);
+    ip_addr_t remote = IPADDR4_INIT(iphdr->src.addr);
+
+    tcp_rst(NULL, 0, lwip_ntohl(tcphdr->seqno) + 1, &local, &remote,
+            lwip_ntohs(tcphdr->dest), lwip_ntohs(tcphdr->src));
+}
+
+static u32_t napt_timeout(const struct napt_entry *e)
+{
+    switch (e->proto) {
+    case IP_PROTO_TCP:
+        if ((e->state & NAPT_TCP_RST) || !(e->state & NAPT_TCP_ESTAB) ||
+            ((e->state & NAPT_TCP_FIN_OUT) && (e->state & NAPT_TCP_FIN_IN))) {
+            return napt_to_tcp_closing;
+        }
+        return napt_to_tcp;
+    case IP_PROTO_UDP:
+        return (e->state & NAPT_UDP_STREAM) ? napt_to_udp_stream : napt_to_udp;
+    default:
+        return napt_to_icmp;
+    }
+}
+
+static void napt_tmr(void *arg)
+{
+    u32_t now = sys_now();
+    u16_t i = napt_lru_tail;
+
+    /* Everything closer to the head was used more recently */
+    while (i != NAPT_NO_IDX) {
+        struct napt_entry *e = &napt_tab[i];
+        u32_t idle = now - e->last;
+        if (idle <= napt_to_min) {
+            break;
+        }
+        i = e->lru_prev;
+        if (idle > napt_timeout(e)) {
+            bool closed = e->proto == IP_PROTO_TCP && ((e->state & NAPT_TCP_RST) ||
+                          ((e->state & NAPT_TCP_FIN_OUT) && (e->state & NAPT_TCP_FIN_IN)));
+            napt_free(e, closed ? IPFIX_END_OF_FLOW : IPFIX_END_IDLE);
+            napt_stats.expired++;
+        }
+    }
+    sys_timeout(NAPT_TMR_INTERVAL, napt_tmr, NULL);
+}
+
+void napt_fw_recheck(void)
+{
+    for (u32_t i = 0; napt_tab != NULL && i < napt_stats.capacity; i++) {
+        struct napt_entry *e = &napt_tab[i];
+        bool ok;
+        if (e->proto == 0) {
+            continue;
+        }
+        if (e->state & NAPT_INBOUND) {
+            ok = fw_check(FW_IN, e->proto, e->src, e->dest, e->mport, false);
+        } else if (e->proto == IP_PROTO_UDP && (e->state & NAPT_UDP_CONE)) {
+            /* Its remote hosts are checked by napt_output() and
+             * napt_input() as they come, the flow cache is flushed */
+            continue;
+        } else {
+            ok = fw_check(FW_OUT, e->proto, e->src, e->dest, e->dport, false);
+        }
+        if (!ok) {
+            napt_free(e, IPFIX_END_FORCED);
+        }
+    }
+}
+
+static ROUTER_HOT void napt_tcp_track(struct napt_entry *e, const struct tcp_hdr *tcphdr, bool out)
+{
+    u8_t flags = TCPH_FLAGS(tcphdr);
+
+    if (out && (flags & (TCP_SYN | TCP_ACK)) == TCP_SYN) {
+        /* The client reuses the tuple for a new connection */
+        e->state &= NAPT_INBOUND;
+    } else if ((flags & (TCP_SYN | TCP_ACK)) == (TCP_SYN | TCP_ACK)) {
+        e->state |= NAPT_TCP_ESTAB;
+    }
+    if (flags & TCP_FIN) {
+        e->state |= out ? NAPT_TCP_FIN_OUT : NAPT_TCP_FIN_IN;
+    }
+    if (flags & TCP_RST) {
+        e->state |= NAPT_TCP_RST;
+    }
+}
+
+/* Rewrites source or destination address and echo id of an ICMP echo */
+static void napt_rewrite_icmp(struct ip_hdr *iphdr, struct icmp_echo_hdr *icmphdr, bool src, u32_t addr, u16_t id)
+{
+    u32_t old_addr = src ? iphdr->src.addr : iphdr->dest.addr;
+
+    /* The ICMP checksum has no pseudo header, only the id counts */
+    icmphdr->chksum = chksum_adjust16(icmphdr->chksum, icmphdr->id, id);
+    icmphdr->id = id;
+    IPH_CHKSUM_SET(iphdr, chksum_adjust32(IPH_CHKSUM(iphdr), old_addr, addr));
+    if (src) {
+        iphdr->src.addr = addr;
+    } else {
+        iphdr->dest.addr = addr;
+    }
+}
+
+/* Translates a TCP/UDP packet of mapping e leaving through the uplink */
+static ROUTER_HOT void napt_out_l4(struct napt_entry *e, struct ip_hdr *iphdr, u8_t proto, void *l4hdr)
+{
+    if (proto == IP_PROTO_TCP) {
+        napt_tcp_track(e, (struct tcp_hdr *)l4hdr, true);
+    } else if (e->state & NAPT_UDP_REPLY) {
+        e->state |= NAPT_UDP_STREAM;
+    }
+    napt_touch(e, iphdr, true);
+    nat_rewrite(iphdr, proto, l4hdr, true, my_ip, lwip_htons(e->mport));
+}
+
+/* Translates a TCP/UDP reply of mapping e back to the AP client */
+static ROUTER_HOT void napt_in_l4(struct napt_entry *e, struct ip_hdr *iphdr, u8_t proto, void *l4hdr)
+{
+    if (proto == IP_PROTO_TCP) {
+        napt_tcp_track(e, (struct tcp_hdr *)l4hdr, false);
+    } else {
+        e->state |= NAPT_UDP_REPLY;
+    }
+    napt_touch(e, iphdr, false);
+    nat_rewrite(iphdr, proto, l4hdr, false, e->src, lwip_htons(e->sport));
+}
+
+int napt_output(struct pbuf *p, struct ip_hdr *iphdr, u8_t proto, void *l4hdr, struct netif *outp, u16_t *flow)
+{
+    struct napt_entry *e;
+
+    *flow = NAPT_NO_FLOW;
+    if (napt_tab == NULL) {
+        goto drop;
+    }
+
+    if (proto == IP_PROTO_TCP || proto == IP_PROTO_UDP) {
+        struct udp_hdr *udphdr = (struct udp_hdr *)l4hdr;
+        u16_t sport = lwip_ntohs(udphdr->src);
+        u32_t dest = iphdr->dest.addr;
+        u16_t dport = lwip_ntohs(udphdr->dest);
+        bool cone = proto == IP_PROTO_UDP && napt_is_cone(iphdr->src.addr);
+
+        if (cone) {
+            dest = 0;
+            dport = 0;
+        }
+        e = napt_find_out(proto, iphdr->src.addr, sport, dest, dport);
+        if (e == NULL) {
+            if (proto == IP_PROTO_TCP &&
+                (TCPH_FLAGS((struct tcp_hdr *)l4hdr) & (TCP_SYN | TCP_ACK)) != TCP_SYN) {
+                goto drop;
+            }
+            if (!fw_check(FW_OUT, proto, iphdr->src.addr, iphdr->dest.addr, lwip_ntohs(udphdr->dest), true)) {
+                goto drop;
+            }
+            if (!napt_client_ok(iphdr->src.addr)) {
+                if (proto == IP_PROTO_TCP) {
+                    napt_tcp_refuse(iphdr, (struct tcp_hdr *)l4hdr);
+                }
+                goto drop;
+            }
+            e = napt_new(proto, iphdr->src.addr, sport, dest, dport,
+                         cone && sport >= NAPT_CONE_PORT_MIN ? sport : 0);
+            if (e == NULL) {
+                goto drop;
+            }
+            if (cone) {
+                e->state = NAPT_UDP_CONE;
+            }
+        } else if (cone && !fw_check(FW_OUT, proto, iphdr->src.addr, iphdr->dest.addr, lwip_ntohs(udphdr->dest), true)) {
+            /* One mapping for all remote hosts, each is checked */
+            goto drop;
+        }
+        napt_out_l4(e, iphdr, proto, l4hdr);
+        *flow = e - napt_tab;
+    } else if (proto == IP_PROTO_ICMP) {
+        struct icmp_echo_hdr *icmphdr = (struct icmp_echo_hdr *)l4hdr;
+        u16_t id = lwip_ntohs(icmphdr->id);
+
+        if (ICMPH_TYPE(icmphdr) != ICMP_ECHO) {
+            goto drop;
+        }
+        e = napt_find_out(proto, iphdr->src.addr, id, iphdr->dest.addr, 0);
+        if (e == NULL) {
+            if (!fw_check(FW_OUT, proto, iphdr->src.addr, iphdr->dest.addr, 0, true) ||
+                !napt_client_ok(iphdr->src.addr)) {
+                goto drop;
+            }
+            e = napt_new(proto, iphdr->src.addr, id, iphdr->dest.addr, 0, 0);
+            if (e == NULL) {
+                goto drop;
+            }
+        }
+        napt_touch(e, iphdr, true);
+        napt_rewrite_icmp(iphdr, icmphdr, true, my_ip, lwip_htons(e->mport));
+    } else {
+        goto drop;
+    }
+
+    router_forward(p, iphdr, outp);
+    return 1;
+
+drop:
+    pbuf_free(p);
+    return 1;
+}
+
+ROUTER_HOT bool napt_input(struct ip_hdr *iphdr, u8_t proto, void *l4hdr, u16_t *flow)
+{
+    struct napt_entry *e;
+
+    *flow = NAPT_NO_FLOW;
+    if (napt_tab == NULL) {
+        return false;
+    }
+
+    if (proto == IP_PROTO_TCP || proto == IP_PROTO_UDP) {
+        struct udp_hdr *udphdr = (struct udp_hdr *)l4hdr;
+
+        e = napt_find_in(proto, lwip_ntohs(udphdr->dest));
+        if (e == NULL || !napt_inbound_ok(e, iphdr->src.addr, lwip_ntohs(udphdr->src), true)) {
+            return false;
+        }
+        napt_in_l4(e, iphdr, proto, l4hdr);
+        *flow = e - napt_tab;
+        return true;
+    }
+    if (proto == IP_PROTO_ICMP) {
+        struct icmp_echo_hdr *icmphdr = (struct icmp_echo_hdr *)l4hdr;
+
+        if (ICMPH_TYPE(icmphdr) != ICMP_ER) {
+            return false;
+        }
+        e = napt_find_in(proto, lwip_ntohs(icmphdr->id));
+        if (e == NULL || e->dest != iphdr->src.addr) {
+            return false;
+        }
+        napt_touch(e, iphdr, false);
+        napt_rewrite_icmp(iphdr, icmphdr, false, e->src, lwip_htons(e->sport));
+        return true;
+    }
+    return false;
+}
+
+/* An error from the uplink about a packet that left from my_ip, the
+ * mapping it belongs to gets it. len is the ICMP length at hand. */
+bool napt_icmp_error_in(struct ip_hdr *iphdr, struct icmp_echo_hdr *icmphdr, u16_t len)
+{
+    struct napt_entry *e;
+    u16_t qhlen;
+
+    struct ip_hdr *q = icmp_quoted(icmphdr, len, &qhlen);
+    if (napt_tab == NULL || q == NULL || q->src.addr != my_ip) {
+        return false;
+    }
+    u8_t qproto = IPH_PROTO(q);
+    void *l4 = (u8_t *)q + qhlen;
+    if (qproto == IP_PROTO_TCP || qproto == IP_PROTO_UDP) {
+        struct udp_hdr *udphdr = (struct udp_hdr *)l4;
+        e = napt_find_in(qproto, lwip_ntohs(udphdr->src));
+        if (e == NULL || !napt_remote_ok(e, q->dest.addr, lwip_ntohs(udphdr->dest))) {
+            return false;
+        }
+    } else if (qproto == IP_PROTO_ICMP) {
+        struct icmp_echo_hdr *echo = (struct icmp_echo_hdr *)l4;
+        if (ICMPH_TYPE(echo) != ICMP_ECHO) {
+            return false;
+        }
+        e = napt_find_in(qproto, lwip_ntohs(echo->id));
+        if (e == NULL || e->dest != q->dest.addr) {
+            return false;
+        }
+    } else {
+        return false;
+    }
+    nat_rewrite_quoted(iphdr, icmphdr, q, qhlen, len - sizeof(struct icmp_echo_hdr) - qhlen,
+                        true, e->src, lwip_htons(e->sport));
+    return true;
+}
+
+/* An error of an AP client about a packet it got through a mapping */
+bool napt_icmp_error_out(struct ip_hdr *iphdr, struct icmp_echo_hdr *icmphdr, u16_t len)
+{
+    struct napt_entry *e;
+    u16_t qhlen;
+
+    struct ip_hdr *q = icmp_quoted(icmphdr, len, &qhlen);
+    if (napt_tab == NULL || q == NULL) {
+        return false;
+    }
+    u8_t qproto = IPH_PROTO(q);
+    if (qproto != IP_PROTO_TCP && qproto != IP_PROTO_UDP) {
+        return false;
+    }
+    struct udp_hdr *udphdr = (struct udp_hdr *)((u8_t *)q + qhlen);
+    u16_t sport = lwip_ntohs(udphdr->dest);
+    e = napt_find_out(qproto, q->dest.addr, sport, q->src.addr, lwip_ntohs(udphdr->src));
+    if (e == NULL && qproto == IP_PROTO_UDP && napt_is_cone(q->dest.addr)) {
+        e = napt_find_out(qproto, q->dest.addr, sport, 0, 0);
+    }
+    if (e == NULL) {
+        return false;
+    }
+    nat_rewrite_quoted(iphdr, icmphdr, q, qhlen, len - sizeof(struct icmp_echo_hdr) - qhlen,
+                        false, my_ip, lwip_htons(e->mport));
+    return true;
+}
+
+/* Inbound TCP/UDP that matched nothing else goes to the DMZ host, on the
+ * same port. A mapping is created for it as if the host had connected
+ * out, so its replies and the packets that follow take the usual path. */
+bool napt_input_dmz(struct ip_hdr *iphdr, u8_t proto, void *l4hdr, u32_t host, u16_t *flow)
+{
+    struct udp_hdr *udphdr = (struct udp_hdr *)l4hdr;
+    u16_t port = lwip_ntohs(udphdr->dest);
+    u16_t rport = lwip_ntohs(udphdr->src);
+    struct napt_entry *e;
+
+    *flow = NAPT_NO_FLOW;
+    if (napt_tab == NULL || port == 0) {
+        return false;
+    }
+    if (proto == IP_PROTO_TCP && (TCPH_FLAGS((struct tcp_hdr *)l4hdr) & (TCP_SYN | TCP_ACK)) != TCP_SYN) {
+        return false;
+    }
+    /* The port is taken by a mapping of another remote host */
+    if (napt_find_in(proto, port) != NULL || napt_find_out(proto, host, port, iphdr->src.addr, rport) != NULL) {
+        return false;
+    }
+    if (!fw_check(FW_IN, proto, host, iphdr->src.addr, port, true)) {
+        return false;
+    }
+    e = napt_new(proto, host, port, iphdr->src.addr, rport, port);
+    if (e == NULL) {
+        return false;
+    }
+    e->state = NAPT_INBOUND;
+    napt_in_l4(e, iphdr, proto, l4hdr);
+    *flow = e - napt_tab;
+    return true;
+}
+
+/* The flow cache remembers the mapping index only. The entry may have
+ * been freed and reused since, so it is checked against the packet. */
+ROUTER_HOT bool napt_output_flow(u16_t flow, struct ip_hdr *iphdr, u8_t proto, void *l4hdr)
+{
+    struct udp_hdr *udphdr = (struct udp_hdr *)l4hdr;
+
+    if (napt_tab == NULL || flow >= napt_stats.capacity) {
+        return false;
+    }
+    struct napt_entry *e = &napt_tab[flow];
+    if (e->proto != proto || e->src != iphdr->src.addr || e->sport != lwip_ntohs(udphdr->src) ||
+        !napt_remote_ok(e, iphdr->dest.addr, lwip_ntohs(udphdr->dest))) {
+        return false;
+    }
+    napt_out_l4(e, iphdr, proto, l4hdr);
+    return true;
+}
+
+ROUTER_HOT bool napt_input_flow(u16_t flow, struct ip_hdr *iphdr, u8_t proto, void *l4hdr)
+{
+    struct udp_hdr *udphdr = (struct udp_hdr *)l4hdr;
+
+    if (napt_tab == NULL || flow >= napt_stats.capacity) {
+        return false;
+    }
+    struct napt_entry *e = &napt_tab[flow];
+    /* The remote host passed the rules when the flow was cached, but the
+     * entry may now be a cone mapping of another client */
+    if (e->proto != proto || e->mport != lwip_ntohs(udphdr->dest) ||
+        !napt_inbound_ok(e, iphdr->src.addr, lwip_ntohs(udphdr->src), false)) {
+        return false;
+    }
+    napt_in_l4(e, iphdr, proto, l4hdr);
+    return true;
+}
+
+struct napt_walk_call {
+    struct tcpip_api_call_data call;
+    u32_t pos;
+    u32_t filter_ip;
+    napt_conn_t *conns;
+    int max;
+    int count;
+};
+
+static err_t napt_walk_batch(struct tcpip_api_call_data *call)
+{
+    struct napt_walk_call *msg = (struct napt_walk_call *)call;
+    u32_t now = sys_now();
+
+    msg->count = 0;
+    while (msg->pos < napt_stats.capacity && msg->count < msg->max) {
+        const struct napt_entry *e = &napt_tab[msg->pos++];
+        if (e->proto == 0 || (msg->filter_ip != 0 && e->src != msg->filter_ip)) {
+            continue;
+        }
+        napt_conn_t *c = &msg->conns[msg->count++];
+        c->proto = e->proto;
+        c->state = e->state;
+        c->src = e->src;
+        c->sport = e->sport;
+        c->dest = e->dest;
+        c->dport = e->dport;
+        c->mport = e->mport;
+        c->age = (now - e->last) / 1000;
+        c->bytes_out = e->bytes_out;
+        c->bytes_in = e->bytes_in;
+    }
+    return ERR_OK;
+}
+
+/* Copies the next up to max mappings, of one client if filter_ip is set,
+ * from table position *pos on. Returns their number, 0 at the end. Each
+ * batch is copied in one go in the tcpip thread, so the table is never
+ * locked for longer than that and needs no buffer of its size. */
+int napt_walk(uint32_t *pos, uint32_t filter_ip, napt_conn_t *conns, int max)
+{
+    struct napt_walk_call msg = {
+        .pos = *pos, .filter_ip = filter_ip, .conns = conns, .max = max, .count = 0
+    };
+
+    if (napt_tab == NULL) {
+        return 0;
+    }
+    do {
+        tcpip_api_call(napt_walk_batch, &msg.call);
+    } while (msg.count == 0 && msg.pos < napt_stats.capacity);
+    *pos = msg.pos;
+    return msg.count;
+}
+
+const char *napt_state_str(uint8_t proto, uint8_t state)
+{
+    if (proto == IP_PROTO_TCP) {
+        if (state & NAPT_TCP_RST) {
+            return "RST";
+        }
+        if ((state & NAPT_TCP_FIN_OUT) && (state & NAPT_TCP_FIN_IN)) {
+            return "CLOSED";
+        }
+        if (state & (NAPT_TCP_FIN_OUT | NAPT_TCP_FIN_IN)) {
+            return "FIN";
+        }
+        return (state & NAPT_TCP_ESTAB) ? "EST" : "SYN";
+    }
+    if (proto == IP_PROTO_UDP) {
+        if (state & NAPT_UDP_STREAM) {
+            return "STREAM";
+        }
+        return (state & NAPT_UDP_REPLY) ? "REPLY" : "NEW";
+    }
+    return "-";
+}
+
+static void napt_apply_timeouts(const napt_timeouts_t *t)
+{
+    napt_to_tcp = t->tcp * 1000;
+    napt_to_tcp_closing = t->tcp_closing * 1000;
+    napt_to_udp = t->udp * 1000;
+    napt_to_udp_stream = t->udp_stream * 1000;
+    napt_to_icmp = t->icmp * 1000;
+
+    /* Nothing idle for less than the shortest timeout can expire */
+    u32_t min = napt_to_tcp;
+    min = LWIP_MIN(min, napt_to_tcp_closing);
+    min = LWIP_MIN(min, napt_to_udp);
+    min = LWIP_MIN(min, napt_to_udp_stream);
+    napt_to_min = LWIP_MIN(min, napt_to_icmp);
+}
+
+void napt_get_timeouts(napt_timeouts_t *t)
+{
+    t->tcp = napt_to_tcp / 1000;
+    t->tcp_closing = napt_to_tcp_closing / 1000;
+    t->udp = napt_to_udp / 1000;
+    t->udp_stream = napt_to_udp_stream / 1000;
+    t->icmp = napt_to_icmp / 1000;
+}
+
+static bool napt_timeout_valid(uint32_t t)
+{
+    return t >= 1 && t <= NAPT_TIMEOUT_MAX;
+}
+
+/* Loads the timeouts stored by set_nat_timeouts(), missing ones keep
+ * their defaults */
+esp_err_t get_nat_timeouts(void)
+{
+    esp_err_t err;
+    nvs_handle_t nvs;
+    napt_timeouts_t t;
+    int32_t *vals[] = { (int32_t *)&t.tcp, (int32_t *)&t.tcp_closing, (int32_t *)&t.udp,
+                        (int32_t *)&t.udp_stream, (int32_t *)&t.icmp };
+    const char *keys[] = { "to_tcp", "to_tcp_close", "to_udp", "to_udp_stream", "to_icmp" };
+
+    err = nvs_open(PARAM_NAMESPACE, NVS_READONLY, &nvs);
+    if (err != ESP_OK) {
+        return err;
+    }
+    napt_get_timeouts(&t);
+    for (int i = 0; i < 5; i++) {
+        int32_t val;
+        if (nvs_get_i32(nvs, keys[i], &val) == ESP_OK && napt_timeout_valid(val)) {
+            *vals[i] = val;
+        }
+    }
+    nvs_close(nvs);
+
+    napt_apply_timeouts(&t);
+    return ESP_OK;
+}
+
+/* Takes effect right away, the next expiry run applies them to the
+ * mappings already in the table */
+esp_err_t set_nat_timeouts(const napt_timeouts_t *t)
+{
+    esp_err_t err;
+    nvs_handle_t nvs;
+
+    if (!napt_timeout_valid(t->tcp) || !napt_timeout_valid(t->tcp_closing) || !napt_timeout_valid(t->udp) ||
+        !napt_timeout_valid(t->udp_stream) || !napt_timeout_valid(t->icmp)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    napt_apply_timeouts(t);
+
+    err = nvs_open(PARAM_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = nvs_set_i32(nvs, "to_tcp", t->tcp);
+    if (err == ESP_OK) {
+        err = nvs_set_i32(nvs, "to_tcp_close", t->tcp_closing);
+    }
+    if (err == ESP_OK) {
+        err = nvs_set_i32(nvs, "to_udp", t->udp);
+    }
+    if (err == ESP_OK) {
+        err = nvs_set_i32(nvs, "to_udp_stream", t->udp_stream);
+    }
+    if (err == ESP_OK) {
+        err = nvs_set_i32(nvs, "to_icmp", t->icmp);
+    }
+    if (err == ESP_OK) {
+        err = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+    return err;
+}
+
+void napt_get_limits(napt_limits_t *l)
+{
+    l->rate = napt_lim_rate;
+    l->flows = napt_lim_flows;
+}
+
+static bool napt_limits_valid(const napt_limits_t *l)
+{
+    return l->rate <= NAPT_LIMIT_RATE_MAX && l->flows <= NAPT_MAX_ENTRIES;
+}
+
+/* Loads the limits stored by set_nat_limits() */
+esp_err_t get_nat_limits(void)
+{
+    esp_err_t err;
+    nvs_handle_t nvs;
+    int32_t rate = 0, flows = 0;
+
+    err = nvs_open(PARAM_NAMESPACE, NVS_READONLY, &nvs);
+    if (err != ESP_OK) {
+        return err;
+    }
+    nvs_get_i32(nvs, "lim_rate", &rate);
+    nvs_get_i32(nvs, "lim_flows", &flows);
+    nvs_close(nvs);
+
+    napt_limits_t l = { .rate = rate, .flows = flows };
+    if (rate < 0 || flows < 0 || !napt_limits_valid(&l)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    napt_lim_rate = l.rate;
+    napt_lim_flows = l.flows;
+    return ESP_OK;
+}
+
+/* Takes effect right away, mappings over a new flow limit are kept */
+esp_err_t set_nat_limits(const napt_limits_t *l)
+{
+    esp_err_t err;
+    nvs_handle_t nvs;
+
+    if (!napt_limits_valid(l)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    napt_lim_rate = l->rate;
+    napt_lim_flows = l->flows;
+
+    err = nvs_open(PARAM_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = nvs_set_i32(nvs, "lim_rate", l->rate);
+    if (err == ESP_OK) {
+        err = nvs_set_i32(nvs, "lim_flows", l->flows);
+    }
+    if (err == ESP_OK) {
+        err = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+    return err;
+}
+
+struct napt_cone_call {
+    struct tcpip_api_call_data call;
+    u32_t ips[NAPT_CONE_MAX];
+    u32_t count;
+};
+
+static err_t napt_cone_install(struct tcpip_api_call_data *call)
+{
+    struct napt_cone_call *msg = (struct napt_cone_call *)call;
+
+    memcpy(napt_cone_ips, msg->ips, sizeof(napt_cone_ips));
+    napt_cone_count = msg->count;
+    return ERR_OK;
+}
+
+int napt_get_cone(uint32_t *ips)
+{
+    memcpy(ips, napt_cone_ips, napt_cone_count * sizeof(u32_t));
+    return napt_cone_count;
+}
+
+/* Loads the clients stored by set_nat_cone() */
+esp_err_t get_nat_cone(void)
+{
+    esp_err_t err;
+    nvs_handle_t nvs;
+    struct napt_cone_call msg = { .count = 0 };
+    size_t len = sizeof(msg.ips);
+
+    err = nvs_open(PARAM_NAMESPACE, NVS_READONLY, &nvs);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = nvs_get_blob(nvs, NAPT_CONE_NVS_KEY, msg.ips, &len);
+    nvs_close(nvs);
+    if (err != ESP_OK) {
+        return err;
+    }
+    msg.count = len / sizeof(u32_t);
+    tcpip_api_call(napt_cone_install, &msg.call);
+    return ESP_OK;
+}
+
+/* Mappings created from now on follow the new setting, the ones in the
+ * table keep their mode until they expire */
+esp_err_t set_nat_cone(uint32_t ip, bool enable)
+{
+    esp_err_t err;
+    nvs_handle_t nvs;
+    struct napt_cone_call msg;
+
+    msg.count = napt_get_cone(msg.ips);
+    u32_t i;
+    for (i = 0; i < msg.count && msg.ips[i] != ip; i++) {
+    }
+    if (enable) {
+        if (i < msg.count) {
+            return ESP_OK;
+        }
+        if (msg.count == NAPT_CONE_MAX) {
+            return ESP_ERR_NO_MEM;
+        }
+        msg.ips[msg.count++] = ip;
+    } else {
+        if (i == msg.count) {
+            return ESP_ERR_NOT_FOUND;
+        }
+        msg.ips[i] = msg.ips[--msg.count];
+    }
+    tcpip_api_call(napt_cone_install, &msg.call);
+
+    err = nvs_open(PARAM_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (msg.count > 0) {
+        err = nvs_set_blob(nvs, NAPT_CONE_NVS_KEY, msg.ips, msg.count * sizeof(u32_t));
+    } else {
+        err = nvs_erase_key(nvs, NAPT_CONE_NVS_KEY);
+    }
+    if (err == ESP_OK) {
+        err = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+    return err;
+}
+
+struct napt_init_call {
+    struct tcpip_api_call_data call;
+    struct napt_entry *tab;
+    u16_t *out_hash;
+    u16_t *in_hash;
+    u32_t shift;
+};
+
+static err_t napt_install(struct tcpip_api_call_data *call)
+{
+    struct napt_init_call *msg = (struct napt_init_call *)call;
+
+    napt_out_hash = msg->out_hash;
+    napt_in_hash = msg->in_hash;
+    napt_hash_shift = msg->shift;
+    napt_free_list = 0;
+    napt_tab = msg->tab;
+    sys_timeout(NAPT_TMR_INTERVAL, napt_tmr, NULL);
+    return ERR_OK;
+}
+
+static size_t napt_table_size(u32_t entries, u32_t buckets)
+{
+    return entries * sizeof(struct napt_entry) + 2 * buckets * sizeof(u16_t);
+}
+
+esp_err_t napt_init(uint32_t max_entries)
+{
+    struct napt_init_call msg;
+    u32_t buckets, shift;
+
+    if (napt_tab != NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (max_entries < NAPT_MIN_ENTRIES) {
+        max_entries = NAPT_MIN_ENTRIES;
+    } else if (max_entries > NAPT_MAX_ENTRIES) {
+        max_entries = NAPT_MAX_ENTRIES;
+    }
+
+    /* Leave at least half of the free heap to everything else */
+    size_t budget = heap_caps_get_free_size(MALLOC_CAP_8BIT) / 2;
+    u32_t entries = max_entries;
+    for (;;) {
+        for (buckets = NAPT_MIN_ENTRIES, shift = 28; buckets < entries; buckets <<= 1, shift--) {
+        }
+        if (napt_table_size(entries, buckets) <= budget || entries == NAPT_MIN_ENTRIES) {
+            msg.tab = malloc(entries * sizeof(struct napt_entry));
+            msg.out_hash = malloc(buckets * sizeof(u16_t));
+            msg.in_hash = malloc(buckets * sizeof(u16_t));
+            if (msg.tab != NULL && msg.out_hash != NULL && msg.in_hash != NULL) {
+                break;
+            }
+            free(msg.tab);
+            free(msg.out_hash);
+            free(msg.in_hash);
+            if (entries == NAPT_MIN_ENTRIES) {
+                ESP_LOGE(TAG, "No memory for the NAPT table");
+                return ESP_ERR_NO_MEM;
+            }
+        }
+        entries = entries / 2 > NAPT_MIN_ENTRIES ? entries / 2 : NAPT_MIN_ENTRIES;
+    }
+    if (entries < max_entries) {
+        ESP_LOGW(TAG, "NAPT table limited to %lu of %lu entries by the free heap",
+                 (unsigned long)entries, (unsigned long)max_entries);
+    }
+
+    memset(msg.out_hash, 0xff, buckets * sizeof(u16_t));
+    memset(msg.in_hash, 0xff, buckets * sizeof(u16_t));
+    for (u32_t i = 0; i < entries; i++) {
+        msg.tab[i].proto = 0;
+        msg.tab[i].out_next = i + 1 < entries ? i + 1 : NAPT_NO_IDX;
+    }
+    msg.shift = shift;
+    napt_stats.capacity = entries;
+
+    tcpip_api_call(napt_install, &msg.call);
+    ESP_LOGI(TAG, "NAPT table with %lu entries (%u bytes)", (unsigned long)entries,
+             (unsigned)napt_table_size(entries, buckets));
+    return ESP_OK;
+}
+
+void napt_get_stats(napt_stats_t *stats)
+{
+    /* Counters are only written by the tcpip thread, a slightly torn
+     * snapshot is good enough for reporting */
+    *stats = napt_stats;
+}
@@ -0,0 +1,196 @@
+/* Internals of the esp32_nat_router forwarding path
+
+   Shared by router_hooks.c, which classifies the packets, and the
+   translation engines (portmap.c rules, napt.c). Everything declared here
+   runs in the tcpip thread only.
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#pragma once
+
+#include "sdkconfig.h"
+#include "esp_attr.h"
+#include "lwip/opt.h"
+#include "lwip/pbuf.h"
+#include "lwip/netif.h"
+#include "lwip/prot/ip4.h"
+#include "lwip/prot/icmp.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Functions every forwarded packet passes through, and the constants
+ * they read, run from IRAM with CONFIG_NAT_IRAM_HOT_PATH, where flash
+ * cache misses caused by other tasks cannot delay them. The functions are
+ * in sections of their own, IRAM_ATTR's with a name linker.lf puts
+ * between _router_hot_start and _router_hot_end. */
+#if CONFIG_NAT_IRAM_HOT_PATH
+#define ROUTER_HOT _SECTION_ATTR_IMPL(".iram1.router", __COUNTER__)
+#define ROUTER_HOT_DATA DRAM_ATTR
+#else
+#define ROUTER_HOT
+#define ROUTER_HOT_DATA
+#endif
+
+/* RFC 1624 incremental checksum update. All values are taken as they are
+ * in the packet (network byte order), the one's complement sum does not
+ * care about the byte order as long as it is the same for all of them. */
+static inline u16_t chksum_adjust16(u16_t chksum, u16_t from, u16_t to)
+{
+    u32_t sum = (u16_t)~chksum + (u16_t)~from + to;
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return (u16_t)~sum;
+}
+
+static inline u16_t chksum_adjust32(u16_t chksum, u32_t from, u32_t to)
+{
+    chksum = chksum_adjust16(chksum, (u16_t)(from >> 16), (u16_t)(to >> 16));
+    return chksum_adjust16(chksum, (u16_t)from, (u16_t)to);
+}
+
+/* Rewrites source or destination address and port (network byte order)
+ * of a TCP/UDP packet, keeping all checksums valid */
+void nat_rewrite(struct ip_hdr *iphdr, u8_t proto, void *l4hdr, bool src, u32_t addr, u16_t port);
+
+/* ICMP errors quote the IP header and at least the first 8 bytes of the
+ * packet they report on. Returns the quoted header if that much is among
+ * the len bytes of the ICMP message, NULL otherwise. */
+struct ip_hdr *icmp_quoted(struct icmp_echo_hdr *icmphdr, u16_t len, u16_t *qhlen);
+
+/* Rewrites source (src) or destination address and port of the packet
+ * quoted by an ICMP error, and the other address of the error itself,
+ * which travels the opposite way. 'avail' bytes of the quoted transport
+ * header are there, its checksum is only updated if it is among them. */
+void nat_rewrite_quoted(struct ip_hdr *iphdr, struct icmp_echo_hdr *icmphdr, struct ip_hdr *q,
+                        u16_t qhlen, u16_t avail, bool src, u32_t addr, u16_t port);
+
+/* Sends a packet out of outp the way ip4_forward() does, consumes p */
+void router_forward(struct pbuf *p, struct ip_hdr *iphdr, struct netif *outp);
+
+/* NAPT of the AP clients onto my_ip (napt.c). napt_output() consumes the
+ * packet, it is either translated and sent out of outp or dropped.
+ * napt_input() returns true if it rewrote the packet to an AP client.
+ * Both set *flow to the mapping of a translated TCP/UDP packet, for the
+ * flow cache, and to NAPT_NO_FLOW otherwise. */
+#define NAPT_NO_FLOW 0xffff
+
+/* Ports (and ICMP echo ids) handed out on my_ip. lwIP picks the local
+ * ports of the router's own connections from 49152 up, these stay below. */
+#define NAPT_PORT_MIN 32768
+#define NAPT_PORT_MAX 49151
+
+int napt_output(struct pbuf *p, struct ip_hdr *iphdr, u8_t proto, void *l4hdr, struct netif *outp, u16_t *flow);
+bool napt_input(struct ip_hdr *iphdr, u8_t proto, void *l4hdr, u16_t *flow);
+
+/* Translate an ICMP error (destination unreachable, time exceeded,
+ * parameter problem) about a mapped packet, from the uplink to the client
+ * or the other way. len is the ICMP length in the first pbuf. Return false
+ * if it belongs to no mapping. */
+bool napt_icmp_error_in(struct ip_hdr *iphdr, struct icmp_echo_hdr *icmphdr, u16_t len);
+bool napt_icmp_error_out(struct ip_hdr *iphdr, struct icmp_echo_hdr *icmphdr, u16_t len);
+
+/* Creates a mapping for an unsolicited TCP/UDP packet to my_ip and
+ * rewrites it to host, see set_dmz_host() */
+bool napt_input_dmz(struct ip_hdr *iphdr, u8_t proto, void *l4hdr, u32_t host, u16_t *flow);
+
+/* Translate a TCP/UDP packet with the mapping remembered by the flow
+ * cache, return false if it no longer belongs to that flow. The caller
+ * forwards the packet. */
+bool napt_output_flow(u16_t flow, struct ip_hdr *iphdr, u8_t proto, void *l4hdr);
+bool napt_input_flow(u16_t flow, struct ip_hdr *iphdr, u8_t proto, void *l4hdr);
+
+/* Charges len bytes to the token bucket of AP client, return false if the
+ * packet is over its rate limit and has to be dropped, see shape.c */
+#define SHAPE_UP 0
+#define SHAPE_DOWN 1
+
+bool shape_ok(u32_t client, u16_t len, int dir);
+
+/* Accounting of an AP client's forwarded packet (dir SHAPE_UP or
+ * SHAPE_DOWN) and of its NAPT mappings being opened and freed, see acct.c */
+void acct_count(u32_t client, u16_t len, int dir);
+void acct_flow(u32_t client, bool open);
+
+/* Class of a TCP/UDP (l4hdr) or other packet of AP client by the QoS
+ * rules, QOS_NONE if none matches. qos_mark() sets the DSCP of the class.
+ * qos_attach() queues the frames sent on netif by class, idx 0 for the
+ * uplink and 1 for the AP. See qos.c. */
+u8_t qos_classify(u8_t proto, u32_t client, const void *l4hdr);
+void qos_mark(struct ip_hdr *iphdr, u8_t cls);
+void qos_attach(struct netif *netif, int idx);
+
+/* Puts the packet capture (pcap.c) in front of netif, idx as above */
+void pcap_attach(struct netif *netif, int idx);
+
+/* Forwarding from the Wi-Fi driver's RX buffers (rxbuf.c), idx as above.
+ * rxbuf_keep() is for a frame kept after linkoutput returned, it adds a
+ * reference or copies a driver buffer, NULL if there is no memory. */
+void rxbuf_attach(struct netif *netif, int idx);
+struct pbuf *rxbuf_keep(struct pbuf *p);
+
+/* AP client isolation (isolate.c): the ARP filter in front of the AP
+ * interface, and the check of packets lwIP would forward between clients.
+ * isolate_drop_mac() is that check for what the IPv6 relay (ip6_relay.c)
+ * forwards or answers between clients, which it knows by MAC, NULL for a
+ * MAC not learned yet. */
+void isolate_attach(struct netif *netif);
+bool isolate_drop(u32_t src, u32_t dest);
+bool isolate_drop_mac(const u8_t *src_mac, const u8_t *dest_mac);
+
+/* A NAPT mapping for the IPFIX exporter (ipfix.c): what it carried from
+ * start to end (sys_now()) and why the record was made. Addresses are in
+ * network byte order, ports in host byte order. ipfix_flow() only copies
+ * the record into a ring. ipfix_active_ms is the active timeout, after
+ * which napt.c reports a mapping still in use, 0 if there is none or the
+ * exporter is off. */
+#define IPFIX_END_IDLE      1
+#define IPFIX_END_ACTIVE    2
+#define IPFIX_END_OF_FLOW   3
+#define IPFIX_END_FORCED    4
+#define IPFIX_END_RESOURCES 5
+
+struct ipfix_flow {
+    u32_t src;
+    u32_t dest;
+    u32_t xaddr;
+    u16_t sport;
+    u16_t dport;
+    u16_t xport;
+    u8_t proto;
+    u8_t reason;
+    u32_t bytes_out;
+    u32_t bytes_in;
+    u32_t start;
+    u32_t end;
+};
+
+extern u32_t ipfix_active_ms;
+void ipfix_flow(const struct ipfix_flow *f);
+
+/* Whether the packet filter (fw.c) lets a new connection of direction
+ * FW_OUT or FW_IN through, for AP client and remote host (network byte
+ * order) and the port the rules are about. count adds it to the hit
+ * counter of the rule that decided. napt_fw_recheck() frees the mappings
+ * the current rules do not allow anymore. */
+bool fw_check(int dir, u8_t proto, u32_t client, u32_t remote, u16_t port, bool count);
+void napt_fw_recheck(void);
+
+/* Whether lwIP has a TCP or UDP socket on port (router_hooks.c) */
+bool local_port_in_use(u8_t proto, u16_t port);
+
+/* Forgets all cached flows (router_hooks.c), after the rules changed, or
+ * those a portmap rule of one port may translate */
+void flow_cache_flush(void);
+void flow_cache_forget(u8_t proto, u16_t mport, u32_t daddr, u16_t dport);
+
+/* Whether an ICMP or ICMPv6 message may be sent now under the rate of
+ * set_icmp_rate() (router_hooks.c), counts the ones that may not */
+bool icmp_rate_ok(void);
+
+#ifdef __cplusplus
+}
+#endif
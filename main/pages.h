@@ -85,12 +85,21 @@ setTimeout(\"location.href = '/'\",10000);\
 <td><input type='text' name='ap_password' value='%s' placeholder='Password of the new network'/></td>\
 </tr>\
 <tr>\
+<td>Client isolation</td>\
+<td><input type='checkbox' name='ap_isolate' value='on' %s/></td>\
+</tr>\
+<tr>\
+<td>Exceptions</td>\
+<td><input type='text' name='ap_isolate_except' value='%s' placeholder='MACs all clients may reach'/></td>\
+</tr>\
+<tr>\
 <td></td>\
 <td><input type='submit' value='Set' class='ok-button'/></td>\
 </tr>\
 </table>\
 <small>\
 <i>Password </i>less than 8 chars = open<br />\
+<i>Client isolation </i>keeps the clients from reaching each other, except the MACs listed (comma separated)<br />\
 </small>\
 </form>\
 \
@@ -150,6 +159,32 @@ setTimeout(\"location.href = '/'\",10000);\
 </small>\
 </form>\
 \
+<h2>Bandwidth Limits</h2>\
+<form action='' method='GET'>\
+<table>\
+<tr>\
+<td>Client</td>\
+<td><input type='text' name='shape_client' placeholder='MAC or IP of an AP client'/></td>\
+</tr>\
+<tr>\
+<td>Upload</td>\
+<td><input type='number' name='shape_up' min='0' value='0' placeholder='kbit/s'/></td>\
+</tr>\
+<tr>\
+<td>Download</td>\
+<td><input type='number' name='shape_down' min='0' value='0' placeholder='kbit/s'/></td>\
+</tr>\
+<tr>\
+<td></td>\
+<td><input type='submit' value='Set' class='ok-button'/></td>\
+</tr>\
+\
+</table>\
+<small>\
+<i>In kbit/s, 0 for no limit. Both 0 removes the client's limits. Applied right away</i>\
+</small>\
+</form>\
+\
 <h2>Device Management</h2>\
 <form action='' method='GET'>\
 <table>\
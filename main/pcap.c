@@ -0,0 +1,316 @@
+/* Packet capture of the esp32_nat_router
+
+   Taps the Ethernet frames the AP and STA interfaces receive and send,
+   for /api/pcap, which streams them to the HTTP client as a pcap file
+   that Wireshark or tcpdump read live. pcap_attach() puts a wrapper in
+   front of the interface's input and its driver: received frames are
+   queued to the tcpip thread through pcap_ethernet_input() instead of
+   ethernet_input(), frames to send pass pcap_linkoutput(), which the
+   tcpip thread calls anyway. Both only look at the frame while a capture
+   runs.
+
+   A frame that passes the filter (interface, host, protocol, port) is
+   copied, cut to the snap length, into a ring buffer allocated when the
+   capture starts. The copy is a complete pcap record, so the reader only
+   moves bytes. Forwarding never waits for the reader: when the ring is
+   full the frame is counted as dropped.
+
+   One capture at a time. pcap_start() and pcap_stop() switch it in the
+   tcpip thread, the only writer, the reader runs in the HTTP server.
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <string.h>
+#include <sys/time.h>
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/ringbuf.h"
+
+#include "lwip/opt.h"
+#include "lwip/def.h"
+#include "lwip/pbuf.h"
+#include "lwip/netif.h"
+#include "lwip/tcpip.h"
+#include "lwip/prot/ethernet.h"
+#include "lwip/prot/ip4.h"
+#include "lwip/prot/udp.h"
+#include "netif/ethernet.h"
+#include "lwip/priv/tcpip_priv.h"
+
+#include "router_globals.h"
+#include "nat.h"
+
+static const char *TAG = "pcap";
+
+#define PCAP_RING_SIZE  (24 * 1024)
+#define PCAP_MAGIC      0xa1b2c3d4
+#define LINKTYPE_ETHERNET 1
+
+/* Ethernet, the longest IPv4 header and the ports */
+#define PCAP_PEEK_LEN   (SIZEOF_ETH_HDR + 60 + 4)
+
+struct pcap_hdr {
+    u32_t magic;
+    u16_t version_major;
+    u16_t version_minor;
+    s32_t thiszone;
+    u32_t sigfigs;
+    u32_t snaplen;
+    u32_t linktype;
+};
+
+struct pcap_rec {
+    u32_t ts_sec;
+    u32_t ts_usec;
+    u32_t incl_len;
+    u32_t orig_len;
+};
+
+struct pcap_if {
+    struct netif *netif;
+    netif_input_fn input;
+    netif_linkoutput_fn linkoutput;
+};
+
+static struct pcap_if pcap_ifs[2];              /* [0] uplink, [1] AP */
+
+/* Owned by the tcpip thread while a capture runs */
+static RingbufHandle_t pcap_rb;
+static pcap_filter_t pcap_filter;
+static u32_t pcap_captured;
+static u32_t pcap_dropped;
+
+/* Reader side */
+static bool pcap_hdr_sent;
+static struct pcap_rec *pcap_pending;
+static size_t pcap_pending_len;
+
+static bool pcap_match(struct pbuf *p)
+{
+    const pcap_filter_t *f = &pcap_filter;
+    u8_t b[PCAP_PEEK_LEN];
+    u16_t len = pbuf_copy_partial(p, b, sizeof(b), 0);
+
+    if (len < SIZEOF_ETH_HDR) {
+        return false;
+    }
+    u16_t type = (b[12] << 8) | b[13];
+    u8_t *l3 = b + SIZEOF_ETH_HDR;
+    len -= SIZEOF_ETH_HDR;
+
+    if (type == ETHTYPE_ARP) {
+        u32_t spa, tpa;
+        if ((f->proto != 0 && f->proto != PCAP_PROTO_ARP) || f->port != 0 || len < 28) {
+            return false;
+        }
+        memcpy(&spa, l3 + 14, 4);
+        memcpy(&tpa, l3 + 24, 4);
+        return f->host == 0 || f->host == spa || f->host == tpa;
+    }
+    if (type != ETHTYPE_IP) {
+        return f->proto == 0 && f->host == 0 && f->port == 0;
+    }
+
+    const struct ip_hdr *iphdr = (const struct ip_hdr *)l3;
+    if (len < IP_HLEN) {
+        return false;
+    }
+    u16_t hlen = IPH_HL_BYTES(iphdr);
+    u8_t proto = IPH_PROTO(iphdr);
+    u32_t src = iphdr->src.addr, dest = iphdr->dest.addr;
+    if (f->proto != 0 && f->proto != proto) {
+        return false;
+    }
+    if (f->host != 0 && f->host != src && f->host != dest) {
+        return false;
+    }
+    if (proto != IP_PROTO_TCP && proto != IP_PROTO_UDP) {
+        return f->port == 0;
+    }
+    /* Only the first fragment has the ports */
+    if ((IPH_OFFSET(iphdr) & PP_HTONS(IP_OFFMASK)) != 0 || len < hlen + 4) {
+        return f->port == 0;
+    }
+    const struct udp_hdr *udphdr = (const struct udp_hdr *)(l3 + hlen);
+    u16_t sport = lwip_ntohs(udphdr->src), dport = lwip_ntohs(udphdr->dest);
+    if (f->port != 0 && f->port != sport && f->port != dport) {
+        return false;
+    }
+    /* Leave out the connection that reads the capture */
+    if (proto == IP_PROTO_TCP &&
+        ((src == f->skip_host && sport == f->skip_port) || (dest == f->skip_host && dport == f->skip_port))) {
+        return false;
+    }
+    return true;
+}
+
+static void pcap_tap(struct pbuf *p, int idx)
+{
+    struct pcap_rec *r;
+    struct timeval tv;
+
+    if (!(pcap_filter.ifs & (1 << idx)) || !pcap_match(p)) {
+        return;
+    }
+    u16_t caplen = LWIP_MIN(p->tot_len, pcap_filter.snaplen);
+    if (xRingbufferSendAcquire(pcap_rb, (void **)&r, sizeof(*r) + caplen, 0) != pdTRUE) {
+        pcap_dropped++;
+        return;
+    }
+    gettimeofday(&tv, NULL);
+    r->ts_sec = tv.tv_sec;
+    r->ts_usec = tv.tv_usec;
+    r->incl_len = caplen;
+    r->orig_len = p->tot_len;
+    pbuf_copy_partial(p, r + 1, caplen, 0);
+    xRingbufferSendComplete(pcap_rb, r);
+    pcap_captured++;
+}
+
+static err_t pcap_ethernet_input(struct pbuf *p, struct netif *netif)
+{
+    if (pcap_rb != NULL) {
+        pcap_tap(p, netif == pcap_ifs[1].netif);
+    }
+    return ethernet_input(p, netif);
+}
+
+/* Runs in the Wi-Fi driver's task */
+static ROUTER_HOT err_t pcap_input(struct pbuf *p, struct netif *netif)
+{
+    if (pcap_rb == NULL) {
+        return pcap_ifs[netif == pcap_ifs[1].netif].input(p, netif);
+    }
+    return tcpip_inpkt(p, netif, pcap_ethernet_input);
+}
+
+static ROUTER_HOT err_t pcap_linkoutput(struct netif *netif, struct pbuf *p)
+{
+    struct pcap_if *pif = &pcap_ifs[netif == pcap_ifs[1].netif];
+
+    if (pcap_rb != NULL) {
+        pcap_tap(p, pif - pcap_ifs);
+    }
+    return pif->linkoutput(netif, p);
+}
+
+/* Taps the frames of netif, idx 0 for the uplink and 1 for the AP, after
+ * qos_attach() so that sent frames are seen before they wait in a queue */
+void pcap_attach(struct netif *netif, int idx)
+{
+    struct pcap_if *pif = &pcap_ifs[idx];
+    pif->netif = netif;
+    pif->input = netif->input;
+    netif->input = pcap_input;
+    pif->linkoutput = netif->linkoutput;
+    netif->linkoutput = pcap_linkoutput;
+}
+
+struct pcap_call {
+    struct tcpip_api_call_data call;
+    RingbufHandle_t rb;
+    pcap_filter_t filter;
+    u32_t captured;
+    u32_t dropped;
+};
+
+static err_t pcap_install(struct tcpip_api_call_data *call)
+{
+    struct pcap_call *msg = (struct pcap_call *)call;
+
+    if (msg->rb != NULL && pcap_rb != NULL) {
+        return ERR_INPROGRESS;
+    }
+    msg->captured = pcap_captured;
+    msg->dropped = pcap_dropped;
+    pcap_filter = msg->filter;
+    pcap_captured = 0;
+    pcap_dropped = 0;
+    pcap_rb = msg->rb;
+    return ERR_OK;
+}
+
+esp_err_t pcap_start(const pcap_filter_t *filter)
+{
+    struct pcap_call msg = { .filter = *filter };
+
+    msg.rb = xRingbufferCreate(PCAP_RING_SIZE, RINGBUF_TYPE_NOSPLIT);
+    if (msg.rb == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    if (msg.filter.snaplen == 0 || msg.filter.snaplen > PCAP_SNAPLEN_MAX) {
+        msg.filter.snaplen = PCAP_SNAPLEN_MAX;
+    }
+    if (tcpip_api_call(pcap_install, &msg.call) != ERR_OK) {
+        vRingbufferDelete(msg.rb);
+        return ESP_ERR_INVALID_STATE;
+    }
+    pcap_hdr_sent = false;
+    pcap_pending = NULL;
+    ESP_LOGI(TAG, "Capture started");
+    return ESP_OK;
+}
+
+/* Ends the capture, with the number of frames it took and dropped */
+void pcap_stop(uint32_t *captured, uint32_t *dropped)
+{
+    RingbufHandle_t rb = pcap_rb;
+    struct pcap_call msg = { .rb = NULL };
+
+    if (rb == NULL) {
+        return;
+    }
+    tcpip_api_call(pcap_install, &msg.call);
+    if (pcap_pending != NULL) {
+        vRingbufferReturnItem(rb, pcap_pending);
+        pcap_pending = NULL;
+    }
+    vRingbufferDelete(rb);
+    *captured = msg.captured;
+    *dropped = msg.dropped;
+    ESP_LOGI(TAG, "Capture stopped, %lu frames, %lu dropped", (unsigned long)msg.captured, (unsigned long)msg.dropped);
+}
+
+/* Fills buf with the pcap file header, then with whole records, waiting up
+ * to timeout_ms for the first one. buf must hold PCAP_RECORD_MAX bytes.
+ * Returns the number of bytes, 0 if nothing was captured meanwhile. */
+size_t pcap_read(uint8_t *buf, size_t size, uint32_t timeout_ms)
+{
+    size_t n = 0;
+
+    if (!pcap_hdr_sent) {
+        struct pcap_hdr hdr = {
+            .magic = PCAP_MAGIC,
+            .version_major = 2,
+            .version_minor = 4,
+            .snaplen = pcap_filter.snaplen,
+            .linktype = LINKTYPE_ETHERNET,
+        };
+        memcpy(buf, &hdr, sizeof(hdr));
+        pcap_hdr_sent = true;
+        return sizeof(hdr);
+    }
+
+    TickType_t wait = pdMS_TO_TICKS(timeout_ms);
+    for (;;) {
+        if (pcap_pending == NULL) {
+            pcap_pending = xRingbufferReceive(pcap_rb, &pcap_pending_len, wait);
+            if (pcap_pending == NULL) {
+                break;
+            }
+        }
+        if (n + pcap_pending_len > size) {
+            /* Kept for the next call */
+            break;
+        }
+        memcpy(buf + n, pcap_pending, pcap_pending_len);
+        n += pcap_pending_len;
+        vRingbufferReturnItem(pcap_rb, pcap_pending);
+        pcap_pending = NULL;
+        wait = 0;
+    }
+    return n;
+}
@@ -0,0 +1,1297 @@
+/* Port forwarding table of the esp32_nat_router
+
+   The rules are kept in an open addressed hash table keyed by
+   (proto, first external port). The table is allocated at runtime, sized
+   from the number of stored rules, and doubles whenever it gets 3/4 full.
+   Its slots are chained a second time by (proto, internal address, first
+   internal port).
+
+   A rule covers a range of external ports that maps 1:1 onto an equally
+   long range of internal ports. The forwarding path (router_hooks.c)
+   finds the rule a port starts by the hash table or the chains, in O(1)
+   however many rules there are. Rules of more than one port are also
+   kept in two short sorted arrays, by external port and by internal
+   address and port, searched in O(log n) when the hash misses. Once the
+   rules are applied, the table belongs to the tcpip thread: a change is
+   made there with tcpip_api_call() by a task that holds portmap_lock, so
+   the forwarding path needs no locking and the tasks read the table under
+   the lock.
+
+   In NVS only the valid rules are stored, as a packed list split into
+   blobs of PORTMAP_NVS_CHUNK records. A new rule is appended to the last
+   blob, a deleted one is replaced by the last record, so a change
+   rewrites one or two blobs however many rules there are.
+
+   The DMZ host, which gets all inbound TCP/UDP no rule or NAPT mapping
+   takes, is kept here as well and stored next to the rules.
+
+   Rules with PORTMAP_HAIRPIN set are also reachable from the AP clients
+   by the uplink address, see hairpin_out() in router_hooks.c.
+
+   Rules with PORTMAP_LEASE set are created by the AP clients themselves,
+   through UPnP-IGD or NAT-PMP/PCP (igd.c). They are kept in RAM only, so
+   port churn never rewrites the NVS blobs, and are removed once their
+   lifetime ran out. The console, the web server and igd.c change the
+   table from their own tasks, portmap_lock serializes them.
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "nvs.h"
+
+#include "lwip/opt.h"
+#include "lwip/def.h"
+#include "lwip/ip4_addr.h"
+#include "lwip/priv/tcpip_priv.h"
+
+#include "router_globals.h"
+#include "nat.h"
+
+static const char *TAG = "portmap";
+
+#define PORTMAP_NVS_KEY     "portmap"
+#define PORTMAP_NVS_LEGACY  "portmap_tab"
+#define PORTMAP_NVS_VERSION 4
+#define PORTMAP_NVS_DMZ     "dmz_host"
+/* Records per blob, under PORTMAP_NVS_KEY ".0", ".1" ... */
+#define PORTMAP_NVS_CHUNK   32
+#define PORTMAP_NVS_KEY_LEN 16  /* NVS_KEY_NAME_MAX_SIZE */
+
+/* Initial size of the table, must be a power of two */
+#define PORTMAP_MIN_SLOTS   16
+/* Limited by the 16 bit record count of the NVS format */
+#define PORTMAP_MAX_RULES   0xffff
+/* External ports a lease may take, below the NAPT ports */
+#define PORTMAP_LEASE_PORT_MIN  1024
+#define PORTMAP_LEASE_PORT_MAX  (NAPT_PORT_MIN - 1)
+
+#define SLOT_EMPTY   0
+#define SLOT_VALID   1
+#define SLOT_DELETED 2
+
+#define PORTMAP_NO_SLOT     0xffffffffu
+
+struct portmap_table_entry {
+  u32_t daddr;
+  u16_t mport;
+  u16_t mport_last;
+  u16_t dport;
+  u8_t proto;
+  u8_t state;
+  u8_t flags;
+  u16_t rec;        /* position in portmap_recs, stored rules only */
+  u32_t expires;    /* s, leases only */
+  u32_t int_next;   /* chain of portmap_int_head, PORTMAP_NO_SLOT terminated */
+};
+
+/* Fixed size array stored by older firmware under PORTMAP_NVS_LEGACY */
+struct portmap_legacy_entry {
+  u32_t daddr;
+  u16_t mport;
+  u16_t dport;
+  u8_t proto;
+  u8_t valid;
+};
+
+/* NVS blob: a header followed by 'count' records of 'rec_len' bytes. From
+ * version 4 on the count is 0 and the records are in the chunk blobs. */
+struct portmap_nvs_hdr {
+  u8_t version;
+  u8_t rec_len;
+  u16_t count;
+} __attribute__((packed));
+
+struct portmap_nvs_rec {
+  u32_t daddr;
+  u16_t mport;
+  u16_t dport;
+  u8_t proto;
+  u16_t mport_last;
+  u8_t flags;
+} __attribute__((packed));
+
+/* Records of older versions are a prefix of the current ones: version 1
+ * had no range, version 2 no flags */
+#define PORTMAP_NVS_REC_LEN_V1 9
+#define PORTMAP_NVS_REC_LEN_V2 11
+
+/* Copy of a rule of more than one port, for the sorted arrays */
+struct portmap_range {
+  u32_t daddr;
+  u16_t mport;
+  u16_t mport_last;
+  u16_t dport;
+  u8_t proto;
+  u8_t flags;
+};
+
+/* A change of the table, made in the tcpip thread */
+struct portmap_call {
+  struct tcpip_api_call_data call;
+  u32_t daddr;
+  u16_t mport;
+  u16_t mport_last;
+  u16_t dport;
+  u8_t proto;
+  u8_t flags;
+  esp_err_t err;
+};
+
+struct portmap_live_call {
+  struct tcpip_api_call_data call;
+  bool live;
+};
+
+static struct portmap_table_entry *portmap_tab;
+static u32_t *portmap_int_head;  /* chains by internal address and port */
+static u32_t portmap_slots;     /* size of portmap_tab, power of two */
+static u32_t portmap_shift;     /* 32 - log2(portmap_slots) */
+static u32_t portmap_count;     /* valid entries */
+static u32_t portmap_used;      /* valid + deleted entries */
+
+/* Rules of more than one port */
+static struct portmap_range *portmap_wide_ext;  /* sorted by proto, mport */
+static struct portmap_range *portmap_wide_int;  /* sorted by proto, daddr, dport */
+static u32_t portmap_wide_count;
+static u32_t portmap_wide_max;
+
+/* The stored rules as in NVS, the entry's rec is its position */
+static struct portmap_nvs_rec *portmap_recs;
+static u32_t portmap_rec_count;
+static u32_t portmap_rec_max;
+static bool portmap_rec_hdr;    /* the header of the current version is stored */
+
+static bool portmap_applied;
+static bool portmap_live;                       /* tcpip thread only */
+static u32_t portmap_max = PORTMAP_MAX_RULES;   /* rules add_portmap accepts */
+static u32_t dmz_host;                          /* 0 if none */
+static u32_t portmap_leases;                    /* valid entries with PORTMAP_LEASE */
+static pthread_mutex_t portmap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline u32_t portmap_now(void)
+{
+    return (u32_t)(esp_timer_get_time() / 1000000);
+}
+
+static inline u32_t portmap_hash(u8_t proto, u16_t mport)
+{
+    /* Fibonacci hashing, the upper bits are the well mixed ones */
+    return (((u32_t)proto << 16) | mport) * 2654435761u;
+}
+
+static inline u32_t portmap_hash_int(u8_t proto, u32_t daddr, u16_t dport)
+{
+    return ((daddr * 2654435761u) ^ (((u32_t)proto << 16) | dport)) * 2654435761u;
+}
+
+/* Returns the entry for (proto, mport). If there is none, NULL is returned
+ * and *free_slot (if given) points to the slot a new entry should use. */
+static struct portmap_table_entry *portmap_lookup(u8_t proto, u16_t mport, struct portmap_table_entry **free_slot)
+{
+    struct portmap_table_entry *first_free = NULL;
+
+    if (portmap_slots == 0) {
+        if (free_slot) *free_slot = NULL;
+        return NULL;
+    }
+
+    u32_t mask = portmap_slots - 1;
+    u32_t i = portmap_hash(proto, mport) >> portmap_shift;
+
+    for (u32_t n = 0; n < portmap_slots; n++, i = (i + 1) & mask) {
+        struct portmap_table_entry *e = &portmap_tab[i];
+
+        if (e->state == SLOT_EMPTY) {
+            if (first_free == NULL) first_free = e;
+            break;
+        }
+        if (e->state == SLOT_DELETED) {
+            if (first_free == NULL) first_free = e;
+        } else if (e->proto == proto && e->mport == mport) {
+            return e;
+        }
+    }
+    if (free_slot) *free_slot = first_free;
+    return NULL;
+}
+
+/* Returns the entry whose internal range starts at daddr:dport, other
+ * than skip, or NULL */
+static struct portmap_table_entry *portmap_lookup_int(u8_t proto, u32_t daddr, u16_t dport,
+                                                      const struct portmap_table_entry *skip)
+{
+    if (portmap_slots == 0) {
+        return NULL;
+    }
+    u32_t i = portmap_int_head[portmap_hash_int(proto, daddr, dport) >> portmap_shift];
+    for (; i != PORTMAP_NO_SLOT; i = portmap_tab[i].int_next) {
+        struct portmap_table_entry *e = &portmap_tab[i];
+        if (e != skip && e->proto == proto && e->daddr == daddr && e->dport == dport) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void portmap_int_link(struct portmap_table_entry *e)
+{
+    u32_t *head = &portmap_int_head[portmap_hash_int(e->proto, e->daddr, e->dport) >> portmap_shift];
+
+    e->int_next = *head;
+    *head = e - portmap_tab;
+}
+
+static void portmap_int_unlink(struct portmap_table_entry *e)
+{
+    u32_t *pos = &portmap_int_head[portmap_hash_int(e->proto, e->daddr, e->dport) >> portmap_shift];
+    u32_t idx = e - portmap_tab;
+
+    while (*pos != idx) {
+        pos = &portmap_tab[*pos].int_next;
+    }
+    *pos = e->int_next;
+}
+
+static int portmap_cmp_ext(const void *a, const void *b)
+{
+    const struct portmap_range *ra = a, *rb = b;
+    if (ra->proto != rb->proto) return ra->proto < rb->proto ? -1 : 1;
+    return (int)ra->mport - (int)rb->mport;
+}
+
+static int portmap_cmp_int(const void *a, const void *b)
+{
+    const struct portmap_range *ra = a, *rb = b;
+    if (ra->proto != rb->proto) return ra->proto < rb->proto ? -1 : 1;
+    if (ra->daddr != rb->daddr) return lwip_ntohl(ra->daddr) < lwip_ntohl(rb->daddr) ? -1 : 1;
+    return (int)ra->dport - (int)rb->dport;
+}
+
+/* Position of the first range in ranges that is not below r */
+static u32_t portmap_wide_pos(const struct portmap_range *ranges, const struct portmap_range *r,
+                              int (*cmp)(const void *, const void *))
+{
+    u32_t lo = 0, hi = portmap_wide_count;
+    while (lo < hi) {
+        u32_t mid = (lo + hi) / 2;
+        if (cmp(&ranges[mid], r) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static esp_err_t portmap_wide_reserve(void)
+{
+    if (portmap_wide_count < portmap_wide_max) {
+        return ESP_OK;
+    }
+    u32_t max = portmap_wide_max == 0 ? 8 : 2 * portmap_wide_max;
+    struct portmap_range *ext = realloc(portmap_wide_ext, max * sizeof(struct portmap_range));
+    if (ext == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    portmap_wide_ext = ext;
+    struct portmap_range *in = realloc(portmap_wide_int, max * sizeof(struct portmap_range));
+    if (in == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    portmap_wide_int = in;
+    portmap_wide_max = max;
+    return ESP_OK;
+}
+
+static void portmap_range_of(struct portmap_range *r, const struct portmap_table_entry *e)
+{
+    r->daddr = e->daddr;
+    r->mport = e->mport;
+    r->mport_last = e->mport_last;
+    r->dport = e->dport;
+    r->proto = e->proto;
+    r->flags = e->flags;
+}
+
+/* Sorts e into the arrays, after portmap_wide_reserve() */
+static void portmap_wide_add(const struct portmap_table_entry *e)
+{
+    struct portmap_range r;
+    u32_t i;
+
+    portmap_range_of(&r, e);
+    i = portmap_wide_pos(portmap_wide_ext, &r, portmap_cmp_ext);
+    memmove(&portmap_wide_ext[i + 1], &portmap_wide_ext[i], (portmap_wide_count - i) * sizeof(r));
+    portmap_wide_ext[i] = r;
+    i = portmap_wide_pos(portmap_wide_int, &r, portmap_cmp_int);
+    memmove(&portmap_wide_int[i + 1], &portmap_wide_int[i], (portmap_wide_count - i) * sizeof(r));
+    portmap_wide_int[i] = r;
+    portmap_wide_count++;
+}
+
+/* Neither range overlaps another rule's, so each is found by its start */
+static void portmap_wide_del(const struct portmap_table_entry *e)
+{
+    struct portmap_range r;
+    u32_t i;
+
+    portmap_range_of(&r, e);
+    portmap_wide_count--;
+    i = portmap_wide_pos(portmap_wide_ext, &r, portmap_cmp_ext);
+    memmove(&portmap_wide_ext[i], &portmap_wide_ext[i + 1], (portmap_wide_count - i) * sizeof(r));
+    i = portmap_wide_pos(portmap_wide_int, &r, portmap_cmp_int);
+    memmove(&portmap_wide_int[i], &portmap_wide_int[i + 1], (portmap_wide_count - i) * sizeof(r));
+}
+
+/* Returns the rule of more than one port whose external range holds port,
+ * or NULL */
+static const struct portmap_range *portmap_wide_find_ext(u8_t proto, u16_t port)
+{
+    /* Find the last range starting at or below port */
+    u32_t lo = 0, hi = portmap_wide_count;
+    while (lo < hi) {
+        u32_t mid = (lo + hi) / 2;
+        const struct portmap_range *r = &portmap_wide_ext[mid];
+        if (r->proto < proto || (r->proto == proto && r->mport <= port)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0) {
+        return NULL;
+    }
+
+    const struct portmap_range *r = &portmap_wide_ext[lo - 1];
+    if (r->proto != proto || port > r->mport_last) {
+        return NULL;
+    }
+    return r;
+}
+
+/* The same by internal address and port */
+static const struct portmap_range *portmap_wide_find_int(u8_t proto, u32_t saddr, u16_t sport)
+{
+    u32_t addr = lwip_ntohl(saddr);
+    u32_t lo = 0, hi = portmap_wide_count;
+    while (lo < hi) {
+        u32_t mid = (lo + hi) / 2;
+        const struct portmap_range *r = &portmap_wide_int[mid];
+        u32_t raddr = lwip_ntohl(r->daddr);
+        if (r->proto < proto || (r->proto == proto && (raddr < addr || (raddr == addr && r->dport <= sport)))) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0) {
+        return NULL;
+    }
+
+    const struct portmap_range *r = &portmap_wide_int[lo - 1];
+    if (r->proto != proto || r->daddr != saddr || sport - r->dport > r->mport_last - r->mport) {
+        return NULL;
+    }
+    return r;
+}
+
+static esp_err_t portmap_resize(u32_t slots)
+{
+    struct portmap_table_entry *old_tab = portmap_tab;
+    u32_t old_slots = portmap_slots;
+
+    struct portmap_table_entry *tab = calloc(slots, sizeof(struct portmap_table_entry));
+    u32_t *int_head = malloc(slots * sizeof(u32_t));
+    if (tab == NULL || int_head == NULL) {
+        ESP_LOGE(TAG, "No memory for %lu portmap slots", (unsigned long)slots);
+        free(tab);
+        free(int_head);
+        return ESP_ERR_NO_MEM;
+    }
+
+    free(portmap_int_head);
+    portmap_tab = tab;
+    portmap_int_head = int_head;
+    portmap_slots = slots;
+    portmap_shift = 32 - __builtin_ctz(slots);
+    portmap_used = portmap_count;
+    memset(int_head, 0xff, slots * sizeof(u32_t));
+
+    /* Rehashing drops the deleted markers as well */
+    for (u32_t i = 0; i < old_slots; i++) {
+        if (old_tab[i].state == SLOT_VALID) {
+            struct portmap_table_entry *slot;
+            portmap_lookup(old_tab[i].proto, old_tab[i].mport, &slot);
+            *slot = old_tab[i];
+            portmap_int_link(slot);
+        }
+    }
+    free(old_tab);
+    return ESP_OK;
+}
+
+/* Makes sure 'n' more entries fit without exceeding a 3/4 load factor */
+static esp_err_t portmap_reserve(u32_t n)
+{
+    if ((portmap_used + n) * 4 <= portmap_slots * 3) {
+        return ESP_OK;
+    }
+
+    u32_t slots = PORTMAP_MIN_SLOTS;
+    while ((portmap_count + n) * 4 > slots * 3) {
+        slots <<= 1;
+    }
+    return portmap_resize(slots);
+}
+
+/* A rule already starting at mport is replaced, it keeps its rec */
+static esp_err_t portmap_insert(u8_t proto, u16_t mport, u16_t mport_last, u32_t daddr, u16_t dport, u8_t flags)
+{
+    struct portmap_table_entry *e, *slot;
+
+    if (mport_last != mport && portmap_wide_reserve() != ESP_OK) {
+        return ESP_ERR_NO_MEM;
+    }
+    e = portmap_lookup(proto, mport, NULL);
+    if (e == NULL) {
+        if (portmap_count >= PORTMAP_MAX_RULES) {
+            return ESP_ERR_NO_MEM;
+        }
+        esp_err_t err = portmap_reserve(1);
+        if (err != ESP_OK) {
+            return err;
+        }
+        portmap_lookup(proto, mport, &slot);
+        e = slot;
+        if (e->state == SLOT_EMPTY) {
+            portmap_used++;
+        }
+        portmap_count++;
+    } else {
+        portmap_int_unlink(e);
+        if (e->mport_last != e->mport) {
+            portmap_wide_del(e);
+        }
+        if (e->flags & PORTMAP_LEASE) {
+            portmap_leases--;
+        }
+    }
+    if (flags & PORTMAP_LEASE) {
+        portmap_leases++;
+    }
+
+    e->proto = proto;
+    e->mport = mport;
+    e->mport_last = mport_last;
+    e->daddr = daddr;
+    e->dport = dport;
+    e->flags = flags;
+    e->expires = 0;
+    e->state = SLOT_VALID;
+    portmap_int_link(e);
+    if (mport_last != mport) {
+        portmap_wide_add(e);
+    }
+    return ESP_OK;
+}
+
+static void portmap_remove(struct portmap_table_entry *e)
+{
+    portmap_int_unlink(e);
+    if (e->mport_last != e->mport) {
+        portmap_wide_del(e);
+    }
+    e->state = SLOT_DELETED;
+    portmap_count--;
+    if (e->flags & PORTMAP_LEASE) {
+        portmap_leases--;
+    }
+    if (portmap_count == 0) {
+        memset(portmap_tab, 0, portmap_slots * sizeof(struct portmap_table_entry));
+        memset(portmap_int_head, 0xff, portmap_slots * sizeof(u32_t));
+        portmap_used = 0;
+    }
+}
+
+/* Drops the cached flows rule e may have translated otherwise. Those of
+ * a rule of one port (as leases are) are found by its ports, the others
+ * go with a rule of more. */
+static void portmap_forget(const struct portmap_table_entry *e)
+{
+    if (!portmap_live) {
+        return;
+    }
+    if (e->mport_last == e->mport) {
+        flow_cache_forget(e->proto, e->mport, e->daddr, e->dport);
+    } else {
+        flow_cache_flush();
+    }
+}
+
+static err_t portmap_insert_call(struct tcpip_api_call_data *call)
+{
+    struct portmap_call *msg = (struct portmap_call *)call;
+    struct portmap_table_entry *e = portmap_lookup(msg->proto, msg->mport, NULL);
+
+    /* The rule replaced */
+    if (e != NULL) {
+        portmap_forget(e);
+    }
+    msg->err = portmap_insert(msg->proto, msg->mport, msg->mport_last, msg->daddr, msg->dport, msg->flags);
+    if (msg->err == ESP_OK) {
+        portmap_forget(portmap_lookup(msg->proto, msg->mport, NULL));
+    }
+    return ERR_OK;
+}
+
+static err_t portmap_remove_call(struct tcpip_api_call_data *call)
+{
+    struct portmap_call *msg = (struct portmap_call *)call;
+    struct portmap_table_entry *e = portmap_lookup(msg->proto, msg->mport, NULL);
+
+    portmap_forget(e);
+    portmap_remove(e);
+    msg->err = ESP_OK;
+    return ERR_OK;
+}
+
+/* Makes a change in the tcpip thread once the forwarding path uses the
+ * table, with portmap_lock held */
+static esp_err_t portmap_change(tcpip_api_call_fn fn, struct portmap_call *msg)
+{
+    if (portmap_applied) {
+        tcpip_api_call(fn, &msg->call);
+    } else {
+        fn(&msg->call);
+    }
+    return msg->err;
+}
+
+static void portmap_rec_of(struct portmap_nvs_rec *rec, const struct portmap_table_entry *e)
+{
+    rec->daddr = e->daddr;
+    rec->mport = e->mport;
+    rec->dport = e->dport;
+    rec->proto = e->proto;
+    rec->mport_last = e->mport_last;
+    rec->flags = e->flags;
+}
+
+/* Makes room for n more records */
+static esp_err_t portmap_rec_reserve(u32_t n)
+{
+    if (portmap_rec_count + n <= portmap_rec_max) {
+        return ESP_OK;
+    }
+    u32_t max = portmap_rec_max == 0 ? PORTMAP_NVS_CHUNK : portmap_rec_max;
+    while (max < portmap_rec_count + n) {
+        max *= 2;
+    }
+    struct portmap_nvs_rec *recs = realloc(portmap_recs, max * sizeof(struct portmap_nvs_rec));
+    if (recs == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    portmap_recs = recs;
+    portmap_rec_max = max;
+    return ESP_OK;
+}
+
+/* NVS key of the chunk-th blob of records */
+static void portmap_chunk_key(char key[PORTMAP_NVS_KEY_LEN], u16_t chunk)
+{
+    snprintf(key, PORTMAP_NVS_KEY_LEN, PORTMAP_NVS_KEY ".%u", chunk);
+}
+
+/* Writes the blob of records the chunk-th holds, or erases it if there
+ * are none: ESP_ERR_NVS_NOT_FOUND if there was none either */
+static esp_err_t portmap_store_chunk(nvs_handle_t nvs, u32_t chunk)
+{
+    char key[PORTMAP_NVS_KEY_LEN];
+    u32_t first = chunk * PORTMAP_NVS_CHUNK;
+
+    portmap_chunk_key(key, chunk);
+    if (first >= portmap_rec_count) {
+        return nvs_erase_key(nvs, key);
+    }
+    u32_t n = LWIP_MIN(portmap_rec_count - first, PORTMAP_NVS_CHUNK);
+    return nvs_set_blob(nvs, key, &portmap_recs[first], n * sizeof(struct portmap_nvs_rec));
+}
+
+static esp_err_t portmap_store_hdr(nvs_handle_t nvs)
+{
+    struct portmap_nvs_hdr hdr = {
+        .version = PORTMAP_NVS_VERSION, .rec_len = sizeof(struct portmap_nvs_rec), .count = 0,
+    };
+
+    esp_err_t err = nvs_set_blob(nvs, PORTMAP_NVS_KEY, &hdr, sizeof(hdr));
+    portmap_rec_hdr = err == ESP_OK;
+    return err;
+}
+
+/* Stores the records at positions a and b, the blobs in between are left */
+static esp_err_t portmap_store_recs(u32_t a, u32_t b)
+{
+    nvs_handle_t nvs;
+
+    esp_err_t err = nvs_open(PARAM_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err == ESP_OK) {
+        err = portmap_store_chunk(nvs, a / PORTMAP_NVS_CHUNK);
+        if ((err == ESP_OK || err == ESP_ERR_NVS_NOT_FOUND) && b / PORTMAP_NVS_CHUNK != a / PORTMAP_NVS_CHUNK) {
+            err = portmap_store_chunk(nvs, b / PORTMAP_NVS_CHUNK);
+        }
+        if ((err == ESP_OK || err == ESP_ERR_NVS_NOT_FOUND) && !portmap_rec_hdr) {
+            /* The first rule */
+            err = portmap_store_hdr(nvs);
+        }
+        if (err == ESP_OK || err == ESP_ERR_NVS_NOT_FOUND) {
+            err = nvs_commit(nvs);
+        }
+        nvs_close(nvs);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Cannot store portmap rules (%s)", esp_err_to_name(err));
+    }
+    return err;
+}
+
+/* Appends the record of a new stored rule, after portmap_rec_reserve() */
+static esp_err_t portmap_rec_add(struct portmap_table_entry *e)
+{
+    e->rec = portmap_rec_count++;
+    portmap_rec_of(&portmap_recs[e->rec], e);
+    return portmap_store_recs(e->rec, e->rec);
+}
+
+static esp_err_t portmap_rec_set(const struct portmap_table_entry *e)
+{
+    portmap_rec_of(&portmap_recs[e->rec], e);
+    return portmap_store_recs(e->rec, e->rec);
+}
+
+/* Takes the record at pos out, the last one moves into its place */
+static esp_err_t portmap_rec_del(u32_t pos)
+{
+    u32_t last = --portmap_rec_count;
+
+    if (pos != last) {
+        struct portmap_nvs_rec *rec = &portmap_recs[pos];
+        *rec = portmap_recs[last];
+        portmap_lookup(rec->proto, rec->mport, NULL)->rec = pos;
+    }
+    return portmap_store_recs(pos, last);
+}
+
+/* Stores all rules anew, with the header of the current version */
+static esp_err_t portmap_store(void)
+{
+    esp_err_t err;
+    nvs_handle_t nvs;
+
+    /* Leases are not stored */
+    portmap_rec_count = 0;
+    err = portmap_rec_reserve(portmap_count - portmap_leases);
+    if (err != ESP_OK) {
+        return err;
+    }
+    for (u32_t i = 0; i < portmap_slots; i++) {
+        struct portmap_table_entry *e = &portmap_tab[i];
+        if (e->state == SLOT_VALID && !(e->flags & PORTMAP_LEASE)) {
+            e->rec = portmap_rec_count++;
+            portmap_rec_of(&portmap_recs[e->rec], e);
+        }
+    }
+
+    err = nvs_open(PARAM_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err == ESP_OK) {
+        /* The records first, then the header, up to the first blob that
+         * was not there */
+        for (u32_t chunk = 0; err == ESP_OK; chunk++) {
+            err = portmap_store_chunk(nvs, chunk);
+        }
+        if (err == ESP_ERR_NVS_NOT_FOUND) {
+            err = portmap_store_hdr(nvs);
+        }
+        if (err == ESP_OK) {
+            err = nvs_commit(nvs);
+            if (err == ESP_OK) {
+                ESP_LOGI(TAG, "New portmap table stored (%lu rules).", (unsigned long)portmap_rec_count);
+            }
+        }
+        nvs_close(nvs);
+    }
+    return err;
+}
+
+/* Loads the blobs of version 4, in the order stored */
+static esp_err_t portmap_load_chunks(nvs_handle_t nvs)
+{
+    esp_err_t err = ESP_OK;
+    bool moved = false;     /* not as portmap_rec_del() left them */
+
+    for (u32_t chunk = 0; err == ESP_OK; chunk++) {
+        char key[PORTMAP_NVS_KEY_LEN];
+        size_t len;
+
+        portmap_chunk_key(key, chunk);
+        err = nvs_get_blob(nvs, key, NULL, &len);
+        if (err == ESP_ERR_NVS_NOT_FOUND) {
+            err = ESP_OK;
+            break;
+        }
+        if (err == ESP_OK && (len == 0 || len % sizeof(struct portmap_nvs_rec) != 0 ||
+                              len > PORTMAP_NVS_CHUNK * sizeof(struct portmap_nvs_rec))) {
+            err = ESP_ERR_NVS_INVALID_LENGTH;
+        }
+        if (err == ESP_OK) {
+            err = portmap_rec_reserve(PORTMAP_NVS_CHUNK);
+        }
+        if (err == ESP_OK) {
+            moved |= portmap_rec_count != chunk * PORTMAP_NVS_CHUNK;
+            err = nvs_get_blob(nvs, key, &portmap_recs[portmap_rec_count], &len);
+        }
+        for (u32_t i = 0; err == ESP_OK && i < len / sizeof(struct portmap_nvs_rec); i++) {
+            struct portmap_nvs_rec *rec = &portmap_recs[portmap_rec_count];
+            rec->flags &= ~PORTMAP_LEASE;
+            moved |= portmap_lookup(rec->proto, rec->mport, NULL) != NULL;
+            err = portmap_insert(rec->proto, rec->mport, rec->mport_last, rec->daddr, rec->dport, rec->flags);
+            if (err == ESP_OK) {
+                portmap_lookup(rec->proto, rec->mport, NULL)->rec = portmap_rec_count++;
+            }
+        }
+    }
+    /* A short blob in between or a rule twice, from a change cut short */
+    if (err == ESP_OK && moved) {
+        err = portmap_store();
+    }
+    return err;
+}
+
+static esp_err_t portmap_load(nvs_handle_t nvs, size_t len)
+{
+    esp_err_t err;
+    u8_t *blob = malloc(len);
+    if (blob == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    err = nvs_get_blob(nvs, PORTMAP_NVS_KEY, blob, &len);
+    if (err == ESP_OK) {
+        struct portmap_nvs_hdr *hdr = (struct portmap_nvs_hdr *)blob;
+        if (len < sizeof(struct portmap_nvs_hdr) ||
+            !((hdr->version == 1 && hdr->rec_len == PORTMAP_NVS_REC_LEN_V1) ||
+              (hdr->version == 2 && hdr->rec_len == PORTMAP_NVS_REC_LEN_V2) ||
+              (hdr->version == 3 && hdr->rec_len == sizeof(struct portmap_nvs_rec)) ||
+              (hdr->version == PORTMAP_NVS_VERSION && hdr->rec_len == sizeof(struct portmap_nvs_rec) &&
+               hdr->count == 0)) ||
+            len != sizeof(struct portmap_nvs_hdr) + hdr->count * hdr->rec_len) {
+            err = ESP_ERR_NVS_INVALID_LENGTH;
+        } else if (hdr->version == PORTMAP_NVS_VERSION) {
+            portmap_rec_hdr = true;
+            err = portmap_load_chunks(nvs);
+        } else {
+            err = portmap_reserve(hdr->count);
+            u8_t *pos = (u8_t *)(hdr + 1);
+            for (u32_t i = 0; err == ESP_OK && i < hdr->count; i++, pos += hdr->rec_len) {
+                struct portmap_nvs_rec *rec = (struct portmap_nvs_rec *)pos;
+                u16_t last = hdr->version == 1 ? rec->mport : rec->mport_last;
+                u8_t flags = hdr->version < 3 ? 0 : rec->flags & ~PORTMAP_LEASE;
+                err = portmap_insert(rec->proto, rec->mport, last, rec->daddr, rec->dport, flags);
+            }
+            /* Converted to the blobs of the current version */
+            if (err == ESP_OK) {
+                err = portmap_store();
+            }
+        }
+    }
+    free(blob);
+    return err;
+}
+
+/* Converts the fixed size table of older firmware to the compact format */
+static esp_err_t portmap_import_legacy(nvs_handle_t nvs)
+{
+    esp_err_t err;
+    size_t len;
+
+    err = nvs_get_blob(nvs, PORTMAP_NVS_LEGACY, NULL, &len);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (len == 0 || len % sizeof(struct portmap_legacy_entry) != 0) {
+        return ESP_ERR_NVS_INVALID_LENGTH;
+    }
+
+    struct portmap_legacy_entry *legacy = malloc(len);
+    if (legacy == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    err = nvs_get_blob(nvs, PORTMAP_NVS_LEGACY, legacy, &len);
+    for (size_t i = 0; err == ESP_OK && i < len / sizeof(struct portmap_legacy_entry); i++) {
+        if (legacy[i].valid) {
+            err = portmap_insert(legacy[i].proto, legacy[i].mport, legacy[i].mport, legacy[i].daddr, legacy[i].dport, 0);
+        }
+    }
+    free(legacy);
+
+    if (err == ESP_OK) {
+        err = portmap_store();
+    }
+    if (err == ESP_OK) {
+        nvs_erase_key(nvs, PORTMAP_NVS_LEGACY);
+        nvs_commit(nvs);
+        ESP_LOGI(TAG, "Converted %lu legacy portmap entries.", (unsigned long)portmap_count);
+    }
+    return err;
+}
+
+esp_err_t get_portmap_tab() {
+    esp_err_t err;
+    nvs_handle_t nvs;
+    size_t len;
+
+    err = nvs_open(PARAM_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err != ESP_OK) {
+        return err;
+    }
+    nvs_get_u32(nvs, PORTMAP_NVS_DMZ, &dmz_host);
+    portmap_rec_hdr = false;
+    err = nvs_get_blob(nvs, PORTMAP_NVS_KEY, NULL, &len);
+    if (err == ESP_OK) {
+        err = portmap_load(nvs, len);
+    } else if (err == ESP_ERR_NVS_NOT_FOUND) {
+        err = portmap_import_legacy(nvs);
+    }
+    nvs_close(nvs);
+
+    if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
+        ESP_LOGE(TAG, "Cannot load portmap table (%s)", esp_err_to_name(err));
+    }
+    return err;
+}
+/* The external range of a rule must not overlap another rule, nor may its
+ * internal range, otherwise replies could not be mapped back. The rules
+ * starting within the ranges are looked up port by port, unless the
+ * ranges are longer than the table. */
+static bool portmap_overlaps(u8_t proto, u16_t mport, u16_t mport_last, u32_t daddr, u16_t dport)
+{
+    u32_t width = mport_last - mport;
+    const struct portmap_range *r;
+
+    /* A rule of more than one port holding the first port, other than
+     * the one replaced */
+    r = portmap_wide_find_ext(proto, mport);
+    if (r != NULL && r->mport != mport) {
+        return true;
+    }
+    r = portmap_wide_find_int(proto, daddr, dport);
+    if (r != NULL && r->mport != mport) {
+        return true;
+    }
+
+    if (width < portmap_count) {
+        const struct portmap_table_entry *skip = portmap_lookup(proto, mport, NULL);
+        for (u32_t i = 0; i <= width; i++) {
+            if ((i > 0 && portmap_lookup(proto, mport + i, NULL) != NULL) ||
+                portmap_lookup_int(proto, daddr, dport + i, skip) != NULL) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    u32_t dport_last = dport + width;
+    for (u32_t i = 0; i < portmap_slots; i++) {
+        struct portmap_table_entry *e = &portmap_tab[i];
+        if (e->state != SLOT_VALID || e->proto != proto || e->mport == mport) {
+            continue;
+        }
+        if (mport <= e->mport_last && e->mport <= mport_last) {
+            return true;
+        }
+        if (e->daddr == daddr && dport <= e->dport + (e->mport_last - e->mport) && e->dport <= dport_last) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Finds the rule whose external range holds port: the one starting there
+ * by the hash table, else one of more than one port */
+static bool portmap_find_ext(u8_t proto, u16_t port, u32_t *daddr, u16_t *dport, u8_t *flags)
+{
+    if (!portmap_live) {
+        return false;
+    }
+    const struct portmap_table_entry *e = portmap_lookup(proto, port, NULL);
+    if (e != NULL) {
+        *daddr = e->daddr;
+        *dport = e->dport;
+        *flags = e->flags;
+        return true;
+    }
+    const struct portmap_range *r = portmap_wide_find_ext(proto, port);
+    if (r == NULL) {
+        return false;
+    }
+    *daddr = r->daddr;
+    *dport = r->dport + (port - r->mport);
+    *flags = r->flags;
+    return true;
+}
+
+bool portmap_match_ext(u8_t proto, u16_t port, u32_t *daddr, u16_t *dport)
+{
+    u8_t flags;
+    return portmap_find_ext(proto, port, daddr, dport, &flags);
+}
+
+bool portmap_match_hairpin(u8_t proto, u16_t port, u32_t *daddr, u16_t *dport)
+{
+    u8_t flags;
+    return portmap_find_ext(proto, port, daddr, dport, &flags) && (flags & PORTMAP_HAIRPIN);
+}
+
+bool portmap_match_int(u8_t proto, u32_t saddr, u16_t sport, u16_t *mport)
+{
+    if (!portmap_live) {
+        return false;
+    }
+    const struct portmap_table_entry *e = portmap_lookup_int(proto, saddr, sport, NULL);
+    if (e != NULL) {
+        *mport = e->mport;
+        return true;
+    }
+    const struct portmap_range *r = portmap_wide_find_int(proto, saddr, sport);
+    if (r == NULL) {
+        return false;
+    }
+    *mport = r->mport + (sport - r->dport);
+    return true;
+}
+
+struct dmz_call {
+    struct tcpip_api_call_data call;
+    u32_t host;
+};
+
+static err_t dmz_swap(struct tcpip_api_call_data *call)
+{
+    dmz_host = ((struct dmz_call *)call)->host;
+    /* Cached flows may still lead to the old host */
+    flow_cache_flush();
+    return ERR_OK;
+}
+
+esp_err_t set_dmz_host(uint32_t ip) {
+    esp_err_t err;
+    nvs_handle_t nvs;
+    struct dmz_call msg = { .host = ip };
+
+    tcpip_api_call(dmz_swap, &msg.call);
+
+    err = nvs_open(PARAM_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = nvs_set_u32(nvs, PORTMAP_NVS_DMZ, ip);
+    if (err == ESP_OK) {
+        err = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+    return err;
+}
+
+uint32_t get_dmz_host(void) {
+    return dmz_host;
+}
+
+/* Rules already stored are always loaded, the limit only applies to new ones */
+void set_portmap_max(uint16_t max) {
+    portmap_max = max;
+}
+
+static err_t portmap_live_set(struct tcpip_api_call_data *call)
+{
+    portmap_live = ((struct portmap_live_call *)call)->live;
+    /* Cached flows may have been translated otherwise */
+    flow_cache_flush();
+    return ERR_OK;
+}
+
+/* Hands the rules (or none) to the forwarding path */
+static void portmap_set_live(bool live)
+{
+    struct portmap_live_call msg = { .live = live };
+
+    pthread_mutex_lock(&portmap_lock);
+    portmap_applied = live;
+    tcpip_api_call(portmap_live_set, &msg.call);
+    pthread_mutex_unlock(&portmap_lock);
+}
+
+esp_err_t apply_portmap_tab() {
+    portmap_set_live(true);
+    return ESP_OK;
+}
+
+esp_err_t delete_portmap_tab() {
+    portmap_set_live(false);
+    return ESP_OK;
+}
+
+/* Called when the uplink got its address, with the address it had before.
+ * The forwarding path matches the rules against my_ip at packet time, so
+ * a changed address is picked up with the next packet and no rule has to
+ * be removed and added again. */
+esp_err_t reconcile_portmap_tab(uint32_t old_ip) {
+    if (!portmap_applied) {
+        return apply_portmap_tab();
+    }
+    if (old_ip == my_ip) {
+        ESP_LOGI(TAG, "Uplink address unchanged, portmap rules kept");
+    } else {
+        ESP_LOGI(TAG, "Uplink address changed, %lu portmap rules moved along", (unsigned long)portmap_count);
+    }
+    return ESP_OK;
+}
+
+void print_portmap_tab() {
+    u32_t now = portmap_now();
+
+    pthread_mutex_lock(&portmap_lock);
+    for (u32_t i = 0; i < portmap_slots; i++) {
+        struct portmap_table_entry *e = &portmap_tab[i];
+        if (e->state == SLOT_VALID) {
+            printf ("%s", e->proto == PROTO_TCP?"TCP ":"UDP ");
+            ip4_addr_t addr;
+            addr.addr = my_ip;
+            if (e->mport == e->mport_last) {
+                printf (IPSTR":%d -> ", IP2STR(&addr), e->mport);
+                addr.addr = e->daddr;
+                printf (IPSTR":%d", IP2STR(&addr), e->dport);
+            } else {
+                printf (IPSTR":%d-%d -> ", IP2STR(&addr), e->mport, e->mport_last);
+                addr.addr = e->daddr;
+                printf (IPSTR":%d-%d", IP2STR(&addr), e->dport, e->dport + (e->mport_last - e->mport));
+            }
+            printf ("%s", (e->flags & PORTMAP_HAIRPIN) ? " (hairpin)" : "");
+            if (e->flags & PORTMAP_LEASE) {
+                printf (" (lease %lus)", (unsigned long)(e->expires > now ? e->expires - now : 0));
+            }
+            printf ("\n");
+        }
+    }
+    pthread_mutex_unlock(&portmap_lock);
+    if (dmz_host != 0) {
+        ip4_addr_t addr;
+        addr.addr = dmz_host;
+        printf ("DMZ host: "IPSTR"\n", IP2STR(&addr));
+    }
+}
+
+esp_err_t add_portmap_range(u8_t proto, u16_t mport, u16_t mport_last, u32_t daddr, u16_t dport, u8_t flags) {
+    esp_err_t err;
+
+    if (mport_last < mport || dport + (u32_t)(mport_last - mport) > 0xffff) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    pthread_mutex_lock(&portmap_lock);
+    if (portmap_overlaps(proto, mport, mport_last, daddr, dport)) {
+        ESP_LOGW(TAG, "Portmap %d-%d overlaps an existing rule", mport, mport_last);
+        err = ESP_ERR_INVALID_STATE;
+    } else if (portmap_count >= portmap_max && portmap_lookup(proto, mport, NULL) == NULL) {
+        ESP_LOGW(TAG, "Portmap table full (%lu rules)", (unsigned long)portmap_max);
+        err = ESP_ERR_NO_MEM;
+    } else {
+        /* A stored rule replaces a lease on the same port */
+        struct portmap_table_entry *e = portmap_lookup(proto, mport, NULL);
+        bool stored = e != NULL && !(e->flags & PORTMAP_LEASE);
+        struct portmap_call msg = {
+            .proto = proto, .mport = mport, .mport_last = mport_last, .daddr = daddr, .dport = dport,
+            .flags = flags & ~PORTMAP_LEASE,
+        };
+        err = stored ? ESP_OK : portmap_rec_reserve(1);
+        if (err == ESP_OK) {
+            err = portmap_change(portmap_insert_call, &msg);
+        }
+        if (err == ESP_OK) {
+            e = portmap_lookup(proto, mport, NULL);
+            if (stored) {
+                portmap_rec_set(e);
+            } else {
+                portmap_rec_add(e);
+            }
+        }
+    }
+    pthread_mutex_unlock(&portmap_lock);
+    return err;
+}
+
+esp_err_t add_portmap(u8_t proto, u16_t mport, u32_t daddr, u16_t dport) {
+    return add_portmap_range(proto, mport, mport, daddr, dport, 0);
+}
+
+/* Deletes the rule whose external range starts at mport */
+esp_err_t del_portmap(u8_t proto, u16_t mport) {
+    esp_err_t err = ESP_ERR_NOT_FOUND;
+
+    pthread_mutex_lock(&portmap_lock);
+    struct portmap_table_entry *e = portmap_lookup(proto, mport, NULL);
+
+    if (e != NULL) {
+        bool leased = e->flags & PORTMAP_LEASE;
+        u32_t rec = e->rec;
+        struct portmap_call msg = { .proto = proto, .mport = mport };
+        err = portmap_change(portmap_remove_call, &msg);
+        if (!leased) {
+            portmap_rec_del(rec);
+        }
+    }
+    pthread_mutex_unlock(&portmap_lock);
+    return err;
+}
+
+/* The last port of the rule whose external range holds port, 0 if port
+ * is in no rule */
+static u16_t portmap_taken_until(u8_t proto, u16_t port)
+{
+    const struct portmap_table_entry *e = portmap_lookup(proto, port, NULL);
+    if (e != NULL) {
+        return e->mport_last;
+    }
+    const struct portmap_range *r = portmap_wide_find_ext(proto, port);
+    return r != NULL ? r->mport_last : 0;
+}
+
+/* Is port of proto free for a lease, in the lease range and in no rule? */
+static bool portmap_lease_port_free(u8_t proto, u16_t port)
+{
+    return port >= PORTMAP_LEASE_PORT_MIN && port <= PORTMAP_LEASE_PORT_MAX && portmap_taken_until(proto, port) == 0;
+}
+
+/* Looks from port on, past one rule at a time */
+uint16_t portmap_lease_port(u8_t proto, u16_t port) {
+    u16_t found = 0;
+
+    if (port < PORTMAP_LEASE_PORT_MIN || port > PORTMAP_LEASE_PORT_MAX) {
+        port = PORTMAP_LEASE_PORT_MIN;
+    }
+    pthread_mutex_lock(&portmap_lock);
+    for (u32_t n = 0; n <= PORTMAP_LEASE_PORT_MAX - PORTMAP_LEASE_PORT_MIN;) {
+        u16_t last = portmap_taken_until(proto, port);
+        if (last == 0) {
+            found = port;
+            break;
+        }
+        u32_t skip = (last < PORTMAP_LEASE_PORT_MAX ? last : PORTMAP_LEASE_PORT_MAX) - port + 1;
+        n += skip;
+        port = port + skip > PORTMAP_LEASE_PORT_MAX ? PORTMAP_LEASE_PORT_MIN : port + skip;
+    }
+    pthread_mutex_unlock(&portmap_lock);
+    return found;
+}
+
+esp_err_t add_portmap_lease(u8_t proto, u16_t mport, u32_t daddr, u16_t dport, u32_t lifetime) {
+    esp_err_t err = ESP_OK;
+
+    if (mport < PORTMAP_LEASE_PORT_MIN || mport > PORTMAP_LEASE_PORT_MAX || dport == 0 || lifetime == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    pthread_mutex_lock(&portmap_lock);
+    struct portmap_table_entry *e = portmap_lookup(proto, mport, NULL);
+    if (e != NULL && e->daddr == daddr && e->dport == dport && (e->flags & PORTMAP_LEASE)) {
+        /* Renewal, the forwarding path is not concerned */
+        e->expires = portmap_now() + lifetime;
+        pthread_mutex_unlock(&portmap_lock);
+        return ESP_OK;
+    }
+
+    if ((e != NULL && (e->daddr != daddr || !(e->flags & PORTMAP_LEASE))) ||
+        (e == NULL && !portmap_lease_port_free(proto, mport)) ||
+        portmap_overlaps(proto, mport, mport, daddr, dport)) {
+        err = ESP_ERR_INVALID_STATE;
+    } else if (e == NULL && (portmap_leases >= PORTMAP_LEASE_MAX || portmap_count >= portmap_max)) {
+        err = ESP_ERR_NO_MEM;
+    } else {
+        struct portmap_call msg = {
+            .proto = proto, .mport = mport, .mport_last = mport, .daddr = daddr, .dport = dport,
+            .flags = PORTMAP_LEASE,
+        };
+        err = portmap_change(portmap_insert_call, &msg);
+    }
+    if (err == ESP_OK) {
+        portmap_lookup(proto, mport, NULL)->expires = portmap_now() + lifetime;
+    }
+    pthread_mutex_unlock(&portmap_lock);
+    return err;
+}
+
+/* Removes the leases of daddr (all if 0) for proto (both if 0), or only
+ * those that ran out if expired is set */
+static void portmap_drop_leases(u8_t proto, u32_t daddr, bool expired)
+{
+    u32_t now = portmap_now();
+
+    pthread_mutex_lock(&portmap_lock);
+    for (u32_t i = 0; i < portmap_slots && portmap_leases > 0; i++) {
+        struct portmap_table_entry *e = &portmap_tab[i];
+        if (e->state != SLOT_VALID || !(e->flags & PORTMAP_LEASE) ||
+            (proto != 0 && e->proto != proto) || (daddr != 0 && e->daddr != daddr) ||
+            (expired && (s32_t)(e->expires - now) > 0)) {
+            continue;
+        }
+        ESP_LOGI(TAG, "Lease of %s port %d %s", e->proto == PROTO_TCP ? "TCP" : "UDP", e->mport,
+            expired ? "expired" : "released");
+        struct portmap_call msg = { .proto = e->proto, .mport = e->mport };
+        portmap_change(portmap_remove_call, &msg);
+        /* The table was cleared with the last rule */
+        if (portmap_count == 0) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&portmap_lock);
+}
+
+void del_portmap_leases(u8_t proto, u32_t daddr) {
+    portmap_drop_leases(proto, daddr, false);
+}
+
+void expire_portmap_leases(void) {
+    portmap_drop_leases(0, 0, true);
+}
+
+bool portmap_walk(uint32_t *pos, portmap_rule_t *rule) {
+    u32_t now = portmap_now();
+    bool found = false;
+
+    pthread_mutex_lock(&portmap_lock);
+    for (; *pos < portmap_slots; (*pos)++) {
+        struct portmap_table_entry *e = &portmap_tab[*pos];
+        if (e->state == SLOT_VALID) {
+            rule->proto = e->proto;
+            rule->flags = e->flags;
+            rule->mport = e->mport;
+            rule->mport_last = e->mport_last;
+            rule->daddr = e->daddr;
+            rule->dport = e->dport;
+            rule->lease = 0;
+            if (e->flags & PORTMAP_LEASE) {
+                rule->lease = (s32_t)(e->expires - now) > 0 ? e->expires - now : 1;
+            }
+            (*pos)++;
+            found = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&portmap_lock);
+    return found;
+}
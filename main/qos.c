@@ -0,0 +1,414 @@
+/* QoS classes of the esp32_nat_router
+
+   Up to QOS_RULE_MAX rules put forwarded traffic into one of the four WMM
+   access categories, by AP client, protocol and port. The packet hook
+   (router_hooks.c) classifies a flow on its first packet, the flow cache
+   remembers the class for the packets that follow, and the DSCP of each
+   packet is set to the one of its class (EF for voice, AF41 for video,
+   CS1 for background, 0 for best effort), which the Wi-Fi driver and the
+   next hops map to their access category. Packets no rule matches keep
+   their DSCP.
+
+   In front of the Wi-Fi driver of both interfaces sits one queue per
+   class. Frames go straight to the driver as long as it takes them. Once
+   it runs out of TX buffers (ERR_MEM), frames wait in their class queue
+   and are handed over in strict priority order, voice first, as soon as
+   the driver has room again, checked on every new frame and every tick.
+   A full queue drops the frame. The class of a frame is taken from its
+   DSCP (RFC 8325), ARP counts as voice.
+
+   Rules are installed in the tcpip thread with tcpip_api_call(), which
+   also owns the queues, the console and the web server change rules from
+   their own tasks under qos_lock.
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include "esp_log.h"
+#include "nvs.h"
+
+#include "lwip/opt.h"
+#include "lwip/def.h"
+#include "lwip/pbuf.h"
+#include "lwip/netif.h"
+#include "lwip/timeouts.h"
+#include "lwip/prot/ethernet.h"
+#include "lwip/prot/ip4.h"
+#include "lwip/prot/ip6.h"
+#include "lwip/prot/udp.h"
+#include "lwip/priv/tcpip_priv.h"
+
+#include "router_globals.h"
+#include "nat.h"
+
+static const char *TAG = "qos";
+
+#define QOS_NVS_KEY     "qos"
+#define QOS_QUEUE_LEN   6       /* frames per class and interface */
+#define QOS_RETRY_MS    10      /* one tick */
+#define QOS_IFS         2
+
+static const ROUTER_HOT_DATA u8_t qos_dscp[QOS_CLASSES] = { 8, 0, 34, 46 };
+static const char *const qos_names[QOS_CLASSES] = { "bk", "be", "vi", "vo" };
+
+struct qos_queue {
+    struct pbuf *p[QOS_QUEUE_LEN];
+    u8_t head;
+    u8_t count;
+};
+
+struct qos_if {
+    struct netif *netif;
+    netif_linkoutput_fn linkoutput;     /* the driver's */
+    struct qos_queue queue[QOS_CLASSES];
+    u32_t waiting;
+    bool retry;
+    qos_class_stats_t stats[QOS_CLASSES];
+};
+
+/* Stored per rule */
+struct qos_nvs_rec {
+    u32_t ip;
+    u16_t port;
+    u16_t port_last;
+    u8_t proto;
+    u8_t cls;
+} __attribute__((packed));
+
+static struct qos_if qos_ifs[QOS_IFS];
+static qos_rule_t qos_rules[QOS_RULE_MAX];
+static u32_t qos_rule_count;
+static u32_t qos_marked[QOS_CLASSES];
+static pthread_mutex_t qos_lock = PTHREAD_MUTEX_INITIALIZER;
+
+const char *qos_class_str(uint8_t cls)
+{
+    return cls < QOS_CLASSES ? qos_names[cls] : "-";
+}
+
+int qos_parse_class(const char *s)
+{
+    for (int i = 0; i < QOS_CLASSES; i++) {
+        if (strcasecmp(s, qos_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+u8_t qos_classify(u8_t proto, u32_t client, const void *l4hdr)
+{
+    u16_t cport = 0, rport = 0;
+
+    if (qos_rule_count == 0) {
+        return QOS_NONE;
+    }
+    if (l4hdr != NULL) {
+        /* Either port may be the client's, the rule matches both */
+        const struct udp_hdr *udphdr = (const struct udp_hdr *)l4hdr;
+        cport = lwip_ntohs(udphdr->src);
+        rport = lwip_ntohs(udphdr->dest);
+    }
+    for (u32_t i = 0; i < qos_rule_count; i++) {
+        const qos_rule_t *r = &qos_rules[i];
+        if ((r->ip == 0 || r->ip == client) && (r->proto == 0 || r->proto == proto) &&
+            (r->port == 0 || (l4hdr != NULL && ((cport >= r->port && cport <= r->port_last) ||
+                                                (rport >= r->port && rport <= r->port_last))))) {
+            return r->cls;
+        }
+    }
+    return QOS_NONE;
+}
+
+ROUTER_HOT void qos_mark(struct ip_hdr *iphdr, u8_t cls)
+{
+    if (cls == QOS_NONE) {
+        return;
+    }
+    u8_t tos = (qos_dscp[cls] << 2) | (IPH_TOS(iphdr) & 0x03);
+    qos_marked[cls]++;
+    if (tos == IPH_TOS(iphdr)) {
+        return;
+    }
+    /* Version/IHL and TOS are one checksum word */
+    u16_t from, to;
+    memcpy(&from, iphdr, 2);
+    IPH_TOS_SET(iphdr, tos);
+    memcpy(&to, iphdr, 2);
+    IPH_CHKSUM_SET(iphdr, chksum_adjust16(IPH_CHKSUM(iphdr), from, to));
+}
+
+/* Access category of an Ethernet frame by its DSCP, RFC 8325 */
+static ROUTER_HOT u8_t qos_frame_class(struct pbuf *p)
+{
+    const u8_t *f = (const u8_t *)p->payload;
+    u8_t dscp;
+
+    if (p->len < SIZEOF_ETH_HDR + 2) {
+        return QOS_BE;
+    }
+    u16_t type = (f[12] << 8) | f[13];
+    if (type == ETHTYPE_ARP) {
+        return QOS_VO;
+    } else if (type == ETHTYPE_IP) {
+        dscp = f[SIZEOF_ETH_HDR + 1] >> 2;
+    } else if (type == ETHTYPE_IPV6) {
+        dscp = ((f[SIZEOF_ETH_HDR] << 4) | (f[SIZEOF_ETH_HDR + 1] >> 4)) >> 2;
+    } else {
+        return QOS_BE;
+    }
+    if (dscp == 46 || dscp == 44 || dscp >= 48) {
+        return QOS_VO;
+    }
+    if (dscp >= 24 && dscp <= 40) {
+        return QOS_VI;
+    }
+    if (dscp == 8 || dscp == 1) {
+        return QOS_BK;
+    }
+    return QOS_BE;
+}
+
+static void qos_retry(void *arg);
+
+/* Hands waiting frames to the driver, highest class first, until it runs
+ * out of buffers again */
+static ROUTER_HOT void qos_drain(struct qos_if *qif)
+{
+    for (int cls = QOS_CLASSES - 1; cls >= 0 && qif->waiting > 0; ) {
+        struct qos_queue *q = &qif->queue[cls];
+        if (q->count == 0) {
+            cls--;
+            continue;
+        }
+        struct pbuf *p = q->p[q->head];
+        err_t err = qif->linkoutput(qif->netif, p);
+        if (err == ERR_MEM) {
+            break;
+        }
+        if (err != ERR_OK) {
+            qif->stats[cls].dropped++;
+        }
+        pbuf_free(p);
+        q->head = (q->head + 1) % QOS_QUEUE_LEN;
+        q->count--;
+        qif->stats[cls].depth--;
+        qif->waiting--;
+    }
+    if (qif->waiting > 0 && !qif->retry) {
+        qif->retry = true;
+        sys_timeout(QOS_RETRY_MS, qos_retry, qif);
+    }
+}
+
+static void qos_retry(void *arg)
+{
+    struct qos_if *qif = (struct qos_if *)arg;
+    qif->retry = false;
+    qos_drain(qif);
+}
+
+static ROUTER_HOT err_t qos_linkoutput(struct netif *netif, struct pbuf *p)
+{
+    struct qos_if *qif = &qos_ifs[0];
+    if (qif->netif != netif) {
+        qif = &qos_ifs[1];
+    }
+
+    if (qif->waiting == 0) {
+        err_t err = qif->linkoutput(netif, p);
+        if (err != ERR_MEM) {
+            return err;
+        }
+    }
+
+    /* The caller frees p when this returns, the queue keeps a reference,
+     * or a copy of a Wi-Fi driver's RX buffer (rxbuf.c) */
+    u8_t cls = qos_frame_class(p);
+    struct qos_queue *q = &qif->queue[cls];
+    qos_class_stats_t *st = &qif->stats[cls];
+    if (q->count == QOS_QUEUE_LEN || (p = rxbuf_keep(p)) == NULL) {
+        st->dropped++;
+        qos_drain(qif);
+        return ERR_MEM;
+    }
+    q->p[(q->head + q->count) % QOS_QUEUE_LEN] = p;
+    q->count++;
+    qif->waiting++;
+    st->queued++;
+    st->depth++;
+    st->high_water = LWIP_MAX(st->high_water, st->depth);
+    qos_drain(qif);
+    return ERR_OK;
+}
+
+/* Puts the queues in front of the driver of netif, before it is up */
+void qos_attach(struct netif *netif, int idx)
+{
+    struct qos_if *qif = &qos_ifs[idx];
+    qif->netif = netif;
+    qif->linkoutput = netif->linkoutput;
+    netif->linkoutput = qos_linkoutput;
+}
+
+struct qos_call {
+    struct tcpip_api_call_data call;
+    qos_rule_t rules[QOS_RULE_MAX];
+    u32_t count;
+    qos_class_stats_t stats[QOS_IFS][QOS_CLASSES];
+};
+
+static err_t qos_install(struct tcpip_api_call_data *call)
+{
+    struct qos_call *msg = (struct qos_call *)call;
+
+    memcpy(qos_rules, msg->rules, msg->count * sizeof(qos_rule_t));
+    qos_rule_count = msg->count;
+    /* Cached flows carry the class of the old rules */
+    flow_cache_flush();
+    return ERR_OK;
+}
+
+static err_t qos_read(struct tcpip_api_call_data *call)
+{
+    struct qos_call *msg = (struct qos_call *)call;
+
+    memcpy(msg->rules, qos_rules, qos_rule_count * sizeof(qos_rule_t));
+    msg->count = qos_rule_count;
+    for (int i = 0; i < QOS_IFS; i++) {
+        for (int cls = 0; cls < QOS_CLASSES; cls++) {
+            msg->stats[i][cls] = qos_ifs[i].stats[cls];
+            msg->stats[i][cls].marked = qos_marked[cls];
+        }
+    }
+    return ERR_OK;
+}
+
+int qos_get_rules(qos_rule_t *rules)
+{
+    struct qos_call msg;
+
+    tcpip_api_call(qos_read, &msg.call);
+    memcpy(rules, msg.rules, msg.count * sizeof(qos_rule_t));
+    return msg.count;
+}
+
+void qos_get_stats(qos_class_stats_t stats[2][QOS_CLASSES])
+{
+    struct qos_call msg;
+
+    tcpip_api_call(qos_read, &msg.call);
+    memcpy(stats, msg.stats, sizeof(msg.stats));
+}
+
+static esp_err_t qos_store(const qos_rule_t *rules, u32_t count)
+{
+    esp_err_t err;
+    nvs_handle_t nvs;
+    struct qos_nvs_rec recs[QOS_RULE_MAX];
+
+    for (u32_t i = 0; i < count; i++) {
+        recs[i].ip = rules[i].ip;
+        recs[i].port = rules[i].port;
+        recs[i].port_last = rules[i].port_last;
+        recs[i].proto = rules[i].proto;
+        recs[i].cls = rules[i].cls;
+    }
+
+    err = nvs_open(PARAM_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (count > 0) {
+        err = nvs_set_blob(nvs, QOS_NVS_KEY, recs, count * sizeof(struct qos_nvs_rec));
+    } else {
+        err = nvs_erase_key(nvs, QOS_NVS_KEY);
+    }
+    if (err == ESP_OK) {
+        err = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+    return err;
+}
+
+/* Loads the rules stored by add_qos_rule() */
+esp_err_t get_qos(void)
+{
+    esp_err_t err;
+    nvs_handle_t nvs;
+    struct qos_nvs_rec recs[QOS_RULE_MAX];
+    struct qos_call msg;
+    size_t len = sizeof(recs);
+
+    err = nvs_open(PARAM_NAMESPACE, NVS_READONLY, &nvs);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = nvs_get_blob(nvs, QOS_NVS_KEY, recs, &len);
+    nvs_close(nvs);
+    if (err != ESP_OK) {
+        return err;
+    }
+    msg.count = 0;
+    for (u32_t i = 0; i < len / sizeof(struct qos_nvs_rec); i++) {
+        if (recs[i].cls >= QOS_CLASSES) {
+            continue;
+        }
+        qos_rule_t *r = &msg.rules[msg.count++];
+        r->ip = recs[i].ip;
+        r->port = recs[i].port;
+        r->port_last = recs[i].port_last;
+        r->proto = recs[i].proto;
+        r->cls = recs[i].cls;
+    }
+    tcpip_api_call(qos_install, &msg.call);
+    ESP_LOGI(TAG, "%u QoS rules", (unsigned)msg.count);
+    return ESP_OK;
+}
+
+/* Appends a rule, the first one that matches a flow decides its class */
+esp_err_t add_qos_rule(const qos_rule_t *rule)
+{
+    struct qos_call msg;
+    esp_err_t err;
+
+    if (rule->cls >= QOS_CLASSES || rule->port_last < rule->port) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&qos_lock);
+    tcpip_api_call(qos_read, &msg.call);
+    if (msg.count == QOS_RULE_MAX) {
+        pthread_mutex_unlock(&qos_lock);
+        return ESP_ERR_NO_MEM;
+    }
+    msg.rules[msg.count++] = *rule;
+    tcpip_api_call(qos_install, &msg.call);
+    err = qos_store(msg.rules, msg.count);
+    pthread_mutex_unlock(&qos_lock);
+    return err;
+}
+
+/* Deletes the rule at index (from 0, as listed by qos_get_rules()) */
+esp_err_t del_qos_rule(int index)
+{
+    struct qos_call msg;
+    esp_err_t err;
+
+    pthread_mutex_lock(&qos_lock);
+    tcpip_api_call(qos_read, &msg.call);
+    if (index < 0 || index >= msg.count) {
+        pthread_mutex_unlock(&qos_lock);
+        return ESP_ERR_NOT_FOUND;
+    }
+    memmove(&msg.rules[index], &msg.rules[index + 1], (msg.count - index - 1) * sizeof(qos_rule_t));
+    msg.count--;
+    tcpip_api_call(qos_install, &msg.call);
+    err = qos_store(msg.rules, msg.count);
+    pthread_mutex_unlock(&qos_lock);
+    return err;
+}
@@ -0,0 +1,846 @@
+/* Packet hooks of the esp32_nat_router
+
+   router_ip4_input_hook() runs in the tcpip thread for every IPv4 packet
+   received on the AP or STA interface, before lwIP routes it. It does all
+   address translation of the router, lwIP's own NAPT is not used:
+
+   - packets from the uplink to my_ip get their destination rewritten to
+     the internal host, by a port forwarding rule (portmap.c) or by a NAPT
+     mapping (napt.c), and are handed back to lwIP, which forwards them to
+     the AP side as it would any other packet. What none of them takes
+     goes to the DMZ host, if one is set,
+   - packets of the AP clients that are routed out of the uplink get their
+     source rewritten to my_ip and are sent out on the STA interface right
+     here. What cannot be translated is dropped rather than forwarded with
+     a private source address. A packet too big for the uplink with DF set
+     is answered with a fragmentation needed before it is translated, so
+     the error quotes the header the client sent,
+   - ICMP errors about translated packets are translated along with the
+     header they quote. Pings and UDP to closed ports of my_ip, which lwIP
+     answers, are rate limited so a flood cannot keep the tcpip thread busy,
+   - AP clients connecting to a forwarded port of my_ip are looped back to
+     the internal host (hairpin NAT), if the rule allows it,
+   - TCP/UDP between the AP clients and the uplink is held to the clients'
+     rate limits (shape.c), gets the DSCP of its QoS class (qos.c) and
+     is counted per client (acct.c),
+   - new connections through the NAT have to pass the packet filter
+     (fw.c), napt.c checks those that get a mapping,
+   - in isolation mode, packets between AP clients are dropped (isolate.c).
+
+   The time each packet spends here is measured in CPU cycles and counted
+   in buckets, nat_stats shows the average, the maximum and the buckets.
+   With CONFIG_NAT_IRAM_HOT_PATH the functions of established flows run
+   from IRAM (ROUTER_HOT), which takes flash cache misses out of that time.
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <string.h>
+#include "esp_log.h"
+#include "esp_netif.h"
+#include "esp_netif_net_stack.h"
+#include "esp_cpu.h"
+#include "esp_rom_sys.h"
+
+#include "lwip/opt.h"
+#include "lwip/def.h"
+#include "lwip/pbuf.h"
+#include "lwip/sys.h"
+#include "lwip/netif.h"
+#include "lwip/ip4.h"
+#include "lwip/ip4_frag.h"
+#include "lwip/prot/ip4.h"
+#include "lwip/prot/tcp.h"
+#include "lwip/prot/udp.h"
+#include "lwip/prot/icmp.h"
+#include "lwip/icmp.h"
+#include "lwip/udp.h"
+#include "lwip/priv/tcp_priv.h"
+#include "lwip/priv/tcpip_priv.h"
+
+#include "router_globals.h"
+#include "router_hooks.h"
+#include "nat.h"
+
+static const char *TAG = "router_hooks";
+
+extern esp_netif_t* wifiAP;
+extern esp_netif_t* wifiSTA;
+
+static struct netif *ap_netif;
+static struct netif *sta_netif;
+
+static router_stats_t hook_stats;
+
+/* Time in the hook, in CPU cycles */
+static u64_t hook_cycles;
+static u32_t hook_cycles_max;
+static u32_t hook_ticks_per_us;
+
+/* MSS clamping of forwarded SYNs: 0 off, MSS_CLAMP_AUTO from the STA MTU,
+ * otherwise the largest MSS let through */
+static int mss_clamp = MSS_CLAMP_AUTO;
+
+/* Token bucket for the ICMP lwIP sends in answer to packets from the
+ * uplink (echo replies, port unreachables) and the errors the router sends
+ * itself (icmp_rate_ok()): icmp_rate per second and as many in a burst, 0
+ * for no limit. Tokens are counted in 1/1000. */
+static u32_t icmp_rate = ICMP_RATE_DEFAULT;
+static u32_t icmp_tokens;
+static u32_t icmp_last;
+
+void router_hooks_init(void)
+{
+    hook_ticks_per_us = esp_rom_get_cpu_ticks_per_us();
+    ap_netif = esp_netif_get_netif_impl(wifiAP);
+    sta_netif = esp_netif_get_netif_impl(wifiSTA);
+    qos_attach(sta_netif, 0);
+    qos_attach(ap_netif, 1);
+    pcap_attach(sta_netif, 0);
+    pcap_attach(ap_netif, 1);
+    isolate_attach(ap_netif);
+    rxbuf_attach(sta_netif, 0);
+    rxbuf_attach(ap_netif, 1);
+    ESP_LOGI(TAG, "Packet hooks attached to AP and STA interface");
+}
+
+void router_hooks_get_stats(router_stats_t *stats)
+{
+    *stats = hook_stats;
+    if (stats->timed != 0) {
+        stats->time_avg_ns = hook_cycles * 1000 / stats->timed / hook_ticks_per_us;
+    }
+    stats->time_max_us = hook_cycles_max / hook_ticks_per_us;
+}
+
+static err_t hook_time_clear(struct tcpip_api_call_data *call)
+{
+    hook_stats.timed = 0;
+    memset(hook_stats.time_hist, 0, sizeof(hook_stats.time_hist));
+    hook_cycles = 0;
+    hook_cycles_max = 0;
+    return ERR_OK;
+}
+
+/* Starts the hook timing over, before a measurement */
+void router_hooks_reset_time(void)
+{
+    struct tcpip_api_call_data call;
+    tcpip_api_call(hook_time_clear, &call);
+}
+
+void set_mss_clamp(int mss)
+{
+    mss_clamp = mss;
+}
+
+int get_mss_clamp(void)
+{
+    return mss_clamp;
+}
+
+void set_icmp_rate(int rate)
+{
+    icmp_rate = rate;
+}
+
+int get_icmp_rate(void)
+{
+    return icmp_rate;
+}
+
+bool icmp_rate_ok(void)
+{
+    u32_t rate = icmp_rate;
+    if (rate == 0) {
+        return true;
+    }
+    u32_t now = sys_now();
+    u32_t elapsed = LWIP_MIN(now - icmp_last, 1000);
+    icmp_last = now;
+    icmp_tokens = LWIP_MIN(icmp_tokens + elapsed * rate, rate * 1000);
+    if (icmp_tokens < 1000) {
+        hook_stats.icmp_limited++;
+        return false;
+    }
+    icmp_tokens -= 1000;
+    return true;
+}
+
+/* Lowers the MSS option of a TCP SYN to what fits the uplink */
+static ROUTER_HOT void tcp_mss_clamp(struct pbuf *p, u16_t hlen, struct tcp_hdr *tcphdr)
+{
+    int clamp = mss_clamp;
+    if (clamp == 0 || !(TCPH_FLAGS(tcphdr) & TCP_SYN)) {
+        return;
+    }
+    if (clamp == MSS_CLAMP_AUTO) {
+        if (sta_netif->mtu == 0) {
+            return;
+        }
+        clamp = sta_netif->mtu - IP_HLEN - TCP_HLEN;
+    }
+
+    u16_t optlen = TCPH_HDRLEN_BYTES(tcphdr);
+    if (optlen <= TCP_HLEN || p->len < hlen + optlen) {
+        return;
+    }
+    u8_t *opt = (u8_t *)tcphdr + TCP_HLEN;
+    optlen -= TCP_HLEN;
+
+    for (u16_t i = 0; i < optlen && opt[i] != 0; ) {
+        if (opt[i] == 1) {
+            i++;
+            continue;
+        }
+        if (i + 1 >= optlen || opt[i + 1] < 2 || i + opt[i + 1] > optlen) {
+            return;
+        }
+        if (opt[i] == 2 && opt[i + 1] == 4) {
+            u16_t mss = (opt[i + 2] << 8) | opt[i + 3];
+            if (mss > clamp) {
+                u16_t from, to;
+                u8_t *val = &opt[i + 2];
+                memcpy(&from, val, 2);
+                val[0] = clamp >> 8;
+                val[1] = clamp & 0xff;
+                memcpy(&to, val, 2);
+                /* Options start 32 bit aligned, an odd offset puts the
+                 * value across two checksum words */
+                if (i & 1) {
+                    from = (u16_t)((from << 8) | (from >> 8));
+                    to = (u16_t)((to << 8) | (to >> 8));
+                }
+                tcphdr->chksum = chksum_adjust16(tcphdr->chksum, from, to);
+                hook_stats.mss_clamped++;
+            }
+            return;
+        }
+        i += opt[i + 1];
+    }
+}
+
+ROUTER_HOT void nat_rewrite(struct ip_hdr *iphdr, u8_t proto, void *l4hdr, bool src, u32_t addr, u16_t port)
+{
+    struct udp_hdr *udphdr = (struct udp_hdr *)l4hdr;
+    u32_t old_addr = src ? iphdr->src.addr : iphdr->dest.addr;
+    u16_t old_port = src ? udphdr->src : udphdr->dest;
+
+    /* TCP and UDP have the ports at the same offsets */
+    if (proto == IP_PROTO_TCP) {
+        struct tcp_hdr *tcphdr = (struct tcp_hdr *)l4hdr;
+        tcphdr->chksum = chksum_adjust32(chksum_adjust16(tcphdr->chksum, old_port, port), old_addr, addr);
+    } else if (udphdr->chksum != 0) {
+        u16_t chksum = chksum_adjust32(chksum_adjust16(udphdr->chksum, old_port, port), old_addr, addr);
+        /* A computed UDP checksum of 0 is transmitted as all ones */
+        udphdr->chksum = chksum != 0 ? chksum : 0xffff;
+    }
+    IPH_CHKSUM_SET(iphdr, chksum_adjust32(IPH_CHKSUM(iphdr), old_addr, addr));
+
+    if (src) {
+        iphdr->src.addr = addr;
+        udphdr->src = port;
+    } else {
+        iphdr->dest.addr = addr;
+        udphdr->dest = port;
+    }
+}
+
+struct ip_hdr *icmp_quoted(struct icmp_echo_hdr *icmphdr, u16_t len, u16_t *qhlen)
+{
+    struct ip_hdr *q = (struct ip_hdr *)(icmphdr + 1);
+
+    if (len < sizeof(struct icmp_echo_hdr) + IP_HLEN) {
+        return NULL;
+    }
+    u16_t hl = IPH_HL_BYTES(q);
+    if (hl < IP_HLEN || len < sizeof(struct icmp_echo_hdr) + hl + 8 ||
+        (IPH_OFFSET(q) & PP_HTONS(IP_OFFMASK)) != 0) {
+        return NULL;
+    }
+    *qhlen = hl;
+    return q;
+}
+
+void nat_rewrite_quoted(struct ip_hdr *iphdr, struct icmp_echo_hdr *icmphdr, struct ip_hdr *q,
+                        u16_t qhlen, u16_t avail, bool src, u32_t addr, u16_t port)
+{
+    u8_t *l4 = (u8_t *)q + qhlen;
+    u8_t qproto = IPH_PROTO(q);
+    u32_t old_addr = src ? q->src.addr : q->dest.addr;
+    u16_t chksum = icmphdr->chksum;
+    u16_t old_port, old_l4, new_l4, old_ip, new_ip;
+
+    /* All fields are 16 bit aligned relative to the ICMP header, so every
+     * change is folded into the ICMP checksum as it is. The port is the
+     * echo id for a quoted echo request. */
+    u16_t port_off = qproto == IP_PROTO_ICMP ? 4 : (src ? 0 : 2);
+    u16_t chksum_off = qproto == IP_PROTO_UDP ? 6 : (qproto == IP_PROTO_TCP ? 16 : 2);
+
+    memcpy(&old_port, l4 + port_off, 2);
+    memcpy(l4 + port_off, &port, 2);
+    chksum = chksum_adjust16(chksum, old_port, port);
+
+    if (chksum_off + 2 <= avail) {
+        memcpy(&old_l4, l4 + chksum_off, 2);
+        if (qproto == IP_PROTO_ICMP) {
+            new_l4 = chksum_adjust16(old_l4, old_port, port);
+        } else if (qproto == IP_PROTO_UDP && old_l4 == 0) {
+            new_l4 = 0;
+        } else {
+            new_l4 = chksum_adjust32(chksum_adjust16(old_l4, old_port, port), old_addr, addr);
+            if (qproto == IP_PROTO_UDP && new_l4 == 0) {
+                new_l4 = 0xffff;
+            }
+        }
+        memcpy(l4 + chksum_off, &new_l4, 2);
+        chksum = chksum_adjust16(chksum, old_l4, new_l4);
+    }
+
+    old_ip = IPH_CHKSUM(q);
+    new_ip = chksum_adjust32(old_ip, old_addr, addr);
+    IPH_CHKSUM_SET(q, new_ip);
+    chksum = chksum_adjust32(chksum_adjust16(chksum, old_ip, new_ip), old_addr, addr);
+    if (src) {
+        q->src.addr = addr;
+    } else {
+        q->dest.addr = addr;
+    }
+    icmphdr->chksum = chksum;
+
+    /* The error itself goes the opposite way */
+    old_addr = src ? iphdr->dest.addr : iphdr->src.addr;
+    IPH_CHKSUM_SET(iphdr, chksum_adjust32(IPH_CHKSUM(iphdr), old_addr, addr));
+    if (src) {
+        iphdr->dest.addr = addr;
+    } else {
+        iphdr->src.addr = addr;
+    }
+}
+
+ROUTER_HOT void router_forward(struct pbuf *p, struct ip_hdr *iphdr, struct netif *outp)
+{
+    ip4_addr_t dest;
+    ip4_addr_copy(dest, iphdr->dest);
+
+    IPH_TTL_SET(iphdr, IPH_TTL(iphdr) - 1);
+    if (IPH_CHKSUM(iphdr) >= PP_HTONS(0xffffU - 0x100)) {
+        IPH_CHKSUM_SET(iphdr, (u16_t)(IPH_CHKSUM(iphdr) + PP_HTONS(0x100) + 1));
+    } else {
+        IPH_CHKSUM_SET(iphdr, (u16_t)(IPH_CHKSUM(iphdr) + PP_HTONS(0x100)));
+    }
+
+    if (outp->mtu && p->tot_len > outp->mtu) {
+        /* With DF set it was answered by router_too_big() before it was
+         * translated, unless it is an ICMP error, which gets none */
+#if IP_FRAG
+        if ((IPH_OFFSET(iphdr) & PP_NTOHS(IP_DF)) == 0) {
+            ip4_frag(p, outp, &dest);
+        }
+#endif
+    } else {
+        outp->output(outp, p, &dest);
+    }
+    pbuf_free(p);
+}
+
+/* A packet for outp that does not fit its MTU and must not be fragmented
+ * is dropped with a fragmentation needed to its sender, within the ICMP
+ * rate, as ip4_forward() would do. Returns true if it was. */
+static ROUTER_HOT bool router_too_big(struct pbuf *p, struct ip_hdr *iphdr, struct netif *outp)
+{
+    if (!outp->mtu || p->tot_len <= outp->mtu || (IPH_OFFSET(iphdr) & PP_HTONS(IP_DF)) == 0) {
+        return false;
+    }
+    if (icmp_rate_ok()) {
+        icmp_dest_unreach(p, ICMP_DUR_FRAG);
+    }
+    pbuf_free(p);
+    return true;
+}
+
+/* Flow cache
+
+   Remembers how the last packet of up to FLOW_CACHE_SLOTS TCP/UDP flows
+   was translated, so the packets that follow skip the route checks and
+   the portmap and NAPT lookups. It is direct mapped on a hash of the
+   5-tuple as received, a colliding flow simply takes over the slot, and
+   at 24 bytes a slot it stays in internal DRAM. The QoS class of the flow
+   is kept along, rule changes flush the cache as well. Portmap results are
+   dropped by flow_cache_flush() whenever the rules change, or by
+   flow_cache_forget() for a rule of one port, NAPT results are checked
+   against their mapping on every hit. */
+#define FLOW_CACHE_BITS     8
+#define FLOW_CACHE_SLOTS    (1 << FLOW_CACHE_BITS)
+
+#define FLOW_PORTMAP_IN     1
+#define FLOW_PORTMAP_OUT    2
+#define FLOW_NAPT_IN        3
+#define FLOW_NAPT_OUT       4
+
+struct flow_cache_slot {
+    u32_t saddr;
+    u32_t daddr;
+    u32_t ports;    /* source and destination port as in the packet */
+    u32_t addr;     /* portmap: internal host */
+    u16_t port;     /* portmap: new port, network byte order */
+    u16_t flow;     /* NAPT mapping */
+    u8_t proto;     /* 0 for a free slot */
+    u8_t kind;
+    u8_t qos;       /* QoS class, QOS_NONE if no rule */
+};
+
+static struct flow_cache_slot flow_cache[FLOW_CACHE_SLOTS];
+
+static inline ROUTER_HOT struct flow_cache_slot *flow_cache_slot(u8_t proto, u32_t saddr, u32_t daddr, u32_t ports)
+{
+    u32_t h = saddr ^ (daddr * 2654435761u) ^ ports ^ proto;
+    h ^= h >> 16;
+    return &flow_cache[(h * 2654435761u) >> (32 - FLOW_CACHE_BITS)];
+}
+
+static inline ROUTER_HOT bool flow_cache_match(const struct flow_cache_slot *fc, u8_t proto, u32_t saddr, u32_t daddr, u32_t ports)
+{
+    return fc->saddr == saddr && fc->daddr == daddr && fc->ports == ports && fc->proto == proto;
+}
+
+static void flow_cache_set(struct flow_cache_slot *fc, u8_t proto, u32_t saddr, u32_t daddr, u32_t ports, u8_t kind)
+{
+    fc->saddr = saddr;
+    fc->daddr = daddr;
+    fc->ports = ports;
+    fc->proto = proto;
+    fc->kind = kind;
+    hook_stats.flow_misses++;
+}
+
+void flow_cache_flush(void)
+{
+    memset(flow_cache, 0, sizeof(flow_cache));
+}
+
+/* Drops only the flows a portmap rule of one port, mport on the uplink
+ * to daddr:dport inside, may translate: those to mport and those from
+ * the internal port. The others stay cached. */
+void flow_cache_forget(u8_t proto, u16_t mport, u32_t daddr, u16_t dport)
+{
+    u16_t m = lwip_htons(mport), d = lwip_htons(dport);
+
+    for (int i = 0; i < FLOW_CACHE_SLOTS; i++) {
+        struct flow_cache_slot *fc = &flow_cache[i];
+        u16_t ports[2];     /* source and destination, as in the packet */
+
+        memcpy(ports, &fc->ports, sizeof(ports));
+        if (fc->proto == proto && (ports[1] == m || (fc->saddr == daddr && ports[0] == d))) {
+            fc->proto = 0;
+        }
+    }
+}
+
+/* Uplink -> internal host. Returns 1 if translated, 0 if no rule takes
+ * the packet and -1 if the packet filter blocks it. */
+static int portmap_in(struct ip_hdr *iphdr, u8_t proto, void *l4hdr, struct flow_cache_slot *fc)
+{
+    u32_t daddr;
+    u16_t dport, port = lwip_ntohs(((struct udp_hdr *)l4hdr)->dest);
+
+    if (!portmap_match_ext(proto, port, &daddr, &dport)) {
+        return 0;
+    }
+    if (!fw_check(FW_IN, proto, daddr, iphdr->src.addr, port, true)) {
+        return -1;
+    }
+    fc->addr = daddr;
+    fc->port = lwip_htons(dport);
+    nat_rewrite(iphdr, proto, l4hdr, false, daddr, lwip_htons(dport));
+    return 1;
+}
+
+/* Internal host -> uplink */
+static bool portmap_out(struct pbuf *p, struct ip_hdr *iphdr, u8_t proto, void *l4hdr, struct flow_cache_slot *fc)
+{
+    u16_t mport;
+
+    if (!portmap_match_int(proto, iphdr->src.addr, lwip_ntohs(((struct udp_hdr *)l4hdr)->src), &mport)) {
+        return false;
+    }
+    fc->port = lwip_htons(mport);
+    nat_rewrite(iphdr, proto, l4hdr, true, my_ip, lwip_htons(mport));
+    router_forward(p, iphdr, sta_netif);
+    return true;
+}
+
+/* Hairpin NAT: an AP client connects to my_ip:mport of a rule that has
+ * PORTMAP_HAIRPIN set. The packet goes straight back out of the AP side to
+ * the internal host, with its source translated by NAPT onto my_ip, so the
+ * host answers through the router rather than to the client directly. */
+static bool hairpin_out(struct pbuf *p, struct ip_hdr *iphdr, u8_t proto, void *l4hdr)
+{
+    u32_t daddr;
+    u16_t dport, flow;
+
+    if (!portmap_match_hairpin(proto, lwip_ntohs(((struct udp_hdr *)l4hdr)->dest), &daddr, &dport)) {
+        return false;
+    }
+    nat_rewrite(iphdr, proto, l4hdr, false, daddr, lwip_htons(dport));
+    napt_output(p, iphdr, proto, l4hdr, ap_netif, &flow);
+    return true;
+}
+
+/* Reply of the internal host to a hairpinned connection: the NAPT mapping
+ * leads back to the client, the rule gives the port it connected to */
+static bool hairpin_in(struct pbuf *p, struct ip_hdr *iphdr, u8_t proto, void *l4hdr)
+{
+    u16_t mport, flow;
+
+    if (!portmap_match_int(proto, iphdr->src.addr, lwip_ntohs(((struct udp_hdr *)l4hdr)->src), &mport) ||
+        !napt_input(iphdr, proto, l4hdr, &flow)) {
+        return false;
+    }
+    nat_rewrite(iphdr, proto, l4hdr, true, my_ip, lwip_htons(mport));
+    router_forward(p, iphdr, ap_netif);
+    return true;
+}
+
+/* Whether lwIP itself has a socket on port, its traffic must not go to
+ * the DMZ host nor to a NAPT mapping */
+bool local_port_in_use(u8_t proto, u16_t port)
+{
+    if (proto == IP_PROTO_UDP) {
+        for (struct udp_pcb *pcb = udp_pcbs; pcb != NULL; pcb = pcb->next) {
+            if (pcb->local_port == port) {
+                return true;
+            }
+        }
+        return false;
+    }
+    for (struct tcp_pcb_listen *lpcb = tcp_listen_pcbs.listen_pcbs; lpcb != NULL; lpcb = lpcb->next) {
+        if (lpcb->local_port == port) {
+            return true;
+        }
+    }
+    for (struct tcp_pcb *pcb = tcp_active_pcbs; pcb != NULL; pcb = pcb->next) {
+        if (pcb->local_port == port) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Uplink -> DMZ host, for what no rule and no mapping takes */
+static bool dmz_in(struct ip_hdr *iphdr, u8_t proto, void *l4hdr, u16_t *flow)
+{
+    u32_t host = get_dmz_host();
+
+    if (host == 0 || local_port_in_use(proto, lwip_ntohs(((struct udp_hdr *)l4hdr)->dest))) {
+        return false;
+    }
+    return napt_input_dmz(iphdr, proto, l4hdr, host, flow);
+}
+
+static inline bool icmp_is_error(u8_t type)
+{
+    return type == ICMP_DUR || type == ICMP_TE || type == ICMP_PP;
+}
+
+/* ICMP error from the uplink about a packet that left from my_ip, of a
+ * NAPT mapping or a forwarded port */
+static void icmp_error_in(struct pbuf *p, struct ip_hdr *iphdr, u16_t hlen, struct icmp_echo_hdr *icmphdr)
+{
+    u16_t len = p->len - hlen;
+    u16_t qhlen, dport;
+    u32_t daddr;
+
+    if (napt_icmp_error_in(iphdr, icmphdr, len)) {
+        return;
+    }
+    struct ip_hdr *q = icmp_quoted(icmphdr, len, &qhlen);
+    if (q == NULL || q->src.addr != my_ip || (IPH_PROTO(q) != IP_PROTO_TCP && IPH_PROTO(q) != IP_PROTO_UDP)) {
+        return;
+    }
+    struct udp_hdr *udphdr = (struct udp_hdr *)((u8_t *)q + qhlen);
+    if (portmap_match_ext(IPH_PROTO(q), lwip_ntohs(udphdr->src), &daddr, &dport)) {
+        nat_rewrite_quoted(iphdr, icmphdr, q, qhlen, len - sizeof(struct icmp_echo_hdr) - qhlen,
+                           true, daddr, lwip_htons(dport));
+    }
+}
+
+/* ICMP error of an AP client about a packet it got from the uplink */
+static bool icmp_error_out(struct pbuf *p, struct ip_hdr *iphdr, u16_t hlen, struct icmp_echo_hdr *icmphdr)
+{
+    u16_t len = p->len - hlen;
+    u16_t qhlen, mport;
+
+    if (napt_icmp_error_out(iphdr, icmphdr, len)) {
+        return true;
+    }
+    struct ip_hdr *q = icmp_quoted(icmphdr, len, &qhlen);
+    if (q == NULL || (IPH_PROTO(q) != IP_PROTO_TCP && IPH_PROTO(q) != IP_PROTO_UDP)) {
+        return false;
+    }
+    struct udp_hdr *udphdr = (struct udp_hdr *)((u8_t *)q + qhlen);
+    if (!portmap_match_int(IPH_PROTO(q), q->dest.addr, lwip_ntohs(udphdr->dest), &mport)) {
+        return false;
+    }
+    nat_rewrite_quoted(iphdr, icmphdr, q, qhlen, len - sizeof(struct icmp_echo_hdr) - qhlen,
+                       false, my_ip, lwip_htons(mport));
+    return true;
+}
+
+/* ICMP from the uplink to my_ip */
+static int icmp_in(struct pbuf *p, struct ip_hdr *iphdr, u16_t hlen, struct icmp_echo_hdr *icmphdr)
+{
+    u8_t type = ICMPH_TYPE(icmphdr);
+    u16_t flow;
+
+    if (icmp_is_error(type)) {
+        icmp_error_in(p, iphdr, hlen, icmphdr);
+    } else if (!napt_input(iphdr, IP_PROTO_ICMP, icmphdr, &flow) && type == ICMP_ECHO && !icmp_rate_ok()) {
+        /* lwIP would answer it */
+        pbuf_free(p);
+        return 1;
+    }
+    return 0;
+}
+
+/* Minimum transport header the translation needs to see */
+static ROUTER_HOT u16_t l4_hlen(u8_t proto)
+{
+    switch (proto) {
+    case IP_PROTO_TCP:
+        return TCP_HLEN;
+    case IP_PROTO_UDP:
+        return UDP_HLEN;
+    case IP_PROTO_ICMP:
+        return sizeof(struct icmp_echo_hdr);
+    default:
+        return 0;
+    }
+}
+
+/* A packet from the uplink rewritten to an AP client, lwIP forwards it
+ * unless it is over the client's download limit, and it is accounted */
+static ROUTER_HOT int shape_in(struct pbuf *p, struct ip_hdr *iphdr, u16_t len)
+{
+    if (shape_ok(iphdr->dest.addr, len, SHAPE_DOWN)) {
+        acct_count(iphdr->dest.addr, len, SHAPE_DOWN);
+        return 0;
+    }
+    pbuf_free(p);
+    return 1;
+}
+
+/* The same for the first packet of a flow, which gets its QoS class */
+static int forward_in(struct pbuf *p, struct ip_hdr *iphdr, u8_t proto, void *l4hdr, u16_t len,
+                      struct flow_cache_slot *fc)
+{
+    fc->qos = qos_classify(proto, iphdr->dest.addr, l4hdr);
+    qos_mark(iphdr, fc->qos);
+    return shape_in(p, iphdr, len);
+}
+
+static ROUTER_HOT int router_ip4_input(struct pbuf *p, struct netif *inp)
+{
+    struct ip_hdr *iphdr = (struct ip_hdr *)p->payload;
+    struct flow_cache_slot *fc = NULL;
+    ip4_addr_t dest;
+    u32_t saddr, ports = 0;
+    u16_t flow;
+
+    if (p->len < IP_HLEN) {
+        return 0;
+    }
+
+    u16_t hlen = IPH_HL_BYTES(iphdr);
+    u16_t len = lwip_ntohs(IPH_LEN(iphdr));
+    u8_t proto = IPH_PROTO(iphdr);
+    bool first_frag = (IPH_OFFSET(iphdr) & PP_HTONS(IP_OFFMASK)) == 0;
+
+    /* Leave malformed packets to ip4_input(), it drops them */
+    if (hlen < IP_HLEN || len < hlen || len > p->tot_len || p->len < hlen) {
+        return 0;
+    }
+    bool l4_ok = first_frag && p->len >= hlen + l4_hlen(proto);
+    void *l4hdr = (u8_t *)p->payload + hlen;
+    ip4_addr_copy(dest, iphdr->dest);
+    saddr = iphdr->src.addr;
+    if (l4_ok && (proto == IP_PROTO_TCP || proto == IP_PROTO_UDP)) {
+        memcpy(&ports, l4hdr, sizeof(ports));
+        fc = flow_cache_slot(proto, saddr, dest.addr, ports);
+    }
+
+    if (inp == sta_netif) {
+        /* Only packets to the uplink address can belong to a mapping */
+        if (my_ip == 0 || dest.addr != my_ip || !l4_ok) {
+            return 0;
+        }
+        /* Drop link layer padding, as ip4_input() would */
+        if (len < p->tot_len) {
+            pbuf_realloc(p, len);
+        }
+        if (proto == IP_PROTO_ICMP) {
+            return icmp_in(p, iphdr, hlen, (struct icmp_echo_hdr *)l4hdr);
+        }
+        if (fc == NULL) {
+            return 0;
+        }
+        /* SYNs for the router itself get clamped as well, it does no harm */
+        if (proto == IP_PROTO_TCP) {
+            tcp_mss_clamp(p, hlen, (struct tcp_hdr *)l4hdr);
+        }
+
+        if (flow_cache_match(fc, proto, saddr, dest.addr, ports)) {
+            if (fc->kind == FLOW_PORTMAP_IN) {
+                nat_rewrite(iphdr, proto, l4hdr, false, fc->addr, fc->port);
+                qos_mark(iphdr, fc->qos);
+                hook_stats.flow_hits++;
+                return shape_in(p, iphdr, len);
+            }
+            if (fc->kind == FLOW_NAPT_IN && napt_input_flow(fc->flow, iphdr, proto, l4hdr)) {
+                qos_mark(iphdr, fc->qos);
+                hook_stats.flow_hits++;
+                return shape_in(p, iphdr, len);
+            }
+        }
+        /* Not addressed to us anymore after the translation, lwIP forwards
+         * it to the AP side */
+        int pm = portmap_in(iphdr, proto, l4hdr, fc);
+        if (pm > 0) {
+            flow_cache_set(fc, proto, saddr, dest.addr, ports, FLOW_PORTMAP_IN);
+            return forward_in(p, iphdr, proto, l4hdr, len, fc);
+        } else if (pm < 0) {
+            pbuf_free(p);
+            return 1;
+        } else if (napt_input(iphdr, proto, l4hdr, &flow) || dmz_in(iphdr, proto, l4hdr, &flow)) {
+            fc->flow = flow;
+            flow_cache_set(fc, proto, saddr, dest.addr, ports, FLOW_NAPT_IN);
+            return forward_in(p, iphdr, proto, l4hdr, len, fc);
+        } else if (proto == IP_PROTO_UDP && !local_port_in_use(proto, lwip_ntohs(((struct udp_hdr *)l4hdr)->dest)) &&
+                   !icmp_rate_ok()) {
+            /* lwIP would answer with a port unreachable */
+            pbuf_free(p);
+            return 1;
+        }
+        return 0;
+    }
+
+    /* AP side. A cached flow has passed the checks below before, only its
+     * TTL is new. The packet is charged and counted once the slot turned
+     * out to be valid, a stale one goes on to the checks below. */
+    if (fc != NULL && my_ip != 0 && IPH_TTL(iphdr) > 1 && flow_cache_match(fc, proto, saddr, dest.addr, ports)) {
+        if (len < p->tot_len) {
+            pbuf_realloc(p, len);
+        }
+        if (router_too_big(p, iphdr, sta_netif)) {
+            return 1;
+        }
+        bool hit = false;
+        if (fc->kind == FLOW_PORTMAP_OUT) {
+            nat_rewrite(iphdr, proto, l4hdr, true, my_ip, fc->port);
+            hit = true;
+        } else if (fc->kind == FLOW_NAPT_OUT) {
+            hit = napt_output_flow(fc->flow, iphdr, proto, l4hdr);
+        }
+        if (hit) {
+            if (!shape_ok(saddr, len, SHAPE_UP)) {
+                pbuf_free(p);
+                return 1;
+            }
+            acct_count(saddr, len, SHAPE_UP);
+            if (proto == IP_PROTO_TCP) {
+                tcp_mss_clamp(p, hlen, (struct tcp_hdr *)l4hdr);
+            }
+            qos_mark(iphdr, fc->qos);
+            router_forward(p, iphdr, sta_netif);
+            hook_stats.flow_hits++;
+            return 1;
+        }
+    }
+
+    /* TCP/UDP of the AP clients to my_ip, lwIP gets what is not hairpinned */
+    if (fc != NULL && dest.addr == my_ip && my_ip != 0 && IPH_TTL(iphdr) > 1) {
+        if (len < p->tot_len) {
+            pbuf_realloc(p, len);
+        }
+        return hairpin_out(p, iphdr, proto, l4hdr) || hairpin_in(p, iphdr, proto, l4hdr);
+    }
+
+    /* Between AP clients, unless isolation keeps them apart lwIP forwards it */
+    if (isolate_drop(saddr, dest.addr)) {
+        pbuf_free(p);
+        return 1;
+    }
+
+    /* Only what is routed out of the uplink gets translated */
+    if (dest.addr == my_ip || ip4_addr_ismulticast(&dest) || ip4_addr_isbroadcast(&dest, inp) ||
+        ip4_route(&dest) != sta_netif || ip4_addr_isbroadcast(&dest, sta_netif) || IPH_TTL(iphdr) <= 1) {
+        /* Local, not for the uplink or expiring, lwIP handles it as usual */
+        return 0;
+    }
+    if (len < p->tot_len) {
+        pbuf_realloc(p, len);
+    }
+    if (my_ip == 0 || !l4_ok) {
+        /* Cannot be translated, and must not leave with a private source */
+        pbuf_free(p);
+        return 1;
+    }
+    if (proto == IP_PROTO_TCP) {
+        tcp_mss_clamp(p, hlen, (struct tcp_hdr *)l4hdr);
+    }
+    if (proto == IP_PROTO_ICMP && icmp_is_error(ICMPH_TYPE((struct icmp_echo_hdr *)l4hdr))) {
+        if (icmp_error_out(p, iphdr, hlen, (struct icmp_echo_hdr *)l4hdr)) {
+            router_forward(p, iphdr, sta_netif);
+        } else {
+            pbuf_free(p);
+        }
+        return 1;
+    }
+    if (router_too_big(p, iphdr, sta_netif)) {
+        return 1;
+    }
+    if (!shape_ok(saddr, len, SHAPE_UP)) {
+        pbuf_free(p);
+        return 1;
+    }
+    acct_count(saddr, len, SHAPE_UP);
+    u8_t qos = qos_classify(proto, saddr, fc != NULL ? l4hdr : NULL);
+    qos_mark(iphdr, qos);
+    if (fc != NULL && portmap_out(p, iphdr, proto, l4hdr, fc)) {
+        fc->qos = qos;
+        flow_cache_set(fc, proto, saddr, dest.addr, ports, FLOW_PORTMAP_OUT);
+        return 1;
+    }
+    napt_output(p, iphdr, proto, l4hdr, sta_netif, &flow);
+    if (flow != NAPT_NO_FLOW) {
+        fc->flow = flow;
+        fc->qos = qos;
+        flow_cache_set(fc, proto, saddr, dest.addr, ports, FLOW_NAPT_OUT);
+    }
+    return 1;
+}
+
+ROUTER_HOT int router_ip4_input_hook(struct pbuf *p, struct netif *inp)
+{
+    if (inp == NULL || (inp != ap_netif && inp != sta_netif)) {
+        return 0;
+    }
+
+    u32_t start = esp_cpu_get_cycle_count();
+    int ret = router_ip4_input(p, inp);
+    u32_t cycles = esp_cpu_get_cycle_count() - start;
+
+    /* The tcpip thread may have moved to the other core meanwhile, whose
+     * counter has nothing to do with this one */
+    u32_t us = cycles / hook_ticks_per_us;
+    if (us < 100000) {
+        int b = us == 0 ? 0 : LWIP_MIN(32 - __builtin_clz(us), ROUTER_TIME_BUCKETS - 1);
+        hook_stats.time_hist[b]++;
+        hook_stats.timed++;
+        hook_cycles += cycles;
+        hook_cycles_max = LWIP_MAX(hook_cycles_max, cycles);
+    }
+    return ret;
+}
@@ -0,0 +1,36 @@
+/* lwIP hooks of the esp32_nat_router
+
+   This header is included into the lwIP build as its custom hook file
+   (ESP_IDF_LWIP_HOOK_FILENAME, see main/CMakeLists.txt). It is read
+   through lwipopts.h, before any lwIP type is declared, so it must only
+   contain forward declarations and macros.
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct pbuf;
+struct netif;
+
+/* Called by ip4_input() for every received IPv4 packet, before lwIP routes
+ * it. Returns non-zero if the packet was consumed. */
+int router_ip4_input_hook(struct pbuf *p, struct netif *inp);
+
+#define LWIP_HOOK_IP4_INPUT(pbuf, input_netif) router_ip4_input_hook((pbuf), (input_netif))
+
+/* Called by ip6_input() for every received IPv6 packet, before lwIP checks
+ * its header. Forwards the packets relayed to and from the AP clients, see
+ * ip6_relay.c. Returns non-zero if the packet was consumed. */
+int router_ip6_input_hook(struct pbuf *p, struct netif *inp);
+
+#define LWIP_HOOK_IP6_INPUT(pbuf, input_netif) router_ip6_input_hook((pbuf), (input_netif))
+
+#ifdef __cplusplus
+}
+#endif
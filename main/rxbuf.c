@@ -0,0 +1,220 @@
+/* Zero-copy forwarding of the esp32_nat_router
+
+   With CONFIG_LWIP_L2_TO_L3_COPY off, the Wi-Fi driver hands every frame
+   it receives to lwIP in the driver's own RX buffer, wrapped in a
+   PBUF_REF, rather than copied into a pbuf from the heap. A forwarded
+   packet is translated in place and sent from that buffer, which goes
+   back to the driver when the pbuf is freed, right after the driver of
+   the other interface took the frame. Two things are in the way, both
+   handled here:
+
+   - lwIP cannot put an Ethernet header in front of a PBUF_REF,
+     ethernet_output() drops such packets. rxbuf_output(), in front of
+     etharp_output() on both interfaces, writes the header into the place
+     of the one ethernet_input() took off, for unicast to a next hop the
+     ARP table knows. Anything else (broadcast, a next hop still to be
+     resolved) goes to etharp_output() as a copy. Since the ARP entries
+     used here are not refreshed, each one is resolved again when it
+     expires, and one packet goes out as a copy then.
+   - the driver has a fixed number of RX buffers, and it drops frames in
+     hardware while lwIP holds them all: in the tcpip mailbox, in TCP's
+     out-of-order queue, in reassembly. rxbuf_input(), in front of the
+     input of both interfaces, counts the buffers held through their free
+     function. Once half of them are held, it copies new frames into the
+     heap as L2_TO_L3_COPY does and returns the buffer right away, until
+     the stack has let go of enough of them. The QoS queues (qos.c), which
+     may hold frames for a while, keep copies (rxbuf_keep()).
+
+   rxbuf_input() runs in the Wi-Fi driver's task, the rest in the tcpip
+   thread. The free function runs wherever the pbuf is freed, so the count
+   is atomic. With L2_TO_L3_COPY on, none of this is attached.
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <string.h>
+#include <stdatomic.h>
+#include "sdkconfig.h"
+#include "esp_log.h"
+
+#include "lwip/opt.h"
+#include "lwip/def.h"
+#include "lwip/pbuf.h"
+#include "lwip/netif.h"
+#include "lwip/ip4_addr.h"
+#include "lwip/etharp.h"
+#include "lwip/prot/ethernet.h"
+
+#include "router_globals.h"
+#include "nat.h"
+
+static const char *TAG = "rxbuf";
+
+/* Buffers lwIP may hold before new frames are copied */
+#if CONFIG_ESP_WIFI_DYNAMIC_RX_BUFFER_NUM > 0
+#define RXBUF_HELD_MAX  (CONFIG_ESP_WIFI_DYNAMIC_RX_BUFFER_NUM / 2)
+#else
+#define RXBUF_HELD_MAX  16
+#endif
+
+struct rxbuf_if {
+    struct netif *netif;
+    netif_input_fn input;
+    netif_output_fn output;
+};
+
+static struct rxbuf_if rxbuf_ifs[2];            /* [0] uplink, [1] AP */
+
+/* The driver's free function, ours takes its place in the pbufs counted */
+static pbuf_free_custom_fn rxbuf_free_driver;
+static atomic_uint rxbuf_held;
+
+/* Written by the driver's task */
+static u32_t rxbuf_peak;
+static u32_t rxbuf_in_place;
+static u32_t rxbuf_copied;
+static u32_t rxbuf_no_mem;
+
+/* Written by the tcpip thread */
+static u32_t rxbuf_out_copied;
+
+static ROUTER_HOT void rxbuf_free(struct pbuf *p)
+{
+    atomic_fetch_sub(&rxbuf_held, 1);
+    rxbuf_free_driver(p);
+}
+
+/* A driver buffer counted by rxbuf_input() */
+static inline ROUTER_HOT bool rxbuf_is_driver(const struct pbuf *p)
+{
+    return (p->flags & PBUF_FLAG_IS_CUSTOM) != 0 &&
+           ((const struct pbuf_custom *)p)->custom_free_function == rxbuf_free;
+}
+
+/* Runs in the Wi-Fi driver's task */
+static ROUTER_HOT err_t rxbuf_input(struct pbuf *p, struct netif *netif)
+{
+    netif_input_fn input = rxbuf_ifs[netif == rxbuf_ifs[1].netif].input;
+    struct pbuf_custom *pc = (struct pbuf_custom *)p;
+
+    if (!(p->flags & PBUF_FLAG_IS_CUSTOM) || p->next != NULL) {
+        return input(p, netif);
+    }
+    if (rxbuf_free_driver == NULL) {
+        rxbuf_free_driver = pc->custom_free_function;
+    } else if (pc->custom_free_function != rxbuf_free_driver) {
+        return input(p, netif);
+    }
+
+    u32_t held = atomic_load(&rxbuf_held);
+    if (held >= RXBUF_HELD_MAX) {
+        struct pbuf *q = pbuf_clone(PBUF_RAW, PBUF_RAM, p);
+        if (q != NULL) {
+            /* The driver gets its buffer back now */
+            pbuf_free(p);
+            rxbuf_copied++;
+            if (input(q, netif) != ERR_OK) {
+                pbuf_free(q);
+            }
+            return ERR_OK;
+        }
+        rxbuf_no_mem++;
+    }
+
+    pc->custom_free_function = rxbuf_free;
+    held = atomic_fetch_add(&rxbuf_held, 1) + 1;
+    rxbuf_peak = LWIP_MAX(rxbuf_peak, held);
+    rxbuf_in_place++;
+    return input(p, netif);
+}
+
+/* Next hop of an IPv4 packet to ipaddr on netif, as etharp_output() picks
+ * it, NULL if there is none */
+static ROUTER_HOT const ip4_addr_t *rxbuf_next_hop(struct netif *netif, const ip4_addr_t *ipaddr)
+{
+    if (ip4_addr_isbroadcast(ipaddr, netif) || ip4_addr_ismulticast(ipaddr)) {
+        return NULL;
+    }
+    if (!ip4_addr_netcmp(ipaddr, netif_ip4_addr(netif), netif_ip4_netmask(netif)) &&
+        !ip4_addr_islinklocal(ipaddr)) {
+        if (ip4_addr_isany_val(*netif_ip4_gw(netif))) {
+            return NULL;
+        }
+        return netif_ip4_gw(netif);
+    }
+    return ipaddr;
+}
+
+static ROUTER_HOT err_t rxbuf_output(struct netif *netif, struct pbuf *p, const ip4_addr_t *ipaddr)
+{
+    netif_output_fn output = rxbuf_ifs[netif == rxbuf_ifs[1].netif].output;
+
+    if (!rxbuf_is_driver(p)) {
+        return output(netif, p, ipaddr);
+    }
+
+    const ip4_addr_t *hop = rxbuf_next_hop(netif, ipaddr);
+    struct eth_addr *mac;
+    const ip4_addr_t *ip;
+    if (hop != NULL && etharp_find_addr(netif, hop, &mac, &ip) >= 0) {
+        /* ethernet_input() took the received header off, the new one goes
+         * in its place */
+        pbuf_add_header_force(p, SIZEOF_ETH_HDR);
+        struct eth_hdr *ethhdr = (struct eth_hdr *)p->payload;
+        SMEMCPY(&ethhdr->dest, mac, ETH_HWADDR_LEN);
+        SMEMCPY(&ethhdr->src, netif->hwaddr, ETH_HWADDR_LEN);
+        ethhdr->type = PP_HTONS(ETHTYPE_IP);
+        err_t err = netif->linkoutput(netif, p);
+        pbuf_remove_header(p, SIZEOF_ETH_HDR);
+        return err;
+    }
+
+    struct pbuf *q = pbuf_clone(PBUF_LINK, PBUF_RAM, p);
+    if (q == NULL) {
+        return ERR_MEM;
+    }
+    rxbuf_out_copied++;
+    err_t err = output(netif, q, ipaddr);
+    pbuf_free(q);
+    return err;
+}
+
+/* For a frame that is kept after linkoutput returned: p itself with one
+ * more reference, or a copy if p is a driver buffer. NULL if there is no
+ * memory for the copy. */
+ROUTER_HOT struct pbuf *rxbuf_keep(struct pbuf *p)
+{
+    if (!rxbuf_is_driver(p)) {
+        pbuf_ref(p);
+        return p;
+    }
+    return pbuf_clone(PBUF_RAW, PBUF_RAM, p);
+}
+
+/* Forwards from the driver's buffers on netif, idx 0 for the uplink and 1
+ * for the AP. Goes last, rxbuf_input() has to see every frame first. */
+void rxbuf_attach(struct netif *netif, int idx)
+{
+#if !CONFIG_LWIP_L2_TO_L3_COPY
+    struct rxbuf_if *rif = &rxbuf_ifs[idx];
+    rif->netif = netif;
+    rif->input = netif->input;
+    netif->input = rxbuf_input;
+    rif->output = netif->output;
+    netif->output = rxbuf_output;
+    if (idx == 1) {
+        ESP_LOGI(TAG, "Forwarding from the driver's RX buffers, copies once %d are held", RXBUF_HELD_MAX);
+    }
+#endif
+}
+
+void rxbuf_get_stats(rxbuf_stats_t *stats)
+{
+    stats->held = atomic_load(&rxbuf_held);
+    stats->peak = rxbuf_peak;
+    stats->in_place = rxbuf_in_place;
+    stats->copied = rxbuf_copied + rxbuf_out_copied;
+    stats->no_mem = rxbuf_no_mem;
+}
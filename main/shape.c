@@ -0,0 +1,355 @@
+/* Per-client rate limits of the esp32_nat_router
+
+   Up to SHAPE_MAX AP clients get an upload and a download limit, each
+   enforced by a token bucket in the forwarding path (router_hooks.c):
+   upload on what a client sends out of the uplink, download on what the
+   NAPT, portmap or DMZ translation hands to it. A packet over the limit
+   is dropped, there is no queue to delay it in, and TCP settles at the
+   rate. Buckets hold 100 ms worth of traffic, at least 4 full packets.
+
+   Clients are set by IP or by MAC. A MAC is resolved to the address the
+   DHCP server leased to it, when the limit is set and whenever the client
+   gets a new lease (shape_client_ip()). Clients with a static address have
+   to be set by IP.
+
+   The forwarding path finds the bucket by the last byte of the address, so
+   a packet costs one array access and one bucket update however many
+   clients are limited. The AP network is a /24 (see wifi_init()). All
+   bucket state is owned by the tcpip thread, changes are installed with
+   tcpip_api_call(). The console, the web server and the event loop change
+   the limits from their own tasks, shape_lock serializes them.
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "esp_log.h"
+#include "esp_netif.h"
+#include "nvs.h"
+
+#include "lwip/opt.h"
+#include "lwip/def.h"
+#include "lwip/sys.h"
+#include "lwip/ip4_addr.h"
+#include "lwip/priv/tcpip_priv.h"
+
+#include "router_globals.h"
+#include "nat.h"
+
+static const char *TAG = "shape";
+
+extern esp_netif_t* wifiAP;
+
+#define SHAPE_NVS_KEY       "shape"
+#define SHAPE_BURST_MS      100
+#define SHAPE_MIN_DEPTH     (4 * 1500 * 8)  /* bits */
+
+/* Rates are in kbit/s, which is bits per ms */
+struct shape_bucket {
+    u32_t rate;         /* 0 for no limit */
+    u32_t depth;        /* bits */
+    u32_t tokens;       /* bits */
+    u32_t last;         /* sys_now() */
+    u32_t dropped;
+};
+
+struct shape_client {
+    shape_rule_t rule;
+    struct shape_bucket bucket[2];
+};
+
+/* Stored per client, ip is 0 for a client set by MAC */
+struct shape_nvs_rec {
+    u8_t mac[6];
+    u32_t ip;
+    u32_t rate[2];
+} __attribute__((packed));
+
+static struct shape_client shape_tab[SHAPE_MAX];
+static u32_t shape_count;
+static u8_t shape_idx[256];     /* last address byte -> shape_tab index + 1 */
+static pthread_mutex_t shape_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void shape_bucket_init(struct shape_bucket *b, u32_t rate)
+{
+    b->rate = rate;
+    b->depth = LWIP_MAX(rate * SHAPE_BURST_MS, SHAPE_MIN_DEPTH);
+    b->tokens = b->depth;
+    b->last = sys_now();
+    b->dropped = 0;
+}
+
+static ROUTER_HOT bool shape_take(struct shape_bucket *b, u16_t len)
+{
+    if (b->rate == 0) {
+        return true;
+    }
+    u32_t now = sys_now();
+    u32_t elapsed = now - b->last;
+    b->last = now;
+    /* Compared first, elapsed * rate could overflow */
+    b->tokens = elapsed >= b->depth / b->rate ? b->depth : LWIP_MIN(b->tokens + elapsed * b->rate, b->depth);
+
+    u32_t bits = (u32_t)len * 8;
+    if (b->tokens < bits) {
+        b->dropped++;
+        return false;
+    }
+    b->tokens -= bits;
+    return true;
+}
+
+ROUTER_HOT bool shape_ok(u32_t client, u16_t len, int dir)
+{
+    if (shape_count == 0) {
+        return true;
+    }
+    u8_t i = shape_idx[((const u8_t *)&client)[3]];
+    if (i == 0 || shape_tab[i - 1].rule.ip != client) {
+        return true;
+    }
+    return shape_take(&shape_tab[i - 1].bucket[dir], len);
+}
+
+struct shape_call {
+    struct tcpip_api_call_data call;
+    shape_rule_t rules[SHAPE_MAX];
+    u32_t count;
+};
+
+/* Buckets of clients whose limits did not change keep their state */
+static err_t shape_install(struct tcpip_api_call_data *call)
+{
+    struct shape_call *msg = (struct shape_call *)call;
+    struct shape_client tab[SHAPE_MAX];
+
+    for (u32_t i = 0; i < msg->count; i++) {
+        shape_rule_t *r = &msg->rules[i];
+        tab[i].rule = *r;
+        shape_bucket_init(&tab[i].bucket[SHAPE_UP], r->up);
+        shape_bucket_init(&tab[i].bucket[SHAPE_DOWN], r->down);
+        for (u32_t j = 0; j < shape_count; j++) {
+            shape_rule_t *o = &shape_tab[j].rule;
+            if (memcmp(o->mac, r->mac, 6) == 0 && o->ip == r->ip && o->up == r->up && o->down == r->down) {
+                memcpy(tab[i].bucket, shape_tab[j].bucket, sizeof(tab[i].bucket));
+                break;
+            }
+        }
+    }
+
+    memcpy(shape_tab, tab, msg->count * sizeof(struct shape_client));
+    shape_count = msg->count;
+    memset(shape_idx, 0, sizeof(shape_idx));
+    for (u32_t i = 0; i < shape_count; i++) {
+        u32_t ip = shape_tab[i].rule.ip;
+        if (ip != 0) {
+            shape_idx[((const u8_t *)&ip)[3]] = i + 1;
+        }
+    }
+    return ERR_OK;
+}
+
+static err_t shape_read(struct tcpip_api_call_data *call)
+{
+    struct shape_call *msg = (struct shape_call *)call;
+
+    for (u32_t i = 0; i < shape_count; i++) {
+        msg->rules[i] = shape_tab[i].rule;
+        msg->rules[i].dropped_up = shape_tab[i].bucket[SHAPE_UP].dropped;
+        msg->rules[i].dropped_down = shape_tab[i].bucket[SHAPE_DOWN].dropped;
+    }
+    msg->count = shape_count;
+    return ERR_OK;
+}
+
+static void shape_load(struct shape_call *msg)
+{
+    memset(msg->rules, 0, sizeof(msg->rules));
+    tcpip_api_call(shape_read, &msg->call);
+}
+
+/* Copies the limits with their drop counters, rules has SHAPE_MAX entries */
+int shape_get_rules(shape_rule_t *rules)
+{
+    struct shape_call msg;
+
+    shape_load(&msg);
+    memcpy(rules, msg.rules, msg.count * sizeof(shape_rule_t));
+    return msg.count;
+}
+
+static bool shape_by_mac(const shape_rule_t *r)
+{
+    static const u8_t none[6];
+    return memcmp(r->mac, none, 6) != 0;
+}
+
+/* Fills in the DHCP lease of the clients set by MAC */
+static void shape_resolve(shape_rule_t *rules, u32_t count)
+{
+    for (u32_t i = 0; i < count; i++) {
+        if (shape_by_mac(&rules[i])) {
+            esp_netif_pair_mac_ip_t pair;
+            memcpy(pair.mac, rules[i].mac, 6);
+            pair.ip.addr = 0;
+            if (esp_netif_dhcps_get_clients_by_mac(wifiAP, 1, &pair) == ESP_OK && pair.ip.addr != 0) {
+                rules[i].ip = pair.ip.addr;
+            }
+        }
+    }
+}
+
+static esp_err_t shape_store(const shape_rule_t *rules, u32_t count)
+{
+    esp_err_t err;
+    nvs_handle_t nvs;
+    struct shape_nvs_rec recs[SHAPE_MAX];
+
+    for (u32_t i = 0; i < count; i++) {
+        memcpy(recs[i].mac, rules[i].mac, 6);
+        recs[i].ip = shape_by_mac(&rules[i]) ? 0 : rules[i].ip;
+        recs[i].rate[SHAPE_UP] = rules[i].up;
+        recs[i].rate[SHAPE_DOWN] = rules[i].down;
+    }
+
+    err = nvs_open(PARAM_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (count > 0) {
+        err = nvs_set_blob(nvs, SHAPE_NVS_KEY, recs, count * sizeof(struct shape_nvs_rec));
+    } else {
+        err = nvs_erase_key(nvs, SHAPE_NVS_KEY);
+    }
+    if (err == ESP_OK) {
+        err = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+    return err;
+}
+
+/* Loads the limits stored by set_shape(), after the DHCP server started */
+esp_err_t get_shape(void)
+{
+    esp_err_t err;
+    nvs_handle_t nvs;
+    struct shape_nvs_rec recs[SHAPE_MAX];
+    struct shape_call msg = { .count = 0 };
+    size_t len = sizeof(recs);
+
+    err = nvs_open(PARAM_NAMESPACE, NVS_READONLY, &nvs);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = nvs_get_blob(nvs, SHAPE_NVS_KEY, recs, &len);
+    nvs_close(nvs);
+    if (err != ESP_OK) {
+        return err;
+    }
+    msg.count = len / sizeof(struct shape_nvs_rec);
+    memset(msg.rules, 0, sizeof(msg.rules));
+    for (u32_t i = 0; i < msg.count; i++) {
+        memcpy(msg.rules[i].mac, recs[i].mac, 6);
+        msg.rules[i].ip = recs[i].ip;
+        msg.rules[i].up = recs[i].rate[SHAPE_UP];
+        msg.rules[i].down = recs[i].rate[SHAPE_DOWN];
+    }
+    shape_resolve(msg.rules, msg.count);
+    tcpip_api_call(shape_install, &msg.call);
+    ESP_LOGI(TAG, "Rate limits for %u clients", (unsigned)msg.count);
+    return ESP_OK;
+}
+
+/* Index of the rule for mac (if set) or ip, count if there is none */
+static u32_t shape_find(const shape_rule_t *rules, u32_t count, const uint8_t *mac, uint32_t ip)
+{
+    u32_t i;
+    for (i = 0; i < count; i++) {
+        if (mac != NULL ? memcmp(rules[i].mac, mac, 6) == 0 : (!shape_by_mac(&rules[i]) && rules[i].ip == ip)) {
+            break;
+        }
+    }
+    return i;
+}
+
+/* Sets the limits (kbit/s, 0 for none) of the client with mac, or with
+ * ip if mac is NULL. Both 0 removes the client. */
+esp_err_t set_shape(const uint8_t *mac, uint32_t ip, uint32_t up, uint32_t down)
+{
+    struct shape_call msg;
+    esp_err_t err;
+
+    pthread_mutex_lock(&shape_lock);
+    shape_load(&msg);
+    u32_t i = shape_find(msg.rules, msg.count, mac, ip);
+
+    if (up == 0 && down == 0) {
+        if (i == msg.count) {
+            pthread_mutex_unlock(&shape_lock);
+            return ESP_ERR_NOT_FOUND;
+        }
+        msg.rules[i] = msg.rules[--msg.count];
+        memset(&msg.rules[msg.count], 0, sizeof(shape_rule_t));
+    } else {
+        if (i == msg.count) {
+            if (msg.count == SHAPE_MAX) {
+                pthread_mutex_unlock(&shape_lock);
+                return ESP_ERR_NO_MEM;
+            }
+            msg.count++;
+            if (mac != NULL) {
+                memcpy(msg.rules[i].mac, mac, 6);
+            } else {
+                msg.rules[i].ip = ip;
+            }
+        }
+        msg.rules[i].up = up;
+        msg.rules[i].down = down;
+    }
+    shape_resolve(msg.rules, msg.count);
+    tcpip_api_call(shape_install, &msg.call);
+    err = shape_store(msg.rules, msg.count);
+    pthread_mutex_unlock(&shape_lock);
+    return err;
+}
+
+/* A client got a DHCP lease, from the event loop */
+void shape_client_ip(const uint8_t *mac, uint32_t ip)
+{
+    struct shape_call msg;
+
+    pthread_mutex_lock(&shape_lock);
+    shape_load(&msg);
+    u32_t i = shape_find(msg.rules, msg.count, mac, 0);
+    if (i < msg.count && msg.rules[i].ip != ip) {
+        msg.rules[i].ip = ip;
+        tcpip_api_call(shape_install, &msg.call);
+    }
+    pthread_mutex_unlock(&shape_lock);
+}
+
+/* Parses a client given as MAC (aa:bb:cc:dd:ee:ff) or IP, *mac_set tells
+ * which one it was */
+bool shape_parse_client(const char *s, uint8_t *mac, uint32_t *ip, bool *mac_set)
+{
+    unsigned int m[6];
+    char end;
+
+    if (sscanf(s, "%x:%x:%x:%x:%x:%x%c", &m[0], &m[1], &m[2], &m[3], &m[4], &m[5], &end) == 6) {
+        for (int i = 0; i < 6; i++) {
+            if (m[i] > 0xff) {
+                return false;
+            }
+            mac[i] = m[i];
+        }
+        *mac_set = true;
+        return true;
+    }
+    *ip = esp_ip4addr_aton(s);
+    *mac_set = false;
+    return *ip != 0 && *ip != IPADDR_NONE;
+}
@@ -0,0 +1,173 @@
+/* Latency of router_ip4_input() per packet, and its spread
+
+   The trace of bench_flow_cache (AP clients through NAPT and back, and
+   connections to a forwarded port) is replayed one packet of every flow
+   in turn, each packet timed on its own:
+
+   - warm: back to back, code and data stay in the caches.
+   - cold: before each packet EVICT bytes are walked, as if another task
+     had run in between. This is the host's nearest thing to what
+     CONFIG_NAT_IRAM_HOT_PATH guards against on the ESP32, the hook's
+     code evicted from the flash cache by the console, the web server or
+     NVS. It costs more there: a miss refills from SPI flash.
+
+   The jitter is the standard deviation and the spread between the median
+   and the 99th percentile. The time of a clock reading, the least of
+   many, is taken off each sample. The hook's own timing (two clock
+   readings, a register read on the ESP32 but a system call here) is in
+   the samples. Host numbers; on the board `nat_stats` shows the hook
+   times of both builds.
+*/
+
+#include <math.h>
+#include "host.h"
+#include "router_globals.h"
+#include "router_hooks.h"
+#include "nat.h"
+
+#define CLIENTS     16
+#define FLOWS       4           /* per client */
+#define INBOUND     8           /* connections to the forwarded port */
+#define WARM        200000
+#define COLD        5000
+#define EVICT       (16 << 20)
+
+#define SERVER      HOST_IP(192, 168, 4, 200)
+#define REMOTE(i)   HOST_IP(198, 51, 100, 1 + (i))
+
+struct trace_pkt {
+    struct netif *inp;
+    u16_t len;
+    struct host_pkt pkt;
+};
+
+static struct trace_pkt trace[CLIENTS * FLOWS * 2 + INBOUND];
+static int trace_len;
+
+static u32_t samples[WARM];
+static u8_t *evict_buf;
+
+static void record(struct netif *inp, u16_t len)
+{
+    struct trace_pkt *t = &trace[trace_len++];
+    t->inp = inp;
+    t->len = len;
+    t->pkt = host_pkt;
+}
+
+/* Opens the NAPT mappings and records a packet of each flow, both ways */
+static void build_trace(void)
+{
+    for (int c = 0; c < CLIENTS; c++) {
+        u32_t client = HOST_IP(192, 168, 4, 10 + c);
+        for (int f = 0; f < FLOWS; f++) {
+            u16_t sport = 40000 + f;
+            u32_t remote = REMOTE(f);
+            bool tcp = f & 1;
+            u16_t dport = tcp ? 443 : 53;
+
+            if (tcp) {
+                HOST_CHECK(host_tcp(&host_ap, client, sport, remote, dport, TCP_SYN) == 1);
+            } else {
+                HOST_CHECK(host_udp(&host_ap, client, sport, remote, dport) == 1);
+            }
+            u16_t mport = lwip_ntohs(host_pkt.udp.src);
+
+            record(&host_ap, tcp ? host_tcp_pkt(client, sport, remote, dport, TCP_ACK)
+                                 : host_udp_pkt(client, sport, remote, dport));
+            record(&host_sta, tcp ? host_tcp_pkt(remote, dport, my_ip, mport, TCP_ACK)
+                                  : host_udp_pkt(remote, dport, my_ip, mport));
+        }
+    }
+    for (int i = 0; i < INBOUND; i++) {
+        record(&host_sta, host_tcp_pkt(REMOTE(10 + i), 50000 + i, my_ip, 8080, TCP_ACK));
+    }
+}
+
+/* The least time of a clock reading */
+static u32_t clock_ns(void)
+{
+    u64_t least = UINT64_MAX;
+
+    for (int i = 0; i < 10000; i++) {
+        u64_t t0 = host_ns();
+        u64_t t1 = host_ns();
+        least = LWIP_MIN(least, t1 - t0);
+    }
+    return (u32_t)least;
+}
+
+static void evict(void)
+{
+    for (size_t i = 0; i < EVICT; i += 64) {
+        evict_buf[i]++;
+    }
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    u32_t x = *(const u32_t *)a, y = *(const u32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static u32_t percentile(int n, double p)
+{
+    return samples[(int)(p * (n - 1) + 0.5)];
+}
+
+static void measure(const char *name, int n, bool cold, u32_t clock)
+{
+    double sum = 0, sq = 0;
+
+    /* A round first so that every mapping has been looked up */
+    for (int i = 0; i < n + trace_len; i++) {
+        struct trace_pkt *t = &trace[i % trace_len];
+        struct pbuf *p = pbuf_alloc(PBUF_IP, t->len, PBUF_RAM);
+        memcpy(p->payload, &t->pkt, t->len);
+        if (cold) {
+            evict();
+        }
+        u64_t start = host_ns();
+        int ret = router_ip4_input_hook(p, t->inp);
+        u64_t ns = host_ns() - start;
+        if (ret == 0) {
+            pbuf_free(p);
+        }
+        if (i >= trace_len) {
+            samples[i - trace_len] = ns > clock ? (u32_t)(ns - clock) : 0;
+        }
+    }
+
+    for (int i = 0; i < n; i++) {
+        sum += samples[i];
+        sq += (double)samples[i] * samples[i];
+    }
+    double mean = sum / n;
+    double sd = sqrt(LWIP_MAX(sq / n - mean * mean, 0.0));
+    qsort(samples, n, sizeof(samples[0]), cmp_u32);
+    printf("%-5s %7d %7.0f %6u %6u %6u %7u %7u %7.0f %7u %9.0f\n", name, n, mean,
+           percentile(n, 0.5), percentile(n, 0.9), percentile(n, 0.99), percentile(n, 0.999),
+           samples[n - 1], sd, percentile(n, 0.99) - percentile(n, 0.5), 1e9 / mean);
+}
+
+int main(void)
+{
+    host_init();
+    router_hooks_init();
+    napt_init(256);
+    get_portmap_tab();
+    HOST_CHECK(add_portmap(PROTO_TCP, 8080, SERVER, 80) == ESP_OK);
+    apply_portmap_tab();
+    build_trace();
+    evict_buf = calloc(1, EVICT);
+    HOST_CHECK(evict_buf != NULL);
+
+    u32_t clock = clock_ns();
+    printf("%d flows, times in ns less the %u ns of a clock reading\n", trace_len, clock);
+    printf("%-5s %7s %7s %6s %6s %6s %7s %7s %7s %7s %9s\n", "cache", "packets", "mean", "p50", "p90",
+           "p99", "p99.9", "max", "stddev", "p99-p50", "pps");
+    measure("warm", WARM, false, clock);
+    measure("cold", COLD, true, clock);
+    free(evict_buf);
+    return 0;
+}
@@ -0,0 +1,71 @@
+/* Time of add_portmap(), del_portmap() and portmap_match_ext() by the
+   number of rules in the table.
+
+   Adding and deleting includes storing the changed blob of records in
+   NVS (in RAM here) and the change of the forwarding path's lookups, as
+   on the device. Lookups are of ports that are forwarded (hit) and that
+   are not (miss). One rule in 16 is a range of 4 ports, hit at its last
+   port, which the hash table does not find.
+*/
+
+#include "host.h"
+#include "router_globals.h"
+#include "nat.h"
+
+#define LOOKUPS 2000000
+
+static const int sizes[] = { 16, 128, 512, 2048 };
+
+/* Spreads the rules over the port range, one in every 7 ports */
+static u16_t rule_port(int i)
+{
+    return 1024 + i * 7;
+}
+
+static double lookup_ns(int n, bool hit)
+{
+    u32_t daddr;
+    u16_t dport;
+    u32_t found = 0;
+
+    u64_t start = host_ns();
+    for (u32_t i = 0; i < LOOKUPS; i++) {
+        int r = i % n;
+        u16_t port = rule_port(r) + (!hit ? 5 : r % 16 == 0 ? 3 : 0);
+        found += portmap_match_ext(PROTO_TCP, port, &daddr, &dport);
+    }
+    u64_t ns = host_ns() - start;
+    HOST_CHECK(found == (hit ? LOOKUPS : 0));
+    return (double)ns / LOOKUPS;
+}
+
+int main(void)
+{
+    host_init();
+    get_portmap_tab();
+    apply_portmap_tab();
+
+    printf("%6s %10s %10s %10s %10s\n", "rules", "add ns", "del ns", "hit ns", "miss ns");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        int n = sizes[s];
+
+        u64_t start = host_ns();
+        for (int i = 0; i < n; i++) {
+            HOST_CHECK(add_portmap_range(PROTO_TCP, rule_port(i), rule_port(i) + (i % 16 == 0 ? 3 : 0),
+                                         HOST_IP(192, 168, 4, 2 + i % 200), 10000 + 4 * i, 0) == ESP_OK);
+        }
+        double add = (double)(host_ns() - start) / n;
+
+        double hit = lookup_ns(n, true);
+        double miss = lookup_ns(n, false);
+
+        start = host_ns();
+        for (int i = 0; i < n; i++) {
+            HOST_CHECK(del_portmap(PROTO_TCP, rule_port(i)) == ESP_OK);
+        }
+        double del = (double)(host_ns() - start) / n;
+
+        printf("%6d %10.0f %10.0f %10.1f %10.1f\n", n, add, del, hit, miss);
+    }
+    return 0;
+}
@@ -0,0 +1,218 @@
+/* Forwarding throughput in the driver's RX buffers against copying them,
+   rxbuf.c
+
+   UDP frames of 16 AP clients are forwarded out of the uplink by frame
+   size. They come from a pool of driver buffers, custom pbufs whose free
+   function puts the buffer back, go in through the input of the AP and
+   leave through the uplink's output and linkoutput:
+
+   - in place: as built, rxbuf.c attached. The translated packet is sent
+     from the driver's buffer.
+   - copied: as with CONFIG_LWIP_L2_TO_L3_COPY, each frame is copied into
+     a heap pbuf first and the buffer freed. rxbuf.c only passes these
+     on, it is not attached with L2_TO_L3_COPY on.
+
+   The final input takes the Ethernet header off and runs the hook, as
+   ethernet_input() and ip4_input() would, and the uplink's output puts
+   one on, as etharp_output() would. linkoutput copies the frame out as
+   esp_wifi_internal_tx() does. The gateway is in the ARP table.
+
+   The time is that of the forwarding less that of taking a buffer from
+   the pool, restoring the headers the translation changed (the DMA's
+   work on the ESP32) and freeing it, each the best of RUNS. These are
+   host numbers: the ESP32 copies far slower relative to the rest, and
+   the host's pbuf_alloc() zeroes the pbuf, which lwIP's does not.
+*/
+
+#include "host.h"
+#include "router_globals.h"
+#include "router_hooks.h"
+#include "nat.h"
+
+#define CLIENTS     16
+#define DRIVER_BUFS 32
+#define ROUNDS      20000
+#define RUNS        15
+
+#define REMOTE      HOST_IP(198, 51, 100, 7)
+#define GATEWAY     HOST_IP(10, 0, 0, 1)
+
+static const u16_t sizes[] = { 60, 590, 1514 };
+
+struct driver_buf {
+    struct pbuf_custom pc;
+    u8_t frame[1600];
+};
+
+static struct driver_buf driver_bufs[DRIVER_BUFS];
+static struct driver_buf *driver_pool[DRIVER_BUFS];
+static int driver_free_count;
+
+static void driver_free(struct pbuf *p)
+{
+    driver_pool[driver_free_count++] = (struct driver_buf *)p;
+}
+
+/* The frame of each client, the first HDR_LEN bytes of which the
+ * translation changes */
+#define HDR_LEN     (SIZEOF_ETH_HDR + IP_HLEN + UDP_HLEN)
+
+static u8_t frames[CLIENTS][1600];
+
+static void build_frames(u16_t size)
+{
+    for (int c = 0; c < CLIENTS; c++) {
+        u8_t *f = frames[c];
+        u16_t len = size - SIZEOF_ETH_HDR;
+
+        host_udp_pkt(HOST_IP(192, 168, 4, 10 + c), 40000, REMOTE, 53);
+        IPH_LEN_SET(&host_pkt.ip, lwip_htons(len));
+        IPH_CHKSUM_SET(&host_pkt.ip, 0);
+        IPH_CHKSUM_SET(&host_pkt.ip, inet_chksum(&host_pkt.ip, IP_HLEN));
+        host_pkt.udp.len = lwip_htons(len - IP_HLEN);
+        host_pkt.udp.chksum = 0;
+
+        memset(f, 0xee, SIZEOF_ETH_HDR);
+        f[12] = ETHTYPE_IP >> 8;
+        f[13] = ETHTYPE_IP & 0xff;
+        memcpy(f + SIZEOF_ETH_HDR, &host_pkt, IP_HLEN + UDP_HLEN);
+        for (int i = HDR_LEN; i < size; i++) {
+            f[i] = i;
+        }
+    }
+    for (int i = 0; i < DRIVER_BUFS; i++) {
+        memcpy(driver_bufs[i].frame, frames[0], size);
+    }
+}
+
+/* A received frame in a driver buffer, the DMA having written only what
+ * changed since its last use */
+static struct pbuf *driver_rx(int c, u16_t size)
+{
+    struct driver_buf *b = driver_pool[--driver_free_count];
+
+    memcpy(b->frame, frames[c], HDR_LEN);
+    b->pc.pbuf = (struct pbuf){
+        .payload = b->frame, .len = size, .tot_len = size, .ref = 1, .flags = PBUF_FLAG_IS_CUSTOM,
+    };
+    b->pc.custom_free_function = driver_free;
+    return &b->pc.pbuf;
+}
+
+static err_t stack_input(struct pbuf *p, struct netif *inp)
+{
+    pbuf_remove_header(p, SIZEOF_ETH_HDR);
+    if (router_ip4_input_hook(p, inp) == 0) {
+        pbuf_free(p);
+    }
+    return ERR_OK;
+}
+
+static struct eth_addr gateway_mac = { { 0x02, 0x11, 0x22, 0x33, 0x44, 0x55 } };
+
+ssize_t etharp_find_addr(struct netif *netif, const ip4_addr_t *ipaddr, struct eth_addr **eth_ret, const ip4_addr_t **ip_ret)
+{
+    if (ipaddr->addr != GATEWAY) {
+        return -1;
+    }
+    *eth_ret = &gateway_mac;
+    *ip_ret = ipaddr;
+    return 0;
+}
+
+static err_t eth_output(struct netif *netif, struct pbuf *p, const ip4_addr_t *ipaddr)
+{
+    HOST_CHECK(pbuf_add_header(p, SIZEOF_ETH_HDR) == 0);
+    struct eth_hdr *ethhdr = (struct eth_hdr *)p->payload;
+    SMEMCPY(&ethhdr->dest, &gateway_mac, ETH_HWADDR_LEN);
+    SMEMCPY(&ethhdr->src, netif->hwaddr, ETH_HWADDR_LEN);
+    ethhdr->type = PP_HTONS(ETHTYPE_IP);
+    err_t err = netif->linkoutput(netif, p);
+    pbuf_remove_header(p, SIZEOF_ETH_HDR);
+    return err;
+}
+
+static u8_t tx_buf[1600];
+static u32_t tx_frames;
+
+static err_t driver_tx(struct netif *netif, struct pbuf *p)
+{
+    memcpy(tx_buf, p->payload, p->len);
+    tx_frames++;
+    return ERR_OK;
+}
+
+/* Nanoseconds of ROUNDS frames of every client */
+static u64_t run(u16_t size, bool copy, bool forward)
+{
+    u64_t start = host_ns();
+    for (int r = 0; r < ROUNDS; r++) {
+        for (int c = 0; c < CLIENTS; c++) {
+            struct pbuf *p = driver_rx(c, size);
+            if (!forward) {
+                __asm__ volatile("" : : "r"(p) : "memory");
+                pbuf_free(p);
+            } else if (copy) {
+                struct pbuf *q = pbuf_clone(PBUF_RAW, PBUF_RAM, p);
+                pbuf_free(p);
+                host_ap.input(q, &host_ap);
+            } else {
+                host_ap.input(p, &host_ap);
+            }
+        }
+    }
+    return host_ns() - start;
+}
+
+static void measure(u16_t size)
+{
+    u32_t frames_run = (u32_t)ROUNDS * CLIENTS;
+    u64_t best[2] = { UINT64_MAX, UINT64_MAX }, best_base = UINT64_MAX;
+
+    build_frames(size);
+    for (int r = 0; r < RUNS; r++) {
+        for (int copy = 0; copy <= 1; copy++) {
+            rxbuf_stats_t st0, st1;
+            u32_t tx = tx_frames;
+
+            rxbuf_get_stats(&st0);
+            u64_t ns = run(size, copy, true);
+            best[copy] = LWIP_MIN(best[copy], ns);
+            rxbuf_get_stats(&st1);
+            HOST_CHECK(tx_frames - tx == frames_run && driver_free_count == DRIVER_BUFS);
+            HOST_CHECK(st1.in_place - st0.in_place == (copy ? 0 : frames_run));
+            HOST_CHECK(st1.copied == st0.copied && st1.held == 0);
+        }
+        u64_t base = run(size, false, false);
+        best_base = LWIP_MIN(best_base, base);
+    }
+
+    for (int copy = 0; copy <= 1; copy++) {
+        double ns = (double)(best[copy] - LWIP_MIN(best[copy], best_base)) / frames_run;
+        printf("%6u %-9s %9.1f %10.0f %9.0f\n", size, copy ? "copied" : "in place", ns, 1e9 / ns,
+               size * 8 * 1e3 / ns);
+    }
+}
+
+int main(void)
+{
+    host_init();
+    host_ap.input = stack_input;
+    host_sta.output = eth_output;
+    host_sta.linkoutput = driver_tx;
+    router_hooks_init();
+    napt_init(256);
+    get_portmap_tab();
+    apply_portmap_tab();
+
+    for (int i = 0; i < DRIVER_BUFS; i++) {
+        driver_pool[driver_free_count++] = &driver_bufs[i];
+    }
+
+    printf("%d clients, %d frames a run\n", CLIENTS, ROUNDS * CLIENTS);
+    printf("%6s %-9s %9s %10s %9s\n", "bytes", "frames", "ns/frame", "pps", "Mbit/s");
+    for (int i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+        measure(sizes[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,1171 @@
+/* Host build of the forwarding code of the esp32_nat_router
+
+   What the ESP-IDF and lwIP functions the sources call do on the host,
+   see host.h. Whatever a test wants to see or change itself (the UDP
+   sockets of the IPFIX exporter and the reflector, the multicast groups,
+   the driver behind linkoutput, the ARP table) is weak, the test defines
+   its own. The BSD sockets and the HTTP server are only as much of them
+   as igd.c needs.
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+
+#include <time.h>
+#include <strings.h>
+#include <pthread.h>
+
+#include "host.h"
+#include "router_globals.h"
+#include "router_hooks.h"
+
+#define WEAK __attribute__((weak))
+
+#define HOST_NVS_KEYS       256
+#define HOST_TIMEOUTS       32
+#define HOST_SOCKS          8
+#define HOST_SOCK_FD0       64      /* clear of the host's own */
+#define HOST_HTTPD_URIS     8
+
+uint32_t my_ip;
+uint32_t my_ap_ip;
+bool ap_connect;
+
+struct netif host_sta, host_ap;
+esp_netif_t *wifiSTA = (esp_netif_t *)&host_sta;
+esp_netif_t *wifiAP = (esp_netif_t *)&host_ap;
+
+u32_t host_now_ms;
+u32_t host_sent;
+struct netif *host_sent_netif;
+struct host_pkt host_pkt;
+u32_t host_sent6;
+struct netif *host_sent6_netif;
+struct eth_addr host_sent6_mac;
+u8_t host_pkt6[1500];
+u16_t host_pkt6_len;
+
+struct udp_pcb *udp_pcbs;
+struct netif *host_input_netif;
+ip4_addr_t host_input_dest;
+const ip_addr_t ip_addr_any = IPADDR4_INIT(0);
+struct tcp_pcb *tcp_active_pcbs;
+union tcp_listen_pcbs_t tcp_listen_pcbs;
+
+WEAK const char *esp_err_to_name(esp_err_t code)
+{
+    switch (code) {
+    case ESP_OK: return "ESP_OK";
+    case ESP_FAIL: return "ESP_FAIL";
+    case ESP_ERR_NO_MEM: return "ESP_ERR_NO_MEM";
+    case ESP_ERR_INVALID_ARG: return "ESP_ERR_INVALID_ARG";
+    case ESP_ERR_INVALID_STATE: return "ESP_ERR_INVALID_STATE";
+    case ESP_ERR_INVALID_SIZE: return "ESP_ERR_INVALID_SIZE";
+    case ESP_ERR_NOT_FOUND: return "ESP_ERR_NOT_FOUND";
+    case ESP_ERR_NVS_NOT_FOUND: return "ESP_ERR_NVS_NOT_FOUND";
+    case ESP_ERR_NVS_INVALID_LENGTH: return "ESP_ERR_NVS_INVALID_LENGTH";
+    default: return "UNKNOWN ERROR";
+    }
+}
+
+WEAK size_t strlcpy(char *dst, const char *src, size_t size)
+{
+    size_t len = strlen(src);
+    if (size > 0) {
+        size_t n = len < size - 1 ? len : size - 1;
+        memcpy(dst, src, n);
+        dst[n] = '\0';
+    }
+    return len;
+}
+
+u64_t host_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+uint32_t esp_cpu_get_cycle_count(void)
+{
+    return (uint32_t)(host_ns() * 160 / 1000);
+}
+
+WEAK size_t heap_caps_get_free_size(uint32_t caps)
+{
+    return 1 << 20;
+}
+
+void *heap_caps_malloc(size_t size, uint32_t caps)
+{
+    return malloc(size);
+}
+
+void *heap_caps_calloc(size_t n, size_t size, uint32_t caps)
+{
+    return calloc(n, size);
+}
+
+int64_t esp_timer_get_time(void)
+{
+    return (int64_t)host_now_ms * 1000;
+}
+
+/* NVS, one namespace */
+
+struct host_nvs_entry {
+    char key[16];
+    void *value;
+    size_t length;
+};
+
+static struct host_nvs_entry host_nvs[HOST_NVS_KEYS];
+
+static struct host_nvs_entry *host_nvs_find(const char *key, bool create)
+{
+    struct host_nvs_entry *free_entry = NULL;
+
+    for (int i = 0; i < HOST_NVS_KEYS; i++) {
+        if (host_nvs[i].value != NULL && strcmp(host_nvs[i].key, key) == 0) {
+            return &host_nvs[i];
+        }
+        if (host_nvs[i].value == NULL && free_entry == NULL) {
+            free_entry = &host_nvs[i];
+        }
+    }
+    if (create && free_entry != NULL) {
+        strlcpy(free_entry->key, key, sizeof(free_entry->key));
+    }
+    return create ? free_entry : NULL;
+}
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t mode, nvs_handle_t *handle)
+{
+    *handle = 1;
+    return ESP_OK;
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *value, size_t *length)
+{
+    struct host_nvs_entry *e = host_nvs_find(key, false);
+    if (e == NULL) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    if (value != NULL) {
+        if (*length < e->length) {
+            return ESP_ERR_NVS_INVALID_LENGTH;
+        }
+        memcpy(value, e->value, e->length);
+    }
+    *length = e->length;
+    return ESP_OK;
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t length)
+{
+    struct host_nvs_entry *e = host_nvs_find(key, true);
+    if (e == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    free(e->value);
+    e->value = malloc(length + 1);
+    memcpy(e->value, value, length);
+    e->length = length;
+    return ESP_OK;
+}
+
+esp_err_t nvs_get_i32(nvs_handle_t handle, const char *key, int32_t *value)
+{
+    size_t length = sizeof(*value);
+    return nvs_get_blob(handle, key, value, &length);
+}
+
+esp_err_t nvs_set_i32(nvs_handle_t handle, const char *key, int32_t value)
+{
+    return nvs_set_blob(handle, key, &value, sizeof(value));
+}
+
+esp_err_t nvs_get_u32(nvs_handle_t handle, const char *key, uint32_t *value)
+{
+    size_t length = sizeof(*value);
+    return nvs_get_blob(handle, key, value, &length);
+}
+
+esp_err_t nvs_set_u32(nvs_handle_t handle, const char *key, uint32_t value)
+{
+    return nvs_set_blob(handle, key, &value, sizeof(value));
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key)
+{
+    struct host_nvs_entry *e = host_nvs_find(key, false);
+    if (e == NULL) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    free(e->value);
+    e->value = NULL;
+    return ESP_OK;
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle)
+{
+    return ESP_OK;
+}
+
+void nvs_close(nvs_handle_t handle)
+{
+}
+
+void host_nvs_put(const char *key, const void *value, size_t length)
+{
+    nvs_set_blob(1, key, value, length);
+}
+
+/* Ring buffer, items on the heap with the ring's size accounting */
+
+struct host_rb_item {
+    struct host_rb_item *next;
+    size_t size;
+    bool complete;
+};
+
+struct host_rb {
+    size_t size;
+    size_t used;
+    struct host_rb_item *head, *tail;
+};
+
+/* An item takes its length rounded up to 32 bits and an 8 byte header */
+static size_t host_rb_cost(size_t size)
+{
+    return ((size + 3) & ~3) + 8;
+}
+
+RingbufHandle_t xRingbufferCreate(size_t size, RingbufferType_t type)
+{
+    struct host_rb *rb = calloc(1, sizeof(*rb));
+    if (rb != NULL) {
+        rb->size = size;
+    }
+    return rb;
+}
+
+void vRingbufferDelete(RingbufHandle_t handle)
+{
+    struct host_rb *rb = handle;
+    while (rb->head != NULL) {
+        struct host_rb_item *item = rb->head;
+        rb->head = item->next;
+        free(item);
+    }
+    free(rb);
+}
+
+BaseType_t xRingbufferSendAcquire(RingbufHandle_t handle, void **item, size_t size, TickType_t wait)
+{
+    struct host_rb *rb = handle;
+
+    if (rb->used + host_rb_cost(size) > rb->size) {
+        return pdFALSE;
+    }
+    struct host_rb_item *it = calloc(1, sizeof(*it) + size);
+    rb->used += host_rb_cost(size);
+    it->size = size;
+    if (rb->tail != NULL) {
+        rb->tail->next = it;
+    } else {
+        rb->head = it;
+    }
+    rb->tail = it;
+    *item = it + 1;
+    return pdTRUE;
+}
+
+BaseType_t xRingbufferSendComplete(RingbufHandle_t handle, void *item)
+{
+    ((struct host_rb_item *)item - 1)->complete = true;
+    return pdTRUE;
+}
+
+void *xRingbufferReceive(RingbufHandle_t handle, size_t *size, TickType_t wait)
+{
+    struct host_rb *rb = handle;
+    struct host_rb_item *it = rb->head;
+
+    if (it == NULL || !it->complete) {
+        return NULL;
+    }
+    rb->head = it->next;
+    if (rb->head == NULL) {
+        rb->tail = NULL;
+    }
+    *size = it->size;
+    return it + 1;
+}
+
+void vRingbufferReturnItem(RingbufHandle_t handle, void *item)
+{
+    struct host_rb *rb = handle;
+    struct host_rb_item *it = (struct host_rb_item *)item - 1;
+
+    rb->used -= host_rb_cost(it->size);
+    free(it);
+}
+
+/* pbufs, in one piece with room for the headers of their layer */
+
+struct pbuf *pbuf_alloc(pbuf_layer layer, u16_t length, pbuf_type type)
+{
+    struct pbuf *p = calloc(1, sizeof(*p) + layer + length);
+    if (p == NULL) {
+        return NULL;
+    }
+    p->payload = (u8_t *)(p + 1) + layer;
+    p->len = p->tot_len = length;
+    p->ref = 1;
+    return p;
+}
+
+struct pbuf *pbuf_clone(pbuf_layer layer, pbuf_type type, struct pbuf *p)
+{
+    struct pbuf *q = pbuf_alloc(layer, p->tot_len, type);
+    if (q != NULL) {
+        pbuf_copy_partial(p, q->payload, p->tot_len, 0);
+    }
+    return q;
+}
+
+u8_t pbuf_free(struct pbuf *p)
+{
+    if (--p->ref > 0) {
+        return 0;
+    }
+    if (p->flags & PBUF_FLAG_IS_CUSTOM) {
+        ((struct pbuf_custom *)p)->custom_free_function(p);
+    } else {
+        free(p);
+    }
+    return 1;
+}
+
+void pbuf_ref(struct pbuf *p)
+{
+    p->ref++;
+}
+
+void pbuf_realloc(struct pbuf *p, u16_t size)
+{
+    if (size < p->tot_len) {
+        p->len = p->tot_len = size;
+    }
+}
+
+u8_t pbuf_add_header_force(struct pbuf *p, size_t size)
+{
+    p->payload = (u8_t *)p->payload - size;
+    p->len += size;
+    p->tot_len += size;
+    return 0;
+}
+
+u8_t pbuf_add_header(struct pbuf *p, size_t size)
+{
+    if (!(p->flags & PBUF_FLAG_IS_CUSTOM) && (u8_t *)p->payload - size < (u8_t *)(p + 1)) {
+        return 1;
+    }
+    return pbuf_add_header_force(p, size);
+}
+
+u8_t pbuf_remove_header(struct pbuf *p, size_t size)
+{
+    if (size > p->len) {
+        return 1;
+    }
+    p->payload = (u8_t *)p->payload + size;
+    p->len -= size;
+    p->tot_len -= size;
+    return 0;
+}
+
+u8_t pbuf_header(struct pbuf *p, s16_t header_size)
+{
+    return header_size >= 0 ? pbuf_add_header(p, header_size) : pbuf_remove_header(p, -header_size);
+}
+
+u16_t pbuf_copy_partial(const struct pbuf *p, void *dataptr, u16_t len, u16_t offset)
+{
+    if (offset >= p->len) {
+        return 0;
+    }
+    u16_t n = LWIP_MIN(len, p->len - offset);
+    memcpy(dataptr, (const u8_t *)p->payload + offset, n);
+    return n;
+}
+
+err_t pbuf_take(struct pbuf *p, const void *dataptr, u16_t len)
+{
+    if (len > p->len) {
+        return ERR_MEM;
+    }
+    memcpy(p->payload, dataptr, len);
+    return ERR_OK;
+}
+
+u16_t inet_chksum(const void *dataptr, u16_t len)
+{
+    const u8_t *b = dataptr;
+    u32_t sum = 0;
+
+    for (u16_t i = 0; i < len; i += 2) {
+        sum += (b[i] << 8) | (i + 1 < len ? b[i + 1] : 0);
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return lwip_htons(~sum & 0xffff);
+}
+
+/* lwIP's timeouts, run by host_advance() */
+
+struct host_timeout {
+    sys_timeout_handler handler;
+    void *arg;
+    u32_t due;
+};
+
+static struct host_timeout host_timeouts[HOST_TIMEOUTS];
+
+u32_t sys_now(void)
+{
+    return host_now_ms;
+}
+
+void sys_timeout(u32_t msecs, sys_timeout_handler handler, void *arg)
+{
+    for (int i = 0; i < HOST_TIMEOUTS; i++) {
+        if (host_timeouts[i].handler == NULL) {
+            host_timeouts[i].handler = handler;
+            host_timeouts[i].arg = arg;
+            host_timeouts[i].due = host_now_ms + msecs;
+            return;
+        }
+    }
+    fprintf(stderr, "host: out of timeouts\n");
+    exit(1);
+}
+
+void sys_untimeout(sys_timeout_handler handler, void *arg)
+{
+    for (int i = 0; i < HOST_TIMEOUTS; i++) {
+        if (host_timeouts[i].handler == handler && host_timeouts[i].arg == arg) {
+            host_timeouts[i].handler = NULL;
+        }
+    }
+}
+
+void host_advance(u32_t ms)
+{
+    u32_t end = host_now_ms + ms;
+
+    for (;;) {
+        struct host_timeout *next = NULL;
+        for (int i = 0; i < HOST_TIMEOUTS; i++) {
+            struct host_timeout *t = &host_timeouts[i];
+            if (t->handler != NULL && (s32_t)(t->due - end) <= 0 &&
+                (next == NULL || (s32_t)(t->due - next->due) < 0)) {
+                next = t;
+            }
+        }
+        if (next == NULL) {
+            break;
+        }
+        if ((s32_t)(next->due - host_now_ms) > 0) {
+            host_now_ms = next->due;
+        }
+        struct host_timeout t = *next;
+        next->handler = NULL;
+        t.handler(t.arg);
+    }
+    host_now_ms = end;
+}
+
+err_t tcpip_api_call(tcpip_api_call_fn fn, struct tcpip_api_call_data *call)
+{
+    return fn(call);
+}
+
+err_t tcpip_inpkt(struct pbuf *p, struct netif *inp, netif_input_fn input_fn)
+{
+    return input_fn(p, inp);
+}
+
+/* The interfaces */
+
+void *esp_netif_get_netif_impl(esp_netif_t *esp_netif)
+{
+    return esp_netif;
+}
+
+WEAK esp_err_t esp_netif_dhcps_get_clients_by_mac(esp_netif_t *esp_netif, int num, esp_netif_pair_mac_ip_t *mac_ip_pair)
+{
+    return ESP_FAIL;
+}
+
+esp_err_t esp_netif_get_ip_info(esp_netif_t *esp_netif, esp_netif_ip_info_t *ip_info)
+{
+    struct netif *netif = (struct netif *)esp_netif;
+    ip_info->ip.addr = netif->ip_addr.addr;
+    ip_info->netmask.addr = netif->netmask.addr;
+    ip_info->gw.addr = netif->gw.addr;
+    return ESP_OK;
+}
+
+esp_err_t esp_netif_get_mac(esp_netif_t *esp_netif, uint8_t mac[])
+{
+    memcpy(mac, ((struct netif *)esp_netif)->hwaddr, ETH_HWADDR_LEN);
+    return ESP_OK;
+}
+
+u32_t ipaddr_addr(const char *cp)
+{
+    unsigned int b[4];
+    char end;
+
+    if (sscanf(cp, "%3u.%3u.%3u.%3u%c", &b[0], &b[1], &b[2], &b[3], &end) != 4 ||
+        b[0] > 255 || b[1] > 255 || b[2] > 255 || b[3] > 255) {
+        return IPADDR_NONE;
+    }
+    return PP_HTONL(LWIP_MAKEU32(b[0], b[1], b[2], b[3]));
+}
+
+uint32_t esp_ip4addr_aton(const char *addr)
+{
+    u32_t a = ipaddr_addr(addr);
+    return a != IPADDR_NONE ? a : 0;
+}
+
+u8_t ip4_addr_isbroadcast_u32(u32_t addr, const struct netif *netif)
+{
+    return addr == IPADDR_NONE || addr == 0 ||
+           addr == (netif->ip_addr.addr | ~netif->netmask.addr);
+}
+
+struct netif *ip4_route(const ip4_addr_t *dest)
+{
+    if (ip4_addr_netcmp(dest, &host_ap.ip_addr, &host_ap.netmask)) {
+        return &host_ap;
+    }
+    return &host_sta;
+}
+
+WEAK err_t ip4_frag(struct pbuf *p, struct netif *netif, const ip4_addr_t *dest)
+{
+    return ERR_OK;
+}
+
+WEAK void icmp_dest_unreach(struct pbuf *p, enum icmp_dur_type t)
+{
+}
+
+WEAK ssize_t etharp_find_addr(struct netif *netif, const ip4_addr_t *ipaddr, struct eth_addr **eth_ret, const ip4_addr_t **ip_ret)
+{
+    return -1;
+}
+
+WEAK err_t ethernet_input(struct pbuf *p, struct netif *netif)
+{
+    pbuf_free(p);
+    return ERR_OK;
+}
+
+static err_t host_output(struct netif *netif, struct pbuf *p, const ip4_addr_t *ipaddr)
+{
+    host_sent++;
+    host_sent_netif = netif;
+    pbuf_copy_partial(p, &host_pkt, sizeof(host_pkt), 0);
+    return ERR_OK;
+}
+
+static err_t host_linkoutput(struct netif *netif, struct pbuf *p)
+{
+    return ERR_OK;
+}
+
+static void host_record6(struct netif *netif, struct pbuf *p, const struct eth_addr *mac)
+{
+    host_sent6++;
+    host_sent6_netif = netif;
+    memset(&host_sent6_mac, 0, sizeof(host_sent6_mac));
+    if (mac != NULL) {
+        host_sent6_mac = *mac;
+    }
+    host_pkt6_len = pbuf_copy_partial(p, host_pkt6, sizeof(host_pkt6), 0);
+}
+
+static err_t host_output_ip6(struct netif *netif, struct pbuf *p, const ip6_addr_t *ipaddr)
+{
+    host_record6(netif, p, NULL);
+    return ERR_OK;
+}
+
+err_t ethernet_output(struct netif *netif, struct pbuf *p, const struct eth_addr *src,
+                      const struct eth_addr *dst, u16_t eth_type)
+{
+    host_record6(netif, p, dst);
+    return ERR_OK;
+}
+
+/* Puts the IPv6 header on and hands the packet to the netif, as lwIP's
+ * does once the route is known */
+err_t ip6_output_if(struct pbuf *p, const ip6_addr_t *src, const ip6_addr_t *dest, u8_t hl, u8_t tc,
+                    u8_t nexth, struct netif *netif)
+{
+    u16_t plen = p->tot_len;
+
+    if (pbuf_add_header(p, IP6_HLEN) != 0) {
+        return ERR_BUF;
+    }
+    struct ip6_hdr *ip6hdr = (struct ip6_hdr *)p->payload;
+    ip6hdr->_v_tc_fl = lwip_htonl((6UL << 28) | ((u32_t)tc << 20));
+    ip6hdr->_plen = lwip_htons(plen);
+    ip6hdr->_nexth = nexth;
+    ip6hdr->_hoplim = hl;
+    memcpy(&ip6hdr->src, src->addr, 16);
+    memcpy(&ip6hdr->dest, dest->addr, 16);
+    err_t err = netif->output_ip6(netif, p, dest);
+    pbuf_remove_header(p, IP6_HLEN);
+    return err;
+}
+
+WEAK struct udp_pcb *udp_new(void)
+{
+    return calloc(1, sizeof(struct udp_pcb));
+}
+
+WEAK void udp_remove(struct udp_pcb *pcb)
+{
+    for (struct udp_pcb **pp = &udp_pcbs; *pp != NULL; pp = &(*pp)->next) {
+        if (*pp == pcb) {
+            *pp = pcb->next;
+            break;
+        }
+    }
+    free(pcb);
+}
+
+err_t udp_bind(struct udp_pcb *pcb, const ip_addr_t *ipaddr, u16_t port)
+{
+    pcb->local_port = port;
+    pcb->next = udp_pcbs;
+    udp_pcbs = pcb;
+    return ERR_OK;
+}
+
+void udp_recv(struct udp_pcb *pcb, udp_recv_fn recv, void *recv_arg)
+{
+    pcb->recv = recv;
+    pcb->recv_arg = recv_arg;
+}
+
+WEAK err_t udp_sendto_if_src(struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *dst_ip, u16_t dst_port,
+                             struct netif *netif, const ip_addr_t *src_ip)
+{
+    return ERR_OK;
+}
+
+bool host_udp_input(struct netif *inp, u32_t src, u16_t sport, u32_t dest, u16_t dport, const void *data,
+                    u16_t len)
+{
+    for (struct udp_pcb *pcb = udp_pcbs; pcb != NULL; pcb = pcb->next) {
+        if (pcb->local_port != dport || pcb->recv == NULL) {
+            continue;
+        }
+        struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, len, PBUF_RAM);
+        ip_addr_t addr;
+        HOST_CHECK(p != NULL);
+        memcpy(p->payload, data, len);
+        ip_addr_set_ip4_u32(&addr, src);
+        host_input_netif = inp;
+        host_input_dest.addr = dest;
+        pcb->recv(pcb->recv_arg, pcb, p, &addr, sport);
+        host_input_netif = NULL;
+        return true;
+    }
+    return false;
+}
+
+WEAK err_t igmp_joingroup_netif(struct netif *netif, const ip4_addr_t *groupaddr)
+{
+    return ERR_OK;
+}
+
+WEAK err_t igmp_leavegroup_netif(struct netif *netif, const ip4_addr_t *groupaddr)
+{
+    return ERR_OK;
+}
+
+WEAK err_t udp_sendto(struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *dst_ip, u16_t dst_port)
+{
+    return ERR_OK;
+}
+
+WEAK void tcp_rst(const struct tcp_pcb *pcb, u32_t seqno, u32_t ackno, const ip_addr_t *local_ip,
+                  const ip_addr_t *remote_ip, u16_t local_port, u16_t remote_port)
+{
+}
+
+/* Sockets. The thread of the code under test runs only while the test
+ * waits for it, in host_sock_input() and host_sock_tick(). */
+
+struct host_sock {
+    bool used;
+    u32_t addr, peer;
+    u16_t port;
+    struct host_dgram rx;       /* len 0 if none */
+};
+
+static struct host_sock host_socks[HOST_SOCKS];
+static pthread_mutex_t host_sock_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t host_sock_cond = PTHREAD_COND_INITIALIZER;
+static bool host_sock_waiting;      /* the thread is in select() */
+static bool host_sock_timeout;
+struct host_dgram host_sock_sent[HOST_SOCK_SENT];
+int host_sock_sent_count;
+
+static struct host_sock *host_sock_get(int s)
+{
+    HOST_CHECK(s >= HOST_SOCK_FD0 && s < HOST_SOCK_FD0 + HOST_SOCKS && host_socks[s - HOST_SOCK_FD0].used);
+    return &host_socks[s - HOST_SOCK_FD0];
+}
+
+int lwip_socket(int domain, int type, int protocol)
+{
+    for (int i = 0; i < HOST_SOCKS; i++) {
+        if (!host_socks[i].used) {
+            memset(&host_socks[i], 0, sizeof(host_socks[i]));
+            host_socks[i].used = true;
+            return HOST_SOCK_FD0 + i;
+        }
+    }
+    return -1;
+}
+
+int lwip_bind(int s, const struct sockaddr *name, socklen_t namelen)
+{
+    const struct sockaddr_in *sin = (const struct sockaddr_in *)name;
+    struct host_sock *sock = host_sock_get(s);
+
+    HOST_CHECK(namelen == sizeof(*sin) && sin->sin_family == AF_INET);
+    sock->addr = sin->sin_addr.s_addr;
+    sock->port = lwip_ntohs(sin->sin_port);
+    return 0;
+}
+
+int lwip_setsockopt(int s, int level, int optname, const void *optval, socklen_t optlen)
+{
+    host_sock_get(s);
+    return 0;
+}
+
+int lwip_close(int s)
+{
+    host_sock_get(s)->used = false;
+    return 0;
+}
+
+static bool host_sock_readable(int maxfdp1, fd_set *readset)
+{
+    for (int s = HOST_SOCK_FD0; s < maxfdp1; s++) {
+        if (FD_ISSET(s, readset) && host_sock_get(s)->rx.len > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int lwip_select(int maxfdp1, fd_set *readset, fd_set *writeset, fd_set *exceptset, struct timeval *timeout)
+{
+    int n = 0;
+
+    pthread_mutex_lock(&host_sock_lock);
+    host_sock_waiting = true;
+    pthread_cond_broadcast(&host_sock_cond);
+    while (!host_sock_timeout && !host_sock_readable(maxfdp1, readset)) {
+        pthread_cond_wait(&host_sock_cond, &host_sock_lock);
+    }
+    host_sock_waiting = false;
+    host_sock_timeout = false;
+    for (int s = HOST_SOCK_FD0; s < maxfdp1; s++) {
+        if (FD_ISSET(s, readset) && host_sock_get(s)->rx.len > 0) {
+            n++;
+        } else {
+            FD_CLR(s, readset);
+        }
+    }
+    pthread_mutex_unlock(&host_sock_lock);
+    return n;
+}
+
+ssize_t lwip_recvfrom(int s, void *mem, size_t len, int flags, struct sockaddr *from, socklen_t *fromlen)
+{
+    struct sockaddr_in *sin = (struct sockaddr_in *)from;
+    ssize_t n = -1;
+
+    pthread_mutex_lock(&host_sock_lock);
+    struct host_sock *sock = host_sock_get(s);
+    if (sock->rx.len > 0) {
+        n = LWIP_MIN(len, sock->rx.len);
+        memcpy(mem, sock->rx.data, n);
+        HOST_CHECK(*fromlen >= sizeof(*sin));
+        memset(sin, 0, sizeof(*sin));
+        sin->sin_len = sizeof(*sin);
+        sin->sin_family = AF_INET;
+        sin->sin_port = lwip_htons(sock->rx.sport);
+        sin->sin_addr.s_addr = sock->rx.src;
+        *fromlen = sizeof(*sin);
+        sock->rx.len = 0;
+    }
+    pthread_mutex_unlock(&host_sock_lock);
+    return n;
+}
+
+ssize_t lwip_sendto(int s, const void *dataptr, size_t size, int flags, const struct sockaddr *to, socklen_t tolen)
+{
+    const struct sockaddr_in *sin = (const struct sockaddr_in *)to;
+
+    pthread_mutex_lock(&host_sock_lock);
+    struct host_sock *sock = host_sock_get(s);
+    HOST_CHECK(tolen >= sizeof(*sin) && sin->sin_family == AF_INET && size <= sizeof(host_sock_sent[0].data));
+    if (host_sock_sent_count < HOST_SOCK_SENT) {
+        struct host_dgram *d = &host_sock_sent[host_sock_sent_count++];
+        d->src = sock->addr;
+        d->sport = sock->port;
+        d->dest = sin->sin_addr.s_addr;
+        d->dport = lwip_ntohs(sin->sin_port);
+        d->len = size;
+        memcpy(d->data, dataptr, size);
+    }
+    pthread_mutex_unlock(&host_sock_lock);
+    return size;
+}
+
+int lwip_getpeername(int s, struct sockaddr *name, socklen_t *namelen)
+{
+    struct sockaddr_in *sin = (struct sockaddr_in *)name;
+    struct host_sock *sock = host_sock_get(s);
+
+    if (sock->peer == 0) {
+        return -1;
+    }
+    HOST_CHECK(*namelen >= sizeof(*sin));
+    memset(sin, 0, sizeof(*sin));
+    sin->sin_len = sizeof(*sin);
+    sin->sin_family = AF_INET;
+    sin->sin_addr.s_addr = sock->peer;
+    *namelen = sizeof(*sin);
+    return 0;
+}
+
+int host_sock_peer(u32_t addr)
+{
+    int s = lwip_socket(AF_INET, 1, 0);
+    HOST_CHECK(s >= 0);
+    host_sock_get(s)->peer = addr;
+    return s;
+}
+
+void host_sock_input(u32_t src, u16_t sport, u32_t dest, u16_t dport, const void *data, u16_t len)
+{
+    struct host_sock *sock = NULL;
+
+    HOST_CHECK(len > 0 && len <= sizeof(sock->rx.data));
+    pthread_mutex_lock(&host_sock_lock);
+    while (!host_sock_waiting) {
+        pthread_cond_wait(&host_sock_cond, &host_sock_lock);
+    }
+    for (int i = 0; i < HOST_SOCKS && sock == NULL; i++) {
+        struct host_sock *t = &host_socks[i];
+        if (t->used && t->port == dport && (t->addr == INADDR_ANY || t->addr == dest)) {
+            sock = t;
+        }
+    }
+    HOST_CHECK(sock != NULL);
+    sock->rx = (struct host_dgram){ .src = src, .sport = sport, .dest = dest, .dport = dport, .len = len };
+    memcpy(sock->rx.data, data, len);
+    pthread_cond_broadcast(&host_sock_cond);
+    while (sock->rx.len > 0 || !host_sock_waiting) {
+        pthread_cond_wait(&host_sock_cond, &host_sock_lock);
+    }
+    pthread_mutex_unlock(&host_sock_lock);
+}
+
+void host_sock_tick(void)
+{
+    pthread_mutex_lock(&host_sock_lock);
+    while (!host_sock_waiting) {
+        pthread_cond_wait(&host_sock_cond, &host_sock_lock);
+    }
+    host_sock_timeout = true;
+    pthread_cond_broadcast(&host_sock_cond);
+    while (host_sock_timeout || !host_sock_waiting) {
+        pthread_cond_wait(&host_sock_cond, &host_sock_lock);
+    }
+    pthread_mutex_unlock(&host_sock_lock);
+}
+
+/* The HTTP server, the handlers run in the test's thread */
+
+static httpd_uri_t host_httpd_uris[HOST_HTTPD_URIS];
+static int host_httpd_uri_count;
+
+esp_err_t httpd_register_uri_handler(httpd_handle_t handle, const httpd_uri_t *uri_handler)
+{
+    HOST_CHECK(host_httpd_uri_count < HOST_HTTPD_URIS);
+    host_httpd_uris[host_httpd_uri_count++] = *uri_handler;
+    return ESP_OK;
+}
+
+const httpd_uri_t *host_httpd_handler(int method, const char *uri)
+{
+    for (int i = 0; i < host_httpd_uri_count; i++) {
+        const httpd_uri_t *h = &host_httpd_uris[i];
+        size_t n = strlen(h->uri);
+        if (h->method == method && (strcmp(h->uri, uri) == 0 ||
+                                    (n > 0 && h->uri[n - 1] == '*' && strncmp(h->uri, uri, n - 1) == 0))) {
+            return h;
+        }
+    }
+    return NULL;
+}
+
+int httpd_req_to_sockfd(httpd_req_t *r)
+{
+    return r->fd;
+}
+
+/* The body in pieces of at most 100 bytes, as it may come off the socket */
+int httpd_req_recv(httpd_req_t *r, char *buf, size_t buf_len)
+{
+    size_t n = LWIP_MIN(LWIP_MIN(buf_len, 100), r->content_len - r->body_read);
+    memcpy(buf, r->body + r->body_read, n);
+    r->body_read += n;
+    return n;
+}
+
+esp_err_t httpd_req_get_hdr_value_str(httpd_req_t *r, const char *field, char *val, size_t val_size)
+{
+    size_t fl = strlen(field);
+
+    for (const char *line = r->headers; line != NULL && *line != '\0'; line = strchr(line, '\n') + 1) {
+        if (strncasecmp(line, field, fl) == 0 && line[fl] == ':') {
+            const char *v = line + fl + 1 + strspn(line + fl + 1, " ");
+            size_t n = strcspn(v, "\r\n");
+            strlcpy(val, v, LWIP_MIN(n + 1, val_size));
+            return n < val_size ? ESP_OK : ESP_ERR_HTTPD_RESULT_TRUNC;
+        }
+        if (strchr(line, '\n') == NULL) {
+            break;
+        }
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t httpd_resp_set_type(httpd_req_t *r, const char *type)
+{
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_status(httpd_req_t *r, const char *status)
+{
+    r->status = status;
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_send(httpd_req_t *r, const char *buf, ssize_t buf_len)
+{
+    HOST_CHECK(buf_len >= 0 && r->resp_len + buf_len < sizeof(r->resp));
+    memcpy(r->resp + r->resp_len, buf, buf_len);
+    r->resp_len += buf_len;
+    r->resp[r->resp_len] = '\0';
+    if (r->status == NULL) {
+        r->status = "200 OK";
+    }
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_sendstr(httpd_req_t *r, const char *str)
+{
+    return httpd_resp_send(r, str, strlen(str));
+}
+
+esp_err_t httpd_resp_send_err(httpd_req_t *req, httpd_err_code_t error, const char *msg)
+{
+    req->status = error == HTTPD_404_NOT_FOUND ? "404 Not Found" : "400 Bad Request";
+    return httpd_resp_sendstr(req, msg);
+}
+
+static void host_netif_init(struct netif *netif, u32_t addr, u32_t gw, u8_t mac_last)
+{
+    memset(netif, 0, sizeof(*netif));
+    netif->ip_addr.addr = addr;
+    netif->netmask.addr = HOST_IP(255, 255, 255, 0);
+    netif->gw.addr = gw;
+    netif->output = host_output;
+    netif->linkoutput = host_linkoutput;
+    netif->output_ip6 = host_output_ip6;
+    netif->mtu = 1500;
+    netif->mtu6 = 1500;
+    netif->hwaddr_len = ETH_HWADDR_LEN;
+    memcpy(netif->hwaddr, (u8_t[]){ 0x24, 0x0a, 0xc4, 0, 0, mac_last }, ETH_HWADDR_LEN);
+}
+
+void host_init(void)
+{
+    for (int i = 0; i < HOST_NVS_KEYS; i++) {
+        free(host_nvs[i].value);
+        host_nvs[i].value = NULL;
+    }
+    memset(host_timeouts, 0, sizeof(host_timeouts));
+    host_now_ms = 1000;
+    host_sent = 0;
+    host_sent_netif = NULL;
+    host_sent6 = 0;
+    host_sent6_netif = NULL;
+    host_netif_init(&host_sta, HOST_STA_IP, HOST_IP(10, 0, 0, 1), 1);
+    host_netif_init(&host_ap, HOST_AP_IP, 0, 2);
+    my_ip = HOST_STA_IP;
+    my_ap_ip = HOST_AP_IP;
+    ap_connect = true;
+}
+
+/* Packets */
+
+static u32_t host_sum(u32_t sum, const void *data, size_t len)
+{
+    const u8_t *b = data;
+    for (size_t i = 0; i < len; i += 2) {
+        sum += (b[i] << 8) | (i + 1 < len ? b[i + 1] : 0);
+    }
+    return sum;
+}
+
+static u16_t host_fold(u32_t sum)
+{
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return sum;
+}
+
+static u16_t host_sum6(const void *src, const void *dest, u8_t proto, const void *data, u16_t len)
+{
+    u32_t sum = host_sum(host_sum(0, src, 16), dest, 16);
+    sum += len + proto;
+    return host_fold(host_sum(sum, data, len));
+}
+
+u16_t ip6_chksum_pseudo(struct pbuf *p, u8_t proto, u16_t proto_len, const ip6_addr_t *src,
+                        const ip6_addr_t *dest)
+{
+    return lwip_htons(~host_sum6(src->addr, dest->addr, proto, p->payload, proto_len) & 0xffff);
+}
+
+bool host_pkt6_csum_ok(void)
+{
+    const struct ip6_hdr *ip6hdr = (const struct ip6_hdr *)host_pkt6;
+    u16_t plen = IP6H_PLEN(ip6hdr);
+
+    return host_pkt6_len == IP6_HLEN + plen &&
+           host_sum6(&ip6hdr->src, &ip6hdr->dest, IP6H_NEXTH(ip6hdr), host_pkt6 + IP6_HLEN, plen) == 0xffff;
+}
+
+/* One's complement sum of the pseudo header and the transport part */
+static u16_t host_l4_sum(void)
+{
+    u16_t len = lwip_ntohs(IPH_LEN(&host_pkt.ip)) - IP_HLEN;
+    u8_t pseudo[12];
+
+    memcpy(pseudo, &host_pkt.ip.src, 4);
+    memcpy(pseudo + 4, &host_pkt.ip.dest, 4);
+    pseudo[8] = 0;
+    pseudo[9] = IPH_PROTO(&host_pkt.ip);
+    pseudo[10] = len >> 8;
+    pseudo[11] = len & 0xff;
+    return host_fold(host_sum(host_sum(0, pseudo, sizeof(pseudo)), &host_pkt.udp, len));
+}
+
+bool host_pkt_csum_ok(void)
+{
+    return host_fold(host_sum(0, &host_pkt.ip, IP_HLEN)) == 0xffff && host_l4_sum() == 0xffff;
+}
+
+/* Runs the hook on host_pkt as lwIP would: on a pbuf of its own, which the
+ * hook frees if it takes the packet. What it leaves to lwIP is copied back
+ * and freed here. */
+static int host_input(struct netif *inp, u16_t len)
+{
+    struct pbuf *p = pbuf_alloc(PBUF_IP, len, PBUF_RAM);
+    memcpy(p->payload, &host_pkt, len);
+    int ret = router_ip4_input_hook(p, inp);
+    if (ret == 0) {
+        pbuf_copy_partial(p, &host_pkt, sizeof(host_pkt), 0);
+        pbuf_free(p);
+    }
+    return ret;
+}
+
+static void host_ip_hdr(u8_t proto, u32_t src, u32_t dest)
+{
+    memset(&host_pkt, 0, sizeof(host_pkt));
+    IPH_VHL_SET(&host_pkt.ip, 4, IP_HLEN / 4);
+    IPH_TTL_SET(&host_pkt.ip, 64);
+    IPH_PROTO_SET(&host_pkt.ip, proto);
+    host_pkt.ip.src.addr = src;
+    host_pkt.ip.dest.addr = dest;
+}
+
+/* Completes the lengths and checksums of the packet in host_pkt */
+static u16_t host_finish(u16_t len)
+{
+    IPH_LEN_SET(&host_pkt.ip, lwip_htons(len));
+    IPH_CHKSUM_SET(&host_pkt.ip, inet_chksum(&host_pkt.ip, IP_HLEN));
+    return len;
+}
+
+u16_t host_udp_pkt(u32_t src, u16_t sport, u32_t dest, u16_t dport)
+{
+    u16_t len = IP_HLEN + UDP_HLEN + sizeof(host_pkt.data);
+
+    host_ip_hdr(IP_PROTO_UDP, src, dest);
+    host_pkt.udp.src = lwip_htons(sport);
+    host_pkt.udp.dest = lwip_htons(dport);
+    host_pkt.udp.len = lwip_htons(len - IP_HLEN);
+    IPH_LEN_SET(&host_pkt.ip, lwip_htons(len));
+    host_pkt.udp.chksum = lwip_htons(~host_l4_sum() & 0xffff);
+    return host_finish(len);
+}
+
+u16_t host_tcp_pkt(u32_t src, u16_t sport, u32_t dest, u16_t dport, u8_t flags)
+{
+    u16_t len = IP_HLEN + TCP_HLEN;
+
+    host_ip_hdr(IP_PROTO_TCP, src, dest);
+    host_pkt.tcp.src = lwip_htons(sport);
+    host_pkt.tcp.dest = lwip_htons(dport);
+    host_pkt.tcp._hdrlen_rsvd_flags = lwip_htons((TCP_HLEN / 4) << 12 | flags);
+    host_pkt.tcp.wnd = lwip_htons(8192);
+    IPH_LEN_SET(&host_pkt.ip, lwip_htons(len));
+    host_pkt.tcp.chksum = lwip_htons(~host_l4_sum() & 0xffff);
+    return host_finish(len);
+}
+
+int host_udp(struct netif *inp, u32_t src, u16_t sport, u32_t dest, u16_t dport)
+{
+    return host_input(inp, host_udp_pkt(src, sport, dest, dport));
+}
+
+int host_tcp(struct netif *inp, u32_t src, u16_t sport, u32_t dest, u16_t dport, u8_t flags)
+{
+    return host_input(inp, host_tcp_pkt(src, sport, dest, dport, flags));
+}
@@ -0,0 +1,810 @@
+/* Host build of the forwarding code of the esp32_nat_router
+
+   Stands in for every ESP-IDF, FreeRTOS and lwIP header the sources in
+   main/ include, see HEADERS in the Makefile, with only what they use.
+   Types and macros follow the real ones closely enough for the code to
+   be compiled unchanged, with lwIP's values and byte order.
+
+   The second half declares what host.c provides for the tests: an NVS
+   in RAM, a clock and lwIP's timeouts, pbufs on the heap, the two
+   interfaces, and packets to feed router_ip4_input_hook().
+
+   Unless required by applicable law or agreed to in writing, this
+   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+   CONDITIONS OF ANY KIND, either express or implied.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/select.h>
+
+/* esp_err.h, esp_log.h, esp_attr.h */
+
+typedef int esp_err_t;
+
+#define ESP_OK                      0
+#define ESP_FAIL                    -1
+#define ESP_ERR_NO_MEM              0x101
+#define ESP_ERR_INVALID_ARG         0x102
+#define ESP_ERR_INVALID_STATE       0x103
+#define ESP_ERR_INVALID_SIZE        0x104
+#define ESP_ERR_NOT_FOUND           0x105
+#define ESP_ERR_NOT_SUPPORTED       0x106
+#define ESP_ERR_TIMEOUT             0x107
+#define ESP_ERR_NVS_NOT_FOUND       0x1102
+#define ESP_ERR_NVS_INVALID_LENGTH  0x110c
+
+const char *esp_err_to_name(esp_err_t code);
+
+/* Logs nothing, but has the compiler check the arguments */
+static inline __attribute__((format(printf, 2, 3))) void host_log(const char *tag, const char *format, ...)
+{
+}
+
+#define ESP_LOGE(tag, format, ...) host_log(tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) host_log(tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) host_log(tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...) host_log(tag, format, ##__VA_ARGS__)
+#define ESP_ERROR_CHECK(x) ((void)(x))
+
+#define IRAM_ATTR
+#define DRAM_ATTR
+
+#define MACSTR "%02x:%02x:%02x:%02x:%02x:%02x"
+#define MAC2STR(a) (a)[0], (a)[1], (a)[2], (a)[3], (a)[4], (a)[5]
+
+size_t strlcpy(char *dst, const char *src, size_t size);
+
+/* esp_cpu.h, esp_rom_sys.h: the cycle counter runs at 160 MHz off the
+ * host's monotonic clock */
+
+uint32_t esp_cpu_get_cycle_count(void);
+static inline uint32_t esp_rom_get_cpu_ticks_per_us(void) { return 160; }
+
+/* esp_heap_caps.h, esp_timer.h */
+
+#define MALLOC_CAP_EXEC         (1 << 0)
+#define MALLOC_CAP_8BIT         (1 << 2)
+#define MALLOC_CAP_INTERNAL     (1 << 11)
+#define MALLOC_CAP_IRAM_8BIT    (1 << 13)
+
+size_t heap_caps_get_free_size(uint32_t caps);
+void *heap_caps_malloc(size_t size, uint32_t caps);
+void *heap_caps_calloc(size_t n, size_t size, uint32_t caps);
+
+int64_t esp_timer_get_time(void);
+
+/* nvs.h */
+
+typedef uint32_t nvs_handle_t;
+typedef enum { NVS_READONLY, NVS_READWRITE } nvs_open_mode_t;
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t mode, nvs_handle_t *handle);
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *value, size_t *length);
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t length);
+esp_err_t nvs_get_i32(nvs_handle_t handle, const char *key, int32_t *value);
+esp_err_t nvs_set_i32(nvs_handle_t handle, const char *key, int32_t value);
+esp_err_t nvs_get_u32(nvs_handle_t handle, const char *key, uint32_t *value);
+esp_err_t nvs_set_u32(nvs_handle_t handle, const char *key, uint32_t value);
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key);
+esp_err_t nvs_commit(nvs_handle_t handle);
+void nvs_close(nvs_handle_t handle);
+
+/* freertos/FreeRTOS.h, freertos/ringbuf.h: a NOSPLIT ring buffer of the
+ * same size accounting, that never waits */
+
+typedef int BaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdTRUE  1
+#define pdFALSE 0
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms) / 10)
+
+typedef void *RingbufHandle_t;
+typedef enum { RINGBUF_TYPE_NOSPLIT, RINGBUF_TYPE_ALLOWSPLIT, RINGBUF_TYPE_BYTEBUF } RingbufferType_t;
+
+RingbufHandle_t xRingbufferCreate(size_t size, RingbufferType_t type);
+void vRingbufferDelete(RingbufHandle_t rb);
+BaseType_t xRingbufferSendAcquire(RingbufHandle_t rb, void **item, size_t size, TickType_t wait);
+BaseType_t xRingbufferSendComplete(RingbufHandle_t rb, void *item);
+void *xRingbufferReceive(RingbufHandle_t rb, size_t *size, TickType_t wait);
+void vRingbufferReturnItem(RingbufHandle_t rb, void *item);
+
+/* lwip/opt.h, lwip/def.h, lwip/err.h */
+
+typedef uint8_t u8_t;
+typedef int8_t s8_t;
+typedef uint16_t u16_t;
+typedef int16_t s16_t;
+typedef uint32_t u32_t;
+typedef int32_t s32_t;
+typedef uint64_t u64_t;
+typedef s8_t err_t;
+
+#define ERR_OK          0
+#define ERR_MEM         -1
+#define ERR_BUF         -2
+#define ERR_TIMEOUT     -3
+#define ERR_RTE         -4
+#define ERR_INPROGRESS  -5
+#define ERR_VAL         -6
+
+#define LWIP_IPV6 1
+#define LWIP_ICMP6_HL 255
+#define LWIP_UNUSED_ARG(x) (void)(x)
+#define LWIP_MIN(x, y) (((x) < (y)) ? (x) : (y))
+#define LWIP_MAX(x, y) (((x) > (y)) ? (x) : (y))
+#define SMEMCPY(dst, src, len) memcpy(dst, src, len)
+
+#define PP_HTONS(x) ((u16_t)((((x) & 0x00ffUL) << 8) | (((x) & 0xff00UL) >> 8)))
+#define PP_NTOHS(x) PP_HTONS(x)
+#define PP_HTONL(x) ((u32_t)__builtin_bswap32((u32_t)(x)))
+#define PP_NTOHL(x) PP_HTONL(x)
+#define lwip_htons(x) PP_HTONS(x)
+#define lwip_ntohs(x) PP_NTOHS(x)
+#define lwip_htonl(x) PP_HTONL(x)
+#define lwip_ntohl(x) PP_NTOHL(x)
+
+/* lwip/ip4_addr.h, lwip/ip_addr.h, lwip/ip6_addr.h */
+
+typedef struct { u32_t addr; } ip4_addr_t;
+typedef struct __attribute__((packed)) { u32_t addr; } ip4_addr_p_t;
+typedef struct { u32_t addr[4]; } ip6_addr_t;
+typedef struct __attribute__((packed)) { u32_t addr[4]; } ip6_addr_p_t;
+typedef struct { union { ip6_addr_t ip6; ip4_addr_t ip4; } u_addr; u8_t type; } ip_addr_t;
+
+#define IPADDR_NONE     ((u32_t)0xffffffffUL)
+#define IPADDR_TYPE_V4  0
+#define IPADDR_TYPE_V6  6
+#define IPADDR4_INIT(u32val) { { { { u32val, 0ul, 0ul, 0ul } } }, IPADDR_TYPE_V4 }
+#define LWIP_MAKEU32(a, b, c, d) (((u32_t)((a) & 0xff) << 24) | ((u32_t)((b) & 0xff) << 16) | \
+                                  ((u32_t)((c) & 0xff) << 8) | (u32_t)((d) & 0xff))
+#define IPADDR4_INIT_BYTES(a, b, c, d) IPADDR4_INIT(PP_HTONL(LWIP_MAKEU32(a, b, c, d)))
+
+extern const ip_addr_t ip_addr_any;
+#define IP_ADDR_ANY (&ip_addr_any)
+
+#define IPSTR "%d.%d.%d.%d"
+#define ip4_addr_get_byte(a, i) (((const u8_t *)(&(a)->addr))[i])
+#define IP2STR(a) ip4_addr_get_byte(a, 0), ip4_addr_get_byte(a, 1), ip4_addr_get_byte(a, 2), ip4_addr_get_byte(a, 3)
+
+#define ip4_addr_copy(dest, src) ((dest).addr = (src).addr)
+#define ip4_addr_get_u32(a) ((a)->addr)
+#define ip4_addr_set_u32(a, v) ((a)->addr = (v))
+#define ip4_addr_cmp(a, b) ((a)->addr == (b)->addr)
+#define ip4_addr_isany_val(a) ((a).addr == 0)
+#define ip4_addr_netcmp(a, b, mask) ((((a)->addr ^ (b)->addr) & (mask)->addr) == 0)
+#define ip4_addr_ismulticast(a) (((a)->addr & PP_HTONL(0xf0000000UL)) == PP_HTONL(0xe0000000UL))
+#define ip4_addr_islinklocal(a) (((a)->addr & PP_HTONL(0xffff0000UL)) == PP_HTONL(0xa9fe0000UL))
+#define ip4_addr_isbroadcast(a, netif) ip4_addr_isbroadcast_u32((a)->addr, netif)
+
+#define IP6_ADDR_INVALID    0x00
+#define IP6_ADDR_TENTATIVE  0x08
+#define IP6_ADDR_VALID      0x10
+#define IP6_ADDR_PREFERRED  0x30
+#define IP6_UNKNOWN         0
+
+#define ip6_addr_isvalid(state) ((state) & IP6_ADDR_VALID)
+#define ip6_addr_islinklocal(a) (((a)->addr[0] & PP_HTONL(0xffc00000UL)) == PP_HTONL(0xfe800000UL))
+#define ip6_addr_ismulticast(a) (((a)->addr[0] & PP_HTONL(0xff000000UL)) == PP_HTONL(0xff000000UL))
+#define ip6_addr_set_zero(a) memset((a)->addr, 0, 16)
+#define ip6_addr_assign_zone(a, type, netif) ((void)0)
+#define IP6_ADDR(a, i0, i1, i2, i3) do { \
+    (a)->addr[0] = (i0); (a)->addr[1] = (i1); (a)->addr[2] = (i2); (a)->addr[3] = (i3); \
+} while (0)
+#define ip6_addr_set_allnodes_linklocal(a) IP6_ADDR(a, PP_HTONL(0xff020000UL), 0, 0, PP_HTONL(0x00000001UL))
+
+#define ip_2_ip4(a) (&((a)->u_addr.ip4))
+#define IP_IS_V4(a) ((a)->type == IPADDR_TYPE_V4)
+#define ip_addr_set_ip4_u32(a, v) do { (a)->u_addr.ip4.addr = (v); (a)->type = IPADDR_TYPE_V4; } while (0)
+
+/* lwip/prot/ip4.h, tcp.h, udp.h, icmp.h */
+
+#define IP_PROTO_ICMP   1
+#define IP_PROTO_IGMP   2
+#define IP_PROTO_TCP    6
+#define IP_PROTO_UDP    17
+
+struct ip_hdr {
+    u16_t _v_hl_tos;
+    u16_t _len;
+    u16_t _id;
+    u16_t _offset;
+    u8_t _ttl;
+    u8_t _proto;
+    u16_t _chksum;
+    ip4_addr_p_t src;
+    ip4_addr_p_t dest;
+} __attribute__((packed));
+
+#define IP_HLEN     20
+#define IP_DF       0x4000U
+#define IP_MF       0x2000U
+#define IP_OFFMASK  0x1fffU
+
+#define IPH_V(h)            ((u8_t)((h)->_v_hl_tos & 0xf0) >> 4)
+#define IPH_HL_BYTES(h)     ((u16_t)(((h)->_v_hl_tos & 0x0f) * 4))
+#define IPH_TOS(h)          ((u8_t)((h)->_v_hl_tos >> 8))
+#define IPH_LEN(h)          ((h)->_len)
+#define IPH_ID(h)           ((h)->_id)
+#define IPH_OFFSET(h)       ((h)->_offset)
+#define IPH_TTL(h)          ((h)->_ttl)
+#define IPH_PROTO(h)        ((h)->_proto)
+#define IPH_CHKSUM(h)       ((h)->_chksum)
+#define IPH_VHL_SET(h, v, hl) ((h)->_v_hl_tos = (u16_t)(((h)->_v_hl_tos & 0xff00) | ((v) << 4) | (hl)))
+#define IPH_TOS_SET(h, tos) (((u8_t *)(h))[1] = (u8_t)(tos))
+#define IPH_LEN_SET(h, len) ((h)->_len = (len))
+#define IPH_ID_SET(h, id)   ((h)->_id = (id))
+#define IPH_OFFSET_SET(h, off) ((h)->_offset = (off))
+#define IPH_TTL_SET(h, ttl) ((h)->_ttl = (u8_t)(ttl))
+#define IPH_PROTO_SET(h, proto) ((h)->_proto = (u8_t)(proto))
+#define IPH_CHKSUM_SET(h, chksum) ((h)->_chksum = (chksum))
+
+struct tcp_hdr {
+    u16_t src;
+    u16_t dest;
+    u32_t seqno;
+    u32_t ackno;
+    u16_t _hdrlen_rsvd_flags;
+    u16_t wnd;
+    u16_t chksum;
+    u16_t urgp;
+} __attribute__((packed));
+
+#define TCP_HLEN 20
+#define TCP_FIN 0x01U
+#define TCP_SYN 0x02U
+#define TCP_RST 0x04U
+#define TCP_PSH 0x08U
+#define TCP_ACK 0x10U
+#define TCPH_FLAGS(h) ((u8_t)(lwip_ntohs((h)->_hdrlen_rsvd_flags) & 0x3f))
+#define TCPH_HDRLEN_BYTES(h) ((u8_t)((lwip_ntohs((h)->_hdrlen_rsvd_flags) >> 12) * 4))
+
+struct udp_hdr {
+    u16_t src;
+    u16_t dest;
+    u16_t len;
+    u16_t chksum;
+} __attribute__((packed));
+
+#define UDP_HLEN 8
+
+struct icmp_echo_hdr {
+    u8_t type;
+    u8_t code;
+    u16_t chksum;
+    u16_t id;
+    u16_t seqno;
+} __attribute__((packed));
+
+#define ICMP_ER     0
+#define ICMP_DUR    3
+#define ICMP_SQ     4
+#define ICMP_RD     5
+#define ICMP_ECHO   8
+#define ICMP_TE     11
+#define ICMP_PP     12
+#define ICMPH_TYPE(h) ((h)->type)
+#define ICMPH_CODE(h) ((h)->code)
+
+/* lwip/icmp.h */
+
+enum icmp_dur_type {
+    ICMP_DUR_NET = 0,
+    ICMP_DUR_HOST = 1,
+    ICMP_DUR_PROTO = 2,
+    ICMP_DUR_PORT = 3,
+    ICMP_DUR_FRAG = 4,
+    ICMP_DUR_SR = 5
+};
+
+struct pbuf;
+void icmp_dest_unreach(struct pbuf *p, enum icmp_dur_type t);
+
+/* lwip/prot/ip6.h, icmp6.h, nd6.h */
+
+struct ip6_hdr {
+    u32_t _v_tc_fl;
+    u16_t _plen;
+    u8_t _nexth;
+    u8_t _hoplim;
+    ip6_addr_p_t src;
+    ip6_addr_p_t dest;
+} __attribute__((packed));
+
+#define IP6_HLEN        40
+#define IP6_NEXTH_UDP   17
+#define IP6_NEXTH_ICMP6 58
+
+#define IP6H_V(h)               ((u8_t)(lwip_ntohl((h)->_v_tc_fl) >> 28))
+#define IP6H_PLEN(h)            (lwip_ntohs((h)->_plen))
+#define IP6H_NEXTH(h)           ((h)->_nexth)
+#define IP6H_HOPLIM(h)          ((h)->_hoplim)
+#define IP6H_VTCFL_SET(h, v, tc, fl) \
+    ((h)->_v_tc_fl = lwip_htonl(((u32_t)(v) << 28) | ((u32_t)(tc) << 20) | (fl)))
+#define IP6H_PLEN_SET(h, plen)  ((h)->_plen = lwip_htons(plen))
+#define IP6H_NEXTH_SET(h, nh)   ((h)->_nexth = (u8_t)(nh))
+#define IP6H_HOPLIM_SET(h, hl)  ((h)->_hoplim = (u8_t)(hl))
+
+struct icmp6_hdr {
+    u8_t type;
+    u8_t code;
+    u16_t chksum;
+    u32_t data;
+} __attribute__((packed));
+
+#define ICMP6_TYPE_PTB  2
+#define ICMP6_TYPE_RS   133
+#define ICMP6_TYPE_RA   134
+#define ICMP6_TYPE_NS   135
+#define ICMP6_TYPE_NA   136
+
+struct ns_header {
+    u8_t type;
+    u8_t code;
+    u16_t chksum;
+    u32_t reserved;
+    ip6_addr_p_t target_address;
+} __attribute__((packed));
+
+struct na_header {
+    u8_t type;
+    u8_t code;
+    u16_t chksum;
+    u8_t flags;
+    u8_t reserved[3];
+    ip6_addr_p_t target_address;
+} __attribute__((packed));
+
+#define ND6_FLAG_ROUTER     0x80
+#define ND6_FLAG_SOLICITED  0x40
+#define ND6_FLAG_OVERRIDE   0x20
+
+struct ra_header {
+    u8_t type;
+    u8_t code;
+    u16_t chksum;
+    u8_t current_hop_limit;
+    u8_t flags;
+    u16_t router_lifetime;
+    u32_t reachable_time;
+    u32_t retrans_timer;
+} __attribute__((packed));
+
+#define ND6_OPTION_TYPE_SOURCE_LLADDR   1
+#define ND6_OPTION_TYPE_TARGET_LLADDR   2
+#define ND6_OPTION_TYPE_PREFIX_INFO     3
+#define ND6_OPTION_TYPE_MTU             5
+
+struct lladdr_option {
+    u8_t type;
+    u8_t length;
+    u8_t addr[6];
+} __attribute__((packed));
+
+struct prefix_option {
+    u8_t type;
+    u8_t length;
+    u8_t prefix_length;
+    u8_t flags;
+    u32_t valid_lifetime;
+    u32_t preferred_lifetime;
+    u8_t reserved2[3];
+    u8_t site_prefix_length;
+    ip6_addr_p_t prefix;
+} __attribute__((packed));
+
+#define ND6_PREFIX_FLAG_ON_LINK     0x80
+#define ND6_PREFIX_FLAG_AUTONOMOUS  0x40
+
+struct mtu_option {
+    u8_t type;
+    u8_t length;
+    u16_t reserved;
+    u32_t mtu;
+} __attribute__((packed));
+
+/* lwip/prot/ethernet.h, lwip/prot/etharp.h */
+
+struct eth_addr { u8_t addr[6]; } __attribute__((packed));
+
+struct eth_hdr {
+    struct eth_addr dest;
+    struct eth_addr src;
+    u16_t type;
+} __attribute__((packed));
+
+#define ETH_HWADDR_LEN  6
+#define SIZEOF_ETH_HDR  14
+#define ETHTYPE_IP      0x0800U
+#define ETHTYPE_ARP     0x0806U
+#define ETHTYPE_IPV6    0x86ddU
+
+/* lwip/pbuf.h: the layers are lwIP's header offsets, with room for an
+ * IPv6 header */
+
+typedef enum {
+    PBUF_TRANSPORT = 74,
+    PBUF_IP = 54,
+    PBUF_LINK = 14,
+    PBUF_RAW_TX = 0,
+    PBUF_RAW = 0
+} pbuf_layer;
+
+typedef enum { PBUF_RAM, PBUF_ROM, PBUF_REF, PBUF_POOL } pbuf_type;
+
+#define PBUF_FLAG_IS_CUSTOM 0x02U
+
+struct pbuf {
+    struct pbuf *next;
+    void *payload;
+    u16_t tot_len;
+    u16_t len;
+    u8_t type_internal;
+    u8_t flags;
+    u16_t ref;
+    u8_t if_idx;
+};
+
+typedef void (*pbuf_free_custom_fn)(struct pbuf *p);
+
+struct pbuf_custom {
+    struct pbuf pbuf;
+    pbuf_free_custom_fn custom_free_function;
+};
+
+struct pbuf *pbuf_alloc(pbuf_layer layer, u16_t length, pbuf_type type);
+struct pbuf *pbuf_clone(pbuf_layer layer, pbuf_type type, struct pbuf *p);
+u8_t pbuf_free(struct pbuf *p);
+void pbuf_ref(struct pbuf *p);
+void pbuf_realloc(struct pbuf *p, u16_t size);
+u8_t pbuf_header(struct pbuf *p, s16_t header_size);
+u8_t pbuf_add_header(struct pbuf *p, size_t size);
+u8_t pbuf_add_header_force(struct pbuf *p, size_t size);
+u8_t pbuf_remove_header(struct pbuf *p, size_t size);
+u16_t pbuf_copy_partial(const struct pbuf *p, void *dataptr, u16_t len, u16_t offset);
+err_t pbuf_take(struct pbuf *p, const void *dataptr, u16_t len);
+
+/* lwip/netif.h */
+
+struct netif;
+typedef err_t (*netif_input_fn)(struct pbuf *p, struct netif *inp);
+typedef err_t (*netif_output_fn)(struct netif *netif, struct pbuf *p, const ip4_addr_t *ipaddr);
+typedef err_t (*netif_linkoutput_fn)(struct netif *netif, struct pbuf *p);
+typedef err_t (*netif_output_ip6_fn)(struct netif *netif, struct pbuf *p, const ip6_addr_t *ipaddr);
+
+#define LWIP_IPV6_NUM_ADDRESSES 3
+
+struct netif {
+    struct netif *next;
+    ip4_addr_t ip_addr;
+    ip4_addr_t netmask;
+    ip4_addr_t gw;
+    netif_input_fn input;
+    netif_output_fn output;
+    netif_linkoutput_fn linkoutput;
+    ip6_addr_t ip6_addr[LWIP_IPV6_NUM_ADDRESSES];
+    u8_t ip6_addr_state[LWIP_IPV6_NUM_ADDRESSES];
+    netif_output_ip6_fn output_ip6;
+    void *state;
+    u16_t mtu;
+    u16_t mtu6;
+    u8_t hwaddr[ETH_HWADDR_LEN];
+    u8_t hwaddr_len;
+    u8_t flags;
+    char name[2];
+    u8_t num;
+};
+
+#define netif_ip4_addr(n)       (&(n)->ip_addr)
+#define netif_ip4_netmask(n)    (&(n)->netmask)
+#define netif_ip4_gw(n)         (&(n)->gw)
+#define netif_ip_addr4(n)       ((const ip_addr_t *)&(n)->ip_addr)
+#define netif_ip6_addr(n, i)    ((const ip6_addr_t *)&(n)->ip6_addr[i])
+#define netif_ip6_addr_state(n, i) ((n)->ip6_addr_state[i])
+#define netif_mtu6(n)           ((n)->mtu6)
+
+u8_t ip4_addr_isbroadcast_u32(u32_t addr, const struct netif *netif);
+
+/* lwip/ip4.h, lwip/ip4_frag.h, lwip/inet_chksum.h, lwip/etharp.h,
+ * netif/ethernet.h */
+
+struct netif *ip4_route(const ip4_addr_t *dest);
+err_t ip4_frag(struct pbuf *p, struct netif *netif, const ip4_addr_t *dest);
+u16_t inet_chksum(const void *dataptr, u16_t len);
+ssize_t etharp_find_addr(struct netif *netif, const ip4_addr_t *ipaddr, struct eth_addr **eth_ret, const ip4_addr_t **ip_ret);
+err_t ethernet_input(struct pbuf *p, struct netif *netif);
+err_t ethernet_output(struct netif *netif, struct pbuf *p, const struct eth_addr *src,
+                      const struct eth_addr *dst, u16_t eth_type);
+
+/* lwip/ip6.h */
+
+err_t ip6_output_if(struct pbuf *p, const ip6_addr_t *src, const ip6_addr_t *dest, u8_t hl, u8_t tc,
+                    u8_t nexth, struct netif *netif);
+u16_t ip6_chksum_pseudo(struct pbuf *p, u8_t proto, u16_t proto_len, const ip6_addr_t *src,
+                        const ip6_addr_t *dest);
+
+/* lwip/tcpip.h, lwip/priv/tcpip_priv.h: the tests are the tcpip thread */
+
+struct tcpip_api_call_data { err_t err; };
+typedef err_t (*tcpip_api_call_fn)(struct tcpip_api_call_data *call);
+
+err_t tcpip_api_call(tcpip_api_call_fn fn, struct tcpip_api_call_data *call);
+err_t tcpip_inpkt(struct pbuf *p, struct netif *inp, netif_input_fn input_fn);
+
+/* lwip/sys.h, lwip/timeouts.h */
+
+typedef void (*sys_timeout_handler)(void *arg);
+
+u32_t sys_now(void);
+void sys_timeout(u32_t msecs, sys_timeout_handler handler, void *arg);
+void sys_untimeout(sys_timeout_handler handler, void *arg);
+
+/* lwip/ip.h, lwip/igmp.h: the input netif and destination are those of
+ * host_udp_input() */
+
+extern struct netif *host_input_netif;
+extern ip4_addr_t host_input_dest;
+
+#define ip_current_input_netif() (host_input_netif)
+#define ip4_current_dest_addr()  (&host_input_dest)
+
+#define SOF_REUSEADDR 0x04U
+#define ip_set_option(pcb, opt) ((void)(pcb), (void)(opt))
+
+err_t igmp_joingroup_netif(struct netif *netif, const ip4_addr_t *groupaddr);
+err_t igmp_leavegroup_netif(struct netif *netif, const ip4_addr_t *groupaddr);
+
+/* lwip/udp.h, lwip/priv/tcp_priv.h: the pcb lists are what
+ * local_port_in_use() looks at, udp_bind() puts a pcb on udp_pcbs */
+
+struct udp_pcb;
+typedef void (*udp_recv_fn)(void *arg, struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *addr, u16_t port);
+
+struct udp_pcb { struct udp_pcb *next; u16_t local_port; udp_recv_fn recv; void *recv_arg; };
+struct tcp_pcb { struct tcp_pcb *next; u16_t local_port; };
+struct tcp_pcb_listen { struct tcp_pcb_listen *next; u16_t local_port; };
+union tcp_listen_pcbs_t { struct tcp_pcb_listen *listen_pcbs; struct tcp_pcb *pcbs; };
+
+extern struct udp_pcb *udp_pcbs;
+extern struct tcp_pcb *tcp_active_pcbs;
+extern union tcp_listen_pcbs_t tcp_listen_pcbs;
+
+struct udp_pcb *udp_new(void);
+void udp_remove(struct udp_pcb *pcb);
+err_t udp_bind(struct udp_pcb *pcb, const ip_addr_t *ipaddr, u16_t port);
+void udp_recv(struct udp_pcb *pcb, udp_recv_fn recv, void *recv_arg);
+err_t udp_sendto_if_src(struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *dst_ip, u16_t dst_port,
+                        struct netif *netif, const ip_addr_t *src_ip);
+err_t udp_sendto(struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *dst_ip, u16_t dst_port);
+void tcp_rst(const struct tcp_pcb *pcb, u32_t seqno, u32_t ackno, const ip_addr_t *local_ip,
+             const ip_addr_t *remote_ip, u16_t local_port, u16_t remote_port);
+
+/* esp_netif.h */
+
+typedef struct esp_netif_obj esp_netif_t;
+typedef struct { uint32_t addr; } esp_ip4_addr_t;
+typedef struct { uint8_t mac[6]; esp_ip4_addr_t ip; } esp_netif_pair_mac_ip_t;
+
+typedef struct { esp_ip4_addr_t ip; esp_ip4_addr_t netmask; esp_ip4_addr_t gw; } esp_netif_ip_info_t;
+
+void *esp_netif_get_netif_impl(esp_netif_t *esp_netif);
+esp_err_t esp_netif_get_ip_info(esp_netif_t *esp_netif, esp_netif_ip_info_t *ip_info);
+esp_err_t esp_netif_get_mac(esp_netif_t *esp_netif, uint8_t mac[]);
+esp_err_t esp_netif_dhcps_get_clients_by_mac(esp_netif_t *esp_netif, int num, esp_netif_pair_mac_ip_t *mac_ip_pair);
+uint32_t esp_ip4addr_aton(const char *addr);
+
+
+/* lwip/sockets.h: lwIP's types and the names mapped onto its functions,
+ * as with LWIP_COMPAT_SOCKETS. fd_set and struct timeval are the host's.
+ * The sockets are host.c's, see host_sock_input(). */
+
+typedef u32_t socklen_t;
+typedef u8_t sa_family_t;
+typedef u16_t in_port_t;
+
+struct in_addr { u32_t s_addr; };
+struct in6_addr { union { u32_t u32_addr[4]; u8_t u8_addr[16]; } un; };
+struct sockaddr { u8_t sa_len; sa_family_t sa_family; char sa_data[14]; };
+struct sockaddr_in {
+    u8_t sin_len;
+    sa_family_t sin_family;
+    in_port_t sin_port;
+    struct in_addr sin_addr;
+    char sin_zero[8];
+};
+struct sockaddr_in6 {
+    u8_t sin6_len;
+    sa_family_t sin6_family;
+    in_port_t sin6_port;
+    u32_t sin6_flowinfo;
+    struct in6_addr sin6_addr;
+    u32_t sin6_scope_id;
+};
+struct sockaddr_storage { u8_t s2_len; sa_family_t ss_family; char s2_data1[2]; u32_t s2_data2[3]; u32_t s2_data3[3]; };
+struct ip_mreq { struct in_addr imr_multiaddr; struct in_addr imr_interface; };
+
+#define AF_INET             2
+#define AF_INET6            10
+#define SOCK_DGRAM          2
+#define IPPROTO_IP          0
+#define IPPROTO_UDP         17
+#define SOL_SOCKET          0xfff
+#define SO_REUSEADDR        0x0004
+#define IP_ADD_MEMBERSHIP   3
+#define IP_MULTICAST_IF     6
+#define INADDR_ANY          ((u32_t)0x00000000UL)
+
+int lwip_socket(int domain, int type, int protocol);
+int lwip_bind(int s, const struct sockaddr *name, socklen_t namelen);
+int lwip_setsockopt(int s, int level, int optname, const void *optval, socklen_t optlen);
+int lwip_close(int s);
+int lwip_select(int maxfdp1, fd_set *readset, fd_set *writeset, fd_set *exceptset, struct timeval *timeout);
+ssize_t lwip_recvfrom(int s, void *mem, size_t len, int flags, struct sockaddr *from, socklen_t *fromlen);
+ssize_t lwip_sendto(int s, const void *dataptr, size_t size, int flags, const struct sockaddr *to, socklen_t tolen);
+int lwip_getpeername(int s, struct sockaddr *name, socklen_t *namelen);
+u32_t ipaddr_addr(const char *cp);
+
+#define socket(domain, type, protocol)          lwip_socket(domain, type, protocol)
+#define bind(s, name, namelen)                  lwip_bind(s, name, namelen)
+#define setsockopt(s, level, optname, opval, optlen) lwip_setsockopt(s, level, optname, opval, optlen)
+#define close(s)                                lwip_close(s)
+#define select(maxfdp1, readset, writeset, exceptset, timeout) \
+    lwip_select(maxfdp1, readset, writeset, exceptset, timeout)
+#define recvfrom(s, mem, len, flags, from, fromlen) lwip_recvfrom(s, mem, len, flags, from, fromlen)
+#define sendto(s, dataptr, size, flags, to, tolen) lwip_sendto(s, dataptr, size, flags, to, tolen)
+#define getpeername(s, name, namelen)           lwip_getpeername(s, name, namelen)
+#define inet_addr(cp)                           ipaddr_addr(cp)
+#define htons(x)                                lwip_htons(x)
+
+/* esp_http_server.h: the tests fill in the request, the fields after
+ * content_len are the host's. The response is kept in the request. */
+
+#define HTTPD_MAX_URI_LEN           512
+#define HTTPD_SOCK_ERR_TIMEOUT      -3
+#define ESP_ERR_HTTPD_RESULT_TRUNC  0xb003
+
+typedef void *httpd_handle_t;
+typedef enum { HTTP_GET = 1, HTTP_POST = 3 } httpd_method_t;
+typedef enum { HTTPD_400_BAD_REQUEST = 3, HTTPD_404_NOT_FOUND = 6 } httpd_err_code_t;
+
+typedef struct httpd_req {
+    httpd_handle_t handle;
+    int method;
+    const char uri[HTTPD_MAX_URI_LEN + 1];
+    size_t content_len;
+    int fd;                     /* host_sock_peer() */
+    const char *headers;        /* "Field: value\r\n" lines */
+    const char *body;
+    size_t body_read;
+    const char *status;
+    char resp[8192];
+    size_t resp_len;
+} httpd_req_t;
+
+typedef struct httpd_uri {
+    const char *uri;
+    httpd_method_t method;
+    esp_err_t (*handler)(httpd_req_t *r);
+    void *user_ctx;
+} httpd_uri_t;
+
+esp_err_t httpd_register_uri_handler(httpd_handle_t handle, const httpd_uri_t *uri_handler);
+int httpd_req_to_sockfd(httpd_req_t *r);
+int httpd_req_recv(httpd_req_t *r, char *buf, size_t buf_len);
+esp_err_t httpd_req_get_hdr_value_str(httpd_req_t *r, const char *field, char *val, size_t val_size);
+esp_err_t httpd_resp_set_type(httpd_req_t *r, const char *type);
+esp_err_t httpd_resp_set_status(httpd_req_t *r, const char *status);
+esp_err_t httpd_resp_send(httpd_req_t *r, const char *buf, ssize_t buf_len);
+esp_err_t httpd_resp_sendstr(httpd_req_t *r, const char *str);
+esp_err_t httpd_resp_send_err(httpd_req_t *req, httpd_err_code_t error, const char *msg);
+
+/* What host.c provides for the tests */
+
+#define HOST_IP(a, b, c, d) PP_HTONL(((u32_t)(a) << 24) | ((u32_t)(b) << 16) | ((u32_t)(c) << 8) | (d))
+
+/* The uplink at 10.0.0.2 and the AP at 192.168.4.1/24, the addresses are
+ * set in my_ip and my_ap_ip by host_init() */
+#define HOST_STA_IP HOST_IP(10, 0, 0, 2)
+#define HOST_AP_IP  HOST_IP(192, 168, 4, 1)
+
+extern esp_netif_t *wifiAP, *wifiSTA;
+extern struct netif host_sta, host_ap;
+
+/* Resets the NVS, the clock, the timeouts and the interfaces */
+void host_init(void);
+
+/* The clock behind sys_now() and esp_timer_get_time(), in ms */
+extern u32_t host_now_ms;
+/* Moves the clock and runs the timeouts that are due */
+void host_advance(u32_t ms);
+
+/* Fills the NVS with a blob as older firmware stored it */
+void host_nvs_put(const char *key, const void *value, size_t length);
+
+/* Packets router_ip4_input_hook() sent, through ip4_route()'s netif */
+extern u32_t host_sent;
+extern struct netif *host_sent_netif;
+
+/* IPv6 packets sent through ip6_output_if(), output_ip6 or
+ * ethernet_output(), the last one with its IPv6 header in host_pkt6. The
+ * destination MAC is that of ethernet_output(), zero otherwise */
+extern u32_t host_sent6;
+extern struct netif *host_sent6_netif;
+extern struct eth_addr host_sent6_mac;
+extern u8_t host_pkt6[1500];
+extern u16_t host_pkt6_len;
+
+/* Is the checksum of the ICMPv6 or UDP packet in host_pkt6 valid? */
+bool host_pkt6_csum_ok(void);
+
+/* The packet of the last host_udp()/host_tcp(), as the hook left it */
+struct host_pkt {
+    struct ip_hdr ip;
+    union {
+        struct udp_hdr udp;
+        struct tcp_hdr tcp;
+    };
+    u8_t data[32];
+} __attribute__((packed));
+
+extern struct host_pkt host_pkt;
+
+/* Builds a UDP or TCP packet with valid checksums and runs the hook on it,
+ * returns what the hook returned */
+int host_udp(struct netif *inp, u32_t src, u16_t sport, u32_t dest, u16_t dport);
+int host_tcp(struct netif *inp, u32_t src, u16_t sport, u32_t dest, u16_t dport, u8_t flags);
+
+/* Only build the packet in host_pkt, return its length */
+u16_t host_udp_pkt(u32_t src, u16_t sport, u32_t dest, u16_t dport);
+u16_t host_tcp_pkt(u32_t src, u16_t sport, u32_t dest, u16_t dport, u8_t flags);
+
+/* Hands a UDP datagram received on inp to the pcb bound to dport, as
+ * udp_input() would. Returns false if no pcb takes it. */
+bool host_udp_input(struct netif *inp, u32_t src, u16_t sport, u32_t dest, u16_t dport, const void *data,
+                    u16_t len);
+
+/* Are the IP and transport checksums of host_pkt still valid? */
+bool host_pkt_csum_ok(void);
+
+/* The sockets serve a thread of the code under test, as igd.c's: a
+ * datagram to dest:dport is read by its next select() and recvfrom(),
+ * host_sock_input() returns once the thread waits in select() again.
+ * host_sock_tick() has select() time out once. What was sent in between
+ * is in host_sock_sent, up to HOST_SOCK_SENT datagrams. */
+#define HOST_SOCK_SENT 16
+
+struct host_dgram {
+    u32_t src, dest;
+    u16_t sport, dport;
+    u16_t len;
+    u8_t data[1500];
+};
+
+extern struct host_dgram host_sock_sent[HOST_SOCK_SENT];
+extern int host_sock_sent_count;
+
+void host_sock_input(u32_t src, u16_t sport, u32_t dest, u16_t dport, const void *data, u16_t len);
+void host_sock_tick(void);
+/* A connected socket whose peer is addr, for an HTTP request */
+int host_sock_peer(u32_t addr);
+
+/* The handler registered for method and uri, NULL if none. A uri ending
+ * in '*' matches what it starts with, as httpd_uri_match_wildcard */
+const httpd_uri_t *host_httpd_handler(int method, const char *uri);
+
+/* Nanoseconds of the host's monotonic clock, for the benchmarks */
+u64_t host_ns(void);
+
+#define HOST_CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        exit(1); \
+    } \
+} while (0)
@@ -0,0 +1,176 @@
+/* Per-client traffic accounting, acct.c */
+
+#include "host.h"
+#include "router_globals.h"
+#include "router_hooks.h"
+#include "nat.h"
+
+#define CLIENT  HOST_IP(192, 168, 4, 2)
+#define OTHER   HOST_IP(192, 168, 4, 3)
+#define REMOTE  HOST_IP(198, 51, 100, 7)
+
+#define PKT_LEN (IP_HLEN + UDP_HLEN + 32)      /* of host_udp() */
+
+/* Only CLIENT is in the ARP table of the AP */
+static struct eth_addr client_mac = { { 1, 2, 3, 4, 5, 6 } };
+
+ssize_t etharp_find_addr(struct netif *netif, const ip4_addr_t *ipaddr, struct eth_addr **eth_ret,
+                         const ip4_addr_t **ip_ret)
+{
+    if (netif != &host_ap || ipaddr->addr != CLIENT) {
+        return -1;
+    }
+    *eth_ret = &client_mac;
+    *ip_ret = ipaddr;
+    return 0;
+}
+
+static acct_client_t *find_client(acct_client_t *clients, int n, u32_t ip)
+{
+    for (int i = 0; i < n; i++) {
+        if (clients[i].ip == ip) {
+            return &clients[i];
+        }
+    }
+    return NULL;
+}
+
+static void test_count(void)
+{
+    acct_client_t clients[ACCT_MAX];
+
+    /* Only clients of the AP network, the router itself is none */
+    acct_count(HOST_IP(10, 0, 0, 2), 100, SHAPE_UP);
+    acct_count(my_ap_ip, 100, SHAPE_UP);
+    acct_count(HOST_IP(192, 168, 5, 2), 100, SHAPE_UP);
+    HOST_CHECK(acct_get_clients(clients) == 0);
+
+    acct_count(CLIENT, 100, SHAPE_UP);
+    acct_count(CLIENT, 1000, SHAPE_DOWN);
+    acct_flow(CLIENT, true);
+    acct_flow(CLIENT, true);
+    acct_flow(CLIENT, false);
+    acct_count(OTHER, 5000, SHAPE_DOWN);
+    /* A mapping older than the entry */
+    acct_flow(OTHER, false);
+
+    host_advance(3000);
+    HOST_CHECK(acct_get_clients(clients) == 2);
+    /* Busiest first */
+    HOST_CHECK(clients[0].ip == OTHER && clients[0].bytes_down == 5000 && clients[0].flows == 0);
+    HOST_CHECK(clients[0].idle == 3 && clients[0].mac[0] == 0);
+    HOST_CHECK(clients[1].ip == CLIENT && clients[1].bytes_up == 100 && clients[1].packets_down == 1);
+    HOST_CHECK(clients[1].flows == 1 && memcmp(clients[1].mac, client_mac.addr, 6) == 0);
+    /* The rate is that of the last second */
+    HOST_CHECK(clients[0].rate_down == 0);
+
+    acct_count(OTHER, 700, SHAPE_DOWN);
+    host_advance(1000);
+    acct_get_clients(clients);
+    HOST_CHECK(clients[0].ip == OTHER && clients[0].rate_down == 700 && clients[0].bytes_down == 5700);
+    host_advance(1000);
+    acct_get_clients(clients);
+    HOST_CHECK(clients[0].rate_down == 0);
+}
+
+/* A new client takes the place of the one idle the longest */
+static void test_evict(void)
+{
+    acct_client_t clients[ACCT_MAX];
+
+    acct_count(OTHER, 1, SHAPE_UP);
+    for (int i = 0; i < ACCT_MAX - 1; i++) {
+        host_advance(10);
+        acct_count(HOST_IP(192, 168, 4, 10 + i), 1, SHAPE_UP);
+    }
+    HOST_CHECK(acct_get_clients(clients) == ACCT_MAX);
+    HOST_CHECK(find_client(clients, ACCT_MAX, CLIENT) == NULL);
+    HOST_CHECK(find_client(clients, ACCT_MAX, OTHER) != NULL);
+
+    /* The same last byte in another network is not counted, nor evicts */
+    acct_count(HOST_IP(192, 168, 5, 10), 1, SHAPE_UP);
+    HOST_CHECK(acct_get_clients(clients) == ACCT_MAX);
+    HOST_CHECK(find_client(clients, ACCT_MAX, HOST_IP(192, 168, 4, 10)) != NULL);
+
+    host_advance(10);
+    acct_count(CLIENT, 1, SHAPE_UP);
+    HOST_CHECK(acct_get_clients(clients) == ACCT_MAX);
+    HOST_CHECK(find_client(clients, ACCT_MAX, OTHER) == NULL);
+    HOST_CHECK(find_client(clients, ACCT_MAX, CLIENT)->bytes_up == 1);
+}
+
+/* What the hook forwards is counted, with the mappings of the client */
+static void test_forward(void)
+{
+    acct_client_t clients[ACCT_MAX], *c;
+    int n;
+
+    n = acct_get_clients(clients);
+    c = find_client(clients, n, CLIENT);
+    u64_t up = c->bytes_up, down = c->bytes_down;
+    u32_t packets = c->packets_up;
+
+    for (int i = 0; i < 10; i++) {
+        HOST_CHECK(host_udp(&host_ap, CLIENT, 4000 + i % 2, REMOTE, 53) == 1);
+        u16_t mport = lwip_ntohs(host_pkt.udp.src);
+        HOST_CHECK(host_udp(&host_sta, REMOTE, 53, my_ip, mport) == 0);
+    }
+    n = acct_get_clients(clients);
+    c = find_client(clients, n, CLIENT);
+    HOST_CHECK(c->bytes_up - up == 10 * PKT_LEN && c->bytes_down - down == 10 * PKT_LEN);
+    HOST_CHECK(c->flows == 2);
+
+    /* Over the rate limit, not forwarded and not counted */
+    HOST_CHECK(set_shape(NULL, CLIENT, 1, 0) == ESP_OK);
+    for (int i = 0; i < 300; i++) {
+        host_udp(&host_ap, CLIENT, 4000, REMOTE, 53);
+    }
+    shape_rule_t rules[SHAPE_MAX];
+    HOST_CHECK(shape_get_rules(rules) == 1);
+    n = acct_get_clients(clients);
+    c = find_client(clients, n, CLIENT);
+    HOST_CHECK(c->packets_up - packets + rules[0].dropped_up == 310 && rules[0].dropped_up > 0);
+    HOST_CHECK(set_shape(NULL, CLIENT, 0, 0) == ESP_OK);
+
+    /* Expired mappings are taken off */
+    host_advance(3600 * 1000);
+    n = acct_get_clients(clients);
+    HOST_CHECK(find_client(clients, n, CLIENT)->flows == 0);
+}
+
+/* A packet of a cached flow whose mapping has expired is counted once,
+ * though it goes through the hook's fast path and then the long way */
+static void test_stale(void)
+{
+    acct_client_t clients[ACCT_MAX], *c;
+    int n;
+
+    HOST_CHECK(host_udp(&host_ap, CLIENT, 4100, REMOTE, 53) == 1);
+    host_advance(3000);
+    n = acct_get_clients(clients);
+    c = find_client(clients, n, CLIENT);
+    u64_t up = c->bytes_up;
+    u32_t packets = c->packets_up;
+
+    HOST_CHECK(host_udp(&host_ap, CLIENT, 4100, REMOTE, 53) == 1);
+    n = acct_get_clients(clients);
+    c = find_client(clients, n, CLIENT);
+    HOST_CHECK(c->packets_up == packets + 1 && c->bytes_up == up + PKT_LEN);
+    HOST_CHECK(c->flows == 1);
+}
+
+int main(void)
+{
+    host_init();
+    router_hooks_init();
+    napt_init(64);
+    get_portmap_tab();
+    apply_portmap_tab();
+
+    test_count();
+    test_evict();
+    test_forward();
+    test_stale();
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,329 @@
+/* Packet filter, fw.c
+
+   fw_check() looks the rules up in compiled tables. Random rule sets are
+   checked against the rules themselves, tried in order, then the filter
+   is run where it is used: on new NAPT mappings, full cone mappings and
+   forwarded ports.
+*/
+
+#include "host.h"
+#include "router_globals.h"
+#include "router_hooks.h"
+#include "nat.h"
+
+#define CLIENT  HOST_IP(192, 168, 4, 3)
+#define OTHER   HOST_IP(192, 168, 4, 4)
+#define LEASED  HOST_IP(192, 168, 4, 9)
+#define REMOTE  HOST_IP(8, 8, 8, 8)
+#define REMOTE2 HOST_IP(1, 1, 1, 1)
+
+static const u8_t client_mac[6] = { 1, 2, 3, 4, 5, 6 };
+static u32_t client_lease = LEASED;
+
+esp_err_t esp_netif_dhcps_get_clients_by_mac(esp_netif_t *esp_netif, int num, esp_netif_pair_mac_ip_t *mac_ip_pair)
+{
+    if (memcmp(mac_ip_pair->mac, client_mac, 6) != 0) {
+        return ESP_FAIL;
+    }
+    mac_ip_pair->ip.addr = client_lease;
+    return ESP_OK;
+}
+
+static fw_rule_t rule(bool allow, int dir)
+{
+    fw_rule_t r = { .allow = allow, .dir = dir };
+    return r;
+}
+
+static void del_all(void)
+{
+    while (del_fw_rule(0) == ESP_OK) {
+    }
+}
+
+/* What fw_check() is to find: the first rule that matches decides */
+static bool reference(const fw_rule_t *rules, int n, int dir, u8_t proto, u32_t client, u32_t remote, u16_t port)
+{
+    bool in_ap = ((client ^ my_ap_ip) & PP_HTONL(0xffffff00UL)) == 0;
+
+    for (int i = 0; i < n; i++) {
+        const fw_rule_t *r = &rules[i];
+        bool by_mac = r->mac[0] | r->mac[1] | r->mac[2] | r->mac[3] | r->mac[4] | r->mac[5];
+        u32_t mask = r->remote_len == 0 ? 0 : lwip_htonl(0xffffffffUL << (32 - r->remote_len));
+
+        if (r->dir != dir) {
+            continue;
+        }
+        if (proto == IP_PROTO_TCP || proto == IP_PROTO_UDP) {
+            if ((r->proto != 0 && r->proto != proto) || (r->port != 0 && (port < r->port || port > r->port_last))) {
+                continue;
+            }
+        } else if ((r->proto != 0 && r->proto != IP_PROTO_ICMP) || r->port != 0) {
+            continue;
+        }
+        if (r->ip != 0 ? !in_ap || r->ip != client : by_mac) {
+            continue;
+        }
+        if (((remote ^ r->remote) & mask) != 0) {
+            continue;
+        }
+        return r->allow;
+    }
+    return true;
+}
+
+static u32_t pick(const u32_t *set, int n)
+{
+    return set[rand() % n];
+}
+
+/* Random rule sets against reference() */
+static void test_tables(void)
+{
+    static const u32_t clients[] = { CLIENT, OTHER, HOST_IP(192, 168, 4, 200), HOST_IP(10, 0, 0, 7) };
+    static const u32_t remotes[] = {
+        HOST_IP(8, 8, 8, 8), HOST_IP(8, 8, 4, 4), HOST_IP(8, 9, 0, 1), HOST_IP(9, 8, 8, 8),
+        HOST_IP(203, 0, 113, 7), HOST_IP(203, 0, 113, 200), HOST_IP(128, 0, 0, 1),
+    };
+    static const u32_t lens[] = { 0, 1, 8, 16, 24, 25, 32 };
+    static const u32_t protos[] = { 0, IP_PROTO_TCP, IP_PROTO_UDP, IP_PROTO_ICMP };
+    static const u32_t lookup_protos[] = { IP_PROTO_TCP, IP_PROTO_UDP, IP_PROTO_ICMP, 47 };
+    fw_rule_t rules[FW_MAX];
+
+    srand(1);
+    for (int set = 0; set < 200; set++) {
+        int n = 1 + rand() % (set < 190 ? 8 : FW_MAX);
+        for (int i = 0; i < n; i++) {
+            fw_rule_t r = rule(rand() & 1, rand() & 1);
+            r.proto = pick(protos, 4);
+            if (r.proto != IP_PROTO_ICMP && rand() % 2) {
+                r.port = 1 + rand() % 60;
+                r.port_last = rand() % 4 == 0 ? 0xffff : r.port + rand() % 20;
+            }
+            if (rand() % 2) {
+                r.ip = pick(clients, 2);
+            }
+            r.remote_len = pick(lens, 7);
+            r.remote = r.remote_len == 0 ? 0 : pick(remotes, 7) & lwip_htonl(0xffffffffUL << (32 - r.remote_len));
+            HOST_CHECK(add_fw_rule(&r, rand() % (i + 1)) == ESP_OK);
+        }
+        HOST_CHECK(fw_get_rules(rules) == n);
+
+        for (int k = 0; k < 500; k++) {
+            int dir = rand() & 1;
+            u8_t proto = pick(lookup_protos, 4);
+            u32_t client = pick(clients, 4), remote = pick(remotes, 7);
+            u16_t port = proto == IP_PROTO_TCP || proto == IP_PROTO_UDP ? rand() % 100 : 0;
+            if (rand() % 50 == 0) {
+                port = 0xffff;
+            }
+            HOST_CHECK(fw_check(dir, proto, client, remote, port, false) ==
+                       reference(rules, n, dir, proto, client, remote, port));
+        }
+        del_all();
+    }
+    HOST_CHECK(fw_check(FW_OUT, IP_PROTO_TCP, CLIENT, REMOTE, 80, true));
+}
+
+static void test_hits(void)
+{
+    fw_rule_t rules[FW_MAX];
+
+    fw_rule_t r = rule(false, FW_OUT);
+    r.ip = OTHER;
+    HOST_CHECK(add_fw_rule(&r, -1) == ESP_OK);
+    r = rule(false, FW_OUT);
+    r.proto = IP_PROTO_UDP;
+    r.port = 50;
+    r.port_last = 60;
+    HOST_CHECK(add_fw_rule(&r, -1) == ESP_OK);
+    r = rule(true, FW_OUT);
+    r.remote = HOST_IP(8, 8, 0, 0);
+    r.remote_len = 16;
+    r.proto = IP_PROTO_UDP;
+    r.port = r.port_last = 53;
+    HOST_CHECK(add_fw_rule(&r, 1) == ESP_OK);
+
+    HOST_CHECK(fw_get_rules(rules) == 3 && rules[1].allow && rules[2].port == 50);
+    HOST_CHECK(!fw_check(FW_OUT, IP_PROTO_TCP, OTHER, REMOTE, 80, true));
+    HOST_CHECK(fw_check(FW_OUT, IP_PROTO_UDP, CLIENT, REMOTE, 53, true));
+    HOST_CHECK(!fw_check(FW_OUT, IP_PROTO_UDP, CLIENT, REMOTE2, 53, true));
+    HOST_CHECK(fw_check(FW_OUT, IP_PROTO_UDP, CLIENT, REMOTE2, 61, true));
+    HOST_CHECK(fw_check(FW_IN, IP_PROTO_TCP, OTHER, REMOTE2, 80, true));
+    HOST_CHECK(fw_get_rules(rules) == 3 && rules[0].hits == 1 && rules[1].hits == 1 && rules[2].hits == 1);
+    del_all();
+}
+
+/* New mappings are filtered, those the rules no longer allow end */
+static void test_napt(void)
+{
+    napt_stats_t st;
+
+    fw_rule_t r = rule(false, FW_OUT);
+    r.remote = REMOTE2;
+    r.remote_len = 32;
+    r.proto = IP_PROTO_UDP;
+    r.port = r.port_last = 53;
+    HOST_CHECK(add_fw_rule(&r, -1) == ESP_OK);
+
+    napt_get_stats(&st);
+    u32_t entries = st.entries;
+    HOST_CHECK(host_udp(&host_ap, CLIENT, 40000, REMOTE, 53) == 1);
+    HOST_CHECK(host_udp(&host_ap, CLIENT, 40001, REMOTE2, 53) == 1);
+    HOST_CHECK(host_udp(&host_ap, CLIENT, 40002, REMOTE2, 99) == 1);
+    napt_get_stats(&st);
+    HOST_CHECK(st.entries == entries + 2);
+
+    /* The mapping to REMOTE2:99 is dropped with the rule that denies it */
+    r.port = r.port_last = 0;
+    r.proto = 0;
+    HOST_CHECK(add_fw_rule(&r, 0) == ESP_OK);
+    napt_get_stats(&st);
+    HOST_CHECK(st.entries == entries + 1);
+    u32_t sent = host_sent;
+    host_udp(&host_ap, CLIENT, 40002, REMOTE2, 99);
+    HOST_CHECK(host_sent == sent);
+    HOST_CHECK(host_udp(&host_ap, CLIENT, 40000, REMOTE, 53) == 1 && host_sent == sent + 1);
+    del_all();
+}
+
+/* Connections to a forwarded port, checked as FW_IN for the internal host */
+static void test_portmap(void)
+{
+    HOST_CHECK(add_portmap(PROTO_UDP, 8080, CLIENT, 80) == ESP_OK);
+    fw_rule_t r = rule(false, FW_IN);
+    r.remote = HOST_IP(203, 0, 113, 0);
+    r.remote_len = 24;
+    HOST_CHECK(add_fw_rule(&r, -1) == ESP_OK);
+
+    /* Dropped, or translated and handed back to lwIP */
+    HOST_CHECK(host_udp(&host_sta, HOST_IP(203, 0, 113, 7), 5000, my_ip, 8080) == 1);
+    HOST_CHECK(host_pkt.ip.dest.addr == my_ip);
+    HOST_CHECK(host_udp(&host_sta, HOST_IP(203, 0, 114, 7), 5000, my_ip, 8080) == 0);
+    HOST_CHECK(host_pkt.ip.dest.addr == CLIENT);
+
+    del_all();
+    HOST_CHECK(del_portmap(PROTO_UDP, 8080) == ESP_OK);
+}
+
+/* A full cone mapping takes only the remote hosts the inbound rules allow,
+ * also once the flow is cached */
+static void test_cone(void)
+{
+    HOST_CHECK(set_nat_cone(CLIENT, true) == ESP_OK);
+    fw_rule_t r = rule(false, FW_IN);
+    r.remote = REMOTE2;
+    r.remote_len = 32;
+    HOST_CHECK(add_fw_rule(&r, -1) == ESP_OK);
+
+    HOST_CHECK(host_udp(&host_ap, CLIENT, 40100, REMOTE, 3478) == 1);
+    u16_t mport = lwip_ntohs(host_pkt.udp.src);
+    for (int i = 0; i < 2; i++) {
+        HOST_CHECK(host_udp(&host_sta, HOST_IP(203, 0, 113, 7), 5000, my_ip, mport) == 0);
+        HOST_CHECK(host_pkt.ip.dest.addr == CLIENT);
+        HOST_CHECK(host_udp(&host_sta, REMOTE2, 5000, my_ip, mport) == 0);
+        HOST_CHECK(host_pkt.ip.dest.addr == my_ip);
+    }
+
+    /* A new rule also holds for remote hosts already let through */
+    r.remote = HOST_IP(203, 0, 113, 0);
+    r.remote_len = 24;
+    HOST_CHECK(add_fw_rule(&r, -1) == ESP_OK);
+    host_udp(&host_sta, HOST_IP(203, 0, 113, 7), 5000, my_ip, mport);
+    HOST_CHECK(host_pkt.ip.dest.addr == my_ip);
+    host_udp(&host_sta, REMOTE, 3478, my_ip, mport);
+    HOST_CHECK(host_pkt.ip.dest.addr == CLIENT);
+
+    del_all();
+
+    /* The cached flow outlives its mapping, whose entry goes to another
+     * client's with the same port */
+    r = rule(false, FW_IN);
+    r.ip = OTHER;
+    HOST_CHECK(add_fw_rule(&r, -1) == ESP_OK);
+    HOST_CHECK(set_nat_cone(OTHER, true) == ESP_OK);
+    HOST_CHECK(host_udp(&host_ap, CLIENT, 40200, REMOTE, 3478) == 1 && host_pkt.udp.src == PP_HTONS(40200));
+    host_udp(&host_sta, REMOTE, 3478, my_ip, 40200);
+    HOST_CHECK(host_pkt.ip.dest.addr == CLIENT);
+    host_advance(5000);
+    HOST_CHECK(host_udp(&host_ap, OTHER, 40200, REMOTE2, 53) == 1 && host_pkt.udp.src == PP_HTONS(40200));
+    host_udp(&host_sta, REMOTE, 3478, my_ip, 40200);
+    HOST_CHECK(host_pkt.ip.dest.addr == my_ip);
+
+    del_all();
+    HOST_CHECK(set_nat_cone(OTHER, false) == ESP_OK);
+    HOST_CHECK(set_nat_cone(CLIENT, false) == ESP_OK);
+}
+
+/* A client set by MAC is filtered under its lease */
+static void test_mac(void)
+{
+    fw_rule_t rules[FW_MAX];
+
+    fw_rule_t r = rule(false, FW_OUT);
+    memcpy(r.mac, client_mac, 6);
+    HOST_CHECK(add_fw_rule(&r, -1) == ESP_OK);
+    HOST_CHECK(fw_get_rules(rules) == 1 && rules[0].ip == LEASED);
+    HOST_CHECK(!fw_check(FW_OUT, IP_PROTO_TCP, LEASED, REMOTE, 80, false));
+
+    fw_client_ip(client_mac, OTHER);
+    HOST_CHECK(fw_check(FW_OUT, IP_PROTO_TCP, LEASED, REMOTE, 80, false));
+    HOST_CHECK(!fw_check(FW_OUT, IP_PROTO_TCP, OTHER, REMOTE, 80, false));
+
+    /* At boot the MAC is looked up again */
+    HOST_CHECK(get_fw() == ESP_OK);
+    HOST_CHECK(fw_get_rules(rules) == 1 && rules[0].ip == LEASED);
+    del_all();
+}
+
+static void test_store(void)
+{
+    fw_rule_t rules[FW_MAX];
+
+    for (int i = 0; i < FW_MAX; i++) {
+        fw_rule_t r = rule(i & 1, FW_OUT);
+        r.remote = HOST_IP(10, i, 0, 0);
+        r.remote_len = 16;
+        r.proto = IP_PROTO_TCP;
+        r.port = 1000 + i;
+        r.port_last = 2000 + i;
+        HOST_CHECK(add_fw_rule(&r, -1) == ESP_OK);
+    }
+    fw_rule_t r = rule(true, FW_OUT);
+    HOST_CHECK(add_fw_rule(&r, -1) == ESP_ERR_INVALID_SIZE);
+    HOST_CHECK(!fw_check(FW_OUT, IP_PROTO_TCP, CLIENT, HOST_IP(10, 4, 1, 1), 1500, false));
+    HOST_CHECK(fw_check(FW_OUT, IP_PROTO_TCP, CLIENT, HOST_IP(10, 31, 1, 1), 2031, false));
+
+    /* Restored as they were */
+    HOST_CHECK(get_fw() == ESP_OK);
+    HOST_CHECK(fw_get_rules(rules) == FW_MAX);
+    for (int i = 0; i < FW_MAX; i++) {
+        HOST_CHECK(rules[i].remote == HOST_IP(10, i, 0, 0) && rules[i].port_last == 2000 + i);
+        HOST_CHECK(rules[i].allow == (i & 1) && rules[i].hits == 0);
+    }
+    HOST_CHECK(!fw_check(FW_OUT, IP_PROTO_TCP, CLIENT, HOST_IP(10, 4, 1, 1), 1500, false));
+
+    del_all();
+    HOST_CHECK(fw_get_rules(rules) == 0 && del_fw_rule(0) == ESP_ERR_NOT_FOUND);
+    HOST_CHECK(get_fw() != ESP_OK);
+}
+
+int main(void)
+{
+    host_init();
+    router_hooks_init();
+    napt_init(64);
+    get_portmap_tab();
+    apply_portmap_tab();
+    get_fw();
+
+    test_tables();
+    test_hits();
+    test_napt();
+    test_portmap();
+    test_cone();
+    test_mac();
+    test_store();
+    printf("ok\n");
+    return 0;
+}
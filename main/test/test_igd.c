@@ -0,0 +1,467 @@
+/* NAT-PMP, PCP and UPnP-IGD server, igd.c
+
+   The server runs in its own thread, as on the ESP32. Datagrams reach it
+   through host_sock_input(), which returns once it has dealt with them,
+   and its answers are taken from host_sock_sent. The UPnP handlers are
+   called with a filled in request. The leases land in the portmap table
+   and are checked there.
+*/
+
+#include "host.h"
+#include "router_globals.h"
+#include "router_hooks.h"
+#include "nat.h"
+
+#define CLIENT      HOST_IP(192, 168, 4, 3)
+#define OTHER       HOST_IP(192, 168, 4, 4)
+#define REMOTE      HOST_IP(10, 0, 0, 7)
+#define SERVER      HOST_IP(192, 168, 4, 2)
+#define PMP_PORT    5351
+#define SSDP_PORT   1900
+#define CLIENT_PORT 5350
+
+#define WANIPC      "urn:schemas-upnp-org:service:WANIPConnection:1"
+
+void igd_register_uri_handlers(httpd_handle_t server);
+
+static u8_t req[1200], resp[1500];
+static u16_t req_len;
+
+static void put8(u8_t v)
+{
+    req[req_len++] = v;
+}
+
+static void put16(u16_t v)
+{
+    put8(v >> 8);
+    put8(v);
+}
+
+static void put32(u32_t v)
+{
+    put16(v >> 16);
+    put16(v);
+}
+
+static u16_t get16(const u8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static u32_t get32(const u8_t *p)
+{
+    return ((u32_t)get16(p) << 16) | get16(p + 2);
+}
+
+/* The answer to req from client on the NAT-PMP/PCP port, in resp. Returns
+ * its length, 0 if there was none. */
+static int ask(u32_t client)
+{
+    host_sock_sent_count = 0;
+    host_sock_input(client, CLIENT_PORT, HOST_AP_IP, PMP_PORT, req, req_len);
+    for (int i = 0; i < host_sock_sent_count; i++) {
+        const struct host_dgram *d = &host_sock_sent[i];
+        if (d->sport == PMP_PORT) {
+            HOST_CHECK(d->src == HOST_AP_IP && d->dest == client && d->dport == CLIENT_PORT);
+            memcpy(resp, d->data, d->len);
+            return d->len;
+        }
+    }
+    return 0;
+}
+
+static void pmp_map(u8_t op, u16_t iport, u16_t mport, u32_t lifetime)
+{
+    req_len = 0;
+    put8(0);
+    put8(op);
+    put16(0);
+    put16(iport);
+    put16(mport);
+    put32(lifetime);
+}
+
+/* The NAT-PMP result of a mapping, the external port or -result */
+static int pmp(u32_t client, u8_t op, u16_t iport, u16_t mport, u32_t lifetime, u32_t *granted)
+{
+    pmp_map(op, iport, mport, lifetime);
+    int len = ask(client);
+    HOST_CHECK(len >= 8 && resp[0] == 0 && resp[1] == (op | 0x80));
+    if (get16(resp + 2) != 0) {
+        return -get16(resp + 2);
+    }
+    HOST_CHECK(len == 16 && get16(resp + 8) == iport);
+    *granted = get32(resp + 12);
+    return get16(resp + 10);
+}
+
+static void pcp_header(u8_t version, u8_t op, u32_t lifetime, u32_t client)
+{
+    req_len = 0;
+    put8(version);
+    put8(op);
+    put16(0);
+    put32(lifetime);
+    put32(0);
+    put32(0);
+    put32(0xffff);
+    memcpy(req + req_len, &client, 4);
+    req_len += 4;
+}
+
+static void pcp_map(u32_t lifetime, u32_t client, u8_t proto, u16_t iport, u16_t mport)
+{
+    pcp_header(2, 1, lifetime, client);
+    for (int i = 0; i < 12; i++) {
+        put8(0xa0 + i);         /* nonce */
+    }
+    put8(proto);
+    put8(0);
+    put16(0);
+    put16(iport);
+    put16(mport);
+    for (int i = 0; i < 16; i++) {
+        put8(0);
+    }
+}
+
+static void pcp_option(u8_t code, u16_t len)
+{
+    put8(code);
+    put8(0);
+    put16(len);
+    for (u16_t i = 0; i < ((len + 3) & ~3); i++) {
+        put8(0);
+    }
+}
+
+/* The PCP result code of req from client */
+static int pcp(u32_t client)
+{
+    int len = ask(client);
+    HOST_CHECK(len >= 24 && len % 4 == 0 && resp[0] == 2 && (resp[1] & 0x80));
+    return resp[3];
+}
+
+static bool leased(u8_t proto, u16_t mport, u32_t daddr, u16_t dport)
+{
+    u32_t a;
+    u16_t p;
+    return portmap_match_ext(proto, mport, &a, &p) && a == daddr && p == dport;
+}
+
+static void test_pmp(void)
+{
+    u32_t granted;
+
+    /* The external address */
+    req_len = 0;
+    put8(0);
+    put8(0);
+    HOST_CHECK(ask(CLIENT) == 12 && resp[1] == 0x80 && get16(resp + 2) == 0);
+    HOST_CHECK(memcmp(resp + 8, &my_ip, 4) == 0);
+    u32_t epoch = get32(resp + 4);
+
+    /* Too short, answers, unknown opcodes, from outside the AP */
+    HOST_CHECK(ask(CLIENT) == 12);
+    req_len = 1;
+    HOST_CHECK(ask(CLIENT) == 0);
+    req[1] = 0x81;
+    req_len = 2;
+    HOST_CHECK(ask(CLIENT) == 0);
+    req[1] = 3;
+    HOST_CHECK(ask(CLIENT) == 8 && get16(resp + 2) == 5);
+    pmp_map(2, 8080, 8080, 3600);
+    req_len = 11;
+    HOST_CHECK(ask(CLIENT) == 8 && get16(resp + 2) == 5);
+    req_len = 12;
+    HOST_CHECK(ask(REMOTE) == 0 && ask(HOST_AP_IP) == 0);
+    HOST_CHECK(!leased(PROTO_TCP, 8080, CLIENT, 8080));
+
+    /* A mapping, kept for a renewal, capped at two hours */
+    HOST_CHECK(pmp(CLIENT, 2, 8080, 8080, 3600, &granted) == 8080 && granted == 3600);
+    HOST_CHECK(leased(PROTO_TCP, 8080, CLIENT, 8080));
+    HOST_CHECK(pmp(CLIENT, 2, 8080, 9000, 100000, &granted) == 8080 && granted == 7200);
+    HOST_CHECK(!leased(PROTO_TCP, 9000, CLIENT, 8080));
+    /* Another client's port is not given twice */
+    HOST_CHECK(pmp(OTHER, 2, 8080, 8080, 3600, &granted) == 8081);
+    HOST_CHECK(leased(PROTO_TCP, 8081, OTHER, 8080) && leased(PROTO_TCP, 8080, CLIENT, 8080));
+    /* Nor a stored rule's, nor one below the lease range */
+    HOST_CHECK(add_portmap(PROTO_UDP, 5000, SERVER, 5000) == ESP_OK);
+    HOST_CHECK(pmp(CLIENT, 1, 5000, 5000, 60, &granted) == 5001);
+    HOST_CHECK(pmp(CLIENT, 1, 22, 22, 60, &granted) == 1024);
+    HOST_CHECK(pmp(CLIENT, 1, 7000, 0, 60, &granted) == 7000);
+    HOST_CHECK(pmp(CLIENT, 1, 7001, 7100, 60, &granted) == 7100);
+    HOST_CHECK(pmp(CLIENT, 1, 0, 0, 60, &granted) == -5);
+
+    /* No uplink */
+    ap_connect = false;
+    HOST_CHECK(pmp(CLIENT, 2, 8082, 8082, 60, &granted) == -3);
+    ap_connect = true;
+
+    /* Deleting: only the client's own, all of a protocol with port 0 */
+    HOST_CHECK(pmp(OTHER, 2, 8080, 0, 0, &granted) == 0 && granted == 0);
+    HOST_CHECK(!leased(PROTO_TCP, 8081, OTHER, 8080) && leased(PROTO_TCP, 8080, CLIENT, 8080));
+    HOST_CHECK(pmp(CLIENT, 1, 0, 0, 0, &granted) == 0);
+    HOST_CHECK(!leased(PROTO_UDP, 5001, CLIENT, 5000) && !leased(PROTO_UDP, 1024, CLIENT, 22));
+    HOST_CHECK(!leased(PROTO_UDP, 7100, CLIENT, 7001));
+    HOST_CHECK(leased(PROTO_UDP, 5000, SERVER, 5000) && leased(PROTO_TCP, 8080, CLIENT, 8080));
+
+    /* Run out, on the server's next round after their end */
+    HOST_CHECK(pmp(CLIENT, 1, 6000, 6000, 60, &granted) == 6000);
+    host_advance(59000);
+    host_sock_tick();
+    HOST_CHECK(leased(PROTO_UDP, 6000, CLIENT, 6000));
+    host_advance(1000);
+    host_sock_tick();
+    HOST_CHECK(!leased(PROTO_UDP, 6000, CLIENT, 6000) && leased(PROTO_TCP, 8080, CLIENT, 8080));
+
+    req_len = 2;
+    req[1] = 0;
+    HOST_CHECK(ask(CLIENT) == 12 && get32(resp + 4) == epoch + 60);
+    HOST_CHECK(pmp(CLIENT, 2, 8080, 0, 0, &granted) == 0);
+    HOST_CHECK(del_portmap(PROTO_UDP, 5000) == ESP_OK);
+}
+
+static void test_pcp(void)
+{
+    /* Header: version, length, the client's own address */
+    pcp_header(3, 0, 0, CLIENT);
+    HOST_CHECK(pcp(CLIENT) == 1 && ask(CLIENT) == 24);
+    pcp_header(2, 0, 0, CLIENT);
+    req_len = 20;
+    HOST_CHECK(pcp(CLIENT) == 3);
+    req_len = 26;
+    HOST_CHECK(pcp(CLIENT) == 3);
+    req_len = 24;
+    HOST_CHECK(pcp(CLIENT) == 0 && get32(resp + 4) == 0);
+    HOST_CHECK(pcp(OTHER) == 12 && get32(resp + 4) == 1800);
+    req[1] = 0x80;
+    HOST_CHECK(ask(CLIENT) == 0);
+    req[1] = 2;
+    HOST_CHECK(pcp(CLIENT) == 4);
+    req[1] = 1;
+    HOST_CHECK(pcp(CLIENT) == 3);
+    pcp_map(3600, CLIENT, PROTO_TCP, 8080, 8080);
+    req_len -= 4;
+    HOST_CHECK(pcp(CLIENT) == 3);
+
+    /* A mapping, the opcode data back with the port and address */
+    pcp_map(3600, CLIENT, PROTO_TCP, 8080, 8080);
+    HOST_CHECK(pcp(CLIENT) == 0 && ask(CLIENT) == 60 && get32(resp + 4) == 3600);
+    HOST_CHECK(memcmp(resp + 24, req + 24, 16) == 0 && get16(resp + 40) == 8080 && get16(resp + 42) == 8080);
+    HOST_CHECK(get32(resp + 44) == 0 && get16(resp + 54) == 0xffff && memcmp(resp + 56, &my_ip, 4) == 0);
+    HOST_CHECK(leased(PROTO_TCP, 8080, CLIENT, 8080));
+    pcp_map(100000, CLIENT, PROTO_UDP, 8080, 0);
+    HOST_CHECK(pcp(CLIENT) == 0 && get32(resp + 4) == 7200 && get16(resp + 42) == 8080);
+
+    /* Options: optional ones ignored, mandatory ones refused, and none
+     * may run past the end */
+    pcp_map(60, CLIENT, PROTO_TCP, 9000, 9000);
+    pcp_option(130, 6);
+    pcp_option(131, 0);
+    HOST_CHECK(pcp(CLIENT) == 0 && leased(PROTO_TCP, 9000, CLIENT, 9000));
+    pcp_map(60, CLIENT, PROTO_TCP, 9001, 9001);
+    pcp_option(1, 16);
+    HOST_CHECK(pcp(CLIENT) == 5 && get32(resp + 4) == 1800 && !leased(PROTO_TCP, 9001, CLIENT, 9001));
+    pcp_map(60, CLIENT, PROTO_TCP, 9001, 9001);
+    pcp_option(130, 8);
+    req_len -= 4;
+    HOST_CHECK(pcp(CLIENT) == 6 && !leased(PROTO_TCP, 9001, CLIENT, 9001));
+    pcp_map(60, CLIENT, PROTO_TCP, 9001, 9001);
+    put8(130);
+    put8(0);
+    put16(0xfffc);
+    HOST_CHECK(pcp(CLIENT) == 6);
+    pcp_map(60, CLIENT, PROTO_TCP, 9001, 9001);
+    pcp_option(130, 0);
+    pcp_option(2, 0);
+    HOST_CHECK(pcp(CLIENT) == 5);
+
+    /* Protocols, ports, the uplink */
+    pcp_map(60, CLIENT, IP_PROTO_ICMP, 9001, 9001);
+    HOST_CHECK(pcp(CLIENT) == 9);
+    pcp_map(60, CLIENT, PROTO_TCP, 0, 9001);
+    HOST_CHECK(pcp(CLIENT) == 3);
+    my_ip = 0;
+    pcp_map(60, CLIENT, PROTO_TCP, 9001, 9001);
+    HOST_CHECK(pcp(CLIENT) == 7 && get32(resp + 4) == 30);
+    my_ip = HOST_STA_IP;
+
+    /* Deleting, only the client's own */
+    pcp_map(0, OTHER, PROTO_TCP, 8080, 0);
+    HOST_CHECK(pcp(OTHER) == 0 && leased(PROTO_TCP, 8080, CLIENT, 8080));
+    pcp_map(0, CLIENT, PROTO_TCP, 8080, 0);
+    HOST_CHECK(pcp(CLIENT) == 0 && !leased(PROTO_TCP, 8080, CLIENT, 8080));
+    pcp_map(0, CLIENT, PROTO_TCP, 0, 0);
+    HOST_CHECK(pcp(CLIENT) == 0 && !leased(PROTO_TCP, 9000, CLIENT, 9000));
+    pcp_map(0, CLIENT, PROTO_UDP, 0, 0);
+    HOST_CHECK(pcp(CLIENT) == 0 && !leased(PROTO_UDP, 8080, CLIENT, 8080));
+}
+
+static httpd_req_t hreq;
+
+/* Calls the handler of method and uri for a request from peer, the
+ * response is in hreq */
+static void http(int method, const char *uri, u32_t peer, const char *headers, const char *body)
+{
+    const httpd_uri_t *h = host_httpd_handler(method, uri);
+
+    HOST_CHECK(h != NULL);
+    memset(&hreq, 0, sizeof(hreq));
+    strcpy((char *)hreq.uri, uri);
+    hreq.method = method;
+    hreq.fd = host_sock_peer(peer);
+    hreq.headers = headers;
+    hreq.body = body;
+    hreq.content_len = body != NULL ? strlen(body) : 0;
+    h->handler(&hreq);
+    lwip_close(hreq.fd);
+    HOST_CHECK(hreq.status != NULL);
+}
+
+/* The UPnP error code of a SOAP action, 0 if it succeeded */
+static int soap(u32_t peer, const char *action, const char *args)
+{
+    static char body[2048], headers[160];
+
+    snprintf(headers, sizeof(headers), "Content-Type: text/xml\r\nSOAPAction: \"" WANIPC "#%s\"\r\n", action);
+    snprintf(body, sizeof(body),
+             "<?xml version=\"1.0\"?><s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\">"
+             "<s:Body><u:%s xmlns:u=\"" WANIPC "\">%s</u:%s></s:Body></s:Envelope>", action, args, action);
+    http(HTTP_POST, "/igd/ctl", peer, headers, body);
+    if (strcmp(hreq.status, "200 OK") == 0) {
+        return 0;
+    }
+    HOST_CHECK(strcmp(hreq.status, "500 Internal Server Error") == 0);
+    const char *code = strstr(hreq.resp, "<errorCode>");
+    HOST_CHECK(code != NULL);
+    return atoi(code + 11);
+}
+
+#define ADD_FROM(host, port, proto, iport, client, lease) \
+    "<NewRemoteHost>" host "</NewRemoteHost><NewExternalPort>" port "</NewExternalPort><NewProtocol>" proto \
+    "</NewProtocol><NewInternalPort>" iport "</NewInternalPort><NewInternalClient>" client \
+    "</NewInternalClient><NewEnabled>1</NewEnabled><NewPortMappingDescription>test" \
+    "</NewPortMappingDescription><NewLeaseDuration>" lease "</NewLeaseDuration>"
+#define ADD(port, proto, iport, client, lease) ADD_FROM("", port, proto, iport, client, lease)
+#define DISABLE(client) \
+    "<NewRemoteHost/><NewExternalPort>8080</NewExternalPort><NewProtocol>TCP</NewProtocol><NewInternalPort>80" \
+    "</NewInternalPort><NewInternalClient>" client "</NewInternalClient><NewEnabled>0</NewEnabled>" \
+    "<NewLeaseDuration>60</NewLeaseDuration>"
+#define KEY(port, proto) \
+    "<NewRemoteHost/><NewExternalPort>" port "</NewExternalPort><NewProtocol>" proto "</NewProtocol>"
+
+static void test_upnp(void)
+{
+    portmap_rule_t rule;
+    uint32_t pos = 0;
+
+    /* The description, to AP clients only */
+    http(HTTP_GET, "/igd/desc.xml", CLIENT, "", NULL);
+    HOST_CHECK(strcmp(hreq.status, "200 OK") == 0 && strstr(hreq.resp, "http://192.168.4.1/") != NULL);
+    HOST_CHECK(strstr(hreq.resp, "<controlURL>/igd/ctl</controlURL>") != NULL);
+    http(HTTP_GET, "/igd/desc.xml", REMOTE, "", NULL);
+    HOST_CHECK(strcmp(hreq.status, "404 Not Found") == 0);
+    http(HTTP_POST, "/igd/ctl", REMOTE, "SOAPAction: \"" WANIPC "#GetExternalIPAddress\"\r\n", "");
+    HOST_CHECK(strcmp(hreq.status, "404 Not Found") == 0);
+
+    HOST_CHECK(soap(CLIENT, "GetExternalIPAddress", "") == 0);
+    HOST_CHECK(strstr(hreq.resp, "<NewExternalIPAddress>10.0.0.2</NewExternalIPAddress>") != NULL);
+    http(HTTP_POST, "/igd/ctl", CLIENT, "Content-Type: text/xml\r\n", "");
+    HOST_CHECK(strstr(hreq.resp, "<errorCode>401</errorCode>") != NULL);
+    HOST_CHECK(soap(CLIENT, "Reboot", "") == 401);
+
+    /* Adding, for the client itself only */
+    HOST_CHECK(soap(CLIENT, "AddPortMapping", ADD("8080", "TCP", "80", "192.168.4.3", "0")) == 0);
+    HOST_CHECK(leased(PROTO_TCP, 8080, CLIENT, 80));
+    HOST_CHECK(portmap_walk(&pos, &rule) && rule.lease == 7 * 24 * 3600);
+    HOST_CHECK(soap(CLIENT, "AddPortMapping", ADD("8081", "TCP", "80", "192.168.4.4", "60")) == 606);
+    HOST_CHECK(soap(OTHER, "AddPortMapping", ADD("8080", "TCP", "80", "192.168.4.4", "60")) == 718);
+    HOST_CHECK(soap(CLIENT, "AddPortMapping", ADD("8082", "TCP", "80", "192.168.4.3", "60")) == 718);
+    HOST_CHECK(soap(CLIENT, "AddPortMapping", ADD("0", "TCP", "80", "192.168.4.3", "60")) == 716);
+    HOST_CHECK(soap(CLIENT, "AddPortMapping", ADD("8081", "ICMP", "80", "192.168.4.3", "60")) == 402);
+    HOST_CHECK(soap(CLIENT, "AddPortMapping", ADD("70000", "TCP", "80", "192.168.4.3", "60")) == 402);
+    HOST_CHECK(soap(CLIENT, "AddPortMapping", ADD("8081", "TCP", "8x", "192.168.4.3", "60")) == 402);
+    HOST_CHECK(soap(CLIENT, "AddPortMapping", ADD("8081", "TCP", "80", "192.168.4.3", "")) == 402);
+    HOST_CHECK(soap(CLIENT, "AddPortMapping", KEY("8081", "TCP")) == 402);
+    HOST_CHECK(soap(CLIENT, "AddPortMapping", ADD_FROM("10.0.0.7", "8081", "TCP", "80", "192.168.4.3", "60")) == 726);
+    HOST_CHECK(soap(CLIENT, "AddPortMapping", ADD_FROM("*", "8081", "TCP", "81", "192.168.4.3", "60")) == 0);
+    HOST_CHECK(soap(CLIENT, "DeletePortMapping", KEY("8081", "TCP")) == 0);
+
+    /* Deleting, for the client itself only */
+    HOST_CHECK(add_portmap(PROTO_UDP, 5000, CLIENT, 5000) == ESP_OK);
+    HOST_CHECK(soap(OTHER, "DeletePortMapping", KEY("8080", "TCP")) == 606);
+    HOST_CHECK(soap(CLIENT, "DeletePortMapping", KEY("5000", "UDP")) == 606);
+    HOST_CHECK(leased(PROTO_TCP, 8080, CLIENT, 80) && leased(PROTO_UDP, 5000, CLIENT, 5000));
+    HOST_CHECK(soap(OTHER, "GetSpecificPortMappingEntry", KEY("8080", "TCP")) == 0);
+    HOST_CHECK(strstr(hreq.resp, "<NewInternalClient>192.168.4.3</NewInternalClient>") != NULL);
+    HOST_CHECK(soap(CLIENT, "DeletePortMapping", KEY("8080", "TCP")) == 0);
+    HOST_CHECK(!leased(PROTO_TCP, 8080, CLIENT, 80));
+    HOST_CHECK(soap(CLIENT, "DeletePortMapping", KEY("8080", "TCP")) == 714);
+    HOST_CHECK(soap(CLIENT, "GetGenericPortMappingEntry", "<NewPortMappingIndex>0</NewPortMappingIndex>") == 0);
+    HOST_CHECK(strstr(hreq.resp, "<NewExternalPort>5000</NewExternalPort>") != NULL);
+    HOST_CHECK(soap(CLIENT, "GetGenericPortMappingEntry", "<NewPortMappingIndex>1</NewPortMappingIndex>") == 713);
+    HOST_CHECK(del_portmap(PROTO_UDP, 5000) == ESP_OK);
+
+    /* Disabled is deleted, the client's own */
+    HOST_CHECK(soap(CLIENT, "AddPortMapping", ADD("8080", "TCP", "80", "192.168.4.3", "60")) == 0);
+    HOST_CHECK(soap(OTHER, "AddPortMapping", DISABLE("192.168.4.4")) == 0);
+    HOST_CHECK(leased(PROTO_TCP, 8080, CLIENT, 80));
+    HOST_CHECK(soap(CLIENT, "AddPortMapping", DISABLE("192.168.4.3")) == 0);
+    HOST_CHECK(!leased(PROTO_TCP, 8080, CLIENT, 80));
+
+    /* Too long a request */
+    static char big[2100];
+    memset(big, ' ', sizeof(big) - 1);
+    http(HTTP_POST, "/igd/ctl", CLIENT, "SOAPAction: \"" WANIPC "#GetExternalIPAddress\"\r\n", big);
+    HOST_CHECK(strcmp(hreq.status, "400 Bad Request") == 0);
+}
+
+static void test_ssdp(void)
+{
+    static const char search_all[] = "M-SEARCH * HTTP/1.1\r\nHOST: 239.255.255.250:1900\r\nMAN: \"ssdp:discover\"\r\n"
+                                     "MX: 1\r\nST: ssdp:all\r\n\r\n";
+    static const char search_ipc[] = "M-SEARCH * HTTP/1.1\r\nST: " WANIPC "\r\n\r\n";
+    int replies = 0;
+
+    host_sock_sent_count = 0;
+    host_sock_input(CLIENT, 50000, HOST_IP(239, 255, 255, 250), SSDP_PORT, search_all, strlen(search_all));
+    for (int i = 0; i < host_sock_sent_count; i++) {
+        const struct host_dgram *d = &host_sock_sent[i];
+        if (d->dest == CLIENT) {
+            HOST_CHECK(d->dport == 50000 && memcmp(d->data, "HTTP/1.1 200 OK\r\n", 17) == 0);
+            replies++;
+        }
+    }
+    HOST_CHECK(replies == 9);
+
+    host_sock_sent_count = 0;
+    host_sock_input(CLIENT, 50000, HOST_IP(239, 255, 255, 250), SSDP_PORT, search_ipc, strlen(search_ipc));
+    HOST_CHECK(host_sock_sent_count == 1 && host_sock_sent[0].len < sizeof(host_sock_sent[0].data));
+    host_sock_sent[0].data[host_sock_sent[0].len] = '\0';
+    HOST_CHECK(strstr((char *)host_sock_sent[0].data, "ST: " WANIPC "\r\n") != NULL);
+    host_sock_sent_count = 0;
+    host_sock_input(REMOTE, 50000, HOST_IP(239, 255, 255, 250), SSDP_PORT, search_ipc, strlen(search_ipc));
+    HOST_CHECK(host_sock_sent_count == 0);
+}
+
+int main(void)
+{
+    host_init();
+    router_hooks_init();
+    napt_init(64);
+    get_portmap_tab();
+    apply_portmap_tab();
+    set_igd(true);
+    igd_register_uri_handlers(NULL);
+    igd_init();
+
+    test_pmp();
+    test_pcp();
+    test_upnp();
+    test_ssdp();
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,487 @@
+/* IPv6 relay to the AP clients, ip6_relay.c */
+
+#include "host.h"
+#include "router_globals.h"
+#include "router_hooks.h"
+#include "nat.h"
+
+#define ND_HOPLIM   255
+
+/* Addresses by their 32-bit words in host order */
+static ip6_addr_t addr6(u32_t w0, u32_t w1, u32_t w2, u32_t w3)
+{
+    ip6_addr_t a;
+    IP6_ADDR(&a, lwip_htonl(w0), lwip_htonl(w1), lwip_htonl(w2), lwip_htonl(w3));
+    return a;
+}
+
+#define PREFIX0     0x20010db8
+#define PREFIX1     0x00010002
+#define CLIENT(n)   addr6(PREFIX0, PREFIX1, 0, (n))
+#define REMOTE      addr6(0x20014860, 0, 0, 0x8888)
+#define STA_ADDR    CLIENT(1)
+#define STA_LL      addr6(0xfe800000, 0, 0, 1)
+#define AP_LL       addr6(0xfe800000, 0, 0, 2)
+#define UPSTREAM_LL addr6(0xfe800000, 0, 0, 0x99)
+#define UNSPEC      addr6(0, 0, 0, 0)
+
+/* The MAC of an address, its Ethernet source on the AP */
+#define MAC_OF(a)   ((const u8_t[]){ 0x02, 0xc1, 0x1e, 0x47, ((const u8_t *)(a).addr)[14], \
+                                     ((const u8_t *)(a).addr)[15] })
+
+static bool addr_eq(const ip6_addr_p_t *a, ip6_addr_t b)
+{
+    return memcmp(a->addr, b.addr, 16) == 0;
+}
+
+static const struct ip6_hdr *sent6(void)
+{
+    return (const struct ip6_hdr *)host_pkt6;
+}
+
+/* Runs the hook on an IPv6 packet, as ethernet_input() leaves it: the
+ * Ethernet header in front of the payload. Returns what the hook
+ * returned. */
+static int input6(struct netif *inp, ip6_addr_t src, ip6_addr_t dest, u8_t nexth, u8_t hoplim,
+                  const void *data, u16_t len)
+{
+    struct pbuf *p = pbuf_alloc(PBUF_LINK, IP6_HLEN + len, PBUF_RAM);
+    struct ip6_hdr *ip6hdr = (struct ip6_hdr *)p->payload;
+    struct eth_hdr *ethhdr = (struct eth_hdr *)ip6hdr - 1;
+
+    memcpy(ethhdr->dest.addr, inp->hwaddr, 6);
+    memcpy(ethhdr->src.addr, MAC_OF(src), 6);
+    ethhdr->type = PP_HTONS(ETHTYPE_IPV6);
+
+    ip6hdr->_v_tc_fl = lwip_htonl(6UL << 28);
+    ip6hdr->_plen = lwip_htons(len);
+    ip6hdr->_nexth = nexth;
+    ip6hdr->_hoplim = hoplim;
+    memcpy(&ip6hdr->src, src.addr, 16);
+    memcpy(&ip6hdr->dest, dest.addr, 16);
+    memcpy(ip6hdr + 1, data, len);
+    int ret = router_ip6_input_hook(p, inp);
+    if (ret == 0) {
+        pbuf_free(p);
+    }
+    return ret;
+}
+
+/* A UDP datagram of len bytes */
+static int udp6_len(struct netif *inp, ip6_addr_t src, ip6_addr_t dest, u8_t hoplim, u16_t len)
+{
+    u8_t data[1500] = { 0x13, 0x88, 0x17, 0x70, len >> 8, len & 0xff };
+    for (int i = UDP_HLEN; i < len; i++) {
+        data[i] = i;
+    }
+    return input6(inp, src, dest, IP6_NEXTH_UDP, hoplim, data, len);
+}
+
+static int udp6(struct netif *inp, ip6_addr_t src, ip6_addr_t dest, u8_t hoplim)
+{
+    return udp6_len(inp, src, dest, hoplim, UDP_HLEN + 16);
+}
+
+/* A neighbor solicitation or advertisement for target, with a link layer
+ * address option if mac is set */
+static int nd(struct netif *inp, u8_t type, ip6_addr_t src, ip6_addr_t dest, ip6_addr_t target,
+              const u8_t *mac, u8_t hoplim)
+{
+    struct {
+        struct ns_header ns;
+        struct lladdr_option lla;
+    } __attribute__((packed)) m = { 0 };
+
+    m.ns.type = type;
+    memcpy(&m.ns.target_address, target.addr, 16);
+    if (mac != NULL) {
+        m.lla.type = type == ICMP6_TYPE_NS ? ND6_OPTION_TYPE_SOURCE_LLADDR : ND6_OPTION_TYPE_TARGET_LLADDR;
+        m.lla.length = 1;
+        memcpy(m.lla.addr, mac, 6);
+    }
+    return input6(inp, src, dest, IP6_NEXTH_ICMP6, hoplim, &m, mac != NULL ? sizeof(m) : sizeof(m.ns));
+}
+
+static ip6_addr_t solicited_node(ip6_addr_t a)
+{
+    return addr6(0xff020000, 0, 1, 0xff000000 | (lwip_ntohl(a.addr[3]) & 0xffffff));
+}
+
+/* Is the last packet sent an ND message of the given type from the
+ * link-local address of netif? */
+static bool sent_nd(struct netif *netif, u8_t type, ip6_addr_t src)
+{
+    const struct ip6_hdr *ip6hdr = sent6();
+    return host_sent6_netif == netif && IP6H_NEXTH(ip6hdr) == IP6_NEXTH_ICMP6 &&
+           IP6H_HOPLIM(ip6hdr) == ND_HOPLIM && addr_eq(&ip6hdr->src, src) &&
+           host_pkt6[IP6_HLEN] == type && host_pkt6_csum_ok();
+}
+
+static void set_addr(struct netif *netif, int i, ip6_addr_t a)
+{
+    netif->ip6_addr[i] = a;
+    netif->ip6_addr_state[i] = IP6_ADDR_PREFERRED;
+}
+
+static bool ra_ok(u32_t lifetime, u32_t w0, u32_t w1)
+{
+    const struct ra_header *ra = (const struct ra_header *)(host_pkt6 + IP6_HLEN);
+    const struct lladdr_option *lla = (const struct lladdr_option *)(ra + 1);
+    const struct mtu_option *mtu = (const struct mtu_option *)(lla + 1);
+    const struct prefix_option *pi = (const struct prefix_option *)(mtu + 1);
+
+    return sent_nd(&host_ap, ICMP6_TYPE_RA, AP_LL) && addr_eq(&sent6()->dest, addr6(0xff020000, 0, 0, 1)) &&
+           host_pkt6_len == IP6_HLEN + sizeof(*ra) + sizeof(*lla) + sizeof(*mtu) + sizeof(*pi) &&
+           lwip_ntohs(ra->router_lifetime) == (lifetime ? 1800 : 0) &&
+           lla->type == ND6_OPTION_TYPE_SOURCE_LLADDR && memcmp(lla->addr, host_ap.hwaddr, 6) == 0 &&
+           mtu->type == ND6_OPTION_TYPE_MTU && lwip_ntohl(mtu->mtu) == 1500 &&
+           pi->type == ND6_OPTION_TYPE_PREFIX_INFO && pi->prefix_length == 64 &&
+           pi->flags == ND6_PREFIX_FLAG_AUTONOMOUS && lwip_ntohl(pi->valid_lifetime) == lifetime &&
+           pi->prefix.addr[0] == lwip_htonl(w0) && pi->prefix.addr[1] == lwip_htonl(w1) &&
+           pi->prefix.addr[2] == 0 && pi->prefix.addr[3] == 0;
+}
+
+/* The prefix of the uplink is announced as autonomous but not on-link */
+static void test_ra(void)
+{
+    u8_t rs[8] = { ICMP6_TYPE_RS };
+
+    /* Nothing without a prefix */
+    HOST_CHECK(udp6(&host_ap, CLIENT(0x100), REMOTE, 64) == 0);
+    host_advance(10000);
+    HOST_CHECK(host_sent6 == 0);
+
+    set_addr(&host_sta, 1, STA_ADDR);
+    host_advance(10000);
+    HOST_CHECK(host_sent6 == 1 && ra_ok(600, PREFIX0, PREFIX1));
+
+    /* Solicited, only from the AP and from the link itself */
+    HOST_CHECK(input6(&host_ap, addr6(0xfe800000, 0, 0, 0x100), addr6(0xff020000, 0, 0, 2),
+                      IP6_NEXTH_ICMP6, ND_HOPLIM, rs, sizeof(rs)) == 1);
+    HOST_CHECK(host_sent6 == 2 && ra_ok(600, PREFIX0, PREFIX1));
+    HOST_CHECK(input6(&host_ap, addr6(0xfe800000, 0, 0, 0x100), addr6(0xff020000, 0, 0, 2),
+                      IP6_NEXTH_ICMP6, 64, rs, sizeof(rs)) == 0);
+    HOST_CHECK(input6(&host_sta, UPSTREAM_LL, addr6(0xff020000, 0, 0, 2),
+                      IP6_NEXTH_ICMP6, ND_HOPLIM, rs, sizeof(rs)) == 0);
+    HOST_CHECK(host_sent6 == 2);
+
+    /* Unsolicited every minute */
+    host_advance(50000);
+    HOST_CHECK(host_sent6 == 2);
+    host_advance(10000);
+    HOST_CHECK(host_sent6 == 3 && ra_ok(600, PREFIX0, PREFIX1));
+}
+
+/* Clients and their addresses are learned from what they send, the uplink
+ * gets proxy advertisements for them */
+static void test_proxy(void)
+{
+    u32_t sent = host_sent6;
+
+    /* Unknown yet, and the router's own address is lwIP's */
+    HOST_CHECK(nd(&host_sta, ICMP6_TYPE_NS, UPSTREAM_LL, solicited_node(CLIENT(0x100)), CLIENT(0x100), NULL,
+                  ND_HOPLIM) == 0);
+    HOST_CHECK(nd(&host_sta, ICMP6_TYPE_NS, UPSTREAM_LL, solicited_node(STA_ADDR), STA_ADDR, NULL,
+                  ND_HOPLIM) == 0);
+    HOST_CHECK(host_sent6 == sent);
+
+    /* Learned from a packet it sends, which goes out of the uplink */
+    HOST_CHECK(udp6(&host_ap, CLIENT(0x100), REMOTE, 64) == 1);
+    HOST_CHECK(host_sent6 == sent + 1 && host_sent6_netif == &host_sta);
+    HOST_CHECK(addr_eq(&sent6()->src, CLIENT(0x100)) && addr_eq(&sent6()->dest, REMOTE));
+    HOST_CHECK(IP6H_HOPLIM(sent6()) == 63);
+
+    HOST_CHECK(nd(&host_sta, ICMP6_TYPE_NS, UPSTREAM_LL, solicited_node(CLIENT(0x100)), CLIENT(0x100), NULL,
+                  ND_HOPLIM) == 1);
+    HOST_CHECK(host_sent6 == sent + 2 && sent_nd(&host_sta, ICMP6_TYPE_NA, STA_LL));
+    HOST_CHECK(addr_eq(&sent6()->dest, UPSTREAM_LL));
+    const struct na_header *na = (const struct na_header *)(host_pkt6 + IP6_HLEN);
+    const struct lladdr_option *lla = (const struct lladdr_option *)(na + 1);
+    HOST_CHECK(na->flags == ND6_FLAG_SOLICITED && addr_eq(&na->target_address, CLIENT(0x100)));
+    HOST_CHECK(lla->type == ND6_OPTION_TYPE_TARGET_LLADDR && memcmp(lla->addr, host_sta.hwaddr, 6) == 0);
+
+    /* ND never crosses a router */
+    HOST_CHECK(nd(&host_sta, ICMP6_TYPE_NS, UPSTREAM_LL, solicited_node(CLIENT(0x100)), CLIENT(0x100), NULL,
+                  64) == 0);
+
+    /* Learned from its duplicate address detection, answered to all nodes */
+    HOST_CHECK(nd(&host_ap, ICMP6_TYPE_NS, UNSPEC, solicited_node(CLIENT(0x200)), CLIENT(0x200), NULL,
+                  ND_HOPLIM) == 0);
+    HOST_CHECK(nd(&host_sta, ICMP6_TYPE_NS, UNSPEC, solicited_node(CLIENT(0x200)), CLIENT(0x200), NULL,
+                  ND_HOPLIM) == 1);
+    HOST_CHECK(host_sent6 == sent + 3 && sent_nd(&host_sta, ICMP6_TYPE_NA, STA_LL));
+    HOST_CHECK(addr_eq(&sent6()->dest, addr6(0xff020000, 0, 0, 1)) && na->flags == 0);
+
+    /* Not for the router's own address */
+    HOST_CHECK(nd(&host_ap, ICMP6_TYPE_NS, UNSPEC, solicited_node(STA_ADDR), STA_ADDR, NULL, ND_HOPLIM) == 0);
+    HOST_CHECK(nd(&host_sta, ICMP6_TYPE_NS, UPSTREAM_LL, solicited_node(STA_ADDR), STA_ADDR, NULL,
+                  ND_HOPLIM) == 0);
+    HOST_CHECK(host_sent6 == sent + 3);
+}
+
+/* Packets for a client are sent to its MAC, which it is asked for while
+ * unknown */
+static void test_forward(void)
+{
+    u32_t sent = host_sent6;
+
+    /* CLIENT(0x200) is known from its DAD only */
+    HOST_CHECK(udp6(&host_sta, REMOTE, CLIENT(0x200), 64) == 1);
+    HOST_CHECK(host_sent6 == sent + 1 && sent_nd(&host_ap, ICMP6_TYPE_NS, AP_LL));
+    HOST_CHECK(addr_eq(&sent6()->dest, solicited_node(CLIENT(0x200))));
+    const struct ns_header *ns = (const struct ns_header *)(host_pkt6 + IP6_HLEN);
+    const struct lladdr_option *lla = (const struct lladdr_option *)(ns + 1);
+    HOST_CHECK(addr_eq(&ns->target_address, CLIENT(0x200)));
+    HOST_CHECK(lla->type == ND6_OPTION_TYPE_SOURCE_LLADDR && memcmp(lla->addr, host_ap.hwaddr, 6) == 0);
+
+    /* Once a second */
+    HOST_CHECK(udp6(&host_sta, REMOTE, CLIENT(0x200), 64) == 1);
+    HOST_CHECK(host_sent6 == sent + 1);
+    host_advance(1000);
+    HOST_CHECK(udp6(&host_sta, REMOTE, CLIENT(0x200), 64) == 1);
+    HOST_CHECK(host_sent6 == sent + 2);
+
+    /* The answer */
+    HOST_CHECK(nd(&host_ap, ICMP6_TYPE_NA, CLIENT(0x200), AP_LL, CLIENT(0x200), MAC_OF(CLIENT(0x200)), ND_HOPLIM) == 0);
+    HOST_CHECK(udp6(&host_sta, REMOTE, CLIENT(0x200), 64) == 1);
+    HOST_CHECK(host_sent6 == sent + 3 && host_sent6_netif == &host_ap);
+    HOST_CHECK(memcmp(host_sent6_mac.addr, MAC_OF(CLIENT(0x200)), 6) == 0);
+    HOST_CHECK(addr_eq(&sent6()->dest, CLIENT(0x200)) && IP6H_HOPLIM(sent6()) == 63);
+
+    /* From one client to another stays on the AP */
+    HOST_CHECK(udp6(&host_ap, CLIENT(0x100), CLIENT(0x200), 64) == 1);
+    HOST_CHECK(host_sent6 == sent + 4 && host_sent6_netif == &host_ap);
+
+    /* What is not the relay's: the rest of the prefix on the uplink,
+     * multicast, link-local, the router itself and foreign sources */
+    HOST_CHECK(udp6(&host_sta, REMOTE, CLIENT(0x300), 64) == 0);
+    HOST_CHECK(udp6(&host_ap, CLIENT(0x100), addr6(0xff050000, 0, 0, 0xfb), 64) == 0);
+    HOST_CHECK(udp6(&host_ap, CLIENT(0x100), AP_LL, 64) == 0);
+    HOST_CHECK(udp6(&host_ap, CLIENT(0x100), STA_ADDR, 64) == 0);
+    HOST_CHECK(udp6(&host_ap, addr6(0x20010db8, 0x99, 0, 1), REMOTE, 64) == 0);
+    HOST_CHECK(host_sent6 == sent + 4);
+
+    /* Dropped out of hops */
+    HOST_CHECK(udp6(&host_sta, REMOTE, CLIENT(0x200), 1) == 1);
+    HOST_CHECK(host_sent6 == sent + 4);
+}
+
+/* Is the last packet sent a Packet Too Big for mtu quoting qlen bytes of a
+ * packet from src to dest? */
+static bool sent_ptb(ip6_addr_t src, ip6_addr_t dest, u32_t mtu, u16_t qlen)
+{
+    const struct ip6_hdr *ip6hdr = sent6();
+    const struct icmp6_hdr *icmp6hdr = (const struct icmp6_hdr *)(ip6hdr + 1);
+    const struct ip6_hdr *q = (const struct ip6_hdr *)(icmp6hdr + 1);
+
+    return IP6H_NEXTH(ip6hdr) == IP6_NEXTH_ICMP6 && addr_eq(&ip6hdr->src, STA_ADDR) &&
+           addr_eq(&ip6hdr->dest, src) && host_pkt6_csum_ok() &&
+           host_pkt6_len == IP6_HLEN + sizeof(*icmp6hdr) + qlen &&
+           icmp6hdr->type == ICMP6_TYPE_PTB && icmp6hdr->code == 0 && lwip_ntohl(icmp6hdr->data) == mtu &&
+           addr_eq(&q->src, src) && addr_eq(&q->dest, dest) && IP6H_HOPLIM(q) == 64 &&
+           ((const u8_t *)q)[qlen - 1] == (u8_t)(qlen - 1 - IP6_HLEN);
+}
+
+/* Packets too big for the way out are answered, back the way they came
+ * and within the ICMP rate */
+static void test_too_big(void)
+{
+    router_stats_t st0, st1;
+    u32_t sent = host_sent6;
+
+    /* To a client, from the uplink's address */
+    host_ap.mtu6 = 1280;
+    HOST_CHECK(udp6_len(&host_sta, REMOTE, CLIENT(0x200), 64, 1281 - IP6_HLEN) == 1);
+    HOST_CHECK(host_sent6 == sent + 1 && host_sent6_netif == &host_sta);
+    HOST_CHECK(sent_ptb(REMOTE, CLIENT(0x200), 1280, 1280 - IP6_HLEN - sizeof(struct icmp6_hdr)));
+    HOST_CHECK(udp6_len(&host_sta, REMOTE, CLIENT(0x200), 64, 1280 - IP6_HLEN) == 1);
+    HOST_CHECK(host_sent6 == sent + 2 && host_sent6_netif == &host_ap);
+    host_ap.mtu6 = 1500;
+
+    /* From a client, to its MAC */
+    host_sta.mtu6 = 100;
+    HOST_CHECK(udp6_len(&host_ap, CLIENT(0x200), REMOTE, 64, 61) == 1);
+    HOST_CHECK(host_sent6 == sent + 3 && host_sent6_netif == &host_ap);
+    HOST_CHECK(memcmp(host_sent6_mac.addr, MAC_OF(CLIENT(0x200)), 6) == 0);
+    HOST_CHECK(sent_ptb(CLIENT(0x200), REMOTE, 100, IP6_HLEN + 61));
+
+    /* Rate limited */
+    set_icmp_rate(1);
+    host_advance(1000);
+    router_hooks_get_stats(&st0);
+    HOST_CHECK(udp6_len(&host_ap, CLIENT(0x200), REMOTE, 64, 61) == 1);
+    HOST_CHECK(udp6_len(&host_ap, CLIENT(0x200), REMOTE, 64, 61) == 1);
+    router_hooks_get_stats(&st1);
+    HOST_CHECK(host_sent6 == sent + 4 && st1.icmp_limited == st0.icmp_limited + 1);
+    host_advance(1000);
+    HOST_CHECK(udp6_len(&host_ap, CLIENT(0x200), REMOTE, 64, 61) == 1);
+    HOST_CHECK(host_sent6 == sent + 5);
+    set_icmp_rate(ICMP_RATE_DEFAULT);
+    host_sta.mtu6 = 1500;
+}
+
+/* With isolation on the clients only reach each other if one of them is an
+ * exception, known by its MAC */
+static void test_isolate(void)
+{
+    isolate_config_t cfg = { .on = true };
+    isolate_stats_t st;
+    u32_t sent;
+
+    HOST_CHECK(set_isolate(&cfg) == ESP_OK);
+    sent = host_sent6;
+    HOST_CHECK(udp6(&host_ap, CLIENT(0x100), CLIENT(0x200), 64) == 1);
+    HOST_CHECK(udp6(&host_ap, CLIENT(0x200), CLIENT(0x100), 64) == 1);
+    HOST_CHECK(nd(&host_ap, ICMP6_TYPE_NS, CLIENT(0x100), solicited_node(CLIENT(0x200)), CLIENT(0x200),
+                  MAC_OF(CLIENT(0x100)), ND_HOPLIM) == 1);
+    HOST_CHECK(host_sent6 == sent);
+    isolate_get_config(&cfg, &st);
+    HOST_CHECK(st.dropped == 3);
+
+    /* The uplink, the router and a client's own address still work */
+    HOST_CHECK(udp6(&host_ap, CLIENT(0x100), REMOTE, 64) == 1 && host_sent6_netif == &host_sta);
+    HOST_CHECK(udp6(&host_sta, REMOTE, CLIENT(0x100), 64) == 1 && host_sent6_netif == &host_ap);
+    HOST_CHECK(udp6(&host_ap, CLIENT(0x100), STA_ADDR, 64) == 0);
+    HOST_CHECK(nd(&host_ap, ICMP6_TYPE_NS, CLIENT(0x100), solicited_node(CLIENT(0x100)), CLIENT(0x100),
+                  MAC_OF(CLIENT(0x100)), ND_HOPLIM) == 0);
+    HOST_CHECK(host_sent6 == sent + 2);
+
+    /* An exception reaches the others and they it, both ways */
+    HOST_CHECK(isolate_parse_macs("02:c1:1e:47:02:00", &cfg));
+    HOST_CHECK(set_isolate(&cfg) == ESP_OK);
+    HOST_CHECK(udp6(&host_ap, CLIENT(0x100), CLIENT(0x200), 64) == 1);
+    HOST_CHECK(host_sent6 == sent + 3 && memcmp(host_sent6_mac.addr, MAC_OF(CLIENT(0x200)), 6) == 0);
+    HOST_CHECK(udp6(&host_ap, CLIENT(0x200), CLIENT(0x100), 64) == 1);
+    HOST_CHECK(host_sent6 == sent + 4 && memcmp(host_sent6_mac.addr, MAC_OF(CLIENT(0x100)), 6) == 0);
+    HOST_CHECK(nd(&host_ap, ICMP6_TYPE_NS, CLIENT(0x100), solicited_node(CLIENT(0x200)), CLIENT(0x200),
+                  MAC_OF(CLIENT(0x100)), ND_HOPLIM) == 0);
+
+    /* A client whose MAC is not known yet is asked for it, with or
+     * without isolation */
+    HOST_CHECK(nd(&host_ap, ICMP6_TYPE_NS, UNSPEC, solicited_node(CLIENT(0x500)), CLIENT(0x500), NULL,
+                  ND_HOPLIM) == 0);
+    HOST_CHECK(udp6(&host_ap, CLIENT(0x100), CLIENT(0x500), 64) == 1);
+    HOST_CHECK(host_sent6 == sent + 5 && sent_nd(&host_ap, ICMP6_TYPE_NS, AP_LL));
+    HOST_CHECK(nd(&host_ap, ICMP6_TYPE_NA, CLIENT(0x500), AP_LL, CLIENT(0x500), MAC_OF(CLIENT(0x500)),
+                  ND_HOPLIM) == 0);
+    HOST_CHECK(udp6(&host_ap, CLIENT(0x100), CLIENT(0x500), 64) == 1);
+    HOST_CHECK(host_sent6 == sent + 5);
+
+    cfg.on = false;
+    HOST_CHECK(set_isolate(&cfg) == ESP_OK);
+    HOST_CHECK(udp6(&host_ap, CLIENT(0x100), CLIENT(0x500), 64) == 1);
+    HOST_CHECK(host_sent6 == sent + 6 && memcmp(host_sent6_mac.addr, MAC_OF(CLIENT(0x500)), 6) == 0);
+    isolate_get_config(&cfg, &st);
+    HOST_CHECK(st.dropped == 4);
+}
+
+/* Malformed packets and ND options are left to lwIP and teach nothing */
+static void test_malformed(void)
+{
+    u32_t sent = host_sent6;
+    u8_t m[sizeof(struct ns_header) + 24] = { ICMP6_TYPE_NA };
+    ip6_addr_t target = CLIENT(0x400);
+
+    memcpy(m + offsetof(struct na_header, target_address), target.addr, 16);
+    HOST_CHECK(nd(&host_ap, ICMP6_TYPE_NS, UNSPEC, solicited_node(target), target, NULL, ND_HOPLIM) == 0);
+
+    /* An option of length 0, one past the end, a source address option in
+     * an advertisement and one of the wrong size, and a truncated one */
+    u8_t *opt = m + sizeof(struct na_header);
+    opt[0] = ND6_OPTION_TYPE_TARGET_LLADDR;
+    HOST_CHECK(input6(&host_ap, target, AP_LL, IP6_NEXTH_ICMP6, ND_HOPLIM, m, sizeof(m)) == 0);
+    opt[1] = 4;
+    HOST_CHECK(input6(&host_ap, target, AP_LL, IP6_NEXTH_ICMP6, ND_HOPLIM, m, sizeof(m)) == 0);
+    opt[0] = ND6_OPTION_TYPE_SOURCE_LLADDR;
+    opt[1] = 1;
+    HOST_CHECK(input6(&host_ap, target, AP_LL, IP6_NEXTH_ICMP6, ND_HOPLIM, m, sizeof(m)) == 0);
+    opt[0] = ND6_OPTION_TYPE_TARGET_LLADDR;
+    opt[1] = 2;
+    HOST_CHECK(input6(&host_ap, target, AP_LL, IP6_NEXTH_ICMP6, ND_HOPLIM, m, sizeof(m)) == 0);
+    opt[1] = 1;
+    HOST_CHECK(input6(&host_ap, target, AP_LL, IP6_NEXTH_ICMP6, ND_HOPLIM, m, sizeof(struct na_header) + 6) == 0);
+    HOST_CHECK(input6(&host_ap, target, AP_LL, IP6_NEXTH_ICMP6, ND_HOPLIM, m, sizeof(struct na_header) - 1) == 0);
+    m[0] = ICMP6_TYPE_NS;
+    HOST_CHECK(input6(&host_ap, target, AP_LL, IP6_NEXTH_ICMP6, ND_HOPLIM, m, sizeof(struct ns_header) - 1) == 0);
+
+    /* So its MAC is still asked for */
+    HOST_CHECK(udp6(&host_sta, REMOTE, target, 64) == 1);
+    HOST_CHECK(host_sent6 == sent + 1 && sent_nd(&host_ap, ICMP6_TYPE_NS, AP_LL));
+
+    /* Headers lwIP drops itself */
+    struct pbuf *p = pbuf_alloc(PBUF_LINK, IP6_HLEN - 1, PBUF_RAM);
+    HOST_CHECK(router_ip6_input_hook(p, &host_sta) == 0);
+    pbuf_free(p);
+    p = pbuf_alloc(PBUF_LINK, IP6_HLEN + UDP_HLEN, PBUF_RAM);
+    struct ip6_hdr *ip6hdr = (struct ip6_hdr *)p->payload;
+    ip6hdr->_v_tc_fl = lwip_htonl(6UL << 28);
+    ip6hdr->_plen = lwip_htons(UDP_HLEN + 1);
+    ip6hdr->_nexth = IP6_NEXTH_UDP;
+    ip6hdr->_hoplim = 64;
+    memcpy(&ip6hdr->src, REMOTE.addr, 16);
+    memcpy(&ip6hdr->dest, CLIENT(0x200).addr, 16);
+    HOST_CHECK(router_ip6_input_hook(p, &host_sta) == 0);
+    ip6hdr->_plen = lwip_htons(UDP_HLEN);
+    ip6hdr->_v_tc_fl = lwip_htonl(4UL << 28);
+    HOST_CHECK(router_ip6_input_hook(p, &host_sta) == 0);
+    pbuf_free(p);
+    HOST_CHECK(host_sent6 == sent + 1);
+}
+
+/* Silent clients are forgotten, the oldest first when the table is full,
+ * and all of them when the prefix changes */
+static void test_expiry(void)
+{
+    u32_t sent;
+
+    host_advance(620000);
+    HOST_CHECK(udp6(&host_ap, CLIENT(0x100), REMOTE, 64) == 1);
+    host_advance(10000);
+    HOST_CHECK(udp6(&host_sta, REMOTE, CLIENT(0x200), 64) == 0);
+    HOST_CHECK(nd(&host_sta, ICMP6_TYPE_NS, UPSTREAM_LL, solicited_node(CLIENT(0x100)), CLIENT(0x100), NULL,
+                  ND_HOPLIM) == 1);
+
+    for (int i = 0; i < 16; i++) {
+        host_advance(10);
+        HOST_CHECK(udp6(&host_ap, CLIENT(0x1000 + i), REMOTE, 64) == 1);
+    }
+    HOST_CHECK(nd(&host_sta, ICMP6_TYPE_NS, UPSTREAM_LL, solicited_node(CLIENT(0x100)), CLIENT(0x100), NULL,
+                  ND_HOPLIM) == 0);
+    HOST_CHECK(nd(&host_sta, ICMP6_TYPE_NS, UPSTREAM_LL, solicited_node(CLIENT(0x1000)), CLIENT(0x1000), NULL,
+                  ND_HOPLIM) == 1);
+
+    /* The old prefix is withdrawn before the new one is announced */
+    sent = host_sent6;
+    set_addr(&host_sta, 1, addr6(PREFIX0, 0x00010003, 0, 1));
+    host_advance(10000);
+    HOST_CHECK(host_sent6 >= sent + 2);
+    HOST_CHECK(ra_ok(600, PREFIX0, 0x00010003));
+    HOST_CHECK(nd(&host_sta, ICMP6_TYPE_NS, UPSTREAM_LL, solicited_node(CLIENT(0x1000)), CLIENT(0x1000), NULL,
+                  ND_HOPLIM) == 0);
+
+    sent = host_sent6;
+    host_sta.ip6_addr_state[1] = IP6_ADDR_INVALID;
+    host_advance(10000);
+    HOST_CHECK(host_sent6 == sent + 1 && ra_ok(0, PREFIX0, 0x00010003));
+    HOST_CHECK(udp6(&host_ap, addr6(PREFIX0, 0x00010003, 0, 5), REMOTE, 64) == 0);
+}
+
+int main(void)
+{
+    host_init();
+    router_hooks_init();
+    set_addr(&host_sta, 0, STA_LL);
+    set_addr(&host_ap, 0, AP_LL);
+    set_ip6_relay(true);
+    ip6_relay_init();
+
+    test_ra();
+    test_proxy();
+    test_forward();
+    test_too_big();
+    test_isolate();
+    test_malformed();
+    test_expiry();
+    printf("ok\n");
+    return 0;
+}
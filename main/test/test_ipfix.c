@@ -0,0 +1,271 @@
+/* IPFIX export of the NAPT flows, ipfix.c
+
+   What the exporter sends is caught in udp_sendto() and decoded as a
+   collector would (RFC 7011): the records are read through the template
+   that came with the messages, not through knowledge of ipfix.c.
+*/
+
+#include "host.h"
+#include "router_globals.h"
+#include "router_hooks.h"
+#include "nat.h"
+
+#define CLIENT      HOST_IP(192, 168, 4, 2)
+#define REMOTE      HOST_IP(198, 51, 100, 7)
+#define COLLECTOR   HOST_IP(10, 0, 0, 1)
+
+#define PKT_LEN     (IP_HLEN + UDP_HLEN + 32)   /* of host_udp() */
+#define MTU_PAYLOAD (1500 - IP_HLEN - UDP_HLEN)
+
+/* Decoded record */
+struct record {
+    u32_t src, dest, xaddr;
+    u16_t sport, dport, xport;
+    u8_t proto, reason;
+    u32_t bytes_out, bytes_in;
+    u64_t start, end;
+};
+
+static struct {
+    int messages;
+    int templates;              /* messages with the template */
+    u32_t next_seq;
+    u16_t fields[32][2];        /* of the template, id and length */
+    int nfields;
+    struct record rec[512];
+    int nrec;
+} collector;
+
+static bool exporter_on;
+
+struct udp_pcb *udp_new(void)
+{
+    HOST_CHECK(!exporter_on);
+    exporter_on = true;
+    return calloc(1, sizeof(struct udp_pcb));
+}
+
+void udp_remove(struct udp_pcb *pcb)
+{
+    HOST_CHECK(exporter_on);
+    exporter_on = false;
+    free(pcb);
+}
+
+static u64_t get(const u8_t *b, int len)
+{
+    u64_t v = 0;
+    for (int i = 0; i < len; i++) {
+        v = v << 8 | b[i];
+    }
+    return v;
+}
+
+/* Addresses stay in network byte order */
+static u32_t get_addr(const u8_t *b)
+{
+    u32_t a;
+    memcpy(&a, b, 4);
+    return a;
+}
+
+static void decode_record(const u8_t *b)
+{
+    struct record *r = &collector.rec[collector.nrec++];
+
+    for (int i = 0; i < collector.nfields; i++) {
+        u16_t id = collector.fields[i][0], len = collector.fields[i][1];
+        switch (id) {
+        case 8: r->src = get_addr(b); break;
+        case 12: r->dest = get_addr(b); break;
+        case 225: r->xaddr = get_addr(b); break;
+        case 7: r->sport = get(b, len); break;
+        case 11: r->dport = get(b, len); break;
+        case 227: r->xport = get(b, len); break;
+        case 4: r->proto = get(b, len); break;
+        case 136: r->reason = get(b, len); break;
+        case 231: r->bytes_out = get(b, len); break;
+        case 232: r->bytes_in = get(b, len); break;
+        case 152: r->start = get(b, len); break;
+        case 153: r->end = get(b, len); break;
+        default: HOST_CHECK(!"unknown information element");
+        }
+        b += len;
+    }
+}
+
+err_t udp_sendto(struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *dst_ip, u16_t dst_port)
+{
+    const u8_t *m = p->payload;
+    u16_t len = p->len;
+
+    HOST_CHECK(exporter_on && p->len == p->tot_len && len <= MTU_PAYLOAD);
+    HOST_CHECK(ip_2_ip4(dst_ip)->addr == COLLECTOR && dst_port == IPFIX_PORT);
+
+    /* Message header */
+    HOST_CHECK(len >= 16 && get(m, 2) == 10 && get(m + 2, 2) == len);
+    HOST_CHECK(get(m + 8, 4) == collector.next_seq && get(m + 12, 4) == 0);
+    collector.messages++;
+
+    for (u16_t pos = 16; pos < len; ) {
+        u16_t set_id = get(m + pos, 2), set_len = get(m + pos + 2, 2);
+        HOST_CHECK(set_len >= 4 && pos + set_len <= len);
+        const u8_t *b = m + pos + 4, *end = m + pos + set_len;
+
+        if (set_id == 2) {
+            HOST_CHECK(get(b, 2) == 256);
+            collector.nfields = get(b + 2, 2);
+            HOST_CHECK(collector.nfields <= 32 && b + 4 + collector.nfields * 4 == end);
+            for (int i = 0; i < collector.nfields; i++) {
+                collector.fields[i][0] = get(b + 4 + i * 4, 2);
+                collector.fields[i][1] = get(b + 6 + i * 4, 2);
+            }
+            collector.templates++;
+        } else {
+            HOST_CHECK(set_id == 256 && collector.nfields > 0);
+            int rec_len = 0;
+            for (int i = 0; i < collector.nfields; i++) {
+                rec_len += collector.fields[i][1];
+            }
+            HOST_CHECK((end - b) % rec_len == 0);
+            for (; b < end; b += rec_len) {
+                decode_record(b);
+                collector.next_seq++;
+            }
+        }
+        pos += set_len;
+    }
+    return ERR_OK;
+}
+
+/* Runs the exporter's timer, the records are sent once a second */
+static void flush(void)
+{
+    host_advance(1000);
+}
+
+static void clear(void)
+{
+    collector.messages = collector.templates = collector.nrec = 0;
+}
+
+static struct record *last(void)
+{
+    HOST_CHECK(collector.nrec > 0);
+    return &collector.rec[collector.nrec - 1];
+}
+
+/* A flow that lasts longer than the active timeout is reported while it
+ * runs, with what it carried since, and once more when it ends */
+static void test_active(void)
+{
+    ipfix_config_t cfg = { .collector = COLLECTOR, .port = IPFIX_PORT, .active_timeout = 5 };
+    ipfix_stats_t st;
+    u16_t mport = 0;
+
+    HOST_CHECK(set_ipfix(&cfg) == ESP_OK && exporter_on);
+    for (int i = 0; i <= 5; i++) {
+        HOST_CHECK(host_udp(&host_ap, CLIENT, 40000, REMOTE, 53) == 1);
+        mport = lwip_ntohs(host_pkt.udp.src);
+        HOST_CHECK(host_udp(&host_sta, REMOTE, 53, my_ip, mport) == 0);
+        if (i < 5) {
+            HOST_CHECK(collector.nrec == 0);
+            host_advance(1000);
+        }
+    }
+    flush();
+    HOST_CHECK(collector.messages == 1 && collector.templates == 1 && collector.nrec == 1);
+    struct record *r = last();
+    HOST_CHECK(r->src == CLIENT && r->dest == REMOTE && r->sport == 40000 && r->dport == 53);
+    HOST_CHECK(r->proto == IP_PROTO_UDP && r->xaddr == my_ip && r->xport == mport);
+    /* The packet that crossed the timeout goes with it, its reply not */
+    HOST_CHECK(r->bytes_out == 6 * PKT_LEN && r->bytes_in == 5 * PKT_LEN);
+    HOST_CHECK(r->end - r->start == 5000 && r->reason == IPFIX_END_ACTIVE);
+
+    /* Idle, after the UDP stream timeout */
+    host_advance(70 * 1000);
+    r = last();
+    HOST_CHECK(collector.nrec == 2 && r->reason == IPFIX_END_IDLE);
+    HOST_CHECK(r->bytes_out == 0 && r->bytes_in == PKT_LEN && r->end == r->start);
+    /* The template is repeated after a minute */
+    HOST_CHECK(collector.messages == 2 && collector.templates == 2);
+
+    ipfix_get_config(&cfg, &st);
+    HOST_CHECK(st.records == 2 && st.packets == 2 && st.dropped == 0);
+}
+
+/* Evicted mappings are reported, records are spread over as many
+ * packets as the MTU needs, a full ring drops */
+static void test_many(void)
+{
+    napt_stats_t ns;
+    ipfix_stats_t st;
+    ipfix_config_t cfg;
+
+    clear();
+    napt_get_stats(&ns);
+    u32_t capacity = ns.capacity;
+    for (u32_t i = 0; i <= capacity; i++) {
+        HOST_CHECK(host_udp(&host_ap, CLIENT, 1000 + i, REMOTE, 53) == 1);
+    }
+    flush();
+    HOST_CHECK(collector.nrec == 1 && last()->reason == IPFIX_END_RESOURCES && last()->sport == 1000);
+
+    /* The rest expire together */
+    clear();
+    host_advance(5000);
+    HOST_CHECK(collector.nrec == (int)capacity && collector.messages > 1);
+    for (int i = 0; i < collector.nrec; i++) {
+        HOST_CHECK(collector.rec[i].reason == IPFIX_END_IDLE && collector.rec[i].bytes_out == PKT_LEN);
+    }
+
+    /* More records than the ring holds between two ticks */
+    ipfix_get_config(&cfg, &st);
+    u32_t records = st.records;
+    clear();
+    for (u32_t i = 0; i < capacity + 200; i++) {
+        host_udp(&host_ap, CLIENT, 3000 + i, REMOTE, 53);
+    }
+    ipfix_get_config(&cfg, &st);
+    HOST_CHECK(st.dropped == 200 - 128);
+    flush();
+    HOST_CHECK(collector.nrec == 128);
+    ipfix_get_config(&cfg, &st);
+    HOST_CHECK(st.records == records + 128);
+}
+
+static void test_off(void)
+{
+    ipfix_config_t cfg = { 0 };
+    ipfix_stats_t st;
+
+    /* Stored */
+    HOST_CHECK(get_ipfix() == ESP_OK);
+    ipfix_get_config(&cfg, &st);
+    HOST_CHECK(cfg.collector == COLLECTOR && cfg.active_timeout == 5);
+
+    cfg.collector = 0;
+    HOST_CHECK(set_ipfix(&cfg) == ESP_OK && !exporter_on);
+    clear();
+    for (int i = 0; i < 20; i++) {
+        host_udp(&host_ap, CLIENT, 5000 + i, REMOTE, 53);
+    }
+    host_advance(10 * 1000);
+    HOST_CHECK(collector.messages == 0);
+    HOST_CHECK(get_ipfix() != ESP_OK && !exporter_on);
+}
+
+int main(void)
+{
+    host_init();
+    router_hooks_init();
+    napt_init(64);
+    get_portmap_tab();
+    apply_portmap_tab();
+
+    test_active();
+    test_many();
+    test_off();
+    printf("ok\n");
+    return 0;
+}
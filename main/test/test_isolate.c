@@ -0,0 +1,130 @@
+/* AP client isolation, isolate.c */
+
+#include "host.h"
+#include "router_globals.h"
+#include "router_hooks.h"
+#include "nat.h"
+
+#define CLIENT  HOST_IP(192, 168, 4, 2)
+#define OTHER   HOST_IP(192, 168, 4, 3)
+#define CAMERA  HOST_IP(192, 168, 4, 9)
+#define REMOTE  HOST_IP(8, 8, 8, 8)
+
+static const u8_t camera_mac[6] = { 0x8c, 0xaa, 0xb5, 1, 2, 3 };
+
+esp_err_t esp_netif_dhcps_get_clients_by_mac(esp_netif_t *esp_netif, int num, esp_netif_pair_mac_ip_t *mac_ip_pair)
+{
+    if (memcmp(mac_ip_pair->mac, camera_mac, 6) != 0) {
+        return ESP_FAIL;
+    }
+    mac_ip_pair->ip.addr = CAMERA;
+    return ESP_OK;
+}
+
+/* Frames the AP interface passed on to lwIP */
+static int ap_input;
+
+static err_t driver_input(struct pbuf *p, struct netif *inp)
+{
+    ap_input++;
+    pbuf_free(p);
+    return ERR_OK;
+}
+
+/* true if an ARP frame from spa to tpa reaches lwIP */
+static bool arp(u32_t spa, u32_t tpa)
+{
+    struct pbuf *p = pbuf_alloc(PBUF_RAW, 60, PBUF_RAM);
+    u8_t *f = p->payload;
+    int before = ap_input;
+
+    memset(f, 0, 60);
+    f[12] = ETHTYPE_ARP >> 8;
+    f[13] = ETHTYPE_ARP & 0xff;
+    memcpy(f + SIZEOF_ETH_HDR + 14, &spa, 4);
+    memcpy(f + SIZEOF_ETH_HDR + 24, &tpa, 4);
+    host_ap.input(p, &host_ap);
+    return ap_input > before;
+}
+
+/* true if the hook lets lwIP forward a packet from the AP */
+static bool forwarded(u32_t src, u32_t dest)
+{
+    return host_udp(&host_ap, src, 5000, dest, 6000) == 0;
+}
+
+static void test_macs(void)
+{
+    isolate_config_t cfg = { 0 }, bad;
+    char buf[ISOLATE_EXEMPT_MAX * 18];
+
+    HOST_CHECK(isolate_parse_macs("8c:aa:b5:01:02:03", &cfg) && cfg.count == 1);
+    HOST_CHECK(memcmp(cfg.mac[0], camera_mac, 6) == 0);
+    bad = cfg;
+    HOST_CHECK(!isolate_parse_macs("192.168.4.2", &bad) && !isolate_parse_macs("8c:aa:b5:01:02", &bad));
+    HOST_CHECK(bad.count == 1);
+    HOST_CHECK(isolate_parse_macs("1:2:3:4:5:6, 1:2:3:4:5:7,1:2:3:4:5:8,1:2:3:4:5:9,"
+                                  "1:2:3:4:5:a,1:2:3:4:5:b,1:2:3:4:5:c,1:2:3:4:5:d", &bad));
+    HOST_CHECK(bad.count == ISOLATE_EXEMPT_MAX);
+    HOST_CHECK(!isolate_parse_macs("1:2:3:4:5:6,1:2:3:4:5:7,1:2:3:4:5:8,1:2:3:4:5:9,"
+                                   "1:2:3:4:5:a,1:2:3:4:5:b,1:2:3:4:5:c,1:2:3:4:5:d,1:2:3:4:5:e", &bad));
+    isolate_format_macs(&bad, buf, sizeof(buf));
+    HOST_CHECK(strcmp(buf, "01:02:03:04:05:06,01:02:03:04:05:07,01:02:03:04:05:08,01:02:03:04:05:09,"
+                           "01:02:03:04:05:0a,01:02:03:04:05:0b,01:02:03:04:05:0c,01:02:03:04:05:0d") == 0);
+    HOST_CHECK(isolate_parse_macs("", &bad) && bad.count == 0);
+}
+
+static void test_isolate(void)
+{
+    isolate_config_t cfg = { .on = true }, got;
+    isolate_stats_t st;
+
+    HOST_CHECK(forwarded(CLIENT, OTHER) && arp(CLIENT, OTHER));
+
+    HOST_CHECK(isolate_parse_macs("8c:aa:b5:01:02:03", &cfg));
+    HOST_CHECK(set_isolate(&cfg) == ESP_OK);
+    HOST_CHECK(!forwarded(CLIENT, OTHER) && !forwarded(OTHER, CLIENT));
+    /* The exception reaches all others and they it */
+    HOST_CHECK(forwarded(CLIENT, CAMERA) && forwarded(CAMERA, OTHER));
+    /* The router, broadcasts and the uplink are still reached */
+    HOST_CHECK(forwarded(CLIENT, my_ap_ip) && forwarded(CLIENT, HOST_IP(192, 168, 4, 255)));
+    HOST_CHECK(host_udp(&host_ap, CLIENT, 5000, REMOTE, 53) == 1 && host_pkt.ip.src.addr == my_ip);
+
+    HOST_CHECK(!arp(CLIENT, OTHER));
+    HOST_CHECK(arp(CLIENT, my_ap_ip) && arp(my_ap_ip, CLIENT) && arp(CLIENT, CAMERA));
+    /* Probes and gratuitous ARP */
+    HOST_CHECK(arp(0, OTHER) && arp(CLIENT, CLIENT));
+
+    isolate_get_config(&got, &st);
+    HOST_CHECK(got.on && got.count == 1 && st.dropped == 2 && st.arp_dropped == 1);
+
+    /* The exception follows its lease */
+    isolate_client_ip(camera_mac, HOST_IP(192, 168, 4, 10));
+    HOST_CHECK(!forwarded(CLIENT, CAMERA) && forwarded(CLIENT, HOST_IP(192, 168, 4, 10)));
+
+    /* Stored, looked up again at boot */
+    HOST_CHECK(get_isolate() == ESP_OK);
+    HOST_CHECK(forwarded(CLIENT, CAMERA) && !forwarded(CLIENT, OTHER));
+
+    cfg.on = false;
+    HOST_CHECK(set_isolate(&cfg) == ESP_OK);
+    HOST_CHECK(forwarded(CLIENT, OTHER) && arp(CLIENT, OTHER));
+    HOST_CHECK(get_isolate() == ESP_OK);
+    isolate_get_config(&got, NULL);
+    HOST_CHECK(!got.on && got.count == 1 && memcmp(got.mac[0], camera_mac, 6) == 0);
+}
+
+int main(void)
+{
+    host_init();
+    host_ap.input = driver_input;
+    router_hooks_init();
+    napt_init(64);
+    get_portmap_tab();
+    apply_portmap_tab();
+
+    test_macs();
+    test_isolate();
+    printf("ok\n");
+    return 0;
+}
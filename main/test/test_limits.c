@@ -0,0 +1,180 @@
+/* Per-client limits on new NAPT mappings, set_nat_limits() in napt.c */
+
+#include "host.h"
+#include "router_globals.h"
+#include "router_hooks.h"
+#include "nat.h"
+
+#define CLIENT  HOST_IP(192, 168, 4, 2)
+#define OTHER   HOST_IP(192, 168, 4, 3)
+#define REMOTE  HOST_IP(198, 51, 100, 7)
+
+/* The RSTs lwIP was asked to send */
+static int rsts;
+static u32_t rst_ackno, rst_local, rst_remote;
+static u16_t rst_local_port, rst_remote_port;
+
+void tcp_rst(const struct tcp_pcb *pcb, u32_t seqno, u32_t ackno, const ip_addr_t *local_ip,
+             const ip_addr_t *remote_ip, u16_t local_port, u16_t remote_port)
+{
+    rsts++;
+    rst_ackno = ackno;
+    rst_local = ip_2_ip4(local_ip)->addr;
+    rst_remote = ip_2_ip4(remote_ip)->addr;
+    rst_local_port = local_port;
+    rst_remote_port = remote_port;
+}
+
+/* true if a UDP packet from the AP went out of the uplink */
+static bool udp_out(u32_t client, u16_t sport)
+{
+    u32_t sent = host_sent;
+    HOST_CHECK(host_udp(&host_ap, client, sport, REMOTE, 53) == 1);
+    return host_sent > sent;
+}
+
+static u32_t limited(void)
+{
+    napt_stats_t st;
+    napt_get_stats(&st);
+    return st.limited;
+}
+
+static void set_limits(u32_t rate, u32_t flows)
+{
+    napt_limits_t l = { .rate = rate, .flows = flows };
+    HOST_CHECK(set_nat_limits(&l) == ESP_OK);
+}
+
+static void test_flows(void)
+{
+    for (int i = 0; i < 30; i++) {
+        HOST_CHECK(udp_out(CLIENT, 1000 + i));
+    }
+    set_limits(0, 20);
+    /* Mappings over a new limit are kept, no new ones */
+    HOST_CHECK(!udp_out(CLIENT, 2000) && limited() == 1);
+    HOST_CHECK(udp_out(CLIENT, 1000) && udp_out(CLIENT, 1029));
+    HOST_CHECK(udp_out(OTHER, 1000));
+
+    /* Room again once they expire */
+    host_advance(60 * 60 * 1000);
+    for (int i = 0; i < 20; i++) {
+        HOST_CHECK(udp_out(CLIENT, 3000 + i));
+    }
+    HOST_CHECK(!udp_out(CLIENT, 3020) && limited() == 2);
+    set_limits(0, 0);
+    HOST_CHECK(udp_out(CLIENT, 3020));
+    host_advance(60 * 60 * 1000);
+}
+
+/* A second's worth of burst, then rate a second */
+static void test_rate(void)
+{
+    int ok = 0;
+
+    set_limits(5, 0);
+    for (int i = 0; i < 20; i++) {
+        ok += udp_out(CLIENT, 4000 + i);
+    }
+    HOST_CHECK(ok == 5 && limited() == 17);
+    host_advance(200);
+    ok = 0;
+    for (int i = 0; i < 20; i++) {
+        ok += udp_out(CLIENT, 5000 + i);
+    }
+    HOST_CHECK(ok == 1);
+    /* Pauses only fill the bucket, with what was left or not */
+    host_advance(10 * 1000);
+    HOST_CHECK(udp_out(CLIENT, 5500));
+    host_advance(1000);
+    ok = 0;
+    for (int i = 0; i < 20; i++) {
+        ok += udp_out(CLIENT, 6000 + i);
+    }
+    HOST_CHECK(ok == 5);
+
+    /* Per client, and existing mappings are not counted */
+    ok = 0;
+    for (int i = 0; i < 5; i++) {
+        ok += udp_out(OTHER, 4000 + i);
+    }
+    HOST_CHECK(ok == 5 && udp_out(CLIENT, 6000));
+}
+
+/* A SYN over the limit is answered with a RST from the remote host */
+static void test_rst(void)
+{
+    u32_t sent = host_sent;
+
+    host_advance(10 * 1000);
+    set_limits(1, 0);
+    HOST_CHECK(host_tcp(&host_ap, CLIENT, 7000, REMOTE, 80, TCP_SYN) == 1 && host_sent == sent + 1);
+    HOST_CHECK(rsts == 0);
+    HOST_CHECK(host_tcp(&host_ap, CLIENT, 7001, REMOTE, 80, TCP_SYN) == 1 && host_sent == sent + 1);
+    HOST_CHECK(rsts == 1 && rst_ackno == lwip_ntohl(host_pkt.tcp.seqno) + 1);
+    HOST_CHECK(rst_local == REMOTE && rst_local_port == 80);
+    HOST_CHECK(rst_remote == CLIENT && rst_remote_port == 7001);
+    /* Other packets are just dropped */
+    HOST_CHECK(!udp_out(CLIENT, 7002) && rsts == 1);
+    set_limits(0, 0);
+    host_advance(60 * 60 * 1000);
+}
+
+/* Mappings of the DMZ host are opened from outside, counted but never
+ * refused */
+static void test_dmz(void)
+{
+    u32_t before = limited();
+
+    HOST_CHECK(set_dmz_host(CLIENT) == ESP_OK);
+    set_limits(0, 2);
+    for (int i = 0; i < 4; i++) {
+        HOST_CHECK(host_udp(&host_sta, REMOTE, 9000 + i, my_ip, 500 + i) == 0);
+        HOST_CHECK(host_pkt.ip.dest.addr == CLIENT);
+    }
+    HOST_CHECK(!udp_out(CLIENT, 8000) && udp_out(OTHER, 8000));
+    HOST_CHECK(limited() == before + 1);
+    HOST_CHECK(set_dmz_host(0) == ESP_OK);
+    set_limits(0, 0);
+}
+
+static void test_store(void)
+{
+    napt_limits_t l = { .rate = 10001 }, got;
+
+    HOST_CHECK(set_nat_limits(&l) == ESP_ERR_INVALID_ARG);
+    l = (napt_limits_t){ .flows = 0x10000 };
+    HOST_CHECK(set_nat_limits(&l) == ESP_ERR_INVALID_ARG);
+
+    /* Read back what was stored last, not 0 as stored before */
+    set_limits(3, 7);
+    HOST_CHECK(get_nat_limits() == ESP_OK);
+    napt_get_limits(&got);
+    HOST_CHECK(got.rate == 3 && got.flows == 7);
+
+    /* Out of range in the NVS, left as they are */
+    int32_t rate = -1;
+    host_nvs_put("lim_rate", &rate, sizeof(rate));
+    HOST_CHECK(get_nat_limits() == ESP_ERR_INVALID_ARG);
+    napt_get_limits(&got);
+    HOST_CHECK(got.rate == 3 && got.flows == 7);
+}
+
+int main(void)
+{
+    host_init();
+    router_hooks_init();
+    napt_init(256);
+    get_portmap_tab();
+    apply_portmap_tab();
+    get_nat_limits();
+
+    test_flows();
+    test_rate();
+    test_rst();
+    test_dmz();
+    test_store();
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,483 @@
+/* mDNS and SSDP reflector, mcast_reflect.c
+
+   Datagrams go in through host_udp_input() to the pcbs the reflector
+   bound, what it reflects is caught in udp_sendto_if_src(). The malformed
+   mDNS messages are there for ASan and UBSan as much as for the checks:
+   none of them may be read past its end.
+*/
+
+#include "host.h"
+#include "router_globals.h"
+#include "router_hooks.h"
+#include "nat.h"
+
+#define CLIENT      HOST_IP(192, 168, 4, 3)
+#define OTHER       HOST_IP(192, 168, 4, 4)
+#define REMOTE      HOST_IP(10, 0, 0, 7)
+#define MDNS_GROUP  HOST_IP(224, 0, 0, 251)
+#define SSDP_GROUP  HOST_IP(239, 255, 255, 250)
+#define MDNS_PORT   5353
+#define MDNS_HLEN   12
+#define SSDP_PORT   1900
+#define SEARCH_PORT 65280
+
+#define MEDIA       "urn:schemas-upnp-org:device:MediaServer:1"
+
+/* The last datagram reflected */
+static struct {
+    int count;
+    struct netif *netif;
+    u16_t sport;
+    u32_t dest;
+    u16_t dport;
+    u8_t data[1500];
+    u16_t len;
+} sent;
+
+static int joined;
+
+err_t udp_sendto_if_src(struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *dst_ip, u16_t dst_port,
+                        struct netif *netif, const ip_addr_t *src_ip)
+{
+    HOST_CHECK(p->len == p->tot_len && p->len <= sizeof(sent.data));
+    HOST_CHECK(ip_2_ip4(src_ip)->addr == netif->ip_addr.addr);
+    sent.count++;
+    sent.netif = netif;
+    sent.sport = pcb->local_port;
+    sent.dest = ip_2_ip4(dst_ip)->addr;
+    sent.dport = dst_port;
+    sent.len = p->len;
+    memcpy(sent.data, p->payload, p->len);
+    return ERR_OK;
+}
+
+err_t igmp_joingroup_netif(struct netif *netif, const ip4_addr_t *groupaddr)
+{
+    HOST_CHECK(groupaddr->addr == MDNS_GROUP || groupaddr->addr == SSDP_GROUP);
+    joined++;
+    return ERR_OK;
+}
+
+err_t igmp_leavegroup_netif(struct netif *netif, const ip4_addr_t *groupaddr)
+{
+    joined--;
+    return ERR_OK;
+}
+
+/* An mDNS message under construction */
+static u8_t msg[1600];
+static u16_t msg_len;
+
+static void put(const void *data, u16_t len)
+{
+    memcpy(msg + msg_len, data, len);
+    msg_len += len;
+}
+
+static void put8(u8_t v)
+{
+    put(&v, 1);
+}
+
+static void put16(u16_t v)
+{
+    put8(v >> 8);
+    put8(v);
+}
+
+static void header(bool response, u16_t qd, u16_t an)
+{
+    msg_len = 0;
+    put16(0);
+    put16(response ? 0x8400 : 0);
+    put16(qd);
+    put16(an);
+    put16(0);
+    put16(0);
+}
+
+/* Dotted name as labels, without the terminating 0 if open */
+static void name(const char *dotted, bool open)
+{
+    while (*dotted != '\0') {
+        size_t n = strcspn(dotted, ".");
+        put8(n);
+        put(dotted, n);
+        dotted += n + (dotted[n] == '.');
+    }
+    if (!open) {
+        put8(0);
+    }
+}
+
+/* A PTR question with the unicast-response bit set */
+static void question(const char *qname)
+{
+    name(qname, false);
+    put16(12);
+    put16(0x8001);
+}
+
+/* The type, class, TTL and RDATA of a record, its name already put */
+static void record(u32_t ttl, u16_t rdlen)
+{
+    put16(12);
+    put16(1);
+    put16(ttl >> 16);
+    put16(ttl);
+    put16(rdlen);
+    for (u16_t i = 0; i < rdlen; i++) {
+        put8(0);
+    }
+}
+
+static void answer(const char *rname, u32_t ttl)
+{
+    name(rname, false);
+    record(ttl, 2);
+}
+
+/* An answer whose name is reached through a chain of n pointers in its
+ * RDATA */
+static void pointers(int n)
+{
+    header(true, 0, 1);
+    put16(0xc000 | (MDNS_HLEN + 12));
+    record(30, 2 * (n - 1) + 22);
+    msg_len -= 2 * (n - 1) + 22;
+    for (int i = 1; i < n; i++) {
+        put16(0xc000 | (msg_len + 2));
+    }
+    name("web._http._tcp.local", false);
+}
+
+/* The message from a full responder of an AP client, or from the uplink */
+static int query(void)
+{
+    int count = sent.count;
+    HOST_CHECK(host_udp_input(&host_ap, CLIENT, MDNS_PORT, MDNS_GROUP, MDNS_PORT, msg, msg_len));
+    return sent.count - count;
+}
+
+static int response(void)
+{
+    int count = sent.count;
+    HOST_CHECK(host_udp_input(&host_sta, REMOTE, MDNS_PORT, MDNS_GROUP, MDNS_PORT, msg, msg_len));
+    return sent.count - count;
+}
+
+static int ssdp(struct netif *inp, u32_t src, u16_t sport, u32_t dest, u16_t dport, const char *text)
+{
+    int count = sent.count;
+    HOST_CHECK(host_udp_input(inp, src, sport, dest, dport, text, strlen(text)));
+    return sent.count - count;
+}
+
+static u32_t dropped(void)
+{
+    uint32_t reflected, dropped;
+    mcast_reflect_get_stats(&reflected, &dropped);
+    return dropped;
+}
+
+static void test_allow(void)
+{
+    char names[MCAST_ALLOW_MAX][MCAST_NAME_LEN];
+    u8_t data[4] = { 0 };
+
+    HOST_CHECK(mcast_get_reflect(names) == 0 && joined == 0);
+    HOST_CHECK(!host_udp_input(&host_sta, REMOTE, MDNS_PORT, MDNS_GROUP, MDNS_PORT, data, sizeof(data)));
+
+    HOST_CHECK(set_mcast_reflect("_HTTP._tcp.", true) == ESP_OK);
+    HOST_CHECK(set_mcast_reflect("_ipp._tcp.local", true) == ESP_OK);
+    HOST_CHECK(set_mcast_reflect(MEDIA, true) == ESP_OK);
+    HOST_CHECK(set_mcast_reflect("_http._tcp", true) == ESP_OK);
+    HOST_CHECK(set_mcast_reflect("...", true) == ESP_ERR_INVALID_ARG);
+    HOST_CHECK(set_mcast_reflect("_nope._tcp", false) == ESP_ERR_NOT_FOUND);
+    HOST_CHECK(mcast_get_reflect(names) == 3);
+    HOST_CHECK(strcmp(names[0], "_http._tcp.local") == 0 && strcmp(names[1], "_ipp._tcp.local") == 0);
+    HOST_CHECK(strcmp(names[2], MEDIA) == 0);
+    /* Both groups on both interfaces, and the ports bound */
+    HOST_CHECK(joined == 4);
+    for (int i = 0; i < 4; i++) {
+        HOST_CHECK(local_port_in_use(IP_PROTO_UDP, SEARCH_PORT + i));
+    }
+
+    HOST_CHECK(set_mcast_reflect("_ipp._tcp", false) == ESP_OK);
+    HOST_CHECK(mcast_get_reflect(names) == 2 && strcmp(names[1], MEDIA) == 0);
+
+    /* Off with the last one, back from the NVS */
+    HOST_CHECK(set_mcast_reflect("_http._tcp", false) == ESP_OK);
+    HOST_CHECK(set_mcast_reflect(MEDIA, false) == ESP_OK);
+    HOST_CHECK(joined == 0 && !local_port_in_use(IP_PROTO_UDP, MDNS_PORT));
+    HOST_CHECK(get_mcast_reflect() == ESP_ERR_NVS_NOT_FOUND);
+    HOST_CHECK(set_mcast_reflect("_http._tcp", true) == ESP_OK);
+    HOST_CHECK(set_mcast_reflect(MEDIA, true) == ESP_OK);
+    HOST_CHECK(get_mcast_reflect() == ESP_OK);
+    HOST_CHECK(mcast_get_reflect(names) == 2 && joined == 4);
+}
+
+static void test_mdns(void)
+{
+    host_advance(1000);
+
+    /* Only queries about an allowed service go up, as multicast ones */
+    header(false, 1, 0);
+    question("_printer._tcp.local");
+    HOST_CHECK(query() == 0);
+    header(false, 2, 0);
+    question("_printer._tcp.local");
+    question("_HTTP._tcp.local");
+    HOST_CHECK(query() == 1);
+    HOST_CHECK(sent.netif == &host_sta && sent.dest == MDNS_GROUP && sent.dport == MDNS_PORT);
+    HOST_CHECK(sent.len == msg_len && sent.data[msg_len - 2] == 0x00 && sent.data[msg_len - 1] == 0x01);
+    HOST_CHECK(sent.data[MDNS_HLEN + 21 + 2] == 0x00);
+    /* Not from a one-shot querier, nor without an uplink address */
+    int count = sent.count;
+    HOST_CHECK(host_udp_input(&host_ap, CLIENT, 50000, MDNS_GROUP, MDNS_PORT, msg, msg_len));
+    HOST_CHECK(sent.count == count);
+    my_ip = 0;
+    host_advance(1000);
+    HOST_CHECK(query() == 0);
+    my_ip = HOST_STA_IP;
+
+    /* Answers about what was asked come down */
+    header(true, 0, 2);
+    answer("_printer._tcp.local", 120);
+    answer("web._http._tcp.local", 120);
+    HOST_CHECK(response() == 1);
+    HOST_CHECK(sent.netif == &host_ap && sent.dest == MDNS_GROUP && sent.len == msg_len);
+    HOST_CHECK(memcmp(sent.data, msg, msg_len) == 0);
+    header(true, 0, 1);
+    answer("_ipp._tcp.local", 120);
+    HOST_CHECK(response() == 0);
+    header(true, 0, 1);
+    answer("web_http._tcp.local", 120);
+    HOST_CHECK(response() == 0);
+    /* Queries from the uplink, answers from the AP and the router's own
+     * stay where they are */
+    header(false, 1, 0);
+    question("_http._tcp.local");
+    HOST_CHECK(response() == 0);
+    header(true, 0, 1);
+    answer("web._http._tcp.local", 60);
+    HOST_CHECK(query() == 0);
+    HOST_CHECK(host_udp_input(&host_sta, my_ip, MDNS_PORT, MDNS_GROUP, MDNS_PORT, msg, msg_len));
+    HOST_CHECK(host_udp_input(&host_sta, REMOTE, MDNS_PORT, my_ip, MDNS_PORT, msg, msg_len));
+    HOST_CHECK(response() == 1);
+
+    /* A name compressed into the question */
+    header(true, 1, 1);
+    question("_http._tcp.local");
+    put16(0xc000 | MDNS_HLEN);
+    record(30, 4);
+    HOST_CHECK(response() == 1);
+
+    /* Not a minute after the query */
+    host_advance(60000);
+    header(true, 0, 1);
+    answer("web._http._tcp.local", 120);
+    HOST_CHECK(response() == 0);
+}
+
+/* Malformed messages match nothing, go nowhere and are not read past
+ * their end */
+static void test_malformed(void)
+{
+    static const char label63[] = "a23456789b123456789c123456789d123456789e123456789f123456789g12";
+
+    host_advance(1000);
+    header(false, 1, 0);
+    question("_http._tcp.local");
+    HOST_CHECK(query() == 1);
+    host_advance(1000);
+
+    /* Short of a header */
+    header(true, 0, 1);
+    msg_len = 11;
+    HOST_CHECK(response() == 0);
+
+    /* A pointer to itself, two pointing at each other, one past the end,
+     * one cut short */
+    header(true, 0, 1);
+    put16(0xc000 | MDNS_HLEN);
+    record(30, 2);
+    HOST_CHECK(response() == 0);
+    header(true, 0, 1);
+    put8(3);
+    put("web", 3);
+    put16(0xc000 | (MDNS_HLEN + 6));
+    put16(0xc000 | MDNS_HLEN);
+    record(30, 2);
+    HOST_CHECK(response() == 0);
+    header(true, 0, 1);
+    put16(0xc000 | 0x3fff);
+    record(30, 2);
+    HOST_CHECK(response() == 0);
+    header(true, 0, 1);
+    name("web._http._tcp.local", true);
+    put8(0xc0);
+    HOST_CHECK(response() == 0);
+
+    /* Labels past the end or of the reserved types */
+    header(true, 0, 1);
+    name("web._http._tcp", true);
+    put8(63);
+    put("local", 5);
+    HOST_CHECK(response() == 0);
+    header(true, 0, 1);
+    name("web", true);
+    put8(0x41);
+    for (int i = 0; i < 0x41; i++) {
+        put8('x');
+    }
+    answer("_http._tcp.local", 120);
+    HOST_CHECK(response() == 0);
+
+    /* A matching name, but its record cut short */
+    header(true, 0, 1);
+    answer("web._http._tcp.local", 120);
+    msg_len -= 3;
+    HOST_CHECK(response() == 0);
+    /* RDATA past the end, the matching record behind it */
+    header(true, 0, 2);
+    name("other.local", false);
+    put16(12);
+    put16(1);
+    put16(0);
+    put16(30);
+    put16(0xffff);
+    answer("web._http._tcp.local", 120);
+    HOST_CHECK(response() == 0);
+    /* More records counted than there are */
+    header(true, 0, 0xffff);
+    answer("_printer._tcp.local", 120);
+    HOST_CHECK(response() == 0);
+
+    /* A name longer than 255 bytes, ending in an allowed one */
+    header(true, 0, 1);
+    for (int i = 0; i < 5; i++) {
+        put8(sizeof(label63) - 1);
+        put(label63, sizeof(label63) - 1);
+    }
+    answer("_http._tcp.local", 120);
+    HOST_CHECK(response() == 0);
+    /* Followed through sixteen pointers, but not seventeen */
+    pointers(16);
+    HOST_CHECK(response() == 1);
+    pointers(17);
+    HOST_CHECK(response() == 0);
+
+    /* Questions: cut short, or more of them than there are. The class of
+     * the one that is there is left alone. */
+    header(false, 1, 0);
+    question("_http._tcp.local");
+    msg_len -= 1;
+    HOST_CHECK(query() == 0);
+    header(false, 0xffff, 0);
+    question("_http._tcp.local");
+    HOST_CHECK(query() == 0);
+
+    /* Larger than the reflector takes */
+    header(true, 0, 1);
+    answer("web._http._tcp.local", 120);
+    msg_len = 1473;
+    HOST_CHECK(response() == 0);
+}
+
+static void test_limits(void)
+{
+    u32_t drops;
+
+    host_advance(1000);
+    header(false, 1, 0);
+    question("_http._tcp.local");
+    HOST_CHECK(query() == 1);
+
+    /* The same packet once a second each way */
+    host_advance(1000);
+    header(true, 0, 1);
+    answer("web._http._tcp.local", 120);
+    drops = dropped();
+    HOST_CHECK(response() == 1);
+    HOST_CHECK(response() == 0 && dropped() == drops + 1);
+    HOST_CHECK(query() == 0 && dropped() == drops + 1);
+    host_advance(999);
+    HOST_CHECK(response() == 0);
+    host_advance(1);
+    HOST_CHECK(response() == 1);
+
+    /* Ten a second, the tokens of the time since the last one */
+    host_advance(1000);
+    drops = dropped();
+    for (int i = 0; i < 12; i++) {
+        header(true, 0, 1);
+        answer("web._http._tcp.local", 1000 + i);
+        HOST_CHECK(response() == (i < 10));
+    }
+    HOST_CHECK(dropped() == drops + 2);
+    host_advance(100);
+    HOST_CHECK(response() == 1);
+    HOST_CHECK(response() == 0);
+}
+
+static void test_ssdp(void)
+{
+    static const char search[] = "M-SEARCH * HTTP/1.1\r\nHOST: 239.255.255.250:1900\r\nMAN: \"ssdp:discover\"\r\n"
+                                 "mx: 2\r\nst:  " MEDIA " \r\n\r\n";
+    static const char other[] = "M-SEARCH * HTTP/1.1\r\nHOST: 239.255.255.250:1900\r\nMX: 2\r\n"
+                                "ST: urn:schemas-upnp-org:device:Printer:1\r\n\r\n";
+    static const char no_st[] = "M-SEARCH * HTTP/1.1\r\nSTX: " MEDIA "\r\nST";
+    static const char reply[] = "HTTP/1.1 200 OK\r\nST: " MEDIA "\r\nLOCATION: http://10.0.0.7/\r\n\r\n";
+    static const char notify[] = "NOTIFY * HTTP/1.1\r\nNT: " MEDIA "\r\nNTS: ssdp:alive\r\n\r\n";
+
+    host_advance(1000);
+    set_mcast_reflect(MEDIA, false);
+    set_mcast_reflect(MEDIA, true);
+    HOST_CHECK(ssdp(&host_sta, REMOTE, SSDP_PORT, SSDP_GROUP, SSDP_PORT, notify) == 0);
+    HOST_CHECK(ssdp(&host_ap, CLIENT, 50000, SSDP_GROUP, SSDP_PORT, other) == 0);
+    HOST_CHECK(ssdp(&host_ap, CLIENT, 50000, SSDP_GROUP, SSDP_PORT, no_st) == 0);
+
+    /* Up from a search port, the answers to it back to the client */
+    HOST_CHECK(ssdp(&host_ap, CLIENT, 50000, SSDP_GROUP, SSDP_PORT, search) == 1);
+    HOST_CHECK(sent.netif == &host_sta && sent.dest == SSDP_GROUP && sent.dport == SSDP_PORT);
+    HOST_CHECK(sent.len == strlen(search) && memcmp(sent.data, search, sent.len) == 0);
+    u16_t port = sent.sport;
+    HOST_CHECK(port >= SEARCH_PORT && port < SEARCH_PORT + 4);
+    HOST_CHECK(ssdp(&host_sta, REMOTE, SSDP_PORT, my_ip, port, reply) == 1);
+    HOST_CHECK(sent.netif == &host_ap && sent.dest == CLIENT && sent.dport == 50000 && sent.sport == port);
+    HOST_CHECK(sent.len == strlen(reply));
+    HOST_CHECK(ssdp(&host_ap, OTHER, SSDP_PORT, my_ip, port, reply) == 0);
+
+    /* Another client's search has a port of its own, the same client's
+     * search the same one */
+    HOST_CHECK(ssdp(&host_ap, OTHER, 50000, SSDP_GROUP, SSDP_PORT, search) == 1);
+    HOST_CHECK(sent.sport != port);
+    host_advance(1000);
+    HOST_CHECK(ssdp(&host_ap, CLIENT, 50000, SSDP_GROUP, SSDP_PORT, search) == 1 && sent.sport == port);
+
+    /* Announcements come down while a client is interested */
+    HOST_CHECK(ssdp(&host_sta, REMOTE, SSDP_PORT, SSDP_GROUP, SSDP_PORT, notify) == 1);
+    HOST_CHECK(sent.netif == &host_ap && sent.dest == SSDP_GROUP && sent.sport == SSDP_PORT);
+    HOST_CHECK(ssdp(&host_ap, CLIENT, 50000, SSDP_GROUP, SSDP_PORT, notify) == 0);
+
+    /* MX + 1 seconds for the answers */
+    host_advance(2999);
+    HOST_CHECK(ssdp(&host_sta, REMOTE, SSDP_PORT, my_ip, port, reply) == 1);
+    host_advance(1);
+    HOST_CHECK(ssdp(&host_sta, REMOTE, SSDP_PORT, my_ip, port, reply) == 0);
+}
+
+int main(void)
+{
+    host_init();
+    router_hooks_init();
+
+    test_allow();
+    test_mdns();
+    test_malformed();
+    test_limits();
+    test_ssdp();
+    printf("ok\n");
+    return 0;
+}
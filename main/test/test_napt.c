@@ -0,0 +1,140 @@
+/* Port allocation of the NAPT table, napt.c */
+
+#include "host.h"
+#include "router_globals.h"
+#include "router_hooks.h"
+#include "nat.h"
+
+#define CLIENT  HOST_IP(192, 168, 4, 3)
+#define REMOTE  HOST_IP(198, 51, 100, 7)
+
+static struct udp_pcb local_udp[9];
+
+/* The destination unreachables lwIP was asked to send, with the header of
+ * the packet they are about */
+static int unreach;
+static enum icmp_dur_type unreach_code;
+static struct host_pkt unreach_pkt;
+
+void icmp_dest_unreach(struct pbuf *p, enum icmp_dur_type t)
+{
+    unreach++;
+    unreach_code = t;
+    pbuf_copy_partial(p, &unreach_pkt, sizeof(unreach_pkt), 0);
+}
+
+/* Opens a UDP socket of the router on port */
+static void bind_udp(struct udp_pcb *pcb, u16_t port)
+{
+    pcb->local_port = port;
+    pcb->next = udp_pcbs;
+    udp_pcbs = pcb;
+}
+
+static u16_t map_udp(u16_t sport)
+{
+    HOST_CHECK(host_udp(&host_ap, CLIENT, sport, REMOTE, 53) == 1);
+    HOST_CHECK(host_pkt.ip.src.addr == my_ip && host_pkt_csum_ok());
+    return lwip_ntohs(host_pkt.udp.src);
+}
+
+/* Mappings stay out of the range lwIP takes the router's own local ports
+ * from, and off ports its sockets are bound to */
+static void test_ports(void)
+{
+    u16_t first = map_udp(1000);
+    HOST_CHECK(first >= NAPT_PORT_MIN && first <= NAPT_PORT_MAX && first < 0xc000);
+
+    for (int i = 0; i < 8; i++) {
+        bind_udp(&local_udp[i], first + 1 + i);
+    }
+    u16_t next = map_udp(1001);
+    HOST_CHECK(next > first + 8 && next <= NAPT_PORT_MAX);
+
+    napt_stats_t st;
+    napt_get_stats(&st);
+    HOST_CHECK(st.entries == 2);
+}
+
+/* nat_cone keeps the client's port, unless the router uses it */
+static void test_cone(void)
+{
+    HOST_CHECK(set_nat_cone(CLIENT, true) == ESP_OK);
+    HOST_CHECK(map_udp(6000) == 6000);
+
+    bind_udp(&local_udp[8], 5351);
+    u16_t mport = map_udp(5351);
+    HOST_CHECK(mport != 5351 && mport >= NAPT_PORT_MIN && mport <= NAPT_PORT_MAX);
+
+    /* Replies to the router's socket are left to lwIP */
+    HOST_CHECK(host_udp(&host_sta, REMOTE, 53, my_ip, 5351) == 0);
+    HOST_CHECK(host_pkt.ip.dest.addr == my_ip);
+    HOST_CHECK(set_nat_cone(CLIENT, false) == ESP_OK);
+}
+
+/* Runs the hook on host_pkt of len bytes with DF set */
+static int input_df(u16_t len)
+{
+    struct pbuf *p = pbuf_alloc(PBUF_IP, len, PBUF_RAM);
+
+    IPH_OFFSET_SET(&host_pkt.ip, PP_HTONS(IP_DF));
+    IPH_CHKSUM_SET(&host_pkt.ip, 0);
+    IPH_CHKSUM_SET(&host_pkt.ip, inet_chksum(&host_pkt.ip, IP_HLEN));
+    memcpy(p->payload, &host_pkt, len);
+    int ret = router_ip4_input_hook(p, &host_ap);
+    if (ret == 0) {
+        pbuf_free(p);
+    }
+    return ret;
+}
+
+/* A packet too big for the uplink with DF set is answered with a
+ * fragmentation needed about the packet as the client sent it, within
+ * the ICMP rate, also on a cached flow */
+static void test_mtu(void)
+{
+    u16_t len = host_udp_pkt(CLIENT, 8000, REMOTE, 53);
+    u32_t sent = host_sent;
+
+    host_sta.mtu = len - 1;
+    HOST_CHECK(input_df(len) == 1 && host_sent == sent && unreach == 1);
+    HOST_CHECK(unreach_code == ICMP_DUR_FRAG && unreach_pkt.ip.src.addr == CLIENT);
+    HOST_CHECK(lwip_ntohs(unreach_pkt.udp.src) == 8000 && IPH_TTL(&unreach_pkt.ip) == 64);
+
+    /* Without DF it is fragmented, by ip4_frag() */
+    HOST_CHECK(host_udp(&host_ap, CLIENT, 8000, REMOTE, 53) == 1 && unreach == 1);
+
+    /* On the flow cached now */
+    host_sta.mtu = 1500;
+    host_udp_pkt(CLIENT, 8000, REMOTE, 53);
+    HOST_CHECK(input_df(len) == 1 && host_sent == sent + 1 && host_pkt.ip.src.addr == my_ip);
+    host_sta.mtu = len - 1;
+    host_udp_pkt(CLIENT, 8000, REMOTE, 53);
+    HOST_CHECK(input_df(len) == 1 && host_sent == sent + 1 && unreach == 2);
+    HOST_CHECK(unreach_pkt.ip.src.addr == CLIENT && lwip_ntohs(unreach_pkt.udp.src) == 8000);
+
+    /* Within the rate */
+    set_icmp_rate(1);
+    host_advance(1000);
+    host_udp_pkt(CLIENT, 8000, REMOTE, 53);
+    HOST_CHECK(input_df(len) == 1 && unreach == 3);
+    host_udp_pkt(CLIENT, 8000, REMOTE, 53);
+    HOST_CHECK(input_df(len) == 1 && unreach == 3);
+    set_icmp_rate(ICMP_RATE_DEFAULT);
+    host_sta.mtu = 1500;
+}
+
+int main(void)
+{
+    host_init();
+    router_hooks_init();
+    napt_init(64);
+    get_portmap_tab();
+    apply_portmap_tab();
+
+    test_ports();
+    test_cone();
+    test_mtu();
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,194 @@
+/* Packet capture for /api/pcap, pcap.c
+
+   Frames are passed through the wrappers pcap_attach() puts in front of
+   the interfaces and what pcap_read() returns is parsed as a pcap file:
+   the header, then records that hold the frames as they were, cut to the
+   snap length.
+*/
+
+#include "host.h"
+#include "router_globals.h"
+#include "router_hooks.h"
+#include "nat.h"
+
+#define CLIENT  HOST_IP(192, 168, 4, 2)
+#define REMOTE  HOST_IP(198, 51, 100, 7)
+
+/* What the interfaces did with the frames, past the capture */
+static int driver_in, driver_out, stack_in;
+
+static err_t driver_input(struct pbuf *p, struct netif *inp)
+{
+    driver_in++;
+    pbuf_free(p);
+    return ERR_OK;
+}
+
+static err_t driver_output(struct netif *netif, struct pbuf *p)
+{
+    driver_out++;
+    return ERR_OK;
+}
+
+err_t ethernet_input(struct pbuf *p, struct netif *netif)
+{
+    stack_in++;
+    pbuf_free(p);
+    return ERR_OK;
+}
+
+/* An Ethernet frame of len bytes, IPv4 with ports or ARP, the rest of it
+ * numbered so that the copy can be told from the frame */
+static struct pbuf *frame(u16_t type, u8_t proto, u32_t src, u16_t sport, u32_t dest, u16_t dport, u16_t len)
+{
+    struct pbuf *p = pbuf_alloc(PBUF_RAW, len, PBUF_RAM);
+    u8_t *f = p->payload;
+
+    for (int i = 0; i < len; i++) {
+        f[i] = i;
+    }
+    f[12] = type >> 8;
+    f[13] = type & 0xff;
+    if (type == ETHTYPE_IP) {
+        struct ip_hdr *ip = (struct ip_hdr *)(f + SIZEOF_ETH_HDR);
+        struct udp_hdr *udp = (struct udp_hdr *)(ip + 1);
+        IPH_VHL_SET(ip, 4, IP_HLEN / 4);
+        IPH_OFFSET_SET(ip, 0);
+        IPH_PROTO_SET(ip, proto);
+        ip->src.addr = src;
+        ip->dest.addr = dest;
+        udp->src = lwip_htons(sport);
+        udp->dest = lwip_htons(dport);
+    } else if (type == ETHTYPE_ARP) {
+        memcpy(f + SIZEOF_ETH_HDR + 14, &src, 4);
+        memcpy(f + SIZEOF_ETH_HDR + 24, &dest, 4);
+    }
+    return p;
+}
+
+static err_t receive(struct netif *netif, struct pbuf *p)
+{
+    return netif->input(p, netif);
+}
+
+static err_t transmit(struct netif *netif, struct pbuf *p)
+{
+    err_t err = netif->linkoutput(netif, p);
+    pbuf_free(p);
+    return err;
+}
+
+static u8_t buf[PCAP_RECORD_MAX];
+
+/* Checks the records in the n bytes of buf, each the first incl_len bytes
+ * of a frame from frame(), and returns their number. incl and orig get
+ * the lengths of the last. */
+static int records(size_t n, u32_t *incl, u32_t *orig)
+{
+    int count = 0;
+
+    for (size_t pos = 0; pos < n; count++) {
+        u32_t hdr[4];
+        HOST_CHECK(pos + sizeof(hdr) <= n);
+        memcpy(hdr, buf + pos, sizeof(hdr));
+        *incl = hdr[2];
+        *orig = hdr[3];
+        pos += sizeof(hdr);
+        HOST_CHECK(hdr[0] > 0 && hdr[1] < 1000000);
+        HOST_CHECK(*incl <= *orig && pos + *incl <= n);
+        for (u32_t i = SIZEOF_ETH_HDR + 28; i < *incl; i++) {
+            HOST_CHECK(buf[pos + i] == (u8_t)i);
+        }
+        pos += *incl;
+    }
+    return count;
+}
+
+static void test_filter(void)
+{
+    pcap_filter_t f = {
+        .ifs = PCAP_IF_AP, .host = CLIENT, .proto = PROTO_TCP,
+        .skip_host = CLIENT, .skip_port = 50000,
+    };
+    u32_t captured, dropped, incl, orig, hdr[6];
+
+    /* Not capturing, straight through */
+    HOST_CHECK(receive(&host_ap, frame(ETHTYPE_IP, IP_PROTO_TCP, CLIENT, 40000, REMOTE, 443, 100)) == ERR_OK);
+    HOST_CHECK(driver_in == 1 && stack_in == 0);
+
+    HOST_CHECK(pcap_start(&f) == ESP_OK);
+    HOST_CHECK(pcap_start(&f) == ESP_ERR_INVALID_STATE);
+
+    /* The file header comes first, on its own */
+    HOST_CHECK(pcap_read(buf, sizeof(buf), 0) == sizeof(hdr));
+    memcpy(hdr, buf, sizeof(hdr));
+    HOST_CHECK(hdr[0] == 0xa1b2c3d4 && hdr[1] == (4 << 16 | 2) && hdr[2] == 0 && hdr[3] == 0);
+    HOST_CHECK(hdr[4] == PCAP_SNAPLEN_MAX && hdr[5] == 1);
+    HOST_CHECK(pcap_read(buf, sizeof(buf), 0) == 0);
+
+    /* Received frames go to the stack through the tcpip thread */
+    receive(&host_ap, frame(ETHTYPE_IP, IP_PROTO_TCP, CLIENT, 40000, REMOTE, 443, 100));
+    HOST_CHECK(stack_in == 1 && driver_in == 1);
+    receive(&host_sta, frame(ETHTYPE_IP, IP_PROTO_TCP, CLIENT, 40000, REMOTE, 443, 100));
+    transmit(&host_ap, frame(ETHTYPE_IP, IP_PROTO_TCP, REMOTE, 443, CLIENT, 40000, 1514));
+    transmit(&host_ap, frame(ETHTYPE_IP, IP_PROTO_UDP, REMOTE, 53, CLIENT, 40000, 80));
+    transmit(&host_ap, frame(ETHTYPE_IP, IP_PROTO_TCP, HOST_AP_IP, 80, CLIENT, 50000, 80));
+    receive(&host_ap, frame(ETHTYPE_IP, IP_PROTO_TCP, CLIENT, 50000, HOST_AP_IP, 80, 80));
+    receive(&host_ap, frame(ETHTYPE_ARP, 0, CLIENT, 0, HOST_AP_IP, 0, 42));
+    receive(&host_ap, frame(ETHTYPE_IPV6, 0, 0, 0, 0, 0, 80));
+    /* Everything was still delivered */
+    HOST_CHECK(stack_in == 5 && driver_out == 3);
+
+    /* A record that does not fit waits for the next read */
+    HOST_CHECK(pcap_read(buf, 16 + 1514, 0) == 16 + 100);
+    HOST_CHECK(records(16 + 100, &incl, &orig) == 1 && incl == 100 && orig == 100);
+    HOST_CHECK(pcap_read(buf, 16 + 1513, 0) == 0);
+    HOST_CHECK(pcap_read(buf, sizeof(buf), 0) == 16 + 1514);
+    HOST_CHECK(records(16 + 1514, &incl, &orig) == 1 && incl == 1514);
+    HOST_CHECK(pcap_read(buf, sizeof(buf), 0) == 0);
+
+    pcap_stop(&captured, &dropped);
+    HOST_CHECK(captured == 2 && dropped == 0);
+    HOST_CHECK(receive(&host_ap, frame(ETHTYPE_IP, IP_PROTO_TCP, CLIENT, 40000, REMOTE, 443, 100)) == ERR_OK);
+    HOST_CHECK(driver_in == 2 && stack_in == 5);
+}
+
+/* The snap length, ARP, and a reader that falls behind */
+static void test_overflow(void)
+{
+    pcap_filter_t f = { .ifs = PCAP_IF_AP | PCAP_IF_STA, .proto = PCAP_PROTO_ARP, .snaplen = 64 };
+    u32_t captured, dropped, incl = 0, orig = 0, hdr[6];
+    int sent = 0, read = 0;
+
+    HOST_CHECK(pcap_start(&f) == ESP_OK);
+    HOST_CHECK(pcap_read(buf, sizeof(buf), 0) == sizeof(hdr));
+    memcpy(hdr, buf, sizeof(hdr));
+    HOST_CHECK(hdr[4] == 64);
+
+    receive(&host_ap, frame(ETHTYPE_IP, IP_PROTO_ICMP, CLIENT, 0, HOST_AP_IP, 0, 42));
+    for (; sent < 2000; sent++) {
+        transmit(&host_sta, frame(ETHTYPE_ARP, 0, HOST_STA_IP, 0, HOST_IP(10, 0, 0, 1), 0, 100));
+    }
+    for (size_t n; (n = pcap_read(buf, sizeof(buf), 0)) > 0; ) {
+        HOST_CHECK(n <= sizeof(buf));
+        read += records(n, &incl, &orig);
+    }
+    HOST_CHECK(incl == 64 && orig == 100);
+
+    pcap_stop(&captured, &dropped);
+    HOST_CHECK(read == captured && captured + dropped == sent && dropped > 0);
+}
+
+int main(void)
+{
+    host_init();
+    host_sta.input = host_ap.input = driver_input;
+    host_sta.linkoutput = host_ap.linkoutput = driver_output;
+    pcap_attach(&host_sta, 0);
+    pcap_attach(&host_ap, 1);
+
+    test_filter();
+    test_overflow();
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,516 @@
+/* Port forwarding table, portmap.c */
+
+#include "host.h"
+#include "router_globals.h"
+#include "router_hooks.h"
+#include "nat.h"
+
+#define SERVER HOST_IP(192, 168, 4, 2)
+#define OTHER  HOST_IP(192, 168, 4, 4)
+#define CLIENT HOST_IP(192, 168, 4, 3)
+#define REMOTE HOST_IP(198, 51, 100, 7)
+
+/* Number of rules portmap_walk() lists */
+static int rule_count(void)
+{
+    portmap_rule_t rule;
+    uint32_t pos = 0;
+    int n = 0;
+
+    while (portmap_walk(&pos, &rule)) {
+        n++;
+    }
+    return n;
+}
+
+static bool forwarded(u8_t proto, u16_t port, u32_t daddr, u16_t dport)
+{
+    u32_t a;
+    u16_t p;
+    return portmap_match_ext(proto, port, &a, &p) && a == daddr && p == dport;
+}
+
+/* The rule starting at mport, as portmap_walk() lists it */
+static bool find_rule(u8_t proto, u16_t mport, portmap_rule_t *rule)
+{
+    uint32_t pos = 0;
+
+    while (portmap_walk(&pos, rule)) {
+        if (rule->proto == proto && rule->mport == mport) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void del_all(void)
+{
+    portmap_rule_t rule;
+    uint32_t pos = 0;
+
+    while (portmap_walk(&pos, &rule)) {
+        HOST_CHECK(del_portmap(rule.proto, rule.mport) == ESP_OK);
+        pos = 0;
+    }
+}
+
+/* Does a connection of an AP client to my_ip:port come back out of the AP
+ * side to daddr:dport, and the answer back to the client? */
+static bool hairpinned(u16_t port, u32_t daddr, u16_t dport)
+{
+    if (host_tcp(&host_ap, CLIENT, 40000, my_ip, port, TCP_SYN) != 1) {
+        return false;
+    }
+    HOST_CHECK(host_sent_netif == &host_ap && host_pkt_csum_ok());
+    HOST_CHECK(host_pkt.ip.dest.addr == daddr && lwip_ntohs(host_pkt.tcp.dest) == dport);
+    HOST_CHECK(host_pkt.ip.src.addr == my_ip);
+
+    u16_t mport = lwip_ntohs(host_pkt.tcp.src);
+    HOST_CHECK(host_tcp(&host_ap, daddr, dport, my_ip, mport, TCP_SYN | TCP_ACK) == 1);
+    HOST_CHECK(host_sent_netif == &host_ap && host_pkt_csum_ok());
+    HOST_CHECK(host_pkt.ip.dest.addr == CLIENT && lwip_ntohs(host_pkt.tcp.dest) == 40000);
+    HOST_CHECK(host_pkt.ip.src.addr == my_ip && lwip_ntohs(host_pkt.tcp.src) == port);
+    return true;
+}
+
+/* From the internet to my_ip:port, does it reach daddr:dport? */
+static bool inbound(u16_t port, u32_t daddr, u16_t dport)
+{
+    host_tcp(&host_sta, REMOTE, 50000, my_ip, port, TCP_SYN);
+    return host_pkt.ip.dest.addr == daddr && lwip_ntohs(host_pkt.tcp.dest) == dport && host_pkt_csum_ok();
+}
+
+static void test_del(void)
+{
+    HOST_CHECK(add_portmap_range(PROTO_UDP, 5000, 5010, SERVER, 6000, 0) == ESP_OK);
+    HOST_CHECK(add_portmap(PROTO_TCP, 8080, SERVER, 80) == ESP_OK);
+    HOST_CHECK(rule_count() == 2);
+
+    /* Only the first port names a rule */
+    HOST_CHECK(del_portmap(PROTO_UDP, 5005) == ESP_ERR_NOT_FOUND);
+    HOST_CHECK(del_portmap(PROTO_UDP, 5010) == ESP_ERR_NOT_FOUND);
+    HOST_CHECK(del_portmap(PROTO_TCP, 5000) == ESP_ERR_NOT_FOUND);
+    HOST_CHECK(del_portmap(PROTO_UDP, 9999) == ESP_ERR_NOT_FOUND);
+    HOST_CHECK(forwarded(PROTO_UDP, 5005, SERVER, 6005));
+    HOST_CHECK(rule_count() == 2);
+
+    HOST_CHECK(del_portmap(PROTO_UDP, 5000) == ESP_OK);
+    HOST_CHECK(!forwarded(PROTO_UDP, 5005, SERVER, 6005));
+    HOST_CHECK(del_portmap(PROTO_UDP, 5000) == ESP_ERR_NOT_FOUND);
+    HOST_CHECK(forwarded(PROTO_TCP, 8080, SERVER, 80));
+
+    HOST_CHECK(del_portmap(PROTO_TCP, 8080) == ESP_OK);
+    HOST_CHECK(rule_count() == 0);
+}
+
+/* Rules with PORTMAP_HAIRPIN are reachable from the AP side as well,
+ * the others only from the uplink */
+static void test_hairpin(void)
+{
+    portmap_rule_t rule;
+
+    HOST_CHECK(add_portmap_range(PROTO_TCP, 8080, 8080, SERVER, 80, PORTMAP_HAIRPIN) == ESP_OK);
+    HOST_CHECK(add_portmap(PROTO_TCP, 8081, SERVER, 81) == ESP_OK);
+    HOST_CHECK(find_rule(PROTO_TCP, 8080, &rule) && rule.flags == PORTMAP_HAIRPIN);
+    HOST_CHECK(find_rule(PROTO_TCP, 8081, &rule) && rule.flags == 0);
+
+    HOST_CHECK(inbound(8080, SERVER, 80));
+    HOST_CHECK(inbound(8081, SERVER, 81));
+    HOST_CHECK(hairpinned(8080, SERVER, 80));
+    /* Left to lwIP, which has nothing listening there */
+    HOST_CHECK(!hairpinned(8081, SERVER, 81));
+    HOST_CHECK(host_pkt.ip.dest.addr == my_ip && lwip_ntohs(host_pkt.tcp.dest) == 8081);
+
+    /* Adding it again without the flag takes the hairpin away */
+    HOST_CHECK(add_portmap(PROTO_TCP, 8080, SERVER, 80) == ESP_OK);
+    HOST_CHECK(rule_count() == 2);
+    HOST_CHECK(!hairpinned(8080, SERVER, 80));
+    HOST_CHECK(add_portmap_range(PROTO_TCP, 8080, 8080, SERVER, 80, PORTMAP_HAIRPIN) == ESP_OK);
+    HOST_CHECK(hairpinned(8080, SERVER, 80));
+
+    HOST_CHECK(del_portmap(PROTO_TCP, 8080) == ESP_OK);
+    HOST_CHECK(!hairpinned(8080, SERVER, 80));
+    HOST_CHECK(!inbound(8080, SERVER, 80));
+    HOST_CHECK(del_portmap(PROTO_TCP, 8081) == ESP_OK);
+    HOST_CHECK(rule_count() == 0);
+}
+
+/* Neither the external nor the internal ports of two rules may overlap */
+static void test_overlap(void)
+{
+    HOST_CHECK(add_portmap_range(PROTO_UDP, 5000, 5010, SERVER, 6000, 0) == ESP_OK);
+
+    HOST_CHECK(add_portmap_range(PROTO_UDP, 5010, 5012, OTHER, 7000, 0) == ESP_ERR_INVALID_STATE);
+    HOST_CHECK(add_portmap_range(PROTO_UDP, 4990, 5000, OTHER, 7000, 0) == ESP_ERR_INVALID_STATE);
+    HOST_CHECK(add_portmap_range(PROTO_UDP, 4000, 6000, OTHER, 7000, 0) == ESP_ERR_INVALID_STATE);
+    HOST_CHECK(add_portmap(PROTO_UDP, 5005, OTHER, 7000) == ESP_ERR_INVALID_STATE);
+    HOST_CHECK(add_portmap_range(PROTO_UDP, 7000, 7002, SERVER, 6010, 0) == ESP_ERR_INVALID_STATE);
+    HOST_CHECK(add_portmap_range(PROTO_UDP, 7000, 7002, SERVER, 5998, 0) == ESP_ERR_INVALID_STATE);
+    HOST_CHECK(add_portmap_range(PROTO_UDP, 5020, 5010, SERVER, 6000, 0) == ESP_ERR_INVALID_ARG);
+    HOST_CHECK(add_portmap_range(PROTO_UDP, 7000, 7010, SERVER, 0xfffa, 0) == ESP_ERR_INVALID_ARG);
+    HOST_CHECK(rule_count() == 1);
+
+    /* Next to it, to another host or of the other protocol is fine */
+    HOST_CHECK(add_portmap_range(PROTO_UDP, 5011, 5012, SERVER, 6011, 0) == ESP_OK);
+    HOST_CHECK(add_portmap_range(PROTO_UDP, 7000, 7002, OTHER, 6005, 0) == ESP_OK);
+    HOST_CHECK(add_portmap_range(PROTO_TCP, 5000, 5010, SERVER, 6000, 0) == ESP_OK);
+    /* A rule starting at the same port is replaced */
+    HOST_CHECK(add_portmap_range(PROTO_UDP, 5000, 5004, SERVER, 6000, 0) == ESP_OK);
+    HOST_CHECK(rule_count() == 4);
+    HOST_CHECK(!forwarded(PROTO_UDP, 5005, SERVER, 6005));
+    HOST_CHECK(add_portmap(PROTO_UDP, 5005, OTHER, 7000) == ESP_OK);
+
+    del_all();
+    HOST_CHECK(rule_count() == 0);
+}
+
+/* Stored blobs of all versions, as older firmware wrote them: a header
+ * {version, record length, count} and the records, little endian */
+
+static const u8_t blob_v1[] = {
+    1, 9, 2, 0,
+    /* tcp 8080 -> 192.168.4.2:80 */
+    192, 168, 4, 2, 0x90, 0x1f, 80, 0, PROTO_TCP,
+    /* udp 53 -> 192.168.4.4:53 */
+    192, 168, 4, 4, 53, 0, 53, 0, PROTO_UDP,
+};
+
+static const u8_t blob_v2[] = {
+    2, 11, 2, 0,
+    /* udp 5000-5010 -> 192.168.4.2:6000 */
+    192, 168, 4, 2, 0x88, 0x13, 0x70, 0x17, PROTO_UDP, 0x92, 0x13,
+    /* tcp 8080 -> 192.168.4.2:80 */
+    192, 168, 4, 2, 0x90, 0x1f, 80, 0, PROTO_TCP, 0x90, 0x1f,
+};
+
+static const u8_t blob_v3[] = {
+    3, 12, 2, 0,
+    /* tcp 8080 -> 192.168.4.2:80 hairpin, a stray lease flag */
+    192, 168, 4, 2, 0x90, 0x1f, 80, 0, PROTO_TCP, 0x90, 0x1f, PORTMAP_HAIRPIN | PORTMAP_LEASE,
+    /* udp 5000-5010 -> 192.168.4.2:6000 */
+    192, 168, 4, 2, 0x88, 0x13, 0x70, 0x17, PROTO_UDP, 0x92, 0x13, 0,
+};
+
+/* Fixed size table of the firmware before the versioned blobs */
+struct legacy_entry {
+    u32_t daddr;
+    u16_t mport;
+    u16_t dport;
+    u8_t proto;
+    u8_t valid;
+};
+
+/* Empties the table and NVS */
+static void forget(void)
+{
+    nvs_handle_t nvs;
+
+    del_all();
+    HOST_CHECK(nvs_open(PARAM_NAMESPACE, NVS_READWRITE, &nvs) == ESP_OK);
+    nvs_erase_key(nvs, "portmap");
+    nvs_erase_key(nvs, "portmap_tab");
+    nvs_close(nvs);
+}
+
+/* Loads blob as stored under key at boot */
+static esp_err_t load(const char *key, const void *blob, size_t len)
+{
+    forget();
+    host_nvs_put(key, blob, len);
+    esp_err_t err = get_portmap_tab();
+    apply_portmap_tab();
+    return err;
+}
+
+/* The blob stored under key, 0 if none */
+static size_t stored(const char *key, u8_t *blob, size_t len)
+{
+    nvs_handle_t nvs;
+
+    HOST_CHECK(nvs_open(PARAM_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK);
+    if (nvs_get_blob(nvs, key, blob, &len) != ESP_OK) {
+        len = 0;
+    }
+    nvs_close(nvs);
+    return len;
+}
+
+#define CHUNKS      8
+#define CHUNK_LEN   (32 * 12)
+
+/* Boots again with what is stored, up to CHUNKS blobs of records */
+static esp_err_t reboot(void)
+{
+    static u8_t chunks[CHUNKS][CHUNK_LEN];
+    size_t lens[CHUNKS];
+    char key[16];
+    u8_t hdr[4];
+
+    HOST_CHECK(stored("portmap", hdr, sizeof(hdr)) == sizeof(hdr));
+    for (int i = 0; i < CHUNKS; i++) {
+        snprintf(key, sizeof(key), "portmap.%d", i);
+        lens[i] = stored(key, chunks[i], CHUNK_LEN);
+    }
+    forget();
+    host_nvs_put("portmap", hdr, sizeof(hdr));
+    for (int i = 0; i < CHUNKS; i++) {
+        snprintf(key, sizeof(key), "portmap.%d", i);
+        HOST_CHECK(stored(key, chunks[0], CHUNK_LEN) == 0);
+        if (lens[i] != 0) {
+            host_nvs_put(key, chunks[i], lens[i]);
+        }
+    }
+    esp_err_t err = get_portmap_tab();
+    apply_portmap_tab();
+    return err;
+}
+
+static void check_rule(u8_t proto, u16_t mport, u16_t mport_last, u32_t daddr, u16_t dport, u8_t flags)
+{
+    portmap_rule_t rule;
+
+    HOST_CHECK(find_rule(proto, mport, &rule));
+    HOST_CHECK(rule.mport_last == mport_last && rule.daddr == daddr && rule.dport == dport);
+    HOST_CHECK(rule.flags == flags && rule.lease == 0);
+}
+
+static void test_nvs(void)
+{
+    u8_t blob[64];
+    size_t len;
+
+    /* Version 1 has no ranges, nor does it know hairpinning */
+    HOST_CHECK(load("portmap", blob_v1, sizeof(blob_v1)) == ESP_OK);
+    HOST_CHECK(rule_count() == 2);
+    check_rule(PROTO_TCP, 8080, 8080, SERVER, 80, 0);
+    check_rule(PROTO_UDP, 53, 53, OTHER, 53, 0);
+    HOST_CHECK(inbound(8080, SERVER, 80));
+    HOST_CHECK(!hairpinned(8080, SERVER, 80));
+
+    /* Version 2 adds the ranges */
+    HOST_CHECK(load("portmap", blob_v2, sizeof(blob_v2)) == ESP_OK);
+    HOST_CHECK(rule_count() == 2);
+    check_rule(PROTO_UDP, 5000, 5010, SERVER, 6000, 0);
+    check_rule(PROTO_TCP, 8080, 8080, SERVER, 80, 0);
+    HOST_CHECK(forwarded(PROTO_UDP, 5010, SERVER, 6010));
+    HOST_CHECK(!hairpinned(8080, SERVER, 80));
+
+    /* Version 3 the flags, a lease is never stored and not taken as one */
+    HOST_CHECK(load("portmap", blob_v3, sizeof(blob_v3)) == ESP_OK);
+    HOST_CHECK(rule_count() == 2);
+    check_rule(PROTO_TCP, 8080, 8080, SERVER, 80, PORTMAP_HAIRPIN);
+    check_rule(PROTO_UDP, 5000, 5010, SERVER, 6000, 0);
+    HOST_CHECK(hairpinned(8080, SERVER, 80));
+
+    /* What is stored again is version 4, a header alone and the records
+     * in blobs of their own, and loads the same */
+    HOST_CHECK(add_portmap(PROTO_TCP, 2222, OTHER, 22) == ESP_OK);
+    len = stored("portmap", blob, sizeof(blob));
+    HOST_CHECK(len == 4 && blob[0] == 4 && blob[1] == 12 && blob[2] == 0 && blob[3] == 0);
+    HOST_CHECK(stored("portmap.0", NULL, 0) == 3 * 12);
+    HOST_CHECK(reboot() == ESP_OK);
+    HOST_CHECK(rule_count() == 3);
+    check_rule(PROTO_TCP, 8080, 8080, SERVER, 80, PORTMAP_HAIRPIN);
+    check_rule(PROTO_UDP, 5000, 5010, SERVER, 6000, 0);
+    check_rule(PROTO_TCP, 2222, 2222, OTHER, 22, 0);
+
+    /* The legacy table is converted and removed */
+    struct legacy_entry legacy[3] = {
+        { SERVER, 8080, 80, PROTO_TCP, 1 },
+        { OTHER, 53, 53, PROTO_UDP, 0 },
+        { OTHER, 2222, 22, PROTO_TCP, 1 },
+    };
+    HOST_CHECK(load("portmap_tab", legacy, sizeof(legacy)) == ESP_OK);
+    HOST_CHECK(rule_count() == 2);
+    check_rule(PROTO_TCP, 8080, 8080, SERVER, 80, 0);
+    check_rule(PROTO_TCP, 2222, 2222, OTHER, 22, 0);
+    HOST_CHECK(stored("portmap", blob, sizeof(blob)) == 4 && blob[0] == 4);
+    HOST_CHECK(stored("portmap.0", NULL, 0) == 2 * 12);
+    nvs_handle_t nvs;
+    HOST_CHECK(nvs_open(PARAM_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK);
+    HOST_CHECK(nvs_get_blob(nvs, "portmap_tab", NULL, &len) == ESP_ERR_NVS_NOT_FOUND);
+    nvs_close(nvs);
+
+    /* Records of a length that does not go with the version are refused */
+    memcpy(blob, blob_v2, sizeof(blob_v2));
+    blob[0] = 3;
+    HOST_CHECK(load("portmap", blob, sizeof(blob_v2)) == ESP_ERR_NVS_INVALID_LENGTH);
+    HOST_CHECK(load("portmap", blob_v1, sizeof(blob_v1) - 1) == ESP_ERR_NVS_INVALID_LENGTH);
+    HOST_CHECK(rule_count() == 0);
+}
+
+/* A change rewrites one or two blobs of 32 records: a new rule goes last,
+ * the last takes the place of a deleted one */
+static void test_chunks(void)
+{
+    static u8_t chunk[CHUNK_LEN];
+    u8_t hdr[4];
+
+    /* Nothing stored at boot */
+    forget();
+    HOST_CHECK(get_portmap_tab() == ESP_ERR_NVS_NOT_FOUND);
+    for (int i = 0; i < 70; i++) {
+        HOST_CHECK(add_portmap(PROTO_TCP, 10000 + i, SERVER, 20000 + i) == ESP_OK);
+    }
+    HOST_CHECK(stored("portmap.0", chunk, CHUNK_LEN) == 32 * 12);
+    HOST_CHECK(stored("portmap.1", chunk, CHUNK_LEN) == 32 * 12);
+    HOST_CHECK(stored("portmap.2", chunk, CHUNK_LEN) == 6 * 12);
+
+    HOST_CHECK(del_portmap(PROTO_TCP, 10003) == ESP_OK);
+    HOST_CHECK(stored("portmap.2", chunk, CHUNK_LEN) == 5 * 12);
+    HOST_CHECK(stored("portmap.0", chunk, CHUNK_LEN) == 32 * 12);
+    HOST_CHECK(chunk[3 * 12 + 4] == (10069 & 0xff) && chunk[3 * 12 + 5] == 10069 >> 8);
+    HOST_CHECK(del_portmap(PROTO_TCP, 10069) == ESP_OK);
+    HOST_CHECK(stored("portmap.0", chunk, CHUNK_LEN) == 32 * 12);
+    HOST_CHECK(chunk[3 * 12 + 4] == (10068 & 0xff) && chunk[3 * 12 + 5] == 10068 >> 8);
+    for (int i = 64; i < 68; i++) {
+        HOST_CHECK(del_portmap(PROTO_TCP, 10000 + i) == ESP_OK);
+    }
+    HOST_CHECK(stored("portmap.2", chunk, CHUNK_LEN) == 0);
+    HOST_CHECK(add_portmap(PROTO_TCP, 8080, OTHER, 80) == ESP_OK);
+    HOST_CHECK(add_portmap(PROTO_TCP, 10001, OTHER, 1) == ESP_OK);
+    HOST_CHECK(stored("portmap.2", chunk, CHUNK_LEN) == 12);
+
+    HOST_CHECK(reboot() == ESP_OK);
+    HOST_CHECK(rule_count() == 65);
+    for (int i = 0; i < 64; i++) {
+        HOST_CHECK(forwarded(PROTO_TCP, 10000 + i, i == 1 ? OTHER : SERVER, i == 1 ? 1 : 20000 + i) == (i != 3));
+    }
+    HOST_CHECK(forwarded(PROTO_TCP, 10068, SERVER, 20068));
+    HOST_CHECK(forwarded(PROTO_TCP, 8080, OTHER, 80));
+
+    /* Cut short between two blobs: the record moved is there twice, the
+     * blobs are written again */
+    HOST_CHECK(stored("portmap.1", chunk, CHUNK_LEN) == 32 * 12);
+    memcpy(chunk + 12, chunk, 12);
+    HOST_CHECK(stored("portmap.2", chunk, 12) == 12);
+    host_nvs_put("portmap.2", chunk, 2 * 12);
+    HOST_CHECK(reboot() == ESP_OK);
+    HOST_CHECK(rule_count() == 65);
+    HOST_CHECK(stored("portmap.2", chunk, CHUNK_LEN) == 12);
+    HOST_CHECK(stored("portmap", hdr, sizeof(hdr)) == 4 && hdr[0] == 4);
+
+    /* A blob whose length is no number of records */
+    host_nvs_put("portmap.1", chunk, 12 + 1);
+    HOST_CHECK(reboot() == ESP_ERR_NVS_INVALID_LENGTH);
+    del_all();
+    HOST_CHECK(stored("portmap.0", chunk, CHUNK_LEN) == 0);
+}
+
+/* Many rules and ranges, the lookups of both directions against the
+ * rules themselves */
+static void test_lookup(void)
+{
+    forget();
+    for (int i = 0; i < 300; i++) {
+        u16_t width = i % 10 == 0 ? 4 : 0;
+        HOST_CHECK(add_portmap_range(i & 1 ? PROTO_UDP : PROTO_TCP, 20000 + 8 * i, 20000 + 8 * i + width,
+                                     HOST_IP(192, 168, 4, 10 + i % 7), 1000 + 8 * i, 0) == ESP_OK);
+    }
+    for (int del = 0; del <= 1; del++) {
+        for (int i = 0; i < 300; i++) {
+            u8_t proto = i & 1 ? PROTO_UDP : PROTO_TCP;
+            u32_t daddr = HOST_IP(192, 168, 4, 10 + i % 7);
+            bool there = !del || i % 3 != 0;
+            u16_t width = i % 10 == 0 ? 4 : 0;
+            u16_t mport;
+
+            for (int k = 0; k < 8; k++) {
+                bool in = there && k <= width;
+                HOST_CHECK(forwarded(proto, 20000 + 8 * i + k, daddr, 1000 + 8 * i + k) == in);
+                HOST_CHECK(!forwarded(proto == PROTO_TCP ? PROTO_UDP : PROTO_TCP, 20000 + 8 * i + k, daddr,
+                                      1000 + 8 * i + k));
+                HOST_CHECK(portmap_match_int(proto, daddr, 1000 + 8 * i + k, &mport) == in);
+                HOST_CHECK(!in || mport == 20000 + 8 * i + k);
+                HOST_CHECK(!portmap_match_int(proto, daddr + PP_HTONL(1), 1000 + 8 * i + k, &mport) ||
+                           (i + 1) % 7 == 0);
+            }
+        }
+        for (int i = 0; i < 300 && !del; i += 3) {
+            HOST_CHECK(del_portmap(i & 1 ? PROTO_UDP : PROTO_TCP, 20000 + 8 * i) == ESP_OK);
+        }
+    }
+    HOST_CHECK(rule_count() == 200);
+
+    /* Overlaps are found by the same lookups */
+    HOST_CHECK(add_portmap(PROTO_TCP, 20000 + 8 * 10 + 2, SERVER, 80) == ESP_ERR_INVALID_STATE);
+    HOST_CHECK(add_portmap(PROTO_UDP, 80, HOST_IP(192, 168, 4, 10 + 5 % 7), 1000 + 8 * 5) == ESP_ERR_INVALID_STATE);
+    HOST_CHECK(add_portmap_range(PROTO_TCP, 100, 110, HOST_IP(192, 168, 4, 10 + 20 % 7), 1000 + 8 * 20 - 10, 0) ==
+               ESP_ERR_INVALID_STATE);
+    HOST_CHECK(add_portmap(PROTO_TCP, 90, HOST_IP(192, 168, 4, 10 + 20 % 7), 1000 + 8 * 20 + 2) == ESP_ERR_INVALID_STATE);
+    HOST_CHECK(add_portmap_range(PROTO_TCP, 19990, 20020, OTHER, 80, 0) == ESP_ERR_INVALID_STATE);
+    HOST_CHECK(add_portmap_range(PROTO_TCP, 100, 60000, OTHER, 1, 0) == ESP_ERR_INVALID_STATE);
+    HOST_CHECK(add_portmap_range(PROTO_TCP, 20000 + 8 * 20 + 5, 20000 + 8 * 20 + 7, OTHER, 80, 0) == ESP_OK);
+    del_all();
+}
+
+/* Leases take the first free port from the one asked for, and a lease
+ * drops only the cached flows of its port */
+static void test_lease(void)
+{
+    router_stats_t st0, st1;
+
+    HOST_CHECK(add_portmap_range(PROTO_TCP, 2000, 2009, SERVER, 3000, 0) == ESP_OK);
+    HOST_CHECK(add_portmap(PROTO_TCP, 2010, SERVER, 2010) == ESP_OK);
+    HOST_CHECK(add_portmap(PROTO_TCP, NAPT_PORT_MIN - 1, SERVER, 4000) == ESP_OK);
+    HOST_CHECK(portmap_lease_port(PROTO_TCP, 1999) == 1999);
+    HOST_CHECK(portmap_lease_port(PROTO_TCP, 2000) == 2011);
+    HOST_CHECK(portmap_lease_port(PROTO_TCP, 2005) == 2011);
+    HOST_CHECK(portmap_lease_port(PROTO_UDP, 2005) == 2005);
+    HOST_CHECK(portmap_lease_port(PROTO_TCP, NAPT_PORT_MIN - 1) == 1024);
+    HOST_CHECK(portmap_lease_port(PROTO_TCP, 80) == 1024);
+    HOST_CHECK(add_portmap_lease(PROTO_TCP, 2005, CLIENT, 2005, 60) == ESP_ERR_INVALID_STATE);
+
+    /* A forwarded connection and an outbound flow of the client, cached */
+    HOST_CHECK(add_portmap(PROTO_TCP, 8080, SERVER, 80) == ESP_OK);
+    HOST_CHECK(inbound(8080, SERVER, 80));
+    HOST_CHECK(host_udp(&host_ap, CLIENT, 1500, REMOTE, 53) == 1);
+    HOST_CHECK(lwip_ntohs(host_pkt.udp.src) >= NAPT_PORT_MIN);
+
+    HOST_CHECK(add_portmap_lease(PROTO_UDP, 1500, CLIENT, 1500, 60) == ESP_OK);
+    HOST_CHECK(add_portmap_lease(PROTO_UDP, 1500, OTHER, 1500, 60) == ESP_ERR_INVALID_STATE);
+    HOST_CHECK(portmap_lease_port(PROTO_UDP, 1500) == 1501);
+    router_hooks_get_stats(&st0);
+    HOST_CHECK(inbound(8080, SERVER, 80));
+    router_hooks_get_stats(&st1);
+    HOST_CHECK(st1.flow_hits == st0.flow_hits + 1);
+    /* The client's flow goes out by the lease now */
+    HOST_CHECK(host_udp(&host_ap, CLIENT, 1500, REMOTE, 53) == 1);
+    HOST_CHECK(host_pkt.ip.src.addr == my_ip && lwip_ntohs(host_pkt.udp.src) == 1500);
+
+    /* Renewed, then run out */
+    host_advance(40000);
+    HOST_CHECK(add_portmap_lease(PROTO_UDP, 1500, CLIENT, 1500, 60) == ESP_OK);
+    host_advance(40000);
+    expire_portmap_leases();
+    HOST_CHECK(forwarded(PROTO_UDP, 1500, CLIENT, 1500));
+    host_advance(30000);
+    expire_portmap_leases();
+    HOST_CHECK(!forwarded(PROTO_UDP, 1500, CLIENT, 1500));
+    HOST_CHECK(host_udp(&host_ap, CLIENT, 1500, REMOTE, 53) == 1);
+    HOST_CHECK(lwip_ntohs(host_pkt.udp.src) >= NAPT_PORT_MIN);
+    router_hooks_get_stats(&st0);
+    HOST_CHECK(inbound(8080, SERVER, 80));
+    router_hooks_get_stats(&st1);
+    HOST_CHECK(st1.flow_hits == st0.flow_hits + 1);
+    del_all();
+}
+
+int main(void)
+{
+    host_init();
+    router_hooks_init();
+    napt_init(64);
+    get_portmap_tab();
+    apply_portmap_tab();
+
+    test_del();
+    test_hairpin();
+    test_overlap();
+    test_nvs();
+    test_chunks();
+    test_lookup();
+    test_lease();
+    printf("ok\n");
+    return 0;
+}
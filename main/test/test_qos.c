@@ -0,0 +1,172 @@
+/* QoS classes and the queues in front of the Wi-Fi driver, qos.c */
+
+#include "host.h"
+#include "router_globals.h"
+#include "router_hooks.h"
+#include "nat.h"
+
+#define CLIENT  HOST_IP(192, 168, 4, 10)
+#define OTHER   HOST_IP(192, 168, 4, 11)
+#define REMOTE  HOST_IP(198, 51, 100, 7)
+
+#define DSCP_EF     46
+#define DSCP_AF41   34
+#define DSCP_CS1    8
+
+/* The uplink's driver, with room for driver_room more frames */
+static int driver_room = 1000;
+static u8_t driver_tos[64];     /* TOS of the frames it took, in order */
+static int driver_sent;
+
+static err_t driver_output(struct netif *netif, struct pbuf *p)
+{
+    if (driver_room == 0) {
+        return ERR_MEM;
+    }
+    driver_room--;
+    driver_tos[driver_sent++ % 64] = ((u8_t *)p->payload)[SIZEOF_ETH_HDR + 1];
+    return ERR_OK;
+}
+
+/* Sends an Ethernet frame of type with the TOS tos out of the uplink, as
+ * etharp_output() would */
+static err_t send_frame(u16_t type, u8_t tos)
+{
+    struct pbuf *p = pbuf_alloc(PBUF_RAW, 64, PBUF_RAM);
+    u8_t *f = p->payload;
+
+    f[12] = type >> 8;
+    f[13] = type & 0xff;
+    f[SIZEOF_ETH_HDR] = 0x45;
+    f[SIZEOF_ETH_HDR + 1] = tos;
+    err_t err = host_sta.linkoutput(&host_sta, p);
+    pbuf_free(p);
+    return err;
+}
+
+static void test_queues(void)
+{
+    qos_class_stats_t st[2][QOS_CLASSES];
+    const u8_t tos[] = { 0, DSCP_CS1 << 2, DSCP_AF41 << 2, DSCP_EF << 2, 0 };
+
+    /* Straight through while the driver has room */
+    HOST_CHECK(send_frame(ETHTYPE_IP, 0) == ERR_OK && driver_sent == 1);
+
+    /* Then queued by class */
+    driver_room = 0;
+    driver_sent = 0;
+    for (size_t i = 0; i < sizeof(tos); i++) {
+        HOST_CHECK(send_frame(ETHTYPE_IP, tos[i]) == ERR_OK);
+    }
+    HOST_CHECK(send_frame(ETHTYPE_ARP, 0) == ERR_OK);
+    qos_get_stats(st);
+    HOST_CHECK(st[0][QOS_BE].depth == 2 && st[0][QOS_VO].depth == 2);
+    HOST_CHECK(st[0][QOS_VI].depth == 1 && st[0][QOS_BK].depth == 1);
+    HOST_CHECK(driver_sent == 0);
+
+    /* Handed over on the next tick, voice first, ARP counts as voice */
+    driver_room = 3;
+    host_advance(10);
+    HOST_CHECK(driver_sent == 3);
+    HOST_CHECK(driver_tos[0] == DSCP_EF << 2 && driver_tos[1] == 0 && driver_tos[2] == DSCP_AF41 << 2);
+    driver_room = 1000;
+    host_advance(10);
+    HOST_CHECK(driver_sent == 6 && driver_tos[3] == 0 && driver_tos[5] == DSCP_CS1 << 2);
+    qos_get_stats(st);
+    HOST_CHECK(st[0][QOS_BE].depth == 0 && st[0][QOS_BE].high_water == 2 && st[0][QOS_BE].queued == 2);
+
+    /* A full queue drops */
+    driver_room = 0;
+    int taken = 0;
+    for (int i = 0; i < 64; i++) {
+        taken += send_frame(ETHTYPE_IP, 0) == ERR_OK;
+    }
+    qos_get_stats(st);
+    HOST_CHECK(st[0][QOS_BE].depth == taken && st[0][QOS_BE].dropped == 64 - taken);
+    HOST_CHECK(st[1][QOS_BE].depth == 0);
+    /* Frames of the other classes still wait */
+    HOST_CHECK(send_frame(ETHTYPE_IP, DSCP_EF << 2) == ERR_OK);
+
+    driver_room = 1000;
+    driver_sent = 0;
+    host_advance(10);
+    HOST_CHECK(driver_sent == taken + 1 && driver_tos[0] == DSCP_EF << 2);
+    qos_get_stats(st);
+    HOST_CHECK(st[0][QOS_BE].depth == 0 && st[0][QOS_VO].depth == 0);
+}
+
+static void test_rules(void)
+{
+    struct udp_hdr udp = { .src = PP_HTONS(5000), .dest = PP_HTONS(22) };
+    qos_rule_t rule = { 0 };
+    qos_rule_t rules[QOS_RULE_MAX];
+
+    HOST_CHECK(qos_classify(IP_PROTO_TCP, CLIENT, &udp) == QOS_NONE);
+
+    rule.cls = QOS_VO;
+    rule.proto = IP_PROTO_TCP;
+    rule.port = rule.port_last = 22;
+    HOST_CHECK(add_qos_rule(&rule) == ESP_OK);
+    rule = (qos_rule_t){ .cls = QOS_VI, .ip = CLIENT };
+    HOST_CHECK(add_qos_rule(&rule) == ESP_OK);
+
+    /* The first rule that matches wins, either port of the flow */
+    HOST_CHECK(qos_classify(IP_PROTO_TCP, CLIENT, &udp) == QOS_VO);
+    HOST_CHECK(qos_classify(IP_PROTO_UDP, CLIENT, &udp) == QOS_VI);
+    HOST_CHECK(qos_classify(IP_PROTO_TCP, OTHER, &udp) == QOS_VO);
+    HOST_CHECK(qos_classify(IP_PROTO_UDP, OTHER, &udp) == QOS_NONE);
+    HOST_CHECK(qos_classify(IP_PROTO_ICMP, CLIENT, NULL) == QOS_VI);
+
+    /* Stored */
+    HOST_CHECK(get_qos() == ESP_OK);
+    HOST_CHECK(qos_get_rules(rules) == 2 && rules[0].cls == QOS_VO && rules[1].ip == CLIENT);
+
+    HOST_CHECK(qos_parse_class("VO") == QOS_VO && qos_parse_class("x") < 0);
+}
+
+/* The DSCP of the class is set on forwarded packets, also on those the
+ * flow cache translates */
+static void test_mark(void)
+{
+    HOST_CHECK(add_portmap(PROTO_TCP, 2222, CLIENT, 22) == ESP_OK);
+
+    for (int i = 0; i < 2; i++) {
+        HOST_CHECK(host_tcp(&host_ap, CLIENT, 22, REMOTE, 40000, TCP_ACK) == 1);
+        HOST_CHECK(IPH_TOS(&host_pkt.ip) == DSCP_EF << 2 && host_pkt_csum_ok());
+        HOST_CHECK(host_udp(&host_ap, CLIENT, 4000, REMOTE, 53) == 1);
+        HOST_CHECK(IPH_TOS(&host_pkt.ip) == DSCP_AF41 << 2 && host_pkt_csum_ok());
+        HOST_CHECK(host_udp(&host_ap, OTHER, 4000, REMOTE, 53) == 1);
+        HOST_CHECK(IPH_TOS(&host_pkt.ip) == 0 && host_pkt_csum_ok());
+        HOST_CHECK(host_tcp(&host_sta, REMOTE, 40000, my_ip, 2222, TCP_ACK) == 0);
+        HOST_CHECK(host_pkt.ip.dest.addr == CLIENT && IPH_TOS(&host_pkt.ip) == DSCP_EF << 2);
+        HOST_CHECK(host_pkt_csum_ok());
+    }
+
+    /* Changing the rules flushes the cached classes */
+    HOST_CHECK(del_qos_rule(0) == ESP_OK);
+    HOST_CHECK(host_tcp(&host_ap, CLIENT, 22, REMOTE, 40000, TCP_ACK) == 1);
+    HOST_CHECK(IPH_TOS(&host_pkt.ip) == DSCP_AF41 << 2);
+    HOST_CHECK(del_qos_rule(1) == ESP_ERR_NOT_FOUND);
+    HOST_CHECK(del_qos_rule(0) == ESP_OK);
+    HOST_CHECK(host_tcp(&host_ap, CLIENT, 22, REMOTE, 40000, TCP_ACK) == 1);
+    HOST_CHECK(IPH_TOS(&host_pkt.ip) == 0);
+    HOST_CHECK(get_qos() != ESP_OK);
+    HOST_CHECK(del_portmap(PROTO_TCP, 2222) == ESP_OK);
+}
+
+int main(void)
+{
+    host_init();
+    host_sta.linkoutput = driver_output;
+    router_hooks_init();
+    napt_init(64);
+    get_portmap_tab();
+    apply_portmap_tab();
+    get_qos();
+
+    test_queues();
+    test_rules();
+    test_mark();
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,166 @@
+/* Port forwards and NAPT across an uplink reconnect, reconcile_portmap_tab()
+
+   got_ip() does what wifi_event_handler() does on IP_EVENT_STA_GOT_IP.
+   Traffic is injected before the uplink drops, while it is down and after
+   it is back, once with the same address (a renewal) and once with a new
+   one. A packet counts as dropped if the hook neither forwarded it nor
+   handed it back translated.
+*/
+
+#include "host.h"
+#include "router_globals.h"
+#include "router_hooks.h"
+#include "nat.h"
+
+#define SERVER  HOST_IP(192, 168, 4, 2)
+#define CLIENT  HOST_IP(192, 168, 4, 3)
+#define REMOTE  HOST_IP(198, 51, 100, 7)
+#define NEW_IP  HOST_IP(10, 0, 1, 9)
+
+#define BURST   50
+
+struct traffic {
+    int sent;
+    int dropped;
+};
+
+static u16_t napt_port;         /* the client's mapping to REMOTE:53 */
+
+static void got_ip(u32_t ip)
+{
+    uint32_t old_ip = my_ip;
+    my_ip = ip;
+    host_sta.ip_addr.addr = ip;
+    reconcile_portmap_tab(old_ip);
+}
+
+/* Connections from the internet to the forwarded port, addressed to to */
+static void inbound(struct traffic *t, u32_t to)
+{
+    for (int i = 0; i < BURST; i++) {
+        t->sent++;
+        host_tcp(&host_sta, REMOTE, 40000 + i % 4, to, 8080, TCP_ACK);
+        if (host_pkt.ip.dest.addr != SERVER || lwip_ntohs(host_pkt.tcp.dest) != 80 || !host_pkt_csum_ok()) {
+            t->dropped++;
+        }
+    }
+}
+
+/* The client's DNS queries and their answers, sent to to */
+static void napt(struct traffic *t, u32_t to)
+{
+    for (int i = 0; i < BURST; i++) {
+        u32_t sent = host_sent;
+        t->sent++;
+        if (host_udp(&host_ap, CLIENT, 5353, REMOTE, 53) != 1 || host_sent != sent + 1 ||
+            host_pkt.ip.src.addr != my_ip || !host_pkt_csum_ok()) {
+            t->dropped++;
+            continue;
+        }
+        napt_port = lwip_ntohs(host_pkt.udp.src);
+        t->sent++;
+        host_udp(&host_sta, REMOTE, 53, to, napt_port);
+        if (host_pkt.ip.dest.addr != CLIENT || lwip_ntohs(host_pkt.udp.dest) != 5353) {
+            t->dropped++;
+        }
+    }
+}
+
+static void report(const char *what, const struct traffic *t)
+{
+    printf("  %-40s %4d sent %4d dropped\n", what, t->sent, t->dropped);
+}
+
+static void test_same_address(void)
+{
+    struct traffic before = { 0 }, down = { 0 }, after = { 0 };
+    router_stats_t st0, st1;
+
+    printf("renewal, same address:\n");
+    inbound(&before, my_ip);
+    napt(&before, my_ip);
+
+    /* WIFI_EVENT_STA_DISCONNECTED keeps my_ip, what was in flight still
+     * arrives on the interface */
+    inbound(&down, my_ip);
+    napt(&down, my_ip);
+
+    router_hooks_get_stats(&st0);
+    got_ip(my_ip);
+    inbound(&after, my_ip);
+    napt(&after, my_ip);
+    router_hooks_get_stats(&st1);
+
+    report("before", &before);
+    report("uplink down", &down);
+    report("after GOT_IP", &after);
+    printf("  flow cache after GOT_IP: %lu hits, %lu misses\n",
+           (unsigned long)(st1.flow_hits - st0.flow_hits), (unsigned long)(st1.flow_misses - st0.flow_misses));
+    HOST_CHECK(before.dropped == 0 && down.dropped == 0 && after.dropped == 0);
+    /* Nothing was flushed, every packet after the event is a hit */
+    HOST_CHECK(st1.flow_misses == st0.flow_misses);
+}
+
+static void test_new_address(void)
+{
+    struct traffic old_addr = { 0 }, new_addr = { 0 }, back = { 0 };
+    router_stats_t st0, st1;
+    u32_t old_ip = my_ip;
+
+    printf("new address:\n");
+    router_hooks_get_stats(&st0);
+    got_ip(NEW_IP);
+
+    /* Still on their way to the old address: not ours anymore, left to
+     * lwIP untranslated, though the flow cache has slots for them */
+    inbound(&old_addr, old_ip);
+    report("inbound to the old address", &old_addr);
+    HOST_CHECK(old_addr.dropped == old_addr.sent);
+    HOST_CHECK(host_pkt.ip.dest.addr == old_ip);
+
+    inbound(&new_addr, NEW_IP);
+    napt(&new_addr, NEW_IP);
+    report("traffic to and from the new address", &new_addr);
+    HOST_CHECK(new_addr.dropped == 0);
+    router_hooks_get_stats(&st1);
+    printf("  flow cache: %lu hits, %lu misses\n",
+           (unsigned long)(st1.flow_hits - st0.flow_hits), (unsigned long)(st1.flow_misses - st0.flow_misses));
+
+    /* Back to the first address, the slots keyed on it are valid again:
+     * the rule they were made by is unchanged */
+    got_ip(old_ip);
+    router_hooks_get_stats(&st0);
+    inbound(&back, old_ip);
+    router_hooks_get_stats(&st1);
+    report("inbound after returning to the old one", &back);
+    HOST_CHECK(back.dropped == 0 && st1.flow_misses == st0.flow_misses);
+}
+
+/* A rule changed while the uplink is down must not be bypassed by a slot
+ * cached before */
+static void test_rule_change(void)
+{
+    HOST_CHECK(del_portmap(PROTO_TCP, 8080) == ESP_OK);
+    HOST_CHECK(add_portmap(PROTO_TCP, 8080, CLIENT, 81) == ESP_OK);
+    got_ip(my_ip);
+    host_tcp(&host_sta, REMOTE, 40000, my_ip, 8080, TCP_ACK);
+    HOST_CHECK(host_pkt.ip.dest.addr == CLIENT && lwip_ntohs(host_pkt.tcp.dest) == 81);
+}
+
+int main(void)
+{
+    host_init();
+    router_hooks_init();
+    napt_init(64);
+    get_portmap_tab();
+    HOST_CHECK(add_portmap(PROTO_TCP, 8080, SERVER, 80) == ESP_OK);
+
+    /* Rules are only published with the first address */
+    got_ip(HOST_STA_IP);
+
+    test_same_address();
+    test_new_address();
+    test_rule_change();
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,325 @@
+/* Forwarding from the Wi-Fi driver's RX buffers, rxbuf.c
+
+   The driver is a pool of custom pbufs whose free function marks the
+   buffer free again. Its frames go in through the input of the
+   interfaces, the last of which takes the Ethernet header off and runs
+   the hook, as ethernet_input() and ip4_input() would.
+*/
+
+#include "host.h"
+#include "router_globals.h"
+#include "router_hooks.h"
+#include "nat.h"
+
+#define CLIENT  HOST_IP(192, 168, 4, 2)
+#define OTHER   HOST_IP(192, 168, 4, 3)
+#define REMOTE  HOST_IP(198, 51, 100, 7)
+#define GATEWAY HOST_IP(10, 0, 0, 1)
+
+/* RXBUF_HELD_MAX without CONFIG_ESP_WIFI_DYNAMIC_RX_BUFFER_NUM */
+#define HELD_MAX    16
+
+#define DRIVER_BUFS 32
+
+struct driver_buf {
+    struct pbuf_custom pc;
+    bool used;
+    u8_t frame[1600];
+};
+
+static struct driver_buf driver_bufs[DRIVER_BUFS];
+static int driver_used;
+
+static void driver_free(struct pbuf *p)
+{
+    struct driver_buf *b = (struct driver_buf *)p;
+    HOST_CHECK(b->used);
+    b->used = false;
+    driver_used--;
+}
+
+/* Another driver's buffers, rxbuf_input() leaves them alone */
+static int other_freed;
+
+static void other_free(struct pbuf *p)
+{
+    other_freed++;
+    driver_free(p);
+}
+
+static struct pbuf *driver_pbuf(pbuf_free_custom_fn free_fn, const void *frame, u16_t len)
+{
+    struct driver_buf *b = NULL;
+
+    for (int i = 0; i < DRIVER_BUFS && b == NULL; i++) {
+        if (!driver_bufs[i].used) {
+            b = &driver_bufs[i];
+        }
+    }
+    HOST_CHECK(b != NULL);
+    b->used = true;
+    driver_used++;
+    memcpy(b->frame, frame, len);
+    b->pc.pbuf = (struct pbuf){
+        .payload = b->frame, .len = len, .tot_len = len, .ref = 1, .flags = PBUF_FLAG_IS_CUSTOM,
+    };
+    b->pc.custom_free_function = free_fn;
+    return &b->pc.pbuf;
+}
+
+/* An Ethernet frame with the packet in host_pkt */
+static u8_t frame[SIZEOF_ETH_HDR + sizeof(struct host_pkt)];
+
+static u16_t udp_frame(u32_t src, u16_t sport, u32_t dest, u16_t dport)
+{
+    u16_t len = host_udp_pkt(src, sport, dest, dport);
+
+    memset(frame, 0xee, SIZEOF_ETH_HDR);
+    frame[12] = ETHTYPE_IP >> 8;
+    frame[13] = ETHTYPE_IP & 0xff;
+    memcpy(frame + SIZEOF_ETH_HDR, &host_pkt, len);
+    return SIZEOF_ETH_HDR + len;
+}
+
+/* The stack past the hook, which keeps what it is handed while holding */
+static bool holding;
+static struct pbuf *held[DRIVER_BUFS];
+static int held_count, stack_in;
+
+static err_t stack_input(struct pbuf *p, struct netif *inp)
+{
+    stack_in++;
+    HOST_CHECK(pbuf_remove_header(p, SIZEOF_ETH_HDR) == 0);
+    if (holding) {
+        held[held_count++] = p;
+    } else if (router_ip4_input_hook(p, inp) == 0) {
+        pbuf_free(p);
+    }
+    return ERR_OK;
+}
+
+static void release(void)
+{
+    for (int i = 0; i < held_count; i++) {
+        pbuf_free(held[i]);
+    }
+    held_count = 0;
+}
+
+/* What went out in place */
+static int link_out;
+static struct netif *link_netif;
+static struct pbuf *link_p;
+static void *link_payload;
+static u8_t link_frame[sizeof(frame)];
+
+static err_t driver_output(struct netif *netif, struct pbuf *p)
+{
+    link_out++;
+    link_netif = netif;
+    link_p = p;
+    link_payload = p->payload;
+    memcpy(link_frame, p->payload, LWIP_MIN(p->len, sizeof(link_frame)));
+    return ERR_OK;
+}
+
+/* The ARP table, one entry */
+static u32_t arp_ip, arp_asked;
+static struct eth_addr arp_mac = { { 0x02, 0x11, 0x22, 0x33, 0x44, 0x55 } };
+
+ssize_t etharp_find_addr(struct netif *netif, const ip4_addr_t *ipaddr, struct eth_addr **eth_ret, const ip4_addr_t **ip_ret)
+{
+    arp_asked = ipaddr->addr;
+    if (arp_ip == 0 || ipaddr->addr != arp_ip) {
+        return -1;
+    }
+    *eth_ret = &arp_mac;
+    *ip_ret = ipaddr;
+    return 0;
+}
+
+static rxbuf_stats_t stats(void)
+{
+    rxbuf_stats_t st;
+    rxbuf_get_stats(&st);
+    return st;
+}
+
+/* Out of the uplink to the gateway, in place once the ARP table has it */
+static void test_forward(void)
+{
+    u16_t len = udp_frame(CLIENT, 5000, REMOTE, 53);
+    u32_t sent = host_sent;
+    struct pbuf *p;
+
+    host_ap.input(driver_pbuf(driver_free, frame, len), &host_ap);
+    HOST_CHECK(stack_in == 1 && arp_asked == GATEWAY);
+    HOST_CHECK(host_sent == sent + 1 && host_sent_netif == &host_sta && link_out == 0);
+    HOST_CHECK(host_pkt.ip.src.addr == my_ip && host_pkt.ip.dest.addr == REMOTE);
+    HOST_CHECK(driver_used == 0);
+    HOST_CHECK(stats().in_place == 1 && stats().copied == 1 && stats().held == 0);
+
+    arp_ip = GATEWAY;
+    p = driver_pbuf(driver_free, frame, len);
+    host_ap.input(p, &host_ap);
+    HOST_CHECK(host_sent == sent + 1 && link_out == 1 && link_netif == &host_sta && link_p == p);
+    struct eth_hdr *eth = (struct eth_hdr *)link_frame;
+    struct ip_hdr *ip = (struct ip_hdr *)(eth + 1);
+    HOST_CHECK(memcmp(&eth->dest, &arp_mac, ETH_HWADDR_LEN) == 0);
+    HOST_CHECK(memcmp(&eth->src, host_sta.hwaddr, ETH_HWADDR_LEN) == 0);
+    HOST_CHECK(eth->type == PP_HTONS(ETHTYPE_IP));
+    HOST_CHECK(ip->src.addr == my_ip && ip->dest.addr == REMOTE && IPH_TTL(ip) == 63);
+    /* Sent from the driver's buffer, which went back right after */
+    HOST_CHECK(link_payload == ((struct driver_buf *)p)->frame);
+    HOST_CHECK(driver_used == 0);
+    HOST_CHECK(stats().in_place == 2 && stats().copied == 1 && stats().held == 0);
+}
+
+/* Output to the AP as lwIP's ip4_forward() does it: on-link, broadcast,
+ * and pbufs that are not the driver's */
+static void test_output(void)
+{
+    u16_t len = udp_frame(REMOTE, 53, OTHER, 5000);
+    u32_t sent = host_sent;
+    int out = link_out;
+    struct pbuf *p;
+    ip4_addr_t dest;
+
+    holding = true;
+    host_ap.input(driver_pbuf(driver_free, frame, len), &host_ap);
+    holding = false;
+    HOST_CHECK(held_count == 1 && stats().held == 1);
+    p = held[0];
+
+    /* The next hop on the AP is the client itself */
+    dest.addr = OTHER;
+    HOST_CHECK(host_ap.output(&host_ap, p, &dest) == ERR_OK);
+    HOST_CHECK(arp_asked == OTHER && host_sent == sent + 1 && link_out == out);
+    arp_ip = OTHER;
+    HOST_CHECK(host_ap.output(&host_ap, p, &dest) == ERR_OK);
+    HOST_CHECK(link_out == out + 1 && link_p == p && host_sent == sent + 1);
+    HOST_CHECK(memcmp(link_frame, &arp_mac, ETH_HWADDR_LEN) == 0);
+    HOST_CHECK(memcmp(link_frame + ETH_HWADDR_LEN, host_ap.hwaddr, ETH_HWADDR_LEN) == 0);
+    /* The header was taken off again for the caller */
+    HOST_CHECK(p->len == len - SIZEOF_ETH_HDR && ((struct ip_hdr *)p->payload)->dest.addr == OTHER);
+
+    arp_asked = 0;
+    dest.addr = HOST_IP(192, 168, 4, 255);
+    HOST_CHECK(host_ap.output(&host_ap, p, &dest) == ERR_OK);
+    HOST_CHECK(arp_asked == 0 && host_sent == sent + 2 && link_out == out + 1);
+    release();
+    HOST_CHECK(driver_used == 0 && stats().held == 0);
+
+    /* Heap pbufs go to etharp_output() as they are */
+    struct pbuf *q = pbuf_alloc(PBUF_LINK, len - SIZEOF_ETH_HDR, PBUF_RAM);
+    memcpy(q->payload, frame + SIZEOF_ETH_HDR, len - SIZEOF_ETH_HDR);
+    dest.addr = OTHER;
+    HOST_CHECK(host_ap.output(&host_ap, q, &dest) == ERR_OK);
+    HOST_CHECK(host_sent == sent + 3 && link_out == out + 1);
+    pbuf_free(q);
+    HOST_CHECK(stats().copied == 3);
+}
+
+/* Copies once HELD_MAX are held, the driver getting its buffer back */
+static void test_held(void)
+{
+    u16_t len = udp_frame(CLIENT, 5000, REMOTE, 53);
+    rxbuf_stats_t st0 = stats(), st;
+
+    holding = true;
+    for (int i = 0; i < HELD_MAX + 4; i++) {
+        host_ap.input(driver_pbuf(driver_free, frame, len), &host_ap);
+    }
+    holding = false;
+    HOST_CHECK(held_count == HELD_MAX + 4 && driver_used == HELD_MAX);
+    for (int i = 0; i < held_count; i++) {
+        HOST_CHECK(((held[i]->flags & PBUF_FLAG_IS_CUSTOM) != 0) == (i < HELD_MAX));
+        HOST_CHECK(memcmp(held[i]->payload, frame + SIZEOF_ETH_HDR, len - SIZEOF_ETH_HDR) == 0);
+    }
+    st = stats();
+    HOST_CHECK(st.held == HELD_MAX && st.peak == HELD_MAX);
+    HOST_CHECK(st.in_place == st0.in_place + HELD_MAX && st.copied == st0.copied + 4);
+
+    /* Back in place as soon as one is let go */
+    pbuf_free(held[0]);
+    held[0] = held[--held_count];
+    holding = true;
+    host_ap.input(driver_pbuf(driver_free, frame, len), &host_ap);
+    holding = false;
+    HOST_CHECK(driver_used == HELD_MAX && stats().in_place == st.in_place + 1);
+    release();
+    HOST_CHECK(driver_used == 0 && stats().held == 0 && stats().peak == HELD_MAX);
+}
+
+/* Heap pbufs, chains and another driver's buffers are passed on as they
+ * are, uncounted */
+static void test_passed(void)
+{
+    u16_t len = udp_frame(CLIENT, 5000, REMOTE, 53);
+    rxbuf_stats_t st0 = stats(), st;
+    struct pbuf *p, *tail;
+
+    holding = true;
+    p = pbuf_alloc(PBUF_RAW, len, PBUF_RAM);
+    memcpy(p->payload, frame, len);
+    host_ap.input(p, &host_ap);
+    HOST_CHECK(held[0] == p);
+
+    p = driver_pbuf(other_free, frame, len);
+    host_sta.input(p, &host_sta);
+    HOST_CHECK(held[1] == p && ((struct pbuf_custom *)p)->custom_free_function == other_free);
+
+    p = driver_pbuf(driver_free, frame, len);
+    tail = pbuf_alloc(PBUF_RAW, 0, PBUF_RAM);
+    p->next = tail;
+    host_ap.input(p, &host_ap);
+    HOST_CHECK(held[2] == p && ((struct pbuf_custom *)p)->custom_free_function == driver_free);
+    holding = false;
+
+    st = stats();
+    HOST_CHECK(st.held == 0 && st.in_place == st0.in_place && st.copied == st0.copied);
+    p->next = NULL;
+    pbuf_free(tail);
+    release();
+    HOST_CHECK(other_freed == 1 && driver_used == 0);
+}
+
+static void test_keep(void)
+{
+    u16_t len = udp_frame(CLIENT, 5000, REMOTE, 53);
+    struct pbuf *p = pbuf_alloc(PBUF_RAW, len, PBUF_RAM), *q;
+
+    HOST_CHECK(rxbuf_keep(p) == p && p->ref == 2);
+    pbuf_free(p);
+    pbuf_free(p);
+
+    holding = true;
+    host_ap.input(driver_pbuf(driver_free, frame, len), &host_ap);
+    holding = false;
+    p = held[0];
+    q = rxbuf_keep(p);
+    HOST_CHECK(q != NULL && q != p && p->ref == 1 && !(q->flags & PBUF_FLAG_IS_CUSTOM));
+    HOST_CHECK(q->len == p->len && memcmp(q->payload, p->payload, p->len) == 0);
+    release();
+    HOST_CHECK(driver_used == 0 && stats().held == 0);
+    pbuf_free(q);
+}
+
+int main(void)
+{
+    host_init();
+    host_sta.input = host_ap.input = stack_input;
+    host_sta.linkoutput = host_ap.linkoutput = driver_output;
+    router_hooks_init();
+    napt_init(64);
+    get_portmap_tab();
+    apply_portmap_tab();
+
+    test_forward();
+    test_output();
+    test_held();
+    test_passed();
+    test_keep();
+    printf("ok\n");
+    return 0;
+}
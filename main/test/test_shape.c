@@ -0,0 +1,194 @@
+/* Per-client rate limits, shape.c */
+
+#include "host.h"
+#include "router_globals.h"
+#include "router_hooks.h"
+#include "nat.h"
+
+#define CLIENT  HOST_IP(192, 168, 4, 2)
+#define OTHER   HOST_IP(192, 168, 4, 3)
+#define REMOTE  HOST_IP(198, 51, 100, 7)
+
+static const u8_t client_mac[6] = { 1, 2, 3, 4, 5, 6 };
+static u32_t client_lease;      /* address the DHCP server gave client_mac */
+
+esp_err_t esp_netif_dhcps_get_clients_by_mac(esp_netif_t *esp_netif, int num, esp_netif_pair_mac_ip_t *mac_ip_pair)
+{
+    if (memcmp(mac_ip_pair->mac, client_mac, 6) != 0 || client_lease == 0) {
+        return ESP_FAIL;
+    }
+    mac_ip_pair->ip.addr = client_lease;
+    return ESP_OK;
+}
+
+/* Packets of len bytes a client may send at once */
+static int burst(u32_t client, u16_t len, int dir)
+{
+    int n = 0;
+    while (shape_ok(client, len, dir)) {
+        n++;
+    }
+    return n;
+}
+
+/* A bucket holds 100 ms of traffic and refills at the rate */
+static void test_bucket(void)
+{
+    shape_rule_t rules[SHAPE_MAX];
+
+    HOST_CHECK(shape_ok(CLIENT, 1500, SHAPE_UP));
+    HOST_CHECK(set_shape(NULL, CLIENT, 0, 0) == ESP_ERR_NOT_FOUND);
+
+    /* 1 Mbit/s up, 100000 bits deep: ten packets of 10000 bits */
+    HOST_CHECK(set_shape(NULL, CLIENT, 1000, 0) == ESP_OK);
+    HOST_CHECK(burst(CLIENT, 1250, SHAPE_UP) == 10);
+    HOST_CHECK(shape_ok(CLIENT, 1250, SHAPE_DOWN));
+    HOST_CHECK(shape_ok(OTHER, 1250, SHAPE_UP));
+    HOST_CHECK(shape_ok(HOST_IP(192, 168, 5, 2), 1250, SHAPE_UP));
+
+    host_advance(10);
+    HOST_CHECK(shape_ok(CLIENT, 1250, SHAPE_UP));
+    HOST_CHECK(!shape_ok(CLIENT, 1250, SHAPE_UP));
+    /* A long pause only fills the bucket */
+    host_advance(100000);
+    HOST_CHECK(burst(CLIENT, 1250, SHAPE_UP) == 10);
+
+    HOST_CHECK(shape_get_rules(rules) == 1);
+    HOST_CHECK(rules[0].up == 1000 && rules[0].down == 0 && rules[0].dropped_up == 3);
+
+    /* Slow limits still let a few full packets through at once */
+    HOST_CHECK(set_shape(NULL, CLIENT, 1, 0) == ESP_OK);
+    HOST_CHECK(burst(CLIENT, 1500, SHAPE_UP) == 4);
+    HOST_CHECK(set_shape(NULL, CLIENT, 0, 0) == ESP_OK);
+    HOST_CHECK(shape_get_rules(rules) == 0);
+}
+
+/* Clients set by MAC are limited under the address they lease */
+static void test_mac(void)
+{
+    shape_rule_t rules[SHAPE_MAX];
+    u8_t mac[6];
+    u32_t ip;
+    bool mac_set;
+
+    HOST_CHECK(shape_parse_client("01:02:03:04:05:06", mac, &ip, &mac_set) && mac_set);
+    HOST_CHECK(memcmp(mac, client_mac, 6) == 0);
+    HOST_CHECK(shape_parse_client("192.168.4.3", mac, &ip, &mac_set) && !mac_set && ip == OTHER);
+    HOST_CHECK(!shape_parse_client("foo", mac, &ip, &mac_set));
+
+    HOST_CHECK(set_shape(NULL, CLIENT, 1000, 0) == ESP_OK);
+    HOST_CHECK(burst(CLIENT, 1250, SHAPE_UP) == 10);
+    /* Without a lease it limits nobody */
+    HOST_CHECK(set_shape(client_mac, 0, 0, 500) == ESP_OK);
+    HOST_CHECK(shape_get_rules(rules) == 2 && rules[1].ip == 0);
+    /* The other rule kept its bucket */
+    HOST_CHECK(rules[0].dropped_up == 1 && !shape_ok(CLIENT, 1250, SHAPE_UP));
+
+    shape_client_ip(client_mac, OTHER);
+    HOST_CHECK(shape_get_rules(rules) == 2 && rules[1].ip == OTHER);
+    HOST_CHECK(burst(OTHER, 1250, SHAPE_DOWN) == 5);
+
+    /* At boot the MAC is looked up again */
+    client_lease = OTHER;
+    HOST_CHECK(get_shape() == ESP_OK);
+    HOST_CHECK(shape_get_rules(rules) == 2 && rules[0].ip == CLIENT && rules[1].ip == OTHER);
+    HOST_CHECK(memcmp(rules[1].mac, client_mac, 6) == 0);
+
+    HOST_CHECK(set_shape(NULL, CLIENT, 0, 0) == ESP_OK);
+    HOST_CHECK(set_shape(client_mac, 0, 0, 0) == ESP_OK);
+    HOST_CHECK(shape_get_rules(rules) == 0);
+    HOST_CHECK(get_shape() != ESP_OK);
+}
+
+static void test_full(void)
+{
+    for (int i = 0; i < SHAPE_MAX; i++) {
+        HOST_CHECK(set_shape(NULL, HOST_IP(192, 168, 4, 100 + i), 1, 1) == ESP_OK);
+    }
+    HOST_CHECK(set_shape(NULL, CLIENT, 1, 1) == ESP_ERR_NO_MEM);
+
+    /* A rate far below the time since the last packet must not overflow */
+    host_advance(0x7fffffff);
+    HOST_CHECK(shape_ok(HOST_IP(192, 168, 4, 100), 100, SHAPE_UP));
+
+    for (int i = 0; i < SHAPE_MAX; i++) {
+        HOST_CHECK(set_shape(NULL, HOST_IP(192, 168, 4, 100 + i), 0, 0) == ESP_OK);
+    }
+}
+
+/* The forwarding path drops what is over the limit, both ways */
+static void test_forward(void)
+{
+    shape_rule_t rules[SHAPE_MAX];
+    int up = 0, down = 0;
+
+    HOST_CHECK(add_portmap(PROTO_UDP, 5000, CLIENT, 5000) == ESP_OK);
+    /* 100000 bits up, 60 byte packets */
+    HOST_CHECK(set_shape(NULL, CLIENT, 1000, 0) == ESP_OK);
+    for (int i = 0; i < 300; i++) {
+        u32_t sent = host_sent;
+        HOST_CHECK(host_udp(&host_ap, CLIENT, 4000, REMOTE, 53) == 1);
+        up += host_sent - sent;
+        HOST_CHECK(host_udp(&host_sta, REMOTE, 53, my_ip, 5000) == 0);
+        down++;
+    }
+    HOST_CHECK(up == 100000 / 480);
+    HOST_CHECK(down == 300);
+
+    /* 48000 bits down at least */
+    HOST_CHECK(set_shape(NULL, CLIENT, 0, 100) == ESP_OK);
+    down = 0;
+    for (int i = 0; i < 300; i++) {
+        down += host_udp(&host_sta, REMOTE, 53, my_ip, 5000) == 0 && host_pkt.ip.dest.addr == CLIENT;
+    }
+    HOST_CHECK(down == 48000 / 480);
+    HOST_CHECK(shape_get_rules(rules) == 1 && rules[0].dropped_down == 300 - down);
+
+    /* Other clients are not held back */
+    u32_t sent = host_sent;
+    for (int i = 0; i < 300; i++) {
+        host_udp(&host_ap, OTHER, 4000, REMOTE, 53);
+    }
+    HOST_CHECK(host_sent - sent == 300);
+
+    HOST_CHECK(set_shape(NULL, CLIENT, 0, 0) == ESP_OK);
+    HOST_CHECK(del_portmap(PROTO_UDP, 5000) == ESP_OK);
+}
+
+/* A packet of a cached flow whose mapping has expired goes the long way
+ * through the hook, and is charged once all the same */
+static void test_stale(void)
+{
+    router_stats_t st0, st1;
+
+    HOST_CHECK(set_shape(NULL, CLIENT, 1000, 0) == ESP_OK);
+    HOST_CHECK(host_udp(&host_ap, CLIENT, 4100, REMOTE, 53) == 1);
+    host_advance(3000);
+    int full = burst(CLIENT, IP_HLEN + UDP_HLEN + 32, SHAPE_UP);
+    host_advance(3000);
+
+    router_hooks_get_stats(&st0);
+    HOST_CHECK(host_udp(&host_ap, CLIENT, 4100, REMOTE, 53) == 1);
+    router_hooks_get_stats(&st1);
+    HOST_CHECK(st1.flow_hits == st0.flow_hits && st1.flow_misses == st0.flow_misses + 1);
+    HOST_CHECK(burst(CLIENT, IP_HLEN + UDP_HLEN + 32, SHAPE_UP) == full - 1);
+    HOST_CHECK(set_shape(NULL, CLIENT, 0, 0) == ESP_OK);
+}
+
+int main(void)
+{
+    host_init();
+    router_hooks_init();
+    napt_init(64);
+    get_portmap_tab();
+    apply_portmap_tab();
+    get_shape();
+
+    test_bucket();
+    test_mac();
+    test_full();
+    test_forward();
+    test_stale();
+    printf("ok\n");
+    return 0;
+}
@@ -40,11 +40,6 @@
 #include "cmd_decl.h"
 #include <esp_http_server.h>
 
-#if !IP_NAPT
-#error "IP_NAPT must be defined"
-#endif
-#include "lwip/lwip_napt.h"
-
 #include "router_globals.h"
 
 // On board LED
@@ -54,6 +49,11 @@
 #define BLINK_GPIO 2
 #endif
 
+// The ROUTER_HOT functions in IRAM, from main/linker.lf (only defined
+// with CONFIG_NAT_IRAM_HOT_PATH)
+extern int _router_hot_start __attribute__((weak));
+extern int _router_hot_end __attribute__((weak));
+
 
 #ifndef DEFAULT_AP_SSID
 #define DEFAULT_AP_SSID     "NozzleBOX"
@@ -92,15 +92,6 @@ bool has_static_ip = false;
 uint32_t my_ip;
 uint32_t my_ap_ip;
 
-struct portmap_table_entry {
-  u32_t daddr;
-  u16_t mport;
-  u16_t dport;
-  u8_t proto;
-  u8_t valid;
-};
-struct portmap_table_entry portmap_tab[IP_PORTMAP_MAX];
-
 esp_netif_t* wifiAP;
 esp_netif_t* wifiSTA;
 
@@ -227,123 +218,6 @@ static void initialize_nvs(void)
     ESP_ERROR_CHECK(err);
 }
 
-esp_err_t apply_portmap_tab() {
-    for (int i = 0; i<IP_PORTMAP_MAX; i++) {
-        if (portmap_tab[i].valid) {
-            ip_portmap_add(portmap_tab[i].proto, my_ip, portmap_tab[i].mport, portmap_tab[i].daddr, portmap_tab[i].dport);
-        }
-    }
-    return ESP_OK;
-}
-
-esp_err_t delete_portmap_tab() {
-    for (int i = 0; i<IP_PORTMAP_MAX; i++) {
-        if (portmap_tab[i].valid) {
-            ip_portmap_remove(portmap_tab[i].proto, portmap_tab[i].mport);
-        }
-    }
-    return ESP_OK;
-}
-
-void print_portmap_tab() {
-    for (int i = 0; i<IP_PORTMAP_MAX; i++) {
-        if (portmap_tab[i].valid) {
-            printf ("%s", portmap_tab[i].proto == PROTO_TCP?"TCP ":"UDP ");
-            ip4_addr_t addr;
-            addr.addr = my_ip;
-            printf (IPSTR":%d -> ", IP2STR(&addr), portmap_tab[i].mport);
-            addr.addr = portmap_tab[i].daddr;
-            printf (IPSTR":%d\n", IP2STR(&addr), portmap_tab[i].dport);
-        }
-    }
-}
-
-esp_err_t get_portmap_tab() {
-    esp_err_t err;
-    nvs_handle_t nvs;
-    size_t len;
-
-    err = nvs_open(PARAM_NAMESPACE, NVS_READWRITE, &nvs);
-    if (err != ESP_OK) {
-        return err;
-    }
-    err = nvs_get_blob(nvs, "portmap_tab", NULL, &len);
-    if (err == ESP_OK) {
-        if (len != sizeof(portmap_tab)) {
-            err = ESP_ERR_NVS_INVALID_LENGTH;
-        } else {
-            err = nvs_get_blob(nvs, "portmap_tab", portmap_tab, &len);
-            if (err != ESP_OK) {
-                memset(portmap_tab, 0, sizeof(portmap_tab));
-            }
-        }
-    }
-    nvs_close(nvs);
-
-    return err;
-}
-
-esp_err_t add_portmap(u8_t proto, u16_t mport, u32_t daddr, u16_t dport) {
-    esp_err_t err;
-    nvs_handle_t nvs;
-
-    for (int i = 0; i<IP_PORTMAP_MAX; i++) {
-        if (!portmap_tab[i].valid) {
-            portmap_tab[i].proto = proto;
-            portmap_tab[i].mport = mport;
-            portmap_tab[i].daddr = daddr;
-            portmap_tab[i].dport = dport;
-            portmap_tab[i].valid = 1;
-
-            err = nvs_open(PARAM_NAMESPACE, NVS_READWRITE, &nvs);
-            if (err != ESP_OK) {
-                return err;
-            }
-            err = nvs_set_blob(nvs, "portmap_tab", portmap_tab, sizeof(portmap_tab));
-            if (err == ESP_OK) {
-                err = nvs_commit(nvs);
-                if (err == ESP_OK) {
-                    ESP_LOGI(TAG, "New portmap table stored.");
-                }
-            }
-            nvs_close(nvs);
-
-            ip_portmap_add(proto, my_ip, mport, daddr, dport);
-
-            return ESP_OK;
-        }
-    }
-    return ESP_ERR_NO_MEM;
-}
-
-esp_err_t del_portmap(u8_t proto, u16_t mport) {
-    esp_err_t err;
-    nvs_handle_t nvs;
-
-    for (int i = 0; i<IP_PORTMAP_MAX; i++) {
-        if (portmap_tab[i].valid && portmap_tab[i].mport == mport && portmap_tab[i].proto == proto) {
-            portmap_tab[i].valid = 0;
-
-            err = nvs_open(PARAM_NAMESPACE, NVS_READWRITE, &nvs);
-            if (err != ESP_OK) {
-                return err;
-            }
-            err = nvs_set_blob(nvs, "portmap_tab", portmap_tab, sizeof(portmap_tab));
-            if (err == ESP_OK) {
-                err = nvs_commit(nvs);
-                if (err == ESP_OK) {
-                    ESP_LOGI(TAG, "New portmap table stored.");
-                }
-            }
-            nvs_close(nvs);
-
-            ip_portmap_remove(proto, mport);
-            return ESP_OK;
-        }
-    }
-    return ESP_OK;
-}
-
 static void initialize_console(void)
 {
     /* Disable buffering on stdin */
@@ -463,6 +337,18 @@ static void wifi_event_handler(void* arg, esp_event_base_t event_base,
     {
         esp_wifi_connect();
     }
+    else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED)
+    {
+        if (get_ip6_relay()) {
+            esp_netif_create_ip6_linklocal(wifiSTA);
+        }
+    }
+    else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_AP_START)
+    {
+        if (get_ip6_relay()) {
+            esp_netif_create_ip6_linklocal(wifiAP);
+        }
+    }
     else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED)
     {
         ESP_LOGI(TAG,"disconnected - retry to connect to the AP");
@@ -476,9 +362,9 @@ static void wifi_event_handler(void* arg, esp_event_base_t event_base,
         ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
         ESP_LOGI(TAG, "got ip:" IPSTR, IP2STR(&event->ip_info.ip));
         ap_connect = true;
+        uint32_t old_ip = my_ip;
         my_ip = event->ip_info.ip.addr;
-        delete_portmap_tab();
-        apply_portmap_tab();
+        reconcile_portmap_tab(old_ip);
         if (esp_netif_get_dns_info(wifiSTA, ESP_NETIF_DNS_MAIN, &dns) == ESP_OK)
         {
             esp_netif_set_dns_info(wifiAP, ESP_NETIF_DNS_MAIN, &dns);
@@ -486,6 +372,13 @@ static void wifi_event_handler(void* arg, esp_event_base_t event_base,
         }
         xEventGroupSetBits(wifi_event_group, WIFI_CONNECTED_BIT);
     }
+    else if (event_base == IP_EVENT && event_id == IP_EVENT_AP_STAIPASSIGNED)
+    {
+        ip_event_ap_staipassigned_t* event = (ip_event_ap_staipassigned_t*) event_data;
+        shape_client_ip(event->mac, event->ip.addr);
+        fw_client_ip(event->mac, event->ip.addr);
+        isolate_client_ip(event->mac, event->ip.addr);
+    }
     else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_AP_STACONNECTED)
     {
         connect_count++;
@@ -533,6 +426,8 @@ void wifi_init(const uint8_t* mac,
     ESP_ERROR_CHECK(esp_event_loop_create_default());
     wifiAP  = esp_netif_create_default_wifi_ap();
     wifiSTA = esp_netif_create_default_wifi_sta();
+    router_hooks_init();
+    ip6_relay_init();
 
     // ---------- Optional static IP on STA ----------
     if (sta_ssid[0] && static_ip && static_ip[0] && subnet_mask && subnet_mask[0] && gateway_addr && gateway_addr[0]) {
@@ -557,9 +452,10 @@ void wifi_init(const uint8_t* mac,
     ESP_ERROR_CHECK(esp_netif_dhcps_start(wifiAP));
 
     // ---------- Event handlers ----------
-    esp_event_handler_instance_t instance_any_id, instance_got_ip;
+    esp_event_handler_instance_t instance_any_id, instance_got_ip, instance_ap_ip;
     ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &wifi_event_handler, NULL, &instance_any_id));
     ESP_ERROR_CHECK(esp_event_handler_instance_register(IP_EVENT,   IP_EVENT_STA_GOT_IP, &wifi_event_handler, NULL, &instance_got_ip));
+    ESP_ERROR_CHECK(esp_event_handler_instance_register(IP_EVENT,   IP_EVENT_AP_STAIPASSIGNED, &wifi_event_handler, NULL, &instance_ap_ip));
 
     // ---------- Wi-Fi init ----------
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
@@ -661,14 +557,19 @@ void wifi_init(const uint8_t* mac,
 
         // NAT/LWIP features
     #if defined(CONFIG_LWIP_IP_FORWARD)
-        ESP_LOGI(TAG, "LWIP: IP_FORWARD=%d  IPV4_NAPT=%d",
-                (int)CONFIG_LWIP_IP_FORWARD,
-    #ifdef CONFIG_LWIP_IPV4_NAPT
-                (int)CONFIG_LWIP_IPV4_NAPT
+        ESP_LOGI(TAG, "LWIP: IP_FORWARD=%d  (NAPT done by the router)",
+                (int)CONFIG_LWIP_IP_FORWARD);
+    #endif
+    #if CONFIG_LWIP_L2_TO_L3_COPY
+        ESP_LOGI(TAG, "LWIP: L2_TO_L3_COPY=1  (received frames copied)");
     #else
-                0
+        ESP_LOGI(TAG, "LWIP: L2_TO_L3_COPY=0  (forwarding from the driver's RX buffers)");
     #endif
-        );
+    #if CONFIG_NAT_IRAM_HOT_PATH
+        ESP_LOGI(TAG, "IRAM: forwarding path in IRAM, %u bytes of router code  (lwIP's in IRAM too)",
+                (unsigned)((char *)&_router_hot_end - (char *)&_router_hot_start));
+    #else
+        ESP_LOGI(TAG, "IRAM: forwarding path in flash");
     #endif
 
     #ifdef APPLY_DEFAULTS_EVERY_BOOT
@@ -807,16 +708,45 @@ void app_main(void)
         ap_ip = param_set_default(DEFAULT_AP_IP);
     }
 
+    int portmap_max = DEFAULT_PORTMAP_MAX;
+    get_config_param_int("portmap_max", &portmap_max);
+    set_portmap_max(portmap_max);
     get_portmap_tab();
 
+    int mss_clamp = MSS_CLAMP_AUTO;
+    get_config_param_int("mss_clamp", &mss_clamp);
+    set_mss_clamp(mss_clamp);
+    int icmp_rate = ICMP_RATE_DEFAULT;
+    get_config_param_int("icmp_rate", &icmp_rate);
+    set_icmp_rate(icmp_rate);
+    int ipv6_relay = 0;
+    get_config_param_int("ipv6_relay", &ipv6_relay);
+    set_ip6_relay(ipv6_relay != 0);
+
     // Setup WIFI
     wifi_init(mac, ssid, ent_username, ent_identity, passwd, static_ip, subnet_mask, gateway_addr, ap_mac, ap_ssid, ap_passwd, ap_ip);
 
     pthread_t t1;
     pthread_create(&t1, NULL, led_status_thread, NULL);
 
-    ip_napt_enable(my_ap_ip, 1);
-    ESP_LOGI(TAG, "NAT is enabled");
+    int napt_max = DEFAULT_NAPT_MAX;
+    get_config_param_int("napt_max", &napt_max);
+    get_nat_timeouts();
+    get_nat_limits();
+    get_nat_cone();
+    get_mcast_reflect();
+    get_shape();
+    get_qos();
+    get_isolate();
+    if (napt_init(napt_max) == ESP_OK) {
+        ESP_LOGI(TAG, "NAT is enabled");
+    }
+    get_fw();
+    get_ipfix();
+    int upnp = 0;
+    get_config_param_int("upnp", &upnp);
+    set_igd(upnp != 0);
+    igd_init();
 
     char* lock = NULL;
     get_config_param_str("lock", &lock);